@@ -20,6 +20,8 @@
 #include "DateTime.h"
 #include "MqttHandler.h"
 #include "ProtocolHandler.h"
+#include "MqttQueue.h"
+#include "OTA_health.h"
 
 /*******************************************************************************
  * Definitions
@@ -282,9 +284,18 @@ static void app_mainTaskCommon(void *arg)
 
         // gửi thông tin lên server bằng mqtt
         if (needSendInfoMqtt && g_isMqttConnected) {
+#ifdef MQTT_HELLO_DOCUMENT_ENABLE
+            // 1 bản tin HELLO thay cho các bản tin thông tin riêng lẻ
+            bool withActive = needUpdateDataActived && begin_active_device && !end_active_device;
+            MQTT_PublishHello(major_set, withActive);
+            if (withActive) {
+                needUpdateDataActived = false;
+            }
+#else
             MQTT_PublishVersion(MODEL_VER_NUMBER, HARD_VER, COMMON_VER, FIRM_VER);
             Wifi_updateInfoWifi();
             MQTT_PublishInfoBeacon(major_set);
+#endif
             needSendInfoMqtt = false;
         }
         // sau khi kích hoạt, khi công tắc online sẽ gửi thông tin đã active lên server
@@ -293,7 +304,8 @@ static void app_mainTaskCommon(void *arg)
             needUpdateDataActived = false;
         }
         // sau khi OTA cho esp kết thúc,chạy hàm kiểm tra xem update thành công hay thất bại
-        if (needCheckVersionEspOTA && checkStateOtaEsp && g_isMqttConnected) {
+        // image mới chờ đủ các mốc health (valid) rồi mới báo Ota_Success
+        if (needCheckVersionEspOTA && checkStateOtaEsp && g_isMqttConnected && !OtaHealth_isPending()) {
             checkUpdateVerFwEsp();
             needCheckVersionEspOTA = false;
         }
@@ -390,6 +402,7 @@ void App_Initialize()
 void app_main()
 {
     Flash_Initialize();
+    OtaHealth_begin();
     GPIO_Initialize();
     Wifi_Initialize();
     My_CronJob_Initialize();
@@ -410,6 +423,15 @@ void app_main()
                                                                                 heap_caps_get_free_size(INFO_RAM_EXTERNAL), 
                                                                                 heap_caps_get_minimum_free_size(INFO_RAM_EXTERNAL));
 
+        // Print mqtt publish queue
+        MqttQueue_printStats();
+        MQTT_printStats();
+        ht_printCmdLatency();
+        ht_reportCmdLatency();
+        FlashHandler_printStats();
+        ht_reportFlashStats();
+        ht_reportBleHeap();
+
         // Print time local
         log_info("Time local: \"day of week: %d\" \"%s%02d-%02d-%02d %02d:%02d:%02d\"", timeLocal.tm_wday+1, 
                                                                                         timeLocal.tm_year >= 100 ? "20" : "19", 
@@ -14,6 +14,9 @@
  #include "FlashHandler.h"
  #include "gateway_config.h"
  #include "timeCheck.h"
+ #include "esp_heap_caps.h"
+ #include "OTA_health.h"
+ #include "OTA_ble.h"
  
  /*******************************************************************************
   * Definitions
@@ -36,9 +39,10 @@
  
  #define MANUFACTURER_DATA_LEN               17
  
- #define PROFILE_NUM                         2
+ #define PROFILE_NUM                         3
  #define PROFILE_CONFIG_WIFI_APP_ID          0
  #define PROFILE_BLE_CONTROL_APP_ID          1
+ #define PROFILE_BLE_OTA_APP_ID              2
  #define MAX_INSTANCE_CHAR                   3
  
  /*------------------------- Service for config wifi -------------------------*/
@@ -69,6 +73,18 @@
  #define BLE_CONTROL_CHAR_VAL_LEN_MAX        500
  #define BLE_CONTROL_COM_CHAR_VAL_LEN_MAX    100
  
+ /*------------------------------ Service for OTA -----------------------------*/
+ //service
+ #define GATTS_SERVICE_UUID_BLE_OTA          0x12ED
+ //character
+ #define GATTS_CHAR_UUID_OTA_CONTROL         0xED01
+ #define GATTS_CHAR_UUID_OTA_DATA            0xED02
+ 
+ #define GATTS_NUM_HANDLE_BLE_OTA            8
+ // BEGIN có chữ ký RSA dài hơn MTU: client dùng long write (prepare/execute)
+ #define BLE_OTA_CONTROL_VAL_LEN_MAX         512
+ #define BLE_OTA_DATA_LEN_MAX                251     // DLE: payload link layer tối đa
+ 
  /*----------------------------------------------------------------------------*/
  #define PRE_CMD_USE_WIFI                    "_UWF:"
  #define PRE_CMD_HARD_RESET                  "_RST:"
@@ -87,6 +103,16 @@
  #define MAX_PARAM_NUM                       10
  #define NUM_OF_PRO                          2
  
+ /*----------------------------- HCI qua VHCI ---------------------------------*/
+ #define HCI_H4_CMD                          0x01
+ #define HCI_H4_EVT                          0x04
+ #define HCI_EVT_CMD_COMPLETE                0x0E
+ #define HCI_OP_RESET                        0x0C03
+ #define HCI_OP_LE_SET_ADV_PARAM             0x2006
+ #define HCI_OP_LE_SET_ADV_DATA              0x2008
+ #define HCI_OP_LE_SET_ADV_ENABLE            0x200A
+ #define HCI_ADV_DATA_MAX_LEN                31
+ 
  /*******************************************************************************
   * Extern Variables
   ******************************************************************************/
@@ -135,6 +161,7 @@
   ******************************************************************************/
  bool registeredConfigService = false;
  bool registeredControlService = false;
+ bool registeredOtaService = false;
  bool s_bleConfigConnected = false;
  bool s_bleControlConnected = false;
  bool g_haveNewSsid = false;
@@ -142,11 +169,21 @@
  bool cccd_notifications_enabled = false;  // Lưu trạng thái CCCD (notify enable/disable) cho profile config
  char g_new_ssid[32], g_new_pwd[32];
  
+ // chế độ chỉ phát iBeacon khi tải OTA/cert
+ static bool s_beaconOnly = false;
+ static uint8_t s_advRaw[HCI_ADV_DATA_MAX_LEN];
+ static uint8_t s_advRawLen = 0;
+ static SemaphoreHandle_t s_hciDone = NULL;
+ static SemaphoreHandle_t s_hciMutex = NULL;
+ static volatile uint8_t s_hciStatus = 0;
+ static ble_heap_report_t s_heapReport;
+ 
  /*******************************************************************************
   * Prototypes
   ******************************************************************************/
  static void gatts_profile_config_wifi_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param);
  static void gatts_profile_ble_control_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param);
+ static void gatts_profile_ble_ota_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param);
 //  void processCmd(uint8_t *cmdLine, uint16_t cmdLineLen, uint16_t *indexList, uint8_t *indexNum);
  void execute_write_event_env(prepare_type_env_t *prepare_write_env, esp_ble_gatts_cb_param_t *param);
  void writeToConfigWifiComCharEvent(uint8_t len, uint8_t *data);
@@ -215,6 +252,10 @@
      [PROFILE_BLE_CONTROL_APP_ID] = {
          .gatts_cb = gatts_profile_ble_control_event_handler,
          .gatts_if = ESP_GATT_IF_NONE,
+     },
+     [PROFILE_BLE_OTA_APP_ID] = {
+         .gatts_cb = gatts_profile_ble_ota_event_handler,
+         .gatts_if = ESP_GATT_IF_NONE,
      }
  };
  
@@ -229,6 +270,9 @@
  
  static prepare_type_env_t a_prepare_write_env;
  static prepare_type_env_t b_prepare_write_env;
+ static prepare_type_env_t c_prepare_write_env;
+ static bool s_otaNotifyEnabled = false;
+ static esp_bd_addr_t s_otaRemoteBda;
  static int cccd_add_index = 0; // Biến đếm thứ tự thêm CCCD cho từng characteristic
 
  // Trạng thái CCCD cho 12BD: [0]=BD01, [1]=BD02
@@ -264,6 +308,9 @@ static uint16_t cfg_cccd[2] = {0, 0};
              log_error("Advertising start failed");
          } else {
              log_info("Advertising start ok");
+             if (ble_adv_params.adv_type == ADV_TYPE_NONCONN_IND) {
+                 OtaHealth_setMilestone(OTA_HEALTH_BEACON);
+             }
          }
          break;
      case ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT:
@@ -282,6 +329,17 @@ static uint16_t cfg_cccd[2] = {0, 0};
                   param->update_conn_params.latency,
                   param->update_conn_params.timeout);
          break;
+     case ESP_GAP_BLE_SEC_REQ_EVT:
+         // client yêu cầu ghép đôi để ghi characteristic OTA (ESP_GATT_PERM_WRITE_ENCRYPTED)
+         esp_ble_gap_security_rsp(param->ble_security.ble_req.bd_addr, true);
+         break;
+     case ESP_GAP_BLE_AUTH_CMPL_EVT:
+         if (param->ble_security.auth_cmpl.success) {
+             log_info("pair ok, auth mode %d", param->ble_security.auth_cmpl.auth_mode);
+         } else {
+             log_error("pair fail, reason 0x%x", param->ble_security.auth_cmpl.fail_reason);
+         }
+         break;
      default:
          break;
      }
@@ -759,6 +817,220 @@ static uint16_t cfg_cccd[2] = {0, 0};
      }
  }
  
+#ifdef BLE_OTA_ENABLE
+ // LE Secure Connections + bond: link phải mã hoá trước khi ghi ED01/ED02
+ static void BLE_otaSetSecurity()
+ {
+     esp_ble_auth_req_t authReq = ESP_LE_AUTH_REQ_SC_BOND;
+     esp_ble_io_cap_t ioCap = ESP_IO_CAP_NONE;
+     uint8_t keySize = 16;
+     uint8_t initKey = ESP_BLE_ENC_KEY_MASK | ESP_BLE_ID_KEY_MASK;
+     uint8_t rspKey = ESP_BLE_ENC_KEY_MASK | ESP_BLE_ID_KEY_MASK;
+     esp_ble_gap_set_security_param(ESP_BLE_SM_AUTHEN_REQ_MODE, &authReq, sizeof(authReq));
+     esp_ble_gap_set_security_param(ESP_BLE_SM_IOCAP_MODE, &ioCap, sizeof(ioCap));
+     esp_ble_gap_set_security_param(ESP_BLE_SM_MAX_KEY_SIZE, &keySize, sizeof(keySize));
+     esp_ble_gap_set_security_param(ESP_BLE_SM_SET_INIT_KEY, &initKey, sizeof(initKey));
+     esp_ble_gap_set_security_param(ESP_BLE_SM_SET_RSP_KEY, &rspKey, sizeof(rspKey));
+ }
+#endif
+ 
+ // notify trên ED01, gọi từ OTA_ble (task BTC hoặc task ghi flash)
+ static void BLE_otaNotify(const uint8_t *data, uint16_t len)
+ {
+     if (!ble_inited || !s_otaNotifyEnabled) {
+         return;
+     }
+     esp_err_t err = esp_ble_gatts_send_indicate(gl_profile_tab[PROFILE_BLE_OTA_APP_ID].gatts_if,
+                                                 gl_profile_tab[PROFILE_BLE_OTA_APP_ID].conn_id,
+                                                 gl_profile_tab[PROFILE_BLE_OTA_APP_ID].charInsts[0].char_handle,
+                                                 len, (uint8_t *)data, false);
+     if (err != ESP_OK) {
+         log_error("ble_ota: notify err=%s", esp_err_to_name(err));
+     }
+ }
+ 
+ static void BLE_otaPrepareWrite(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param)
+ {
+     esp_gatt_status_t status = ESP_GATT_OK;
+ 
+     if (c_prepare_write_env.prepare_buf == NULL) {
+         c_prepare_write_env.prepare_buf = (uint8_t *)malloc(BLE_OTA_CONTROL_VAL_LEN_MAX);
+         c_prepare_write_env.prepare_len = 0;
+     }
+     if (c_prepare_write_env.prepare_buf == NULL) {
+         status = ESP_GATT_NO_RESOURCES;
+     } else if ((param->write.offset + param->write.len) > BLE_OTA_CONTROL_VAL_LEN_MAX) {
+         status = ESP_GATT_INVALID_ATTR_LEN;
+     } else {
+         memcpy(c_prepare_write_env.prepare_buf + param->write.offset, param->write.value, param->write.len);
+         c_prepare_write_env.prepare_len = param->write.offset + param->write.len;
+     }
+ 
+     // prepare write phải trả lại đúng dữ liệu đã nhận
+     esp_gatt_rsp_t rsp = {0};
+     rsp.attr_value.handle = param->write.handle;
+     rsp.attr_value.offset = param->write.offset;
+     rsp.attr_value.len = param->write.len;
+     rsp.attr_value.auth_req = ESP_GATT_AUTH_REQ_NONE;
+     memcpy(rsp.attr_value.value, param->write.value, param->write.len);
+     esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, status, &rsp);
+ }
+ 
+ static void gatts_profile_ble_ota_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param)
+ {
+     switch (event) {
+     case ESP_GATTS_REG_EVT:
+         log_info("ble_ota: ESP_GATTS_REG_EVT, status %d, app_id %d", param->reg.status, param->reg.app_id);
+         gl_profile_tab[PROFILE_BLE_OTA_APP_ID].service_id.is_primary = true;
+         gl_profile_tab[PROFILE_BLE_OTA_APP_ID].service_id.id.inst_id = 0x00;
+         gl_profile_tab[PROFILE_BLE_OTA_APP_ID].service_id.id.uuid.len = ESP_UUID_LEN_16;
+         gl_profile_tab[PROFILE_BLE_OTA_APP_ID].service_id.id.uuid.uuid.uuid16 = GATTS_SERVICE_UUID_BLE_OTA;
+         OtaBle_setNotify(BLE_otaNotify);
+         esp_ble_gatts_create_service(gatts_if, &gl_profile_tab[PROFILE_BLE_OTA_APP_ID].service_id, GATTS_NUM_HANDLE_BLE_OTA);
+         break;
+ 
+     case ESP_GATTS_CREATE_EVT: {
+         log_info("ble_ota: ESP_GATTS_CREATE_EVT, status %d, service_handle %d", param->create.status, param->create.service_handle);
+         gl_profile_tab[PROFILE_BLE_OTA_APP_ID].service_handle = param->create.service_handle;
+         gl_profile_tab[PROFILE_BLE_OTA_APP_ID].charInsts[0].char_uuid.len = ESP_UUID_LEN_16;
+         gl_profile_tab[PROFILE_BLE_OTA_APP_ID].charInsts[0].char_uuid.uuid.uuid16 = GATTS_CHAR_UUID_OTA_CONTROL;
+         gl_profile_tab[PROFILE_BLE_OTA_APP_ID].charInsts[1].char_uuid.len = ESP_UUID_LEN_16;
+         gl_profile_tab[PROFILE_BLE_OTA_APP_ID].charInsts[1].char_uuid.uuid.uuid16 = GATTS_CHAR_UUID_OTA_DATA;
+         gl_profile_tab[PROFILE_BLE_OTA_APP_ID].numberOfChar = 2;
+ 
+         esp_ble_gatts_start_service(gl_profile_tab[PROFILE_BLE_OTA_APP_ID].service_handle);
+ 
+         // tự trả lời (BY_APP): không lưu giá trị vào attr, dữ liệu chuyển thẳng cho OTA_ble
+         // chỉ ghi được sau khi link đã mã hoá (ghép đôi)
+         esp_attr_control_t otaAttrControl = { .auto_rsp = ESP_GATT_RSP_BY_APP };
+         esp_ble_gatts_add_char(gl_profile_tab[PROFILE_BLE_OTA_APP_ID].service_handle,
+                                &gl_profile_tab[PROFILE_BLE_OTA_APP_ID].charInsts[0].char_uuid,
+                                ESP_GATT_PERM_WRITE_ENCRYPTED,
+                                ESP_GATT_CHAR_PROP_BIT_WRITE | ESP_GATT_CHAR_PROP_BIT_NOTIFY,
+                                NULL,
+                                &otaAttrControl);
+         esp_ble_gatts_add_char(gl_profile_tab[PROFILE_BLE_OTA_APP_ID].service_handle,
+                                &gl_profile_tab[PROFILE_BLE_OTA_APP_ID].charInsts[1].char_uuid,
+                                ESP_GATT_PERM_WRITE_ENCRYPTED,
+                                ESP_GATT_CHAR_PROP_BIT_WRITE_NR,
+                                NULL,
+                                &otaAttrControl);
+         break;
+     }
+ 
+     case ESP_GATTS_ADD_CHAR_EVT:
+         log_info("ble_ota: ESP_GATTS_ADD_CHAR_EVT, status %d, attr_handle %d, char_uuid 0x%04x",
+                  param->add_char.status, param->add_char.attr_handle, param->add_char.char_uuid.uuid.uuid16);
+         if (param->add_char.status) break;
+ 
+         for (int i = 0; i < gl_profile_tab[PROFILE_BLE_OTA_APP_ID].numberOfChar; i++) {
+             if (param->add_char.char_uuid.uuid.uuid16 == gl_profile_tab[PROFILE_BLE_OTA_APP_ID].charInsts[i].char_uuid.uuid.uuid16) {
+                 gl_profile_tab[PROFILE_BLE_OTA_APP_ID].charInsts[i].char_handle = param->add_char.attr_handle;
+             }
+         }
+         // CCCD cho ED01 (notify)
+         if (param->add_char.char_uuid.uuid.uuid16 == GATTS_CHAR_UUID_OTA_CONTROL) {
+             esp_attr_control_t cccdAttrControl = { .auto_rsp = ESP_GATT_RSP_BY_APP };
+             esp_ble_gatts_add_char_descr(gl_profile_tab[PROFILE_BLE_OTA_APP_ID].service_handle,
+                                          &cccd_uuid,
+                                          ESP_GATT_PERM_READ_ENCRYPTED | ESP_GATT_PERM_WRITE_ENCRYPTED,
+                                          NULL, &cccdAttrControl);
+         }
+         break;
+ 
+     case ESP_GATTS_ADD_CHAR_DESCR_EVT:
+         if (param->add_char_descr.status == ESP_GATT_OK) {
+             gl_profile_tab[PROFILE_BLE_OTA_APP_ID].descr_handle = param->add_char_descr.attr_handle;
+             log_info("ble_ota: CCCD descriptor added handle %d", param->add_char_descr.attr_handle);
+         } else {
+             log_error("ble_ota: CCCD descriptor addition failed status %d", param->add_char_descr.status);
+         }
+         break;
+ 
+     case ESP_GATTS_START_EVT:
+         log_info("ble_ota: Service 12ED start status %d", param->start.status);
+         break;
+ 
+     case ESP_GATTS_READ_EVT:
+         if (param->read.handle == gl_profile_tab[PROFILE_BLE_OTA_APP_ID].descr_handle) {
+             esp_gatt_rsp_t rsp = {0};
+             rsp.attr_value.handle = param->read.handle;
+             rsp.attr_value.len = 2;
+             rsp.attr_value.value[0] = s_otaNotifyEnabled ? 0x01 : 0x00;
+             esp_ble_gatts_send_response(gatts_if, param->read.conn_id, param->read.trans_id, ESP_GATT_OK, &rsp);
+         }
+         break;
+ 
+     case ESP_GATTS_WRITE_EVT:
+         if (param->write.handle == gl_profile_tab[PROFILE_BLE_OTA_APP_ID].charInsts[1].char_handle) {
+             OtaBle_onData(param->write.value, param->write.len);
+             if (param->write.need_rsp) {
+                 esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, ESP_GATT_OK, NULL);
+             }
+         } else if (param->write.handle == gl_profile_tab[PROFILE_BLE_OTA_APP_ID].charInsts[0].char_handle) {
+             if (param->write.is_prep) {
+                 BLE_otaPrepareWrite(gatts_if, param);
+                 break;
+             }
+             esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, ESP_GATT_OK, NULL);
+             if ((param->write.len > 0) && (param->write.value[0] == OTA_BLE_OP_BEGIN)) {
+                 // tải image: rút ngắn connection interval (cấu hình wifi đặt 60-100 ms)
+                 esp_ble_conn_update_params_t conn_params;
+                 memcpy(conn_params.bda, s_otaRemoteBda, sizeof(esp_bd_addr_t));
+                 conn_params.latency = 0;
+                 conn_params.min_int = 6;   // 7.5ms
+                 conn_params.max_int = 12;  // 15ms
+                 conn_params.timeout = 400; // 4s
+                 esp_ble_gap_update_conn_params(&conn_params);
+             }
+             OtaBle_onControl(param->write.value, param->write.len);
+         } else if (param->write.handle == gl_profile_tab[PROFILE_BLE_OTA_APP_ID].descr_handle) {
+             if (param->write.len >= 2) {
+                 s_otaNotifyEnabled = (param->write.value[0] & 0x01) != 0;
+             }
+             esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, ESP_GATT_OK, NULL);
+         }
+         break;
+ 
+     case ESP_GATTS_EXEC_WRITE_EVT:
+         if (c_prepare_write_env.prepare_buf == NULL) {
+             break;
+         }
+         esp_ble_gatts_send_response(gatts_if, param->exec_write.conn_id, param->exec_write.trans_id, ESP_GATT_OK, NULL);
+         if (param->exec_write.exec_write_flag == ESP_GATT_PREP_WRITE_EXEC) {
+             OtaBle_onControl(c_prepare_write_env.prepare_buf, c_prepare_write_env.prepare_len);
+         }
+         free(c_prepare_write_env.prepare_buf);
+         c_prepare_write_env.prepare_buf = NULL;
+         c_prepare_write_env.prepare_len = 0;
+         break;
+ 
+     case ESP_GATTS_MTU_EVT:
+         log_info("ble_ota: ESP_GATTS_MTU_EVT, MTU %d", param->mtu.mtu);
+         OtaBle_setMtu(param->mtu.mtu);
+         break;
+ 
+     case ESP_GATTS_CONNECT_EVT:
+         gl_profile_tab[PROFILE_BLE_OTA_APP_ID].conn_id = param->connect.conn_id;
+         memcpy(s_otaRemoteBda, param->connect.remote_bda, sizeof(esp_bd_addr_t));
+         // DLE: 1 gói link layer chở trọn 1 chunk khi MTU lớn
+         esp_ble_gap_set_pkt_data_len(param->connect.remote_bda, BLE_OTA_DATA_LEN_MAX);
+         OtaBle_setMtu(ESP_GATT_DEF_BLE_MTU_SIZE);
+         break;
+ 
+     case ESP_GATTS_DISCONNECT_EVT:
+         // phiên OTA giữ lại, client kết nối lại gửi BEGIN để tải tiếp
+         s_otaNotifyEnabled = false;
+         free(c_prepare_write_env.prepare_buf);
+         c_prepare_write_env.prepare_buf = NULL;
+         c_prepare_write_env.prepare_len = 0;
+         break;
+ 
+     default:
+         break;
+     }
+ }
+ 
  static void gatts_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param)
  {
      /* If event is register event, store the gatts_if for each profile */
@@ -784,6 +1056,90 @@ static uint16_t cfg_cccd[2] = {0, 0};
      } while (0);
  }
  
+ /*******************************************************************************
+  * Beacon Only (VHCI)
+  ******************************************************************************/
+ static void BLE_vhciSendAvailable(void)
+ {
+ }
+ 
+ // chỉ cần Command Complete: H4 0x04, 0x0E, len, numPkts, opcode(2), status
+ static int BLE_vhciRecv(uint8_t *data, uint16_t len)
+ {
+     if ((len >= 7) && (data[0] == HCI_H4_EVT) && (data[1] == HCI_EVT_CMD_COMPLETE)) {
+         s_hciStatus = data[6];
+         xSemaphoreGive(s_hciDone);
+     }
+     return 0;
+ }
+ 
+ static esp_vhci_host_callback_t s_vhciCallback = {
+     .notify_host_send_available = BLE_vhciSendAvailable,
+     .notify_host_recv = BLE_vhciRecv,
+ };
+ 
+ static bool BLE_hciSend(uint16_t opcode, const uint8_t *param, uint8_t len)
+ {
+     uint8_t buf[4 + HCI_ADV_DATA_MAX_LEN + 1];
+     uint8_t retry = 0;
+ 
+     buf[0] = HCI_H4_CMD;
+     buf[1] = opcode & 0xff;
+     buf[2] = (opcode >> 8) & 0xff;
+     buf[3] = len;
+     if (len > 0) {
+         memcpy(buf + 4, param, len);
+     }
+ 
+     while (!esp_vhci_host_check_send_available()) {
+         if (retry++ >= 10) {
+             log_error("HCI busy, drop 0x%04x", opcode);
+             return false;
+         }
+         vTaskDelay(10/portTICK_PERIOD_MS);
+     }
+     xSemaphoreTake(s_hciDone, 0);
+     esp_vhci_host_send_packet(buf, len + 4);
+     if (xSemaphoreTake(s_hciDone, BLE_HCI_TIMEOUT_MS/portTICK_PERIOD_MS) != pdTRUE) {
+         log_error("HCI 0x%04x timeout", opcode);
+         return false;
+     }
+     if (s_hciStatus != 0) {
+         log_error("HCI 0x%04x status 0x%02x", opcode, s_hciStatus);
+         return false;
+     }
+     return true;
+ }
+ 
+ static bool BLE_hciSetAdvData(const uint8_t *data, uint8_t len)
+ {
+     uint8_t param[1 + HCI_ADV_DATA_MAX_LEN] = {0};
+     param[0] = len;
+     memcpy(param + 1, data, len);
+     return BLE_hciSend(HCI_OP_LE_SET_ADV_DATA, param, sizeof(param));
+ }
+ 
+ static bool BLE_hciStartBeacon()
+ {
+     uint8_t advParam[15] = {0};
+     uint8_t enable = 1;
+ 
+     advParam[0] = ble_adv_params.adv_int_min & 0xff;
+     advParam[1] = (ble_adv_params.adv_int_min >> 8) & 0xff;
+     advParam[2] = ble_adv_params.adv_int_max & 0xff;
+     advParam[3] = (ble_adv_params.adv_int_max >> 8) & 0xff;
+     advParam[4] = ADV_TYPE_NONCONN_IND;
+     advParam[5] = BLE_ADDR_TYPE_PUBLIC;
+     advParam[13] = ADV_CHNL_ALL;
+     advParam[14] = ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY;
+ 
+     // reset controller về trạng thái sạch sau khi Bluedroid dừng
+     return BLE_hciSend(HCI_OP_RESET, NULL, 0) &&
+            BLE_hciSend(HCI_OP_LE_SET_ADV_PARAM, advParam, sizeof(advParam)) &&
+            BLE_hciSetAdvData(s_advRaw, s_advRawLen) &&
+            BLE_hciSend(HCI_OP_LE_SET_ADV_ENABLE, &enable, 1);
+ }
+ 
  /*******************************************************************************
   * Application Functions
   ******************************************************************************/
@@ -792,19 +1148,28 @@ static uint16_t cfg_cccd[2] = {0, 0};
      printf("Init Bluetooth\n");
  
      esp_err_t ret;
-     ESP_ERROR_CHECK(esp_bt_controller_mem_release(ESP_BT_MODE_CLASSIC_BT));
-     esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
+     if (s_beaconOnly) {
+         // controller vẫn chạy từ chế độ beacon only: tắt quảng bá HCI, chỉ dựng lại Bluedroid
+         uint8_t enable = 0;
+         xSemaphoreTake(s_hciMutex, portMAX_DELAY);
+         BLE_hciSend(HCI_OP_LE_SET_ADV_ENABLE, &enable, 1);
+         s_beaconOnly = false;
+         xSemaphoreGive(s_hciMutex);
+     } else {
+         ESP_ERROR_CHECK(esp_bt_controller_mem_release(ESP_BT_MODE_CLASSIC_BT));
+         esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
  
-     ret = esp_bt_controller_init(&bt_cfg);
-     if (ret) {
-         log_error("%s initialize controller failed: %s", __func__, esp_err_to_name(ret));
-         return;
-     }
+         ret = esp_bt_controller_init(&bt_cfg);
+         if (ret) {
+             log_error("%s initialize controller failed: %s", __func__, esp_err_to_name(ret));
+             return;
+         }
  
-     ret = esp_bt_controller_enable(ESP_BT_MODE_BLE);
-     if (ret) {
-         log_error("%s enable controller failed: %s", __func__, esp_err_to_name(ret));
-         return;
+         ret = esp_bt_controller_enable(ESP_BT_MODE_BLE);
+         if (ret) {
+             log_error("%s enable controller failed: %s", __func__, esp_err_to_name(ret));
+             return;
+         }
      }
      ret = esp_bluedroid_init();
      if (ret) {
@@ -843,6 +1208,13 @@ static uint16_t cfg_cccd[2] = {0, 0};
          ble_adv_params.adv_type = ADV_TYPE_IND;
          esp_ble_gatts_app_register(PROFILE_CONFIG_WIFI_APP_ID);
          registeredConfigService = true;
+#ifdef BLE_OTA_ENABLE
+         if (!registeredOtaService) {
+             BLE_otaSetSecurity();
+             esp_ble_gatts_app_register(PROFILE_BLE_OTA_APP_ID);
+             registeredOtaService = true;
+         }
+#endif
      } else {
          printf("change advertising data config wifi\n");
          esp_ble_gap_config_adv_data(&config_wifi_adv_data);
@@ -876,13 +1248,81 @@ static uint16_t cfg_cccd[2] = {0, 0};
      esp_bt_mem_release(ESP_BT_MODE_BTDM);
  
      ble_inited = false;
+     s_beaconOnly = false;
      s_bleConfigConnected = false;
      s_bleControlConnected = false;
      registeredConfigService = false;
      registeredControlService = false;
+     registeredOtaService = false;
      printf("release ble done\n");
  }
  
+ // bỏ Bluedroid, giữ controller phát iBeacon đã cấu hình; false nếu không làm được (chưa có iBeacon, thiếu heap)
+ bool BLE_enterBeaconOnlyMode()
+ {
+     if (s_beaconOnly) {
+         return true;
+     }
+     if (!ble_inited || (s_advRawLen == 0) || (esp_bt_controller_get_status() != ESP_BT_CONTROLLER_STATUS_ENABLED)) {
+         return false;
+     }
+     if (s_hciDone == NULL) {
+         s_hciDone = xSemaphoreCreateBinary();
+         s_hciMutex = xSemaphoreCreateMutex();
+         if ((s_hciDone == NULL) || (s_hciMutex == NULL)) {
+             return false;
+         }
+     }
+ 
+     uint32_t seq = s_heapReport.seq + 1;
+     memset(&s_heapReport, 0, sizeof(s_heapReport));
+     s_heapReport.seq = seq;
+     s_heapReport.budget = BLE_DOWNLOAD_HEAP_BUDGET;
+     s_heapReport.freeBefore = esp_get_free_heap_size();
+ 
+     xSemaphoreTake(s_hciMutex, portMAX_DELAY);
+     esp_bluedroid_disable();
+     esp_bluedroid_deinit();
+     esp_vhci_host_register_callback(&s_vhciCallback);
+     ble_inited = false;
+     s_bleConfigConnected = false;
+     s_bleControlConnected = false;
+     registeredConfigService = false;
+     registeredControlService = false;
+     registeredOtaService = false;
+     s_heapReport.freeHostOff = esp_get_free_heap_size();
+ 
+     s_beaconOnly = (s_heapReport.freeHostOff >= BLE_DOWNLOAD_HEAP_BUDGET) && BLE_hciStartBeacon();
+     xSemaphoreGive(s_hciMutex);
+ 
+     s_heapReport.freeBeaconOnly = esp_get_free_heap_size();
+     s_heapReport.largestBlock = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+     s_heapReport.beaconOnly = s_beaconOnly;
+     printf("BLE heap: [bluedroid - %lu] [host off - %lu] [beacon only - %lu] [largest - %lu] [budget - %lu] %s\n", s_heapReport.freeBefore,
+                                                                                                              s_heapReport.freeHostOff,
+                                                                                                              s_heapReport.freeBeaconOnly,
+                                                                                                              s_heapReport.largestBlock,
+                                                                                                              s_heapReport.budget,
+                                                                                                              s_beaconOnly ? "fits" : "release controller");
+     return s_beaconOnly;
+ }
+ 
+ // gọi trước khi tải OTA/cert thay cho BLE_releaseBle
+ void BLE_releaseForDownload()
+ {
+ #ifdef BLE_BEACON_DURING_DOWNLOAD_ENABLE
+     if (BLE_enterBeaconOnlyMode()) {
+         return;
+     }
+ #endif
+     BLE_releaseBle();
+ }
+ 
+ void BLE_getHeapReport(ble_heap_report_t *report)
+ {
+     memcpy(report, &s_heapReport, sizeof(ble_heap_report_t));
+ }
+ 
  void BLE_getMesParamIndex(uint8_t *cmdLine, uint16_t cmdLineLen, uint16_t *indexList, uint8_t *indexNum)
  {
      for (uint8_t i = 0; i < cmdLineLen; i++) {
@@ -1027,7 +1467,7 @@ static uint16_t cfg_cccd[2] = {0, 0};
  
  void BLE_iBeaconSetSpecial(uint16_t cid, uint16_t major, uint16_t minor)
  {
-     if (!ble_inited) {
+     if (!ble_inited && !s_beaconOnly) {
          log_error("wait BLE init...");
          return;
      }
@@ -1052,6 +1492,17 @@ static uint16_t cfg_cccd[2] = {0, 0};
      raw_ibeacon_data[27] = (minor>>8) & 0xff;
      raw_ibeacon_data[28] = (minor) & 0xff;
  
+     // giữ lại để chế độ beacon only phát tiếp, đổi minor/cid qua HCI khi Bluedroid đã dừng
+     memcpy(s_advRaw, raw_ibeacon_data, sizeof(raw_ibeacon_data));
+     s_advRawLen = sizeof(raw_ibeacon_data);
+     if (s_beaconOnly) {
+         xSemaphoreTake(s_hciMutex, portMAX_DELAY);
+         bool ok = BLE_hciSetAdvData(s_advRaw, s_advRawLen);
+         xSemaphoreGive(s_hciMutex);
+         printf(" >> Config iBeacon (HCI):: Cid [0x%04x] Major [%d] Minor [%d] %s\n", cid, major, minor, ok ? "ok" : "fail");
+         return;
+     }
+ 
      ble_adv_params.adv_type = ADV_TYPE_NONCONN_IND;
      esp_err_t status = esp_ble_gap_config_adv_data_raw(raw_ibeacon_data, sizeof(raw_ibeacon_data));
  
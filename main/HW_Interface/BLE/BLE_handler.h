@@ -12,6 +12,17 @@
 #include "Global.h"
 
 /* Exported types ------------------------------------------------------------*/
+// heap trước/sau khi bỏ Bluedroid, giữ controller phát iBeacon qua VHCI
+typedef struct
+{
+    uint32_t freeBefore;        // Bluedroid đang chạy
+    uint32_t freeHostOff;       // sau esp_bluedroid_deinit
+    uint32_t freeBeaconOnly;    // sau khi bật quảng bá bằng HCI
+    uint32_t largestBlock;
+    uint32_t budget;            // heap cần cho tải OTA/cert
+    bool beaconOnly;            // false: không đủ heap, đã release cả controller
+    uint32_t seq;               // tăng mỗi lần đo, 0: chưa đo
+} ble_heap_report_t;
 /* Exported macro ------------------------------------------------------------*/
 #define BLE_MES_WIFI_OK                 "Wifi_OK"
 
@@ -22,6 +33,17 @@
 #define BLE_MES_USER_EXIST              "User_EXIST"
 #define BLE_MES_USER_FALSE              "User_FALSE"
 
+// Khi tải OTA/cert: chỉ bỏ Bluedroid (GATT, GAP), controller vẫn phát iBeacon non-connectable qua VHCI
+// để không mất chấm công trong lúc cập nhật. Không đủ BLE_DOWNLOAD_HEAP_BUDGET thì release hẳn như cũ
+#define BLE_BEACON_DURING_DOWNLOAD_ENABLE
+// ring OTA 32 KB + giải nén 48 KB + TLS ~45 KB + buffer HTTP, stack task ghi
+#define BLE_DOWNLOAD_HEAP_BUDGET        (140*1024)
+#define BLE_HCI_TIMEOUT_MS              500
+
+// service OTA qua BLE (0x12ED) trong chế độ cấu hình, cho nơi chưa có internet (OTA_ble.h)
+// tắt mặc định: cần ghép đôi mã hoá và image ký bằng khoá của main/ota_sign_pub.pem
+// #define BLE_OTA_ENABLE
+
 /* Exported functions ------------------------------------------------------- */
 void BLE_init();
 void BLE_startConfigMode();
@@ -29,6 +51,9 @@ void BLE_startControlMode();
 void BLE_sentToMobile(const char *sentMes);
 void BLE_reAdvertising();
 void BLE_releaseBle();
+void BLE_releaseForDownload();
+bool BLE_enterBeaconOnlyMode();
+void BLE_getHeapReport(ble_heap_report_t *report);
 void BLE_startModeHardReset();
 void BLE_iBeaconSetSpecial(uint16_t cid, uint16_t major, uint16_t minor);
 
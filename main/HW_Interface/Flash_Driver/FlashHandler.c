@@ -45,7 +45,6 @@ extern uint32_t g_user_ID;
 
 extern versionFwOld versionFwOld_t;
 extern confirmEndOta confirmEndOta_t;
-extern mqtt_certKey_t certKeyMqtt;
 extern mqtt_environment_t envir;
 extern schedule_t mySchedule;
 
@@ -58,17 +57,237 @@ typedef struct
     char password[PASSWORD_LEN];
 } info_id_password_t;
 
+typedef struct
+{
+    char nameSpace[NVS_NS_NAME_MAX_SIZE];
+    nvs_handle_t handle;
+    bool needCommit;
+    uint32_t lastUse;
+} flash_handle_slot_t;
+
+// size 0: đã biết key không có trong NVS
+typedef struct
+{
+    char nameSpace[NVS_NS_NAME_MAX_SIZE];
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    uint8_t *data;
+    size_t size;
+    bool used;
+    bool dirty;
+    uint32_t lastUse;
+} flash_cache_entry_t;
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+static flash_handle_slot_t s_handles[FLASH_HANDLE_CACHE_SIZE];
+static flash_cache_entry_t s_cache[FLASH_CACHE_ENTRIES];
+static uint32_t s_useCounter = 0;
+static uint32_t s_nvsOps = 0;
+static flash_stats_t s_flashStats;
+static SemaphoreHandle_t s_flashMutex = NULL;
+static esp_timer_handle_t s_commitTimer = NULL;
+static bool s_commitArmed = false;
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+static void FlashHandler_commitTimerCb(void *arg);
+
+static const esp_timer_create_args_t s_commitTimerArgs = {
+    .callback = &FlashHandler_commitTimerCb,
+    .name = "flashCommit"
+};
+
+/*******************************************************************************
+ * Handle & Write-behind Cache
+ ******************************************************************************/
+static void FlashHandler_lock()
+{
+    // có thể được gọi trước Flash_Initialize, lúc đó chỉ có app_main chạy
+    if (s_flashMutex == NULL) {
+        s_flashMutex = xSemaphoreCreateRecursiveMutex();
+    }
+    xSemaphoreTakeRecursive(s_flashMutex, portMAX_DELAY);
+}
+
+static void FlashHandler_unlock()
+{
+    xSemaphoreGiveRecursive(s_flashMutex);
+}
+
+static bool FlashHandler_commitSlot(flash_handle_slot_t *slot)
+{
+    if (!slot->needCommit) {
+        return true;
+    }
+    s_nvsOps++;
+    esp_err_t err = nvs_commit(slot->handle);
+    slot->needCommit = false;
+    if (err != ESP_OK) {
+        log_error("nvs_commit \"%s\" failed, err %s", slot->nameSpace, esp_err_to_name(err));
+        s_flashStats.errors++;
+        return false;
+    }
+    s_flashStats.commits++;
+    return true;
+}
+
+// lấy handle đã mở của namespace, bảng đầy thì commit và đóng handle lâu không dùng
+static flash_handle_slot_t* FlashHandler_getHandle(const char *nameSpace)
+{
+    flash_handle_slot_t *slot = NULL;
+
+    for (uint8_t i = 0; i < FLASH_HANDLE_CACHE_SIZE; i++) {
+        if ((s_handles[i].nameSpace[0] != 0) && (strcmp(s_handles[i].nameSpace, nameSpace) == 0)) {
+            s_handles[i].lastUse = ++s_useCounter;
+            return &s_handles[i];
+        }
+        if ((slot == NULL) || ((slot->nameSpace[0] != 0) && ((s_handles[i].nameSpace[0] == 0) || (s_handles[i].lastUse < slot->lastUse)))) {
+            slot = &s_handles[i];
+        }
+    }
+
+    if (slot->nameSpace[0] != 0) {
+        FlashHandler_commitSlot(slot);
+        nvs_close(slot->handle);
+        slot->nameSpace[0] = 0;
+    }
+    s_nvsOps++;
+    esp_err_t err = nvs_open(nameSpace, NVS_READWRITE, &slot->handle);
+    if (err != ESP_OK) {
+        log_error("open nvs \"%s\" error %s", nameSpace, esp_err_to_name(err));
+        s_flashStats.errors++;
+        return NULL;
+    }
+    strlcpy(slot->nameSpace, nameSpace, sizeof(slot->nameSpace));
+    slot->needCommit = false;
+    slot->lastUse = ++s_useCounter;
+    return slot;
+}
+
+static flash_cache_entry_t* FlashHandler_findEntry(const char *nameSpace, const char *key)
+{
+    for (uint8_t i = 0; i < FLASH_CACHE_ENTRIES; i++) {
+        if (s_cache[i].used && (strcmp(s_cache[i].key, key) == 0) && (strcmp(s_cache[i].nameSpace, nameSpace) == 0)) {
+            s_cache[i].lastUse = ++s_useCounter;
+            return &s_cache[i];
+        }
+    }
+    return NULL;
+}
+
+static void FlashHandler_dropEntry(flash_cache_entry_t *entry)
+{
+    free(entry->data);
+    memset(entry, 0, sizeof(flash_cache_entry_t));
+}
+
+static bool FlashHandler_storeEntry(flash_cache_entry_t *entry, const void *data, size_t size)
+{
+    if (size != entry->size) {
+        uint8_t *buf = (size > 0) ? (uint8_t *)realloc(entry->data, size) : NULL;
+        if ((size > 0) && (buf == NULL)) {
+            return false;
+        }
+        if (size == 0) {
+            free(entry->data);
+        }
+        entry->data = buf;
+        entry->size = size;
+    }
+    if (size > 0) {
+        memcpy(entry->data, data, size);
+    }
+    return true;
+}
+
+// ô trống hoặc ô sạch lâu không dùng, toàn ô dirty thì commit trước
+static flash_cache_entry_t* FlashHandler_newEntry(const char *nameSpace, const char *key)
+{
+    flash_cache_entry_t *entry = NULL;
+
+    for (uint8_t i = 0; i < FLASH_CACHE_ENTRIES; i++) {
+        if (!s_cache[i].used) {
+            entry = &s_cache[i];
+            break;
+        }
+        if (!s_cache[i].dirty && ((entry == NULL) || (s_cache[i].lastUse < entry->lastUse))) {
+            entry = &s_cache[i];
+        }
+    }
+    if (entry == NULL) {
+        FlashHandler_flush();
+        return FlashHandler_newEntry(nameSpace, key);
+    }
+    if (entry->used) {
+        FlashHandler_dropEntry(entry);
+    }
+    strlcpy(entry->nameSpace, nameSpace, sizeof(entry->nameSpace));
+    strlcpy(entry->key, key, sizeof(entry->key));
+    entry->used = true;
+    entry->lastUse = ++s_useCounter;
+    return entry;
+}
+
+// ghi 1 blob dirty xuống NVS (chưa commit), lỗi thì bỏ bản trong RAM để lần đọc sau lấy đúng dữ liệu trong NVS
+static flash_handle_slot_t* FlashHandler_writeEntry(flash_cache_entry_t *entry)
+{
+    entry->dirty = false;
+    flash_handle_slot_t *slot = FlashHandler_getHandle(entry->nameSpace);
+    s_nvsOps++;
+    esp_err_t err = (slot != NULL) ? nvs_set_blob(slot->handle, entry->key, entry->data, entry->size) : ESP_FAIL;
+    if (err != ESP_OK) {
+        log_error("nvs_set_blob \"%s\" error %s", entry->key, esp_err_to_name(err));
+        s_flashStats.errors++;
+        FlashHandler_dropEntry(entry);
+        return NULL;
+    }
+    s_flashStats.nvsWrites++;
+    slot->needCommit = true;
+    return slot;
+}
+
+static void FlashHandler_armCommit()
+{
+    if (s_commitArmed) {
+        return;
+    }
+    if ((s_commitTimer == NULL) && (esp_timer_create(&s_commitTimerArgs, &s_commitTimer) != ESP_OK)) {
+        s_commitTimer = NULL;
+    }
+    // hẹn giờ từ lần ghi đầu tiên, không dời theo các lần ghi sau
+    if ((s_commitTimer != NULL) && (esp_timer_start_once(s_commitTimer, (uint64_t)FLASH_COMMIT_DELAY_MS*1000) == ESP_OK)) {
+        s_commitArmed = true;
+        return;
+    }
+    log_error("Start commit timer fail, flush now");
+    FlashHandler_flush();
+}
+
+static void FlashHandler_commitTimerCb(void *arg)
+{
+    FlashHandler_flush();
+}
+
 /*******************************************************************************
  * Application Functions
  ******************************************************************************/
 void Flash_Initialize()
 {
+    int64_t startUs = esp_timer_get_time();
+    uint32_t startOps = s_nvsOps;
+
     nvs_flash_init();
     Flash_loadDataActiveDevice();
     Flash_loadInfoFactoryDefault();
     // Flash_loadConfigWifi();
     FlashHandler_getDataOtaInStore();
     // FlashHandler_initInfoSwitch();
+
+    s_flashStats.bootMs = (uint32_t)((esp_timer_get_time() - startUs) / 1000);
+    s_flashStats.bootNvsOps = s_nvsOps - startOps;
+    log_info("Flash init %lu ms, %lu nvs ops", s_flashStats.bootMs, s_flashStats.bootNvsOps);
 }
 
 void FlashHandler_initInfoSwitch()
@@ -128,122 +347,218 @@ void FlashHandler_getDataOtaInStore()
 
 bool FlashHandler_getData(char* nameSpace,char* key,void* dataStore)
 {
-    // log_info("Getting data store in flash");
-    nvs_handle my_handle;
-    esp_err_t err;
+    bool found = false;
+
+    FlashHandler_lock();
+    s_flashStats.reads++;
+    flash_cache_entry_t *entry = FlashHandler_findEntry(nameSpace, key);
+    if (entry != NULL) {
+        s_flashStats.readHits++;
+        if (entry->size > 0) {
+            memcpy(dataStore, entry->data, entry->size);
+        }
+        found = (entry->size > 0);
+        FlashHandler_unlock();
+        return found;
+    }
 
-    // Open
-    err = nvs_open(nameSpace, NVS_READWRITE, &my_handle);
-    if (err != ESP_OK) {
-        log_error("open nvs error");
+    flash_handle_slot_t *slot = FlashHandler_getHandle(nameSpace);
+    if (slot == NULL) {
+        FlashHandler_unlock();
         return false;
     }
 
     // Read the size of memory space required for blob
     size_t required_size = 0; // value will default to 0, if not set yet in NVS
-    err = nvs_get_blob(my_handle, key, NULL, &required_size);
+    s_nvsOps++;
+    esp_err_t err = nvs_get_blob(slot->handle, key, NULL, &required_size);
     if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
         log_error("nvs_get_blob error");
+        FlashHandler_unlock();
         return false;
     }
 
-    // Read previously saved blob if available
-    if (required_size > 0) {
-        // log_info("Found data store in flash");
-        err = nvs_get_blob(my_handle, key, dataStore, &required_size);
-        if (err != ESP_OK) {
-            log_error("nvs_get_blob error");
-            return false;
+    if (required_size > FLASH_CACHE_BLOB_MAX) {
+        // blob lớn: đọc thẳng, không giữ bản sao
+        s_nvsOps++;
+        found = (nvs_get_blob(slot->handle, key, dataStore, &required_size) == ESP_OK);
+    } else {
+        // newEntry có thể commit và đóng handle khi cache đầy, lấy lại handle sau đó
+        entry = FlashHandler_newEntry(nameSpace, key);
+        slot = FlashHandler_getHandle(nameSpace);
+        if (required_size > 0) {
+            entry->data = (uint8_t *)malloc(required_size);
+            s_nvsOps++;
+            if ((slot == NULL) || (entry->data == NULL) || (nvs_get_blob(slot->handle, key, entry->data, &required_size) != ESP_OK)) {
+                log_error("nvs_get_blob error");
+                FlashHandler_dropEntry(entry);
+                FlashHandler_unlock();
+                return false;
+            }
+            entry->size = required_size;
+            memcpy(dataStore, entry->data, required_size);
+            found = true;
         }
     }
-
-    // Commit
-    err = nvs_commit(my_handle);
-    if (err != ESP_OK) {
-        log_error("nvs_commit error");
-        return false;
-    }
-    // Close
-    nvs_close(my_handle);
-    // log_info("Get data store in flash done");
-    if (required_size > 0) {
-        return true;
-    }
-    
-    return false;
+    FlashHandler_unlock();
+    return found;
 }
 
+// ghi vào RAM, commit sau FLASH_COMMIT_DELAY_MS hoặc khi FlashHandler_flush (trước reset)
 bool FlashHandler_setData(char* nameSpace,char* key,void* dataStore,size_t dataSize)
 {
-    // log_info("Saving data to flash");
-    nvs_handle my_handle;
-    esp_err_t err;
+    bool ok = true;
 
-    // Open
-    err = nvs_open(nameSpace, NVS_READWRITE, &my_handle);
-    if (err != ESP_OK) {
-        log_error("open nvs error");
-        return false;
-    }
+    FlashHandler_lock();
+    s_flashStats.writes++;
+    flash_cache_entry_t *entry = FlashHandler_findEntry(nameSpace, key);
 
-    // Read the size of memory space required for blob
-    size_t required_size = 0; // value will default to 0, if not set yet in NVS
-    // Write value including previously saved blob if available
-    required_size = dataSize;
-    // log_info("store data size: %d", required_size);
-    err = nvs_set_blob(my_handle, key, dataStore, required_size);
+    if ((dataSize == 0) || (dataSize > FLASH_CACHE_BLOB_MAX)) {
+        if (entry != NULL) {
+            FlashHandler_dropEntry(entry);
+        }
+        flash_handle_slot_t *slot = FlashHandler_getHandle(nameSpace);
+        s_nvsOps++;
+        esp_err_t err = (slot != NULL) ? nvs_set_blob(slot->handle, key, dataStore, dataSize) : ESP_FAIL;
+        if (err != ESP_OK) {
+            log_error("nvs_set_blob error %d", err);
+            s_flashStats.errors++;
+            FlashHandler_unlock();
+            return false;
+        }
+        s_flashStats.nvsWrites++;
+        slot->needCommit = true;
+        ok = FlashHandler_commitSlot(slot);
+        FlashHandler_unlock();
+        return ok;
+    }
 
-    if (err != ESP_OK) {
-        log_error("nvs_set_blob error %d", err);
+    if ((entry != NULL) && (entry->size == dataSize) && (memcmp(entry->data, dataStore, dataSize) == 0)) {
+        s_flashStats.skipped++;
+        FlashHandler_unlock();
+        return true;
+    }
+    if (entry == NULL) {
+        entry = FlashHandler_newEntry(nameSpace, key);
+    } else if (entry->dirty) {
+        s_flashStats.coalesced++;
+    }
+    if (!FlashHandler_storeEntry(entry, dataStore, dataSize)) {
+        log_error("No memory to cache \"%s\"", key);
+        FlashHandler_dropEntry(entry);
+        FlashHandler_unlock();
         return false;
     }
+    entry->dirty = true;
+    FlashHandler_armCommit();
+    FlashHandler_unlock();
+    return ok;
+}
 
-    // Commit
-    err = nvs_commit(my_handle);
-    if (err != ESP_OK) {
-        log_error("nvs_commit error");
-        return false;
+// ghi và commit ngay: dữ liệu phải còn sau panic/WDT/brownout (không đi qua ESP_resetChip)
+bool FlashHandler_setDataSync(char* nameSpace, char* key, void* dataStore, size_t dataSize)
+{
+    FlashHandler_lock();
+    bool ok = FlashHandler_setData(nameSpace, key, dataStore, dataSize);
+    flash_cache_entry_t *entry = FlashHandler_findEntry(nameSpace, key);
+    // giá trị không đổi nhưng bản trước còn chờ commit thì vẫn phải ghi
+    if (ok && (entry != NULL) && entry->dirty) {
+        flash_handle_slot_t *slot = FlashHandler_writeEntry(entry);
+        ok = (slot != NULL) && FlashHandler_commitSlot(slot);
     }
-    // Close
-    nvs_close(my_handle);
-    // log_info("Data is saved\n");
-    return true;
+    FlashHandler_unlock();
+    return ok;
 }
 
 bool FlashHandler_eraseData(char* nameSpace, const char *key)
 {
-    nvs_handle_t my_handle;
     esp_err_t err = ESP_OK;
 
-    err = nvs_open(nameSpace, NVS_READWRITE, &my_handle);
-    if (err != ESP_OK) {
-        log_error("open nvs error");
+    FlashHandler_lock();
+    flash_handle_slot_t *slot = FlashHandler_getHandle(nameSpace);
+    if (slot == NULL) {
+        FlashHandler_unlock();
         return false;
     }
 
     if (key) {
-        err = nvs_erase_key(my_handle, key);
+        // bỏ bản chưa commit, lần đọc sau biết key không còn
+        flash_cache_entry_t *entry = FlashHandler_findEntry(nameSpace, key);
+        if (entry != NULL) {
+            FlashHandler_storeEntry(entry, NULL, 0);
+            entry->dirty = false;
+        }
+        s_nvsOps++;
+        err = nvs_erase_key(slot->handle, key);
         if (err == ESP_ERR_NVS_NOT_FOUND) {
             log_info("Erase, namespace \"%s\", key \"%s\" not exists", nameSpace, key);
+            FlashHandler_unlock();
             return false;
         }
     }
     if (err != ESP_OK) {
         log_error("Erase, nvs_erase_%s_%s failed, err %s", nameSpace, key, esp_err_to_name(err));
+        FlashHandler_unlock();
         return false;
     }
 
-    err = nvs_commit(my_handle);
-    if (err != ESP_OK) {
-        log_error("Erase, nvs_commit failed, err %s", esp_err_to_name(err));
+    slot->needCommit = true;
+    if (!FlashHandler_commitSlot(slot)) {
+        FlashHandler_unlock();
         return false;
     }
+    FlashHandler_unlock();
     if (key) {
         log_info("Erase done, namespace \"%s\", key \"%s\"", nameSpace, key);
     } 
     return true;
 }
 
+// ghi các blob dirty rồi commit mỗi namespace 1 lần; gọi trước khi reset
+void FlashHandler_flush()
+{
+    FlashHandler_lock();
+    if (s_commitArmed) {
+        esp_timer_stop(s_commitTimer);
+        s_commitArmed = false;
+    }
+    for (uint8_t i = 0; i < FLASH_CACHE_ENTRIES; i++) {
+        flash_cache_entry_t *entry = &s_cache[i];
+        if (entry->used && entry->dirty) {
+            FlashHandler_writeEntry(entry);
+        }
+    }
+    for (uint8_t i = 0; i < FLASH_HANDLE_CACHE_SIZE; i++) {
+        if (s_handles[i].nameSpace[0] != 0) {
+            FlashHandler_commitSlot(&s_handles[i]);
+        }
+    }
+    FlashHandler_unlock();
+}
+
+void FlashHandler_getStats(flash_stats_t *stats)
+{
+    FlashHandler_lock();
+    memcpy(stats, &s_flashStats, sizeof(flash_stats_t));
+    FlashHandler_unlock();
+}
+
+void FlashHandler_printStats()
+{
+    flash_stats_t stats;
+    FlashHandler_getStats(&stats);
+    printf("Flash: [boot - %lu ms, %lu ops] [read - %lu, hit %lu] [write - %lu, skip %lu, coalesced %lu] [nvs write - %lu] [commit - %lu] [error - %lu]\n", stats.bootMs,
+                                                                                                                                                         stats.bootNvsOps,
+                                                                                                                                                         stats.reads,
+                                                                                                                                                         stats.readHits,
+                                                                                                                                                         stats.writes,
+                                                                                                                                                         stats.skipped,
+                                                                                                                                                         stats.coalesced,
+                                                                                                                                                         stats.nvsWrites,
+                                                                                                                                                         stats.commits,
+                                                                                                                                                         stats.errors);
+}
+
 bool FlashHandler_getDeviceInfoInStore()
 {
     info_id_password_t deviceInfo;
@@ -261,7 +576,7 @@ bool FlashHandler_saveDeviceInfoInStore()
     info_id_password_t deviceInfo;
     strcpy(deviceInfo.productId, g_product_Id);
     strcpy(deviceInfo.password, g_password);
-    if (FlashHandler_setData(NAMESPACE_GENARAL, KEY_DEVICE_INFO_ID_PWS, &deviceInfo, sizeof(deviceInfo))) {
+    if (FlashHandler_setDataSync(NAMESPACE_GENARAL, KEY_DEVICE_INFO_ID_PWS, &deviceInfo, sizeof(deviceInfo))) {
         // log_info("Save data in store done id: %s, pw: %s", deviceInfo.productId, deviceInfo.password);
         return true;
     } else {
@@ -292,22 +607,20 @@ bool FlashHandler_saveUserData()
     }  
 }
 
-bool FlashHandler_getCertKeyMqttInStore()
+bool FlashHandler_getCertKeyMqttInStore(void* certKey)
 {
-    if (FlashHandler_getData(NAMESPACE_GENARAL, KEY_CERTKEY_MQTT, &certKeyMqtt)) {
-        // log_info("Got cert : %s", (char*)(certKeyMqtt.cert));
-        // log_info("Got key : %s", (char*)(certKeyMqtt.key));
+    // chuyển cert/key cũ sang partition mqtt_cert, hoặc dùng trực tiếp khi chưa có partition
+    if (FlashHandler_getData(NAMESPACE_GENARAL, KEY_CERTKEY_MQTT, certKey)) {
         return true;
     } else {
-        log_error("Get cert key fail");
         return false;
     }
 }
 
-bool FlashHandler_saveCertKeyMqttInStore()
+// chỉ dùng khi bảng partition chưa có mqtt_cert (thiết bị cập nhật qua OTA)
+bool FlashHandler_saveCertKeyMqttInStore(void* certKey, size_t size)
 {
-    if (FlashHandler_setData(NAMESPACE_GENARAL, KEY_CERTKEY_MQTT, &certKeyMqtt, sizeof(certKeyMqtt))) {
-        // log_info("Save cert key mqtt ok");
+    if (FlashHandler_setDataSync(NAMESPACE_GENARAL, KEY_CERTKEY_MQTT, certKey, size)) {
         return true;
     } else {
         log_error("Save cert key false");
@@ -315,6 +628,11 @@ bool FlashHandler_saveCertKeyMqttInStore()
     }
 }
 
+bool FlashHandler_eraseCertKeyMqttInStore()
+{
+    return FlashHandler_eraseData(NAMESPACE_GENARAL, KEY_CERTKEY_MQTT);
+}
+
 bool FlashHandler_getEnvironmentMqttInStore()
 {
     if (FlashHandler_getData(NAMESPACE_GENARAL, KEY_ENVIR_MQTT, &envir)) {
@@ -328,7 +646,7 @@ bool FlashHandler_getEnvironmentMqttInStore()
 
 bool FlashHandler_saveEnvironmentMqttInStore()
 {
-    if (FlashHandler_setData(NAMESPACE_GENARAL, KEY_ENVIR_MQTT, &envir, sizeof(mqtt_environment_t))) {
+    if (FlashHandler_setDataSync(NAMESPACE_GENARAL, KEY_ENVIR_MQTT, &envir, sizeof(mqtt_environment_t))) {
         // log_info("Save environment mqtt ok");
         return true;
     } else {
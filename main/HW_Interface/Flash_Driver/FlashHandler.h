@@ -12,13 +12,37 @@
 #include "Global.h"
 
 /* Exported types ------------------------------------------------------------*/
+typedef struct
+{
+    uint32_t bootMs;            // thời gian Flash_Initialize
+    uint32_t bootNvsOps;        // số lần gọi NVS trong Flash_Initialize
+    uint32_t reads;             // gọi FlashHandler_getData
+    uint32_t readHits;          // đọc từ RAM, không vào NVS
+    uint32_t writes;            // gọi FlashHandler_setData
+    uint32_t skipped;           // giá trị không đổi, bỏ qua
+    uint32_t coalesced;         // ghi đè bản chưa commit
+    uint32_t nvsWrites;         // nvs_set_blob thực sự
+    uint32_t commits;
+    uint32_t errors;
+} flash_stats_t;
+
 /* Exported macro ------------------------------------------------------------*/
+// giữ handle NVS mở theo namespace, không open/close mỗi lần đọc ghi
+#define FLASH_HANDLE_CACHE_SIZE     12
+// bản sao blob trong RAM: đọc lại không vào NVS, ghi gom lại commit 1 lần
+#define FLASH_CACHE_ENTRIES         24
+#define FLASH_CACHE_BLOB_MAX        2048    // blob lớn hơn ghi thẳng
+// thời gian tối đa dữ liệu nằm trong RAM chưa commit (mất điện sẽ mất phần này)
+// trạng thái OTA, bản tin QoS1 chờ gửi, cert, kích hoạt: dùng FlashHandler_setDataSync
+#define FLASH_COMMIT_DELAY_MS       5000
+
 #define NAMESPACE_GENARAL           "DEVICE_GENARAL"
 #define KEY_DEVICE_INFO_ID_PWS      "InfoIdPassword"
-#define KEY_CERTKEY_MQTT            "mqttCertkey"
+#define KEY_CERTKEY_MQTT            "mqttCertkey"     // bản cũ, đã chuyển sang partition mqtt_cert
 #define KEY_ENVIR_MQTT              "mqttEnvir"
 #define KEY_SCHEDULE                "schedule"
 #define KEY_USER_ID                 "userId"
+#define KEY_PAYLOAD_ENCODING        "payloadEnc"
 
 /* Exported functions ------------------------------------------------------- */
 void Flash_Initialize();
@@ -27,13 +51,18 @@ void FlashHandler_resetUserSetting();
 void FlashHandler_getDataOtaInStore();
 bool FlashHandler_getData(char* nameSpace, char* key, void* dataStore);
 bool FlashHandler_setData(char* nameSpace, char* key, void* dataStore, size_t dataSize);
+bool FlashHandler_setDataSync(char* nameSpace, char* key, void* dataStore, size_t dataSize);
 bool FlashHandler_eraseData(char* nameSpace, const char* key);
+void FlashHandler_flush();
+void FlashHandler_getStats(flash_stats_t *stats);
+void FlashHandler_printStats();
 bool FlashHandler_getDeviceInfoInStore();
 bool FlashHandler_saveDeviceInfoInStore();
 bool FlashHandler_getUserData();
 bool FlashHandler_saveUserData();
-bool FlashHandler_getCertKeyMqttInStore();
-bool FlashHandler_saveCertKeyMqttInStore();
+bool FlashHandler_getCertKeyMqttInStore(void* certKey);
+bool FlashHandler_saveCertKeyMqttInStore(void* certKey, size_t size);
+bool FlashHandler_eraseCertKeyMqttInStore();
 bool FlashHandler_getEnvironmentMqttInStore();
 bool FlashHandler_saveEnvironmentMqttInStore();
 bool FlashHandler_getMyJobsInStore();
@@ -304,11 +304,15 @@ void Out_button_process()
 	}
 }
 
+bool Out_getRelayState(buttonIndex_t btn)
+{
+    return relay_state[btn];
+}
+
 void Out_publishStateRelayDefault()
 {
     for (buttonIndex_t btn = 0; btn < BUTTON_MAX; btn++) {
         MQTT_PublishSwitchState(btn + 1, relay_state[btn]);
-        vTaskDelay(10/portTICK_PERIOD_MS);
     }
     log_info("Publish state relay default");
 }
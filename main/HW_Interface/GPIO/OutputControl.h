@@ -74,6 +74,7 @@ void Out_ledHardReset();
 void Out_setRelay(buttonIndex_t btn, bool state);
 void Out_toggleRelay(buttonIndex_t btn);
 void Out_button_process();
+bool Out_getRelayState(buttonIndex_t btn);
 void Out_publishStateRelayDefault();
 
 #endif /* __OUTPUT_CONTROL_H */
\ No newline at end of file
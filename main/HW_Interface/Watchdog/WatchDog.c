@@ -9,6 +9,7 @@
  ******************************************************************************/
 #include "WatchDog.h"
 #include "timeCheck.h"
+#include "FlashHandler.h"
 
 /*******************************************************************************
  * Extern Variables
@@ -23,6 +24,8 @@ void ESP_resetChip()
     if (!begin_active_device) {
         Flash_saveWaitTimeActive();
     }
+    // ghi nốt dữ liệu NVS còn trong RAM
+    FlashHandler_flush();
     printf("Reset Chip After 10ms...\n");
     vTaskDelay(10/portTICK_PERIOD_MS);
     esp_restart();
@@ -11,6 +11,7 @@
 #include "HTG_Utility.h"
 #include "gateway_config.h"
 #include "MqttHandler.h"
+#include "OTA_health.h"
 
 /*******************************************************************************
  * Definitions
@@ -143,6 +144,7 @@ static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_
         sprintf(IP_Device, "%d.%d.%d.%d", IP2STR(&event->ip_info.ip));
         wifiState = Wifi_State_Got_IP;
         time_waitConnect = false;
+        OtaHealth_setMilestone(OTA_HEALTH_WIFI);
         GatewayConfig_wifiConnectDone();
         xEventGroupSetBits(wifi_event_group, CONNECTED_BIT);
         MQTT_Start();
@@ -307,10 +309,9 @@ int Wifi_checkRssi()
     return 0;
 }
 
-void Wifi_updateInfoWifi()
+void Wifi_getInfoWifi(char* data)
 {
     int rssi = Wifi_checkRssi();
-    char data[150] = "";
     wifi_config_t getCfgWifi;
     esp_wifi_get_config(ESP_IF_WIFI_STA, &getCfgWifi);
 	sprintf(data,"{\"SSID\":\"%s\",\"MAC\":\"%02X:%02X:%02X:%02X:%02X:%02X\",\"IP\":\"%s\",\"RSSI\":\"%d\"}", getCfgWifi.sta.ssid, 
@@ -322,6 +323,12 @@ void Wifi_updateInfoWifi()
                                                                                                                 g_macDevice[5], 
                                                                                                                 IP_Device, 
                                                                                                                 rssi);
+}
+
+void Wifi_updateInfoWifi()
+{
+    char data[150] = "";
+    Wifi_getInfoWifi(data);
     MQTT_PublishInfoWifi(data);
 }
 
@@ -50,6 +50,7 @@ void Wifi_startConfigMode();
 void Wifi_getMacStr();
 void setProductId_defaultMac();
 void Wifi_retryToConnect();
+void Wifi_getInfoWifi(char* data);
 void Wifi_updateInfoWifi();
 void Wifi_setStateDefault();
 Wifi_State getWifiState();
@@ -0,0 +1,62 @@
+/**
+ ******************************************************************************
+ * @file    MqttCert.h
+ * @author  HT EZLife Co.,LTD.
+ * @date    January 1, 2025
+ ******************************************************************************/
+
+#ifndef __MQTT_CERT_H
+#define __MQTT_CERT_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "Global.h"
+
+/* Exported types ------------------------------------------------------------*/
+// con trỏ vào vùng flash đã mmap (hoặc PEM nhúng trong firmware), không copy ra RAM
+typedef struct
+{
+	const uint8_t *cert;
+	size_t certLen;
+	const uint8_t *key;
+	size_t keyLen;
+} mqtt_cert_creds_t;
+
+typedef struct
+{
+	uint32_t requests;
+	uint32_t signs;
+	uint32_t fails;
+	uint32_t keyParses;
+	uint32_t lastParseMs;
+	uint32_t lastSignMs;
+	uint32_t maxSignMs;
+} mqtt_cert_sign_stats_t;
+
+/* Exported macro ------------------------------------------------------------*/
+// Cert/key thiết bị dạng DER trong partition riêng, 2 slot xoay vòng
+// Slot mới ghi ở trạng thái chờ, chỉ commit khi server xác nhận cert (certificates/<id>/complete)
+// Partition chỉ có sau khi nạp partitions.csv mới qua serial, thiết bị cập nhật OTA vẫn lưu PEM trong NVS
+#define MQTT_CERT_PARTITION_LABEL       "mqtt_cert"
+#define MQTT_CERT_PARTITION_SUBTYPE     0x40
+#define MQTT_CERT_SLOT_SIZE             4096
+#define MQTT_CERT_SLOT_MAX              2
+#define MQTT_CERT_SLOT_MAGIC            0x48544345
+#define MQTT_CERT_COMMIT_MAGIC          0x434F4D54
+#define MQTT_CERT_DATA_OFFSET           32
+
+// Ký RSA (lấy cert lần đầu) chạy trong task riêng, không chặn task MQTT
+// DRBG và key đã parse giữ lại cho lần server gửi lại privateKey, task tồn tại đến khi reset sau commit
+#define MQTT_CERT_SIGN_TASK_STACK       (6*1024)
+#define MQTT_CERT_SIGN_TASK_PRIORITY    4
+#define MQTT_CERT_SIGN_MAX_LEN          512     // RSA 4096
+
+/* Exported functions ------------------------------------------------------- */
+void MqttCert_Initialize();
+bool MqttCert_getActive(mqtt_cert_creds_t *creds);
+bool MqttCert_stage(const char *certPem, const char *keyPem, mqtt_cert_creds_t *creds);
+bool MqttCert_commit();
+bool MqttCert_requestSignature(const char *keyPem);
+void MqttCert_getSignStats(mqtt_cert_sign_stats_t *stats);
+void MqttCert_printSignStats();
+
+#endif /* __MQTT_CERT_H */
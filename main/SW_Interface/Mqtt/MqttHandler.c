@@ -14,6 +14,16 @@
 #include "FlashHandler.h"
 #include "ProtocolHandler.h"
 #include "OutputControl.h"
+#include "MqttQueue.h"
+#include "MqttTransport.h"
+#include "MqttCert.h"
+#include "MqttReliable.h"
+#include "MqttOutbox.h"
+#include "esp_attr.h"
+#include "HTG_Cbor.h"
+#include "timeCheck.h"
+#include "OTA_health.h"
+#include <stddef.h>
 
 /*******************************************************************************
  * Definitions
@@ -40,6 +50,7 @@
 extern char g_product_Id[PRODUCT_ID_LEN];
 extern char g_password[PASSWORD_LEN];
 
+extern bool needSendInfoMqtt;
 extern infoFactoryDefault_t infoFactoryDefault;
 extern mqtt_certKey_t *pMqttCertKey;
 
@@ -60,23 +71,94 @@ bool needConfirmNewCerificate = false;
 bool s_isFirstConnected = true;
 
 char topic_filter[2][30] = {0};
-int msgIdSubcribeDevice = 0;
-int msgIdSubcribeGetPrivateKey = 0;
-int msgIdSubConfirmCert = 0;
+int msgIdSubscribeBatch = 0;
+uint8_t subscribeBatchMask = 0;
 
 uint8_t count_error_connect = 0;
 uint16_t count_restart_client = 0;
 
-mqtt_certKey_t certKeyMqtt = {"none", "none"};
 mqtt_environment_t envir = {"none"};
 
 esp_mqtt_client_handle_t g_mqttCientHandle;
 
+// trỏ vào slot DER đã mmap hoặc PEM mặc định nhúng trong firmware
+static mqtt_cert_creds_t s_certCreds;
+
+#ifdef MQTT_RATE_LIMIT_ENABLE
+static portMUX_TYPE s_rateLimitMux = portMUX_INITIALIZER_UNLOCKED;
+static int32_t s_rateTokens = MQTT_RATE_LIMIT_BURST*1000;
+static int64_t s_rateLastUs = 0;
+static mqtt_rate_limit_stats_t s_rateStats = {.minTokens = MQTT_RATE_LIMIT_BURST*1000};
+#endif
+
+#ifdef MQTT_PERSISTENT_SESSION_ENABLE
+// topic đã subscribe trong session trên broker, giữ qua soft reset
+static RTC_NOINIT_ATTR mqtt_session_sub_t s_sessionSub;
+#endif
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+// topic alias chỉ có hiệu lực trong 1 phiên kết nối
+static SemaphoreHandle_t s_publishLock = NULL;
+static char s_topicAlias[MQTT5_TOPIC_ALIAS_MAX][100];
+static uint8_t s_topicAliasCount = 0;
+// Topic Alias Maximum của broker (CONNACK), esp-mqtt không có API đọc: học từ lần set property bị từ chối
+static uint8_t s_topicAliasLimit = MQTT5_TOPIC_ALIAS_MAX;
+static bool s_topicAliasDisabled = false;
+static uint32_t s_aliasPublishCount = 0;
+static uint32_t s_aliasBytesSaved = 0;
+#endif
+
+#ifdef MQTT_CBOR_ENABLE
+static mqtt_payload_encoding_t s_payloadEncoding = MQTT_PAYLOAD_ENCODING_DEFAULT;
+
+// thêm field mới vào cuối bảng để không đổi key của field cũ
+static const mqtt_cbor_field_t s_cborDeviceInfo[] = {
+	{"serialNumber", MQTT_CBOR_AUTO},
+	{"model", MQTT_CBOR_AUTO},
+	{"hardVer", MQTT_CBOR_AUTO},
+	{"comVer", MQTT_CBOR_AUTO},
+	{"firmVer", MQTT_CBOR_AUTO},
+};
+static const mqtt_cbor_field_t s_cborWifiInfo[] = {
+	{"SSID", MQTT_CBOR_AUTO},
+	{"MAC", MQTT_CBOR_MAC},
+	{"IP", MQTT_CBOR_IP4},
+	{"RSSI", MQTT_CBOR_AUTO},
+};
+static const mqtt_cbor_field_t s_cborSwitch[] = {
+	{"id", MQTT_CBOR_AUTO},
+	{"state", MQTT_CBOR_AUTO},
+};
+static const mqtt_cbor_field_t s_cborActiveDevice[] = {
+	{"time", MQTT_CBOR_TIME_MIN},
+	{"confirm", MQTT_CBOR_AUTO},
+};
+static const mqtt_cbor_field_t s_cborSchedule[] = {
+	{"total", MQTT_CBOR_AUTO},
+	{"sch", MQTT_CBOR_AUTO},
+	{"e", MQTT_CBOR_AUTO},
+	{"j", MQTT_CBOR_AUTO},
+	{"d", MQTT_CBOR_AUTO},
+	{"lid", MQTT_CBOR_AUTO},
+};
+
+static mqtt_cbor_schema_t s_cborSchema[] = {
+	{PROPERTY_CODE_DEVICE_INFO, s_cborDeviceInfo, sizeof(s_cborDeviceInfo)/sizeof(s_cborDeviceInfo[0])},
+	{PROPERTY_CODE_WIFI_INFO, s_cborWifiInfo, sizeof(s_cborWifiInfo)/sizeof(s_cborWifiInfo[0])},
+	{PROPERTY_CODE_S_SWITCH, s_cborSwitch, sizeof(s_cborSwitch)/sizeof(s_cborSwitch[0])},
+	{PROPERTY_CODE_ACTIVE_DEVICE, s_cborActiveDevice, sizeof(s_cborActiveDevice)/sizeof(s_cborActiveDevice[0])},
+	{PROPERTY_CODE_SCHEDULE, s_cborSchedule, sizeof(s_cborSchedule)/sizeof(s_cborSchedule[0])},
+};
+#endif
+
 /*******************************************************************************
  * Prototypes
  ******************************************************************************/
 void topic_name_filter(char *data, int len);
 void sub_string(char *des, char *src, int start, int end);
+#ifdef CONFIG_MQTT_PROTOCOL_5
+void MQTT5_resetTopicAlias();
+#endif
 
 /*******************************************************************************
  * Process Properties
@@ -116,14 +198,9 @@ int MQTT_PublishStatusGetPrivateKey(char* productId)
 	sprintf(pTopic, "device/%s/status", g_product_Id);
 	#endif
 	sprintf(pData,"{\"serialNumber\":\"%s\",\"status\":\"ready\"}", productId);
-	if (!g_isMqttConnected) {
-		return -1;
-	}
-	if (esp_mqtt_client_publish(g_mqttCientHandle, pTopic, pData, strlen(pData), 0, 0) == -1) {
+	if (MQTT_clientPublishPriority(pTopic, pData, strlen(pData), 0, MQTT_PRIORITY_HIGH) < 0) {
 		return -1;
 	}
-	log_info(" [Device] Publish Topic: %s", pTopic);
-	printf(" [Device] Publish Data: %s\n", pData);
 	return 0;
 }
 
@@ -140,25 +217,32 @@ int MQTT_SubscribeTopicGetCert()
 	return msg_id;
 }
 
-int MQTT_PublishRequestGetCert(char* signature)
+int MQTT_PublishRequestGetCert(const uint8_t* signature, size_t sigLen)
 {
-	char pData[1024] = "";
+	static const char hex[] = "0123456789abcdef";
 	char pTopic[100] = "";
+	int ret = 0;
 	#ifdef AWS_PHASE_STAGING
 	#elif defined(AWS_PHASE_DEVERLOP)
 	#elif defined(AWS_PHASE_PRODUCTION)
 	sprintf(pTopic, "certificates/%s/requestcert", g_product_Id);
 	#endif
-	sprintf(pData,"{\"serialNumber\":\"%s\",\"signature\":\"%s\"}", g_product_Id, signature);
-	if (!g_isMqttConnected) {
+	// hex trực tiếp vào payload, không qua chuỗi signature trung gian
+	char* pData = (char*)malloc(sigLen*2 + PRODUCT_ID_LEN + 50);
+	if (pData == NULL) {
 		return -1;
 	}
-	if (esp_mqtt_client_publish(g_mqttCientHandle, pTopic, pData, strlen(pData), 0, 0) == -1) {
-		return -1;
+	int len = sprintf(pData, "{\"serialNumber\":\"%s\",\"signature\":\"", g_product_Id);
+	for (size_t i = 0; i < sigLen; i++) {
+		pData[len++] = hex[signature[i] >> 4];
+		pData[len++] = hex[signature[i] & 0x0F];
 	}
-	log_info(" [Device] Publish Topic: %s", pTopic);
-	printf(" [Device] Publish Data: %s\n", pData);
-	return 0;
+	len += sprintf(pData + len, "\"}");
+	if (MQTT_clientPublishPriority(pTopic, pData, len, 0, MQTT_PRIORITY_HIGH) < 0) {
+		ret = -1;
+	}
+	free(pData);
+	return ret;
 }
 
 int MQTT_SubscribeTopicConfirmCert()
@@ -184,19 +268,87 @@ int MQTT_PublishStatusConfirmCert()
 	sprintf(pTopic, "certificates/%s/confirm", g_product_Id);
 	#endif
 	sprintf(pData,"{\"serialNumber\":\"%s\",\"status\":\"connected\"}", g_product_Id);
-	if (!g_isMqttConnected) {
+	// cert mới chỉ nằm trong RAM đến khi server xác nhận, không lưu NVS
+	if (!MqttReliable_push(MQTT_RELIABLE_KEY_CERT_CONFIRM, pTopic, pData, strlen(pData), 0)) {
 		return -1;
 	}
-	if (esp_mqtt_client_publish(g_mqttCientHandle, pTopic, pData, strlen(pData), 0, 0) == -1) {
-		return -1;
-	}
-	log_info(" [Device] Publish Topic: %s", pTopic);
-	printf(" [Device] Publish Data: %s\n", pData);
 	return 0;
 }
 
+static uint8_t MQTT_getSubscribeMask()
+{
+	uint8_t mask = 0;
+	if (g_mqttHaveNewCertificate) {
+		mask |= MQTT_SUB_DEVICE;
+	}
+	if (!g_mqttHaveNewCertificate && !needConfirmNewCerificate) {
+		mask |= MQTT_SUB_PRIVATE_KEY;
+	}
+	if (needConfirmNewCerificate) {
+		mask |= MQTT_SUB_CONFIRM_CERT;
+	}
+	return mask;
+}
+
+#ifdef MQTT_PERSISTENT_SESSION_ENABLE
+static uint32_t MQTT_sessionSubCrc()
+{
+	return ht_check_crc32((uint8_t *)&s_sessionSub, offsetof(mqtt_session_sub_t, crc));
+}
+
+static void MQTT_setSessionSub(uint8_t mask)
+{
+	// xoá cả byte đệm nằm trong vùng tính crc
+	memset(&s_sessionSub, 0, sizeof(s_sessionSub));
+	s_sessionSub.magic = MQTT_SESSION_SUB_MAGIC;
+	s_sessionSub.mask = mask;
+	s_sessionSub.crc = MQTT_sessionSubCrc();
+}
+
+static bool MQTT_sessionSubValid()
+{
+	return (s_sessionSub.magic == MQTT_SESSION_SUB_MAGIC) && (s_sessionSub.crc == MQTT_sessionSubCrc());
+}
+#endif
+
+int MQTT_SubscribeBatch(uint8_t mask)
+{
+	char topics[MQTT_SUB_MAX][100] = {0};
+	esp_mqtt_topic_t topicList[MQTT_SUB_MAX];
+	int count = 0;
+
+	if (mask & MQTT_SUB_DEVICE) {
+		subTopicFromProductId(g_product_Id, topics[count]);
+		count++;
+	}
+	#ifdef AWS_PHASE_STAGING
+	#elif defined(AWS_PHASE_DEVERLOP)
+	#elif defined(AWS_PHASE_PRODUCTION)
+	if (mask & MQTT_SUB_PRIVATE_KEY) {
+		sprintf(topics[count++], "device/%s/privateKey", g_product_Id);
+	}
+	if (mask & MQTT_SUB_CONFIRM_CERT) {
+		sprintf(topics[count++], "certificates/%s/complete", g_product_Id);
+	}
+	#endif
+	for (int i = 0; i < count; i++) {
+		topicList[i].filter = topics[i];
+		topicList[i].qos = MQTT_SUBSCRIBE_QOS;
+		log_info(" Subcribe to topic: %s", topics[i]);
+	}
+	if (count == 0) {
+		return 0;
+	}
+	// 1 gói SUBSCRIBE cho tất cả topic
+	int msg_id = esp_mqtt_client_subscribe_multiple(g_mqttCientHandle, topicList, count);
+	log_info(" Subcribe %d topics, id: %d", count, msg_id);
+	return msg_id;
+}
+
 static void MQTT_data_cb(esp_mqtt_event_handle_t event)
 {
+	// thời điểm nhận lệnh, tính độ trễ nhận -> thực thi
+	int64_t recvUs = esp_timer_get_time();
 	char *topic = (char *)malloc(event->topic_len + 1);
 	memcpy(topic, event->topic, event->topic_len);
 	topic[event->topic_len] = 0;
@@ -216,7 +368,7 @@ static void MQTT_data_cb(esp_mqtt_event_handle_t event)
 		topic_name_filter(topic, event->topic_len);
 		// log_info("EventType: %s\n", topic_filter[EVENT_TYPE]);
 		// log_info("PropertyCode: %s\n", topic_filter[PROPERTY_CODE]);
-		ht_processCmd(data);
+		ht_processCmd(data, recvUs);
 	}	
 	
 	free(topic);
@@ -236,18 +388,33 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 		log_info("MQTT_EVENT_CONNECTED");
 		count_error_connect = 0;
 		count_restart_client = 0;
+#ifdef CONFIG_MQTT_PROTOCOL_5
+		MQTT5_resetTopicAlias();
+#endif
 
-		msgIdSubcribeDevice = MQTT_SubscribeToDeviceTopic(g_product_Id);
-
-		if (!g_mqttHaveNewCertificate && !needConfirmNewCerificate) {
-			msgIdSubcribeGetPrivateKey = MQTT_SubscribeTopicGetPrivateKey();
+		subscribeBatchMask = MQTT_getSubscribeMask();
+#ifdef MQTT_PERSISTENT_SESSION_ENABLE
+		if (event->session_present && MQTT_sessionSubValid()) {
+			// broker còn giữ session: chỉ subscribe topic chưa có
+			subscribeBatchMask &= ~s_sessionSub.mask;
+			log_info("Session present, subscribed mask: 0x%02X", s_sessionSub.mask);
+		} else {
+			// RTC hỏng (crc sai) cũng subscribe lại toàn bộ
+			if (event->session_present) {
+				log_warning("Session present but subscribed mask invalid, resubscribe all");
+			}
+			MQTT_setSessionSub(0);
 		}
-
-		if (needConfirmNewCerificate) {
-			msgIdSubConfirmCert = MQTT_SubscribeTopicConfirmCert();
+#endif
+		msgIdSubscribeBatch = 0;
+		if (subscribeBatchMask != 0) {
+			msgIdSubscribeBatch = MQTT_SubscribeBatch(subscribeBatchMask);
+		} else if (needConfirmNewCerificate) {
+			MQTT_PublishStatusConfirmCert();
 		}
 
 		g_isMqttConnected = true;
+		OtaHealth_setMilestone(OTA_HEALTH_MQTT);
 		if (s_isFirstConnected) {
 			if (!g_mqttHaveNewCertificate) {
 				MQTT_PublishStatusGetPrivateKey(g_product_Id);
@@ -256,7 +423,17 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 		}
 
 		MQTT_connectToServerDone();
+#ifdef MQTT_HELLO_DOCUMENT_ENABLE
+		// trạng thái relay nằm trong bản tin HELLO, gửi lại sau mỗi lần kết nối
+		needSendInfoMqtt = true;
+#else
 		Out_publishStateRelayDefault();
+#endif
+		MqttQueue_notify();
+		MqttReliable_onConnected();
+#ifdef MQTT_OUTBOX_ENABLE
+		MqttOutbox_notify();
+#endif
 		break;
 	}
 	case MQTT_EVENT_DISCONNECTED:
@@ -267,18 +444,33 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 	}
 	case MQTT_EVENT_SUBSCRIBED:
 		log_info("MQTT_EVENT_SUBSCRIBED");
-		if (event->msg_id == msgIdSubConfirmCert) {
-			if (needConfirmNewCerificate) {
+		if ((msgIdSubscribeBatch > 0) && (event->msg_id == msgIdSubscribeBatch)) {
+#ifdef MQTT_PERSISTENT_SESSION_ENABLE
+			// SUBACK trả 0x80 cho topic bị từ chối, lần kết nối sau subscribe lại
+			bool subscribeOk = true;
+			for (int i = 0; i < event->data_len; i++) {
+				if ((uint8_t)event->data[i] >= 0x80) {
+					subscribeOk = false;
+				}
+			}
+			if (subscribeOk) {
+				MQTT_setSessionSub(s_sessionSub.mask | subscribeBatchMask);
+			}
+#endif
+			if ((subscribeBatchMask & MQTT_SUB_CONFIRM_CERT) && needConfirmNewCerificate) {
 				MQTT_PublishStatusConfirmCert();
 				// needConfirmNewCerificate = false;
 			}
-		}	
+		}
 		break;
 	case MQTT_EVENT_UNSUBSCRIBED:
 		log_info("MQTT_EVENT_UNSUBSCRIBED,");
 		break;
 	case MQTT_EVENT_PUBLISHED:
-		log_info("MQTT_EVENT_PUBLISHED");
+		log_info("MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+		MqttQueue_onPublished(event->msg_id);
+		MqttOutbox_onPublished(event->msg_id);
+		MqttReliable_onPublished(event->msg_id);
 		break;
 	case MQTT_EVENT_DATA:
 		log_info("MQTT_EVENT_DATA");
@@ -301,48 +493,80 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 /*******************************************************************************
  * Application Funtions
  ******************************************************************************/
+static void MQTT_getConfig(esp_mqtt_client_config_t *cfg)
+{
+	*cfg = (esp_mqtt_client_config_t){
+#ifdef CONFIG_MQTT_PROTOCOL_5
+		.session.protocol_ver = MQTT_PROTOCOL_V_5,
+#endif
+#ifdef MQTT_PERSISTENT_SESSION_ENABLE
+		// client_id cố định theo serial, broker giữ subscription và lệnh QoS1 khi mất kết nối ngắn
+		.session.disable_clean_session = true,
+#endif
+		.broker = {
+			#ifdef AWS_PHASE_PRODUCTION
+				.address.uri = "mqtts://d06946761osfaa0nlznxq-ats.iot.ap-southeast-1.amazonaws.com:8883",
+			#else
+			#endif
+			.verification.certificate = (const char *)amazon_root_ca_pem_start,
+		},
+		.credentials.client_id = g_product_Id,
+		// có độ dài: esp-tls nhận cả DER (slot mqtt_cert) và PEM (mặc định)
+		.credentials.authentication.certificate = (const char *)s_certCreds.cert,
+		.credentials.authentication.certificate_len = s_certCreds.certLen,
+		.credentials.authentication.key = (const char *)s_certCreds.key,
+		.credentials.authentication.key_len = s_certCreds.keyLen,
+    };
+}
+
 void MQTT_Initialize()
 {
+	esp_mqtt_client_config_t mqtt_cfg;
+
 	if (FlashHandler_getEnvironmentMqttInStore() == false) {
         FlashHandler_saveEnvironmentMqttInStore();
     }
 
-	if (FlashHandler_getCertKeyMqttInStore() == false) {
-		// FlashHandler_saveCertKeyMqttInStore();
-	} else {
-		if (strcmp(certKeyMqtt.cert,"none") == 0 && strcmp(certKeyMqtt.key,"none") == 0) {
+	MqttCert_Initialize();
+	if (MqttCert_getActive(&s_certCreds)) {
+		g_mqttHaveNewCertificate = true;
+		if (strcmp(envir.environment, ENVIR_STR) != 0) {
 			g_mqttHaveNewCertificate = false;
-		} else {
-			g_mqttHaveNewCertificate = true;
-			if (strcmp(envir.environment, ENVIR_STR) != 0) {
-                g_mqttHaveNewCertificate = false;
-                printf("Had cert but bad cert\n");
-            }
+			printf("Had cert but bad cert\n");
 		}
 	}
 
-	printf("Cert is have new cert: %s, len cert: %d, len key: %d\n", g_mqttHaveNewCertificate == true ? "yes":"no", strlen(certKeyMqtt.cert), strlen(certKeyMqtt.key));
 	if (!g_mqttHaveNewCertificate) {
+		// PEM nhúng (TEXT) có '\0' cuối, end - start gồm cả '\0' theo yêu cầu của mbedtls
 		strcpy(envir.environment, ENVIR_STR);
-		strcpy(certKeyMqtt.cert, (const char*)client_cert_pem_start);
-		strcpy(certKeyMqtt.key, (const char*)client_key_pem_start);
-		printf("copy cert key default: %d, %d\n", strlen(certKeyMqtt.cert), strlen(certKeyMqtt.key));
+		s_certCreds.cert = client_cert_pem_start;
+		s_certCreds.certLen = client_cert_pem_end - client_cert_pem_start;
+		s_certCreds.key = client_key_pem_start;
+		s_certCreds.keyLen = client_key_pem_end - client_key_pem_start;
 	}
+	printf("Cert is have new cert: %s, len cert: %d, len key: %d\n", g_mqttHaveNewCertificate == true ? "yes":"no", s_certCreds.certLen, s_certCreds.keyLen);
 	
-	const esp_mqtt_client_config_t mqtt_cfg = {
-		.broker = {
-			#ifdef AWS_PHASE_PRODUCTION
-				.address.uri = "mqtts://d06946761osfaa0nlznxq-ats.iot.ap-southeast-1.amazonaws.com:8883",
-			#else
-			#endif
-			.verification.certificate = (const char *)amazon_root_ca_pem_start,
-		},
-		.credentials.client_id = g_product_Id,
-		.credentials.authentication.certificate = (const char *)(certKeyMqtt.cert),
-		.credentials.authentication.key = (const char *)(certKeyMqtt.key),
-    };
+#ifdef CONFIG_MQTT_PROTOCOL_5
+	s_publishLock = xSemaphoreCreateMutex();
+#endif
+
+	MQTT_getConfig(&mqtt_cfg);
+#ifdef MQTT_TLS_SESSION_RESUME_ENABLE
+	// transport riêng để giữ TLS session qua các lần reconnect
+	mqtt_cfg.network.transport = MqttTransport_create((const char *)amazon_root_ca_pem_start, &s_certCreds);
+#endif
+#ifdef MQTT_CBOR_ENABLE
+	uint8_t encoding = MQTT_PAYLOAD_ENCODING_DEFAULT;
+	FlashHandler_getData(NAMESPACE_GENARAL, KEY_PAYLOAD_ENCODING, &encoding);
+	s_payloadEncoding = (encoding == MQTT_PAYLOAD_CBOR) ? MQTT_PAYLOAD_CBOR : MQTT_PAYLOAD_JSON;
+#endif
 	g_mqttCientHandle = esp_mqtt_client_init(&mqtt_cfg);
 	esp_mqtt_client_register_event(g_mqttCientHandle, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
+	MqttQueue_Initialize();
+	MqttReliable_Initialize();
+#ifdef MQTT_OUTBOX_ENABLE
+	MqttOutbox_Initialize();
+#endif
 }
 
 void MQTT_Start()
@@ -374,21 +598,471 @@ void MQTT_connectToServerDone()
 	printf("mqtt connect done\n");
 }
 
-int MQTT_PublishToDeviceTopic(char* pubTopicName, char* pubData)
+#ifdef CONFIG_MQTT_PROTOCOL_5
+void MQTT5_resetTopicAlias()
 {
-	if (!g_mqttHaveNewCertificate) {
+	xSemaphoreTake(s_publishLock, portMAX_DELAY);
+	s_topicAliasCount = 0;
+	s_topicAliasLimit = MQTT5_TOPIC_ALIAS_MAX;
+	s_topicAliasDisabled = false;
+	xSemaphoreGive(s_publishLock);
+}
+
+static uint16_t MQTT5_getTopicAlias(const char* pubTopicName, bool *isNew)
+{
+	*isNew = false;
+	if (s_topicAliasDisabled || strlen(pubTopicName) >= sizeof(s_topicAlias[0])) {
+		return 0;
+	}
+	for (uint8_t i = 0; i < s_topicAliasCount; i++) {
+		if (strcmp(s_topicAlias[i], pubTopicName) == 0) {
+			return i + 1;
+		}
+	}
+	if (s_topicAliasCount >= s_topicAliasLimit) {
 		return 0;
 	}
+	strcpy(s_topicAlias[s_topicAliasCount], pubTopicName);
+	s_topicAliasCount++;
+	*isNew = true;
+	return s_topicAliasCount;
+}
+
+static int MQTT5_publish(const char* pubTopicName, const char* pubData, size_t len, int qos, const char* correlationId)
+{
+	bool isNew = false;
+	esp_mqtt5_publish_property_config_t publish_property = {0};
+	esp_mqtt5_user_property_item_t user_property[] = {
+		{MQTT5_USER_PROPERTY_CORRELATION, correlationId},
+	};
+
+	xSemaphoreTake(s_publishLock, portMAX_DELAY);
+	uint16_t alias = MQTT5_getTopicAlias(pubTopicName, &isNew);
+	publish_property.topic_alias = alias;
+	if (correlationId != NULL) {
+		esp_mqtt5_client_set_user_property(&publish_property.user_property, user_property, 1);
+	}
+	esp_err_t err = esp_mqtt5_client_set_publish_property(g_mqttCientHandle, &publish_property);
+	if ((err != ESP_OK) && alias) {
+		// alias vượt Topic Alias Maximum của broker: giới hạn alias < giá trị này, 0 thì không dùng alias
+		s_topicAliasLimit = alias - 1;
+		if (s_topicAliasCount > s_topicAliasLimit) {
+			s_topicAliasCount = s_topicAliasLimit;
+		}
+		s_topicAliasDisabled = (s_topicAliasLimit == 0);
+		log_error("Topic alias %d over broker maximum, limit %d", alias, s_topicAliasLimit);
+		alias = 0;
+		publish_property.topic_alias = 0;
+		err = esp_mqtt5_client_set_publish_property(g_mqttCientHandle, &publish_property);
+	}
+	if (err != ESP_OK) {
+		// không gửi với property cũ của lần publish trước
+		log_error("Set publish property fail: %s", esp_err_to_name(err));
+		if (publish_property.user_property != NULL) {
+			esp_mqtt5_client_delete_user_property(publish_property.user_property);
+		}
+		xSemaphoreGive(s_publishLock);
+		return -1;
+	}
+	// topic đã có alias: gửi topic rỗng, server tra theo alias
+	int msg_id = esp_mqtt_client_publish(g_mqttCientHandle, (alias && !isNew) ? "" : pubTopicName, pubData, len, qos, 0);
+	if (msg_id == -1 && alias) {
+		// server không nhận topic alias, tắt cho phiên này và gửi lại topic đầy đủ
+		log_error("Topic alias %d rejected, disable topic alias", alias);
+		s_topicAliasDisabled = true;
+		publish_property.topic_alias = 0;
+		if (esp_mqtt5_client_set_publish_property(g_mqttCientHandle, &publish_property) == ESP_OK) {
+			msg_id = esp_mqtt_client_publish(g_mqttCientHandle, pubTopicName, pubData, len, qos, 0);
+		}
+	} else if (msg_id != -1 && alias && !isNew) {
+		s_aliasPublishCount++;
+		s_aliasBytesSaved += strlen(pubTopicName) - MQTT5_TOPIC_ALIAS_PROPERTY_LEN;
+	}
+	if (publish_property.user_property != NULL) {
+		esp_mqtt5_client_delete_user_property(publish_property.user_property);
+	}
+	xSemaphoreGive(s_publishLock);
+	return msg_id;
+}
+#endif
+
+bool MQTT_isProtocolV5()
+{
+#ifdef CONFIG_MQTT_PROTOCOL_5
+	return true;
+#else
+	return false;
+#endif
+}
+
+#ifdef MQTT_RATE_LIMIT_ENABLE
+// token bucket, đơn vị 1/1000 token để không mất phần lẻ khi nạp lại
+static bool MQTT_rateLimitTake(mqtt_priority_t priority)
+{
+	static const int32_t reserve[MQTT_PRIORITY_MAX] = {0, MQTT_RATE_LIMIT_RESERVE_NORMAL*1000, MQTT_RATE_LIMIT_RESERVE_LOW*1000};
+	bool allowed = false;
+
+	taskENTER_CRITICAL(&s_rateLimitMux);
+	int64_t now = esp_timer_get_time();
+	int64_t tokens = s_rateTokens + (now - s_rateLastUs)*MQTT_RATE_LIMIT_PER_SECOND/1000;
+	s_rateTokens = (tokens > MQTT_RATE_LIMIT_BURST*1000) ? MQTT_RATE_LIMIT_BURST*1000 : (int32_t)tokens;
+	s_rateLastUs = now;
+	// bản tin ưu tiên thấp hơn không được dùng phần token dự trữ cho mức cao hơn
+	if (s_rateTokens - reserve[priority] >= 1000) {
+		s_rateTokens -= 1000;
+		allowed = true;
+		s_rateStats.allowed[priority]++;
+		if (s_rateTokens < s_rateStats.minTokens) {
+			s_rateStats.minTokens = s_rateTokens;
+		}
+	} else {
+		s_rateStats.deferred[priority]++;
+	}
+	taskEXIT_CRITICAL(&s_rateLimitMux);
+	return allowed;
+}
+#endif
+
+int MQTT_clientPublishCorrelated(const char* pubTopicName, const char* pubData, size_t len, int qos, mqtt_priority_t priority, const char* correlationId)
+{
 	if (!g_isMqttConnected) {
 		return -1;
 	}
-	if (esp_mqtt_client_publish(g_mqttCientHandle, pubTopicName, pubData, strlen(pubData), 0, 0) == -1) {
+#ifdef MQTT_RATE_LIMIT_ENABLE
+	if (!MQTT_rateLimitTake(priority)) {
+		log_info("Rate limit, defer publish: %s", pubTopicName);
+		return MQTT_PUBLISH_DEFERRED;
+	}
+#endif
+#ifdef CONFIG_MQTT_PROTOCOL_5
+	int msg_id = MQTT5_publish(pubTopicName, pubData, len, qos, correlationId);
+#else
+	// MQTT 3.1.1 không có user property, correlation id nằm trong payload
+	int msg_id = esp_mqtt_client_publish(g_mqttCientHandle, pubTopicName, pubData, len, qos, 0);
+#endif
+	if (msg_id == -1) {
 		return -1;
 	}
 	log_info(" [Device] Publish Topic: %s", pubTopicName);
-	printf(" [Device] Publish Data: %s\n", pubData);
+	printf(" [Device] Publish Data: %.*s\n", (int)len, pubData);
 
-	return 0;
+	return msg_id;
+}
+
+int MQTT_clientPublishPriority(const char* pubTopicName, const char* pubData, size_t len, int qos, mqtt_priority_t priority)
+{
+	return MQTT_clientPublishCorrelated(pubTopicName, pubData, len, qos, priority, NULL);
+}
+
+int MQTT_clientPublish(const char* pubTopicName, const char* pubData, size_t len, int qos)
+{
+	return MQTT_clientPublishCorrelated(pubTopicName, pubData, len, qos, MQTT_PRIORITY_NORMAL, NULL);
+}
+
+void MQTT_rateLimitDropped()
+{
+#ifdef MQTT_RATE_LIMIT_ENABLE
+	taskENTER_CRITICAL(&s_rateLimitMux);
+	s_rateStats.dropped++;
+	taskEXIT_CRITICAL(&s_rateLimitMux);
+#endif
+}
+
+#ifdef MQTT_CBOR_ENABLE
+static bool MQTT_cborIsNumber(const char *str)
+{
+	const char *p = (*str == '-') ? str + 1 : str;
+	size_t len = strlen(p);
+	// "007" giữ dạng text để không mất số 0 đầu
+	if ((len == 0) || (len > 9) || ((len > 1) && (p[0] == '0'))) {
+		return false;
+	}
+	for (size_t i = 0; i < len; i++) {
+		if ((p[i] < '0') || (p[i] > '9')) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void MQTT_cborString(ht_cbor_t *cbor, const char *str, mqtt_cbor_type_t type)
+{
+	uint8_t bytes[6];
+	unsigned int ip[4];
+	unsigned long hour;
+	unsigned int minute;
+
+	switch (type) {
+	case MQTT_CBOR_MAC:
+		if (sscanf(str, "%2hhx:%2hhx:%2hhx:%2hhx:%2hhx:%2hhx", &bytes[0], &bytes[1], &bytes[2], &bytes[3], &bytes[4], &bytes[5]) == 6) {
+			ht_cbor_bytes(cbor, bytes, 6);
+			return;
+		}
+		break;
+	case MQTT_CBOR_IP4:
+		if ((sscanf(str, "%u.%u.%u.%u", &ip[0], &ip[1], &ip[2], &ip[3]) == 4) && (ip[0] < 256) && (ip[1] < 256) && (ip[2] < 256) && (ip[3] < 256)) {
+			for (int i = 0; i < 4; i++) {
+				bytes[i] = (uint8_t)ip[i];
+			}
+			ht_cbor_bytes(cbor, bytes, 4);
+			return;
+		}
+		break;
+	case MQTT_CBOR_TIME_MIN:
+		if (sscanf(str, "%lu:%u", &hour, &minute) == 2) {
+			ht_cbor_uint(cbor, (uint64_t)hour*60 + minute);
+			return;
+		}
+		break;
+	default:
+		break;
+	}
+	if (MQTT_cborIsNumber(str)) {
+		ht_cbor_int(cbor, atol(str));
+	} else {
+		ht_cbor_text(cbor, str, strlen(str));
+	}
+}
+
+static int MQTT_cborFieldIndex(const mqtt_cbor_schema_t *schema, const char *name)
+{
+	for (int i = 0; i < schema->count; i++) {
+		if (strcmp(schema->fields[i].name, name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static bool MQTT_cborValue(ht_cbor_t *cbor, const mqtt_cbor_schema_t *schema, cJSON *item, mqtt_cbor_type_t type)
+{
+	cJSON *child = NULL;
+
+	if (cJSON_IsObject(item)) {
+		ht_cbor_map(cbor, cJSON_GetArraySize(item));
+		cJSON_ArrayForEach(child, item) {
+			int idx = MQTT_cborFieldIndex(schema, child->string);
+			// field chưa có trong schema vẫn gửi được, key giữ dạng text
+			if (idx >= 0) {
+				ht_cbor_uint(cbor, idx);
+			} else {
+				ht_cbor_text(cbor, child->string, strlen(child->string));
+			}
+			if (!MQTT_cborValue(cbor, schema, child, (idx >= 0) ? schema->fields[idx].type : MQTT_CBOR_AUTO)) {
+				return false;
+			}
+		}
+	} else if (cJSON_IsArray(item)) {
+		ht_cbor_array(cbor, cJSON_GetArraySize(item));
+		cJSON_ArrayForEach(child, item) {
+			if (!MQTT_cborValue(cbor, schema, child, MQTT_CBOR_AUTO)) {
+				return false;
+			}
+		}
+	} else if (cJSON_IsBool(item)) {
+		ht_cbor_bool(cbor, cJSON_IsTrue(item));
+	} else if (cJSON_IsNumber(item) && (item->valuedouble == (double)item->valueint)) {
+		ht_cbor_int(cbor, item->valueint);
+	} else if (cJSON_IsString(item)) {
+		MQTT_cborString(cbor, item->valuestring, type);
+	} else {
+		// null, số thực: gửi JSON
+		return false;
+	}
+	return !cbor->overflow;
+}
+
+// trả về buffer CBOR (người gọi free) hoặc NULL nếu gửi JSON
+static uint8_t* MQTT_encodePayload(const char* pubTopicName, const char* pubData, size_t *len)
+{
+	if ((s_payloadEncoding != MQTT_PAYLOAD_CBOR) || (strstr(pubTopicName, "/pub/" EVT_UPDATE_PROPERTY "/") == NULL)) {
+		return NULL;
+	}
+
+	const char *property = strrchr(pubTopicName, '/') + 1;
+	mqtt_cbor_schema_t *schema = NULL;
+	for (int i = 0; i < sizeof(s_cborSchema)/sizeof(s_cborSchema[0]); i++) {
+		if (strcmp(s_cborSchema[i].property, property) == 0) {
+			schema = &s_cborSchema[i];
+			break;
+		}
+	}
+	if (schema == NULL) {
+		return NULL;
+	}
+
+	cJSON *msgObject = cJSON_Parse(pubData);
+	if (msgObject == NULL) {
+		return NULL;
+	}
+	cJSON *dataItem = cJSON_GetObjectItem(msgObject, "d");
+	uint8_t *buf = (uint8_t *)malloc(*len);
+	ht_cbor_t cbor;
+	if ((dataItem == NULL) || (buf == NULL)) {
+		free(buf);
+		cJSON_Delete(msgObject);
+		return NULL;
+	}
+
+	// CBOR không nhỏ hơn JSON (overflow) thì gửi JSON
+	ht_cbor_init(&cbor, buf, *len);
+	bool encoded = MQTT_cborValue(&cbor, schema, dataItem, MQTT_CBOR_AUTO);
+	cJSON_Delete(msgObject);
+	if (!encoded) {
+		free(buf);
+		return NULL;
+	}
+	schema->jsonBytes += *len;
+	schema->cborBytes += cbor.len;
+	*len = cbor.len;
+	return buf;
+}
+#endif
+
+bool MQTT_setPayloadEncoding(mqtt_payload_encoding_t encoding)
+{
+#ifdef MQTT_CBOR_ENABLE
+	if ((encoding != MQTT_PAYLOAD_JSON) && (encoding != MQTT_PAYLOAD_CBOR)) {
+		return false;
+	}
+	if (encoding != s_payloadEncoding) {
+		uint8_t value = encoding;
+		s_payloadEncoding = encoding;
+		FlashHandler_setData(NAMESPACE_GENARAL, KEY_PAYLOAD_ENCODING, &value, sizeof(value));
+		log_info("Payload encoding: %s", (encoding == MQTT_PAYLOAD_CBOR) ? MQTT_PAYLOAD_ENCODING_CBOR_STR : MQTT_PAYLOAD_ENCODING_JSON_STR);
+	}
+	return true;
+#else
+	return (encoding == MQTT_PAYLOAD_JSON);
+#endif
+}
+
+mqtt_payload_encoding_t MQTT_getPayloadEncoding()
+{
+#ifdef MQTT_CBOR_ENABLE
+	return s_payloadEncoding;
+#else
+	return MQTT_PAYLOAD_JSON;
+#endif
+}
+
+void MQTT_printStats()
+{
+#ifdef MQTT_RATE_LIMIT_ENABLE
+	printf("Mqtt rate limit: [allowed - %lu/%lu/%lu] [deferred - %lu/%lu/%lu] [dropped - %lu] [min tokens - %ld.%03ld]\n", s_rateStats.allowed[MQTT_PRIORITY_HIGH],
+																														s_rateStats.allowed[MQTT_PRIORITY_NORMAL],
+																														s_rateStats.allowed[MQTT_PRIORITY_LOW],
+																														s_rateStats.deferred[MQTT_PRIORITY_HIGH],
+																														s_rateStats.deferred[MQTT_PRIORITY_NORMAL],
+																														s_rateStats.deferred[MQTT_PRIORITY_LOW],
+																														s_rateStats.dropped,
+																														s_rateStats.minTokens/1000,
+																														s_rateStats.minTokens%1000);
+#endif
+	MqttReliable_printStats();
+	MqttCert_printSignStats();
+#ifdef MQTT_OUTBOX_ENABLE
+	MqttOutbox_printStats();
+#endif
+#ifdef MQTT_TLS_SESSION_RESUME_ENABLE
+	MqttTransport_printStats();
+#endif
+#ifdef MQTT_CBOR_ENABLE
+	printf("Mqtt payload: [encoding - %s]", (s_payloadEncoding == MQTT_PAYLOAD_CBOR) ? MQTT_PAYLOAD_ENCODING_CBOR_STR : MQTT_PAYLOAD_ENCODING_JSON_STR);
+	for (int i = 0; i < sizeof(s_cborSchema)/sizeof(s_cborSchema[0]); i++) {
+		printf(" [%s - %lu/%lu]", s_cborSchema[i].property, s_cborSchema[i].cborBytes, s_cborSchema[i].jsonBytes);
+	}
+	printf("\n");
+#endif
+#ifdef CONFIG_MQTT_PROTOCOL_5
+	printf("Mqtt v5: [topic alias - %d] [alias publish - %lu] [bytes saved - %lu]\n", s_topicAliasCount, s_aliasPublishCount, s_aliasBytesSaved);
+#endif
+}
+
+int MQTT_PublishToDeviceTopic(char* pubTopicName, char* pubData)
+{
+	int ret = 0;
+	size_t len = strlen(pubData);
+	const char *payload = pubData;
+
+	if (!g_mqttHaveNewCertificate) {
+		return 0;
+	}
+#ifdef MQTT_CBOR_ENABLE
+	uint8_t *cbor = MQTT_encodePayload(pubTopicName, pubData, &len);
+	if (cbor != NULL) {
+		payload = (const char *)cbor;
+	}
+#endif
+#ifdef MQTT_OUTBOX_ENABLE
+	// mất kết nối hoặc outbox còn bản tin cũ: ghi vào outbox để gửi lại đúng thứ tự
+	if (!g_isMqttConnected || MqttOutbox_hasPending()) {
+		ret = MqttOutbox_append(pubTopicName, payload, len) ? 0 : -1;
+	} else if (MQTT_clientPublish(pubTopicName, payload, len, 0) < 0) {
+		// lỗi hoặc bị rate limit: để outbox gửi lại sau
+		if (!MqttOutbox_append(pubTopicName, payload, len)) {
+			MQTT_rateLimitDropped();
+			ret = -1;
+		}
+	}
+#else
+	if (MQTT_clientPublish(pubTopicName, payload, len, 0) < 0) {
+		MQTT_rateLimitDropped();
+		ret = -1;
+	}
+#endif
+#ifdef MQTT_CBOR_ENABLE
+	free(cbor);
+#endif
+	return ret;
+}
+
+int MQTT_PublishToDeviceQueue(char* key, char* pubTopicName, char* pubData)
+{
+	int ret = 0;
+	size_t len = strlen(pubData);
+	const char *payload = pubData;
+
+	if (!g_mqttHaveNewCertificate) {
+		return 0;
+	}
+#ifdef MQTT_CBOR_ENABLE
+	uint8_t *cbor = MQTT_encodePayload(pubTopicName, pubData, &len);
+	if (cbor != NULL) {
+		payload = (const char *)cbor;
+	}
+#endif
+	if (!MqttQueue_push(key, pubTopicName, payload, len)) {
+		ret = -1;
+	}
+#ifdef MQTT_CBOR_ENABLE
+	free(cbor);
+#endif
+	return ret;
+}
+
+int MQTT_PublishToDeviceReliable(char* key, char* pubTopicName, char* pubData, uint8_t flags)
+{
+	int ret = 0;
+	size_t len = strlen(pubData);
+	const char *payload = pubData;
+
+	if (!g_mqttHaveNewCertificate) {
+		return 0;
+	}
+#ifdef MQTT_CBOR_ENABLE
+	uint8_t *cbor = MQTT_encodePayload(pubTopicName, pubData, &len);
+	if (cbor != NULL) {
+		payload = (const char *)cbor;
+	}
+#endif
+	if (!MqttReliable_push(key, pubTopicName, payload, len, flags)) {
+		ret = -1;
+	}
+#ifdef MQTT_CBOR_ENABLE
+	free(cbor);
+#endif
+	return ret;
 }
 
 void MQTT_PublishVersion(uint16_t model, uint16_t hardver, uint16_t commonVer, uint16_t firmver)
@@ -398,17 +1072,19 @@ void MQTT_PublishVersion(uint16_t model, uint16_t hardver, uint16_t commonVer, u
     sprintf(pData, "{\"d\":{\"serialNumber\":\"%s\",\"model\":\"%d\",\"hardVer\":\"%d\",\"comVer\":\"%d\",\"firmVer\":\"%d\"}}", g_product_Id, model, hardver, commonVer, firmver);
 
     pubTopicFromProductId(g_product_Id, EVT_UPDATE_PROPERTY, PROPERTY_CODE_DEVICE_INFO, pubTopicName);
-    MQTT_PublishToDeviceTopic(pubTopicName, pData);
+    MQTT_PublishToDeviceQueue(PROPERTY_CODE_DEVICE_INFO, pubTopicName, pData);
 }
 
 void MQTT_PublishSwitchState(uint8_t id, uint8_t state)
 {
     char pData[MAX_LEN_MSG] = "[]";
     char pubTopicName[100] = {0};
+    char key[MQTT_QUEUE_KEY_LEN] = {0};
     sprintf(pData,"{\"d\":{\"id\":\"%d\",\"state\":\"%d\"}}", id, state);
+    sprintf(key, "%s/%d", PROPERTY_CODE_S_SWITCH, id);
 
     pubTopicFromProductId(g_product_Id, EVT_UPDATE_PROPERTY, PROPERTY_CODE_S_SWITCH, pubTopicName); 
-    MQTT_PublishToDeviceTopic(pubTopicName, pData);
+    MQTT_PublishToDeviceQueue(key, pubTopicName, pData);
 }
 
 void MQTT_PublishInfoBeacon(uint16_t major)
@@ -418,7 +1094,7 @@ void MQTT_PublishInfoBeacon(uint16_t major)
     sprintf(pData,"{\"d\":\"%d\"}", major);
 
     pubTopicFromProductId(g_product_Id, EVT_UPDATE_PROPERTY, PROPERTY_CODE_BEACON_INFO, pubTopicName);
-    MQTT_PublishToDeviceTopic(pubTopicName, pData);
+    MQTT_PublishToDeviceQueue(PROPERTY_CODE_BEACON_INFO, pubTopicName, pData);
 }
 
 void MQTT_PublishTimeActiveDevice(char* data)
@@ -428,7 +1104,7 @@ void MQTT_PublishTimeActiveDevice(char* data)
 	sprintf(pData, "{\"d\":%s}", data);
 
     pubTopicFromProductId(g_product_Id, EVT_UPDATE_PROPERTY, PROPERTY_CODE_ACTIVE_DEVICE, pubTopicName);
-    MQTT_PublishToDeviceTopic(pubTopicName, pData);
+    MQTT_PublishToDeviceQueue(PROPERTY_CODE_ACTIVE_DEVICE, pubTopicName, pData);
 	free(pData);
 }
 
@@ -439,7 +1115,7 @@ void MQTT_PublishInfoWifi(char* data)
 	sprintf(pData, "{\"d\":%s}", data);
 
     pubTopicFromProductId(g_product_Id, EVT_UPDATE_PROPERTY, PROPERTY_CODE_WIFI_INFO, pubTopicName);
-    MQTT_PublishToDeviceTopic(pubTopicName, pData);
+    MQTT_PublishToDeviceQueue(PROPERTY_CODE_WIFI_INFO, pubTopicName, pData);
 	free(pData);
 }
 
@@ -450,10 +1126,89 @@ void MQTT_PublishStateUpdateFirmware(char* data)
 	sprintf(pData, "{\"d\":%s}", data);
 
     pubTopicFromProductId(g_product_Id, EVT_UPDATE_FIRMWARE, PROPERTY_CODE_PROCESS_OTA, pubTopicName);
-    MQTT_PublishToDeviceTopic(pubTopicName, pData);
+    MQTT_PublishToDeviceReliable(MQTT_RELIABLE_KEY_OTA, pubTopicName, pData, MQTT_RELIABLE_FLAG_PERSIST);
 	free(pData);
 }
 
+// tiến độ OTA: qua hàng đợi thường, bản tin chưa gửi được thay bằng bản mới nhất
+void MQTT_PublishProgressFirmware(char* data)
+{
+	char* pData = (char*)malloc(strlen(data) + 20);
+	char pubTopicName[100] = {0};
+	sprintf(pData, "{\"d\":%s}", data);
+
+	pubTopicFromProductId(g_product_Id, EVT_UPDATE_FIRMWARE, PROPERTY_CODE_PROCESS_OTA, pubTopicName);
+	MQTT_PublishToDeviceQueue(MQTT_QUEUE_KEY_OTA_PROGRESS, pubTopicName, pData);
+	free(pData);
+}
+
+void MQTT_PublishStateEndFirmware(char* data)
+{
+	char* pData = (char*)malloc(strlen(data) + 20);
+    char pubTopicName[100] = {0};
+	sprintf(pData, "{\"d\":%s}", data);
+
+	// gửi lại đến khi server trả về PROCESS_OTA
+    pubTopicFromProductId(g_product_Id, EVT_UPDATE_FIRMWARE, PROPERTY_CODE_PROCESS_OTA, pubTopicName);
+    MQTT_PublishToDeviceReliable(MQTT_RELIABLE_KEY_OTA, pubTopicName, pData, MQTT_RELIABLE_FLAG_PERSIST | MQTT_RELIABLE_FLAG_APP_ACK);
+	free(pData);
+}
+
+void MQTT_PublishConfirmActiveDevice(char* data)
+{
+	char* pData = (char*)malloc(strlen(data) + 20);
+    char pubTopicName[100] = {0};
+	sprintf(pData, "{\"d\":%s}", data);
+
+    pubTopicFromProductId(g_product_Id, EVT_UPDATE_PROPERTY, PROPERTY_CODE_ACTIVE_DEVICE, pubTopicName);
+    MQTT_PublishToDeviceReliable(MQTT_RELIABLE_KEY_ACTIVE, pubTopicName, pData, MQTT_RELIABLE_FLAG_PERSIST);
+	free(pData);
+}
+
+void MQTT_PublishHello(uint16_t major, bool withActive)
+{
+	char* pData = (char*)malloc(MQTT_HELLO_DOCUMENT_LEN);
+	char pubTopicName[100] = {0};
+	char wifiInfo[150] = "";
+	char activeInfo[50] = "";
+	if (pData == NULL) {
+		log_error("Malloc hello document fail");
+		return;
+	}
+
+	Wifi_getInfoWifi(wifiInfo);
+	int len = sprintf(pData, "{\"v\":%d,\"d\":{\"info\":{\"serialNumber\":\"%s\",\"model\":\"%d\",\"hardVer\":\"%d\",\"comVer\":\"%d\",\"firmVer\":\"%d\"},\"wifi\":%s,\"beacon\":\"%d\",\"switch\":[", MQTT_HELLO_DOCUMENT_VER,
+																																														g_product_Id,
+																																														MODEL_VER_NUMBER,
+																																														HARD_VER,
+																																														COMMON_VER,
+																																														FIRM_VER,
+																																														wifiInfo,
+																																														major);
+	for (buttonIndex_t btn = 0; btn < BUTTON_MAX; btn++) {
+		len += sprintf(pData + len, "%s{\"id\":\"%d\",\"state\":\"%d\"}", (btn == 0) ? "" : ",", btn + 1, Out_getRelayState(btn));
+	}
+	len += sprintf(pData + len, "]");
+	if (withActive) {
+		getInfoActiveDevice(activeInfo);
+		len += sprintf(pData + len, ",\"active\":%s", activeInfo);
+	}
+	sprintf(pData + len, "}}");
+
+	pubTopicFromProductId(g_product_Id, EVT_UPDATE_PROPERTY, PROPERTY_CODE_HELLO, pubTopicName);
+	MQTT_PublishToDeviceQueue(PROPERTY_CODE_HELLO, pubTopicName, pData);
+	free(pData);
+}
+
+void MQTT_PublishAck(char* property, char* data, char* rid)
+{
+    char pubTopicName[100] = {0};
+
+    // MQTT 5: rid thêm vào user property "cid", MQTT 3.1.1 chỉ có trong payload
+    pubTopicFromProductId(g_product_Id, EVT_ACK, property, pubTopicName);
+    MQTT_clientPublishCorrelated(pubTopicName, data, strlen(data), 1, MQTT_PRIORITY_HIGH, rid);
+}
+
 void MQTT_PublishDataCommon(char* data, char* property)
 {
 	char pData[MAX_LEN_MSG] = "[]";
@@ -506,10 +1261,23 @@ static void taskCheckFileCertificate(void* arg)
 	{
 		if (pMqttCertKey != NULL) {
 			if ((strlen(pMqttCertKey->key) > 0) && (strlen(pMqttCertKey->cert) > 0)) {
+				// ghi vào slot chờ, chỉ commit khi server xác nhận, reset trước đó thì dùng lại cert cũ
+				mqtt_cert_creds_t creds;
+				if (!MqttCert_stage(pMqttCertKey->cert, pMqttCertKey->key, &creds)) {
+					log_error("Stage new certificate fail");
+					break;
+				}
 				esp_mqtt_client_disconnect(g_mqttCientHandle);
 				printf("update config mqtt...\n");
-				strcpy(certKeyMqtt.cert, (const char*)pMqttCertKey->cert);
-				strcpy(certKeyMqtt.key, (const char*)pMqttCertKey->key);
+				s_certCreds = creds;
+#ifdef MQTT_TLS_SESSION_RESUME_ENABLE
+				// session cũ gắn với cert cũ
+				MqttTransport_clearSession();
+#else
+				esp_mqtt_client_config_t mqtt_cfg;
+				MQTT_getConfig(&mqtt_cfg);
+				esp_mqtt_set_config(g_mqttCientHandle, &mqtt_cfg);
+#endif
 				printf("start reconnect mqtt...\n");
 				esp_mqtt_client_reconnect(g_mqttCientHandle);
 				needConfirmNewCerificate = true;
@@ -29,6 +29,58 @@ typedef struct
     char environment[10];
 } mqtt_environment_t;
 
+typedef struct
+{
+    uint32_t magic;
+    uint8_t mask;
+    uint32_t crc;
+} mqtt_session_sub_t;
+
+typedef enum
+{
+    MQTT_PRIORITY_HIGH,         // phản hồi lệnh điều khiển, OTA, certificate
+    MQTT_PRIORITY_NORMAL,       // trạng thái thiết bị
+    MQTT_PRIORITY_LOW,          // telemetry, gửi lại outbox
+    MQTT_PRIORITY_MAX
+} mqtt_priority_t;
+
+typedef struct
+{
+    uint32_t allowed[MQTT_PRIORITY_MAX];
+    uint32_t deferred[MQTT_PRIORITY_MAX];
+    uint32_t dropped;
+    int32_t minTokens;          // 1/1000 token
+} mqtt_rate_limit_stats_t;
+
+typedef enum
+{
+    MQTT_PAYLOAD_JSON,
+    MQTT_PAYLOAD_CBOR
+} mqtt_payload_encoding_t;
+
+typedef enum
+{
+    MQTT_CBOR_AUTO,             // số (kể cả số trong chuỗi "12") -> int, còn lại -> text
+    MQTT_CBOR_MAC,              // "AA:BB:CC:DD:EE:FF" -> 6 byte
+    MQTT_CBOR_IP4,              // "192.168.1.10" -> 4 byte
+    MQTT_CBOR_TIME_MIN          // "h:mm:ss" -> số phút
+} mqtt_cbor_type_t;
+
+typedef struct
+{
+    const char *name;           // key int trong CBOR = vị trí trong bảng
+    mqtt_cbor_type_t type;
+} mqtt_cbor_field_t;
+
+typedef struct
+{
+    const char *property;
+    const mqtt_cbor_field_t *fields;
+    uint8_t count;
+    uint32_t jsonBytes;
+    uint32_t cborBytes;
+} mqtt_cbor_schema_t;
+
 /* Exported macro ------------------------------------------------------------*/
 #define USER_NAME_MQTT_HT_EZLIFE     "HT_EZLife"
 
@@ -41,6 +93,41 @@ typedef struct
 // #define AWS_PHASE_STAGING
 // #define ENVIR_STR    "STG"
 
+// Gộp DEVICE_INFO, WIFI_INFO, INFO_BEACON, S_SWITCH, ACTIVE_DEVICE thành 1 bản tin HELLO mỗi lần kết nối
+// #define MQTT_HELLO_DOCUMENT_ENABLE
+#define MQTT_HELLO_DOCUMENT_VER      1
+#define MQTT_HELLO_DOCUMENT_LEN      600
+
+// MQTT 5 bật bằng CONFIG_MQTT_PROTOCOL_5 (menuconfig -> ESP-MQTT), mặc định MQTT 3.1.1
+#define MQTT5_TOPIC_ALIAS_MAX               8
+#define MQTT5_TOPIC_ALIAS_PROPERTY_LEN      3       // 1 byte id + 2 byte giá trị alias
+#define MQTT5_USER_PROPERTY_CORRELATION     "cid"
+
+// Persistent session (clean_session = 0), AWS IoT giữ session mặc định 1 giờ
+#define MQTT_PERSISTENT_SESSION_ENABLE
+#define MQTT_SESSION_SUB_MAGIC              0x48545353
+#define MQTT_SUBSCRIBE_QOS                  1
+
+#define MQTT_SUB_DEVICE                     (1 << 0)    // device/<id>/com/#
+#define MQTT_SUB_PRIVATE_KEY                (1 << 1)    // device/<id>/privateKey
+#define MQTT_SUB_CONFIRM_CERT               (1 << 2)    // certificates/<id>/complete
+#define MQTT_SUB_MAX                        3
+
+// Token bucket trước esp_mqtt_client_publish, AWS IoT giới hạn 100 publish/s mỗi kết nối
+#define MQTT_RATE_LIMIT_ENABLE
+#define MQTT_RATE_LIMIT_PER_SECOND          5
+#define MQTT_RATE_LIMIT_BURST               20
+#define MQTT_RATE_LIMIT_RESERVE_NORMAL      4       // token chỉ bản tin HIGH được dùng
+#define MQTT_RATE_LIMIT_RESERVE_LOW         10      // token bản tin LOW không được dùng
+#define MQTT_PUBLISH_DEFERRED               -3      // hết token, người gọi tự gửi lại
+
+// Bản tin UP có schema gửi dạng CBOR (RFC 8949): bỏ lớp {"d":...}, key thay bằng số theo bảng schema
+// Server chọn qua lệnh CP/ENCODING {"d":"cbor"|"json"}, lưu NVS. Bản tin JSON luôn bắt đầu bằng '{'
+#define MQTT_CBOR_ENABLE
+#define MQTT_PAYLOAD_ENCODING_DEFAULT       MQTT_PAYLOAD_JSON
+#define MQTT_PAYLOAD_ENCODING_JSON_STR      "json"
+#define MQTT_PAYLOAD_ENCODING_CBOR_STR      "cbor"
+
 /* Exported functions ------------------------------------------------------- */
 void MQTT_Initialize();
 void MQTT_Start();
@@ -48,21 +135,39 @@ void MQTT_Stop();
 void MQTT_restartClient();
 void MQTT_connectToServerDone();
 
+int MQTT_SubscribeBatch(uint8_t mask);
 int MQTT_SubscribeToDeviceTopic(char *product_Id);
 int MQTT_SubscribeTopicGetPrivateKey();
 int MQTT_PublishStatusGetPrivateKey(char* productId);
 int MQTT_SubscribeTopicGetCert();
-int MQTT_PublishRequestGetCert(char* signature);
+int MQTT_PublishRequestGetCert(const uint8_t* signature, size_t sigLen);
 int MQTT_SubscribeTopicConfirmCert();
 int MQTT_PublishStatusConfirmCert();
 void MqttHandle_startCheckNewCertificate();
 
+bool MQTT_isProtocolV5();
+int MQTT_clientPublishCorrelated(const char* pubTopicName, const char* pubData, size_t len, int qos, mqtt_priority_t priority, const char* correlationId);
+int MQTT_clientPublishPriority(const char* pubTopicName, const char* pubData, size_t len, int qos, mqtt_priority_t priority);
+int MQTT_clientPublish(const char* pubTopicName, const char* pubData, size_t len, int qos);
+void MQTT_rateLimitDropped();
+bool MQTT_setPayloadEncoding(mqtt_payload_encoding_t encoding);
+mqtt_payload_encoding_t MQTT_getPayloadEncoding();
+void MQTT_printStats();
+int MQTT_PublishToDeviceTopic(char* pubTopicName, char* pubData);
+int MQTT_PublishToDeviceQueue(char* key, char* pubTopicName, char* pubData);
+int MQTT_PublishToDeviceReliable(char* key, char* pubTopicName, char* pubData, uint8_t flags);
+
 void MQTT_PublishVersion(uint16_t model, uint16_t hardver, uint16_t commonVer, uint16_t firmver);
 void MQTT_PublishSwitchState(uint8_t id, uint8_t state);
 void MQTT_PublishInfoBeacon(uint16_t major);
 void MQTT_PublishTimeActiveDevice(char* data);
 void MQTT_PublishInfoWifi(char* data);
 void MQTT_PublishStateUpdateFirmware(char* data);
+void MQTT_PublishProgressFirmware(char* data);
+void MQTT_PublishStateEndFirmware(char* data);
+void MQTT_PublishConfirmActiveDevice(char* data);
+void MQTT_PublishHello(uint16_t major, bool withActive);
+void MQTT_PublishAck(char* property, char* data, char* rid);
 void MQTT_PublishDataCommon(char* data, char* property);
 void MQTT_PublishData(char* data, char* property);
 
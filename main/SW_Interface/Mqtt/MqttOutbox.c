@@ -0,0 +1,479 @@
+/**
+ ******************************************************************************
+ * @file    MqttOutbox.c
+ * @author  HT EZLife Co.,LTD.
+ * @date    January 1, 2025
+ ******************************************************************************/
+/*******************************************************************************
+ * Include
+ ******************************************************************************/
+#include "MqttOutbox.h"
+#include "MqttHandler.h"
+#include "HTG_Utility.h"
+#include "esp_partition.h"
+#include <stddef.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define TAG "MQTT_Outbox"
+
+#ifndef DISABLE_LOG_ALL
+#define MQTT_OUTBOX_LOG_INFO_ON
+#endif
+
+#ifdef MQTT_OUTBOX_LOG_INFO_ON
+#define log_info(format, ...) ESP_LOGI(TAG, format, ##__VA_ARGS__)
+#define log_error(format, ...) ESP_LOGE(TAG, format, ##__VA_ARGS__)
+#define log_warning(format, ...) ESP_LOGW(TAG, format, ##__VA_ARGS__)
+#else
+#define log_info(format, ...)
+#define log_error(format, ...)
+#define log_warning(format, ...)
+#endif
+
+#define OUTBOX_STATE_PENDING        0xFF
+#define OUTBOX_STATE_DELIVERED      0x00
+#define OUTBOX_RECORD_SIZE(len)     ((sizeof(mqtt_outbox_header_t) + (len) + 3) & ~3)
+
+/*******************************************************************************
+ * Extern Variables
+ ******************************************************************************/
+extern bool g_isMqttConnected;
+
+/*******************************************************************************
+ * Typedef Variables
+ ******************************************************************************/
+// Bản ghi: header + topic + data, không nằm vắt qua 2 sector
+typedef struct
+{
+	uint16_t magic;
+	uint16_t len;           // topic + data
+	uint32_t seq;
+	uint32_t crc;           // tính khi crc = 0, state = OUTBOX_STATE_PENDING
+	uint8_t topicLen;
+	uint8_t state;          // chỉ ghi 1 -> 0 khi đã gửi, không cần xoá sector
+	uint16_t reserved;
+} mqtt_outbox_header_t;
+
+typedef enum
+{
+	OUTBOX_RECORD_VALID,
+	OUTBOX_RECORD_CORRUPT,
+	OUTBOX_RECORD_END,
+} mqtt_outbox_record_t;
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+static const esp_partition_t *s_partition = NULL;
+static uint32_t s_sectorCount = 0;
+static uint32_t s_writeSector = 0, s_writeOffset = 0;
+static uint32_t s_readSector = 0, s_readOffset = 0;
+static uint32_t s_seq = 0;
+static mqtt_outbox_stats_t s_stats;
+static SemaphoreHandle_t s_outboxLock = NULL;
+static TaskHandle_t s_outboxTask = NULL;
+static uint8_t s_record[OUTBOX_RECORD_SIZE(MQTT_OUTBOX_MAX_PAYLOAD)];
+// bản ghi đang chờ PUBACK, chỉ đánh dấu đã gửi khi có MQTT_EVENT_PUBLISHED
+static int s_inflightMsgId = 0;
+static int s_earlyAckMsgId = 0;
+static uint32_t s_inflightSector = 0, s_inflightOffset = 0, s_inflightSize = 0;
+
+/*******************************************************************************
+ * Flash Functions
+ ******************************************************************************/
+static uint32_t MqttOutbox_address(uint32_t sector, uint32_t offset)
+{
+	return sector*MQTT_OUTBOX_SECTOR_SIZE + offset;
+}
+
+static bool MqttOutbox_readHeader(uint32_t sector, uint32_t offset, mqtt_outbox_header_t *header)
+{
+	if (offset + sizeof(mqtt_outbox_header_t) > MQTT_OUTBOX_SECTOR_SIZE) {
+		return false;
+	}
+	if (esp_partition_read(s_partition, MqttOutbox_address(sector, offset), header, sizeof(mqtt_outbox_header_t)) != ESP_OK) {
+		return false;
+	}
+	return (header->magic == MQTT_OUTBOX_RECORD_MAGIC) && (header->len <= MQTT_OUTBOX_MAX_PAYLOAD) && (header->topicLen <= header->len)
+			&& (offset + OUTBOX_RECORD_SIZE(header->len) <= MQTT_OUTBOX_SECTOR_SIZE);
+}
+
+// đọc bản ghi vào s_record và kiểm tra crc
+static mqtt_outbox_record_t MqttOutbox_readRecord(uint32_t sector, uint32_t offset, mqtt_outbox_header_t *header)
+{
+	if (!MqttOutbox_readHeader(sector, offset, header)) {
+		return OUTBOX_RECORD_END;
+	}
+	uint32_t size = OUTBOX_RECORD_SIZE(header->len);
+	if (esp_partition_read(s_partition, MqttOutbox_address(sector, offset), s_record, size) != ESP_OK) {
+		return OUTBOX_RECORD_CORRUPT;
+	}
+	mqtt_outbox_header_t *raw = (mqtt_outbox_header_t *)s_record;
+	raw->crc = 0;
+	raw->state = OUTBOX_STATE_PENDING;
+	if (ht_check_crc32(s_record, size) != header->crc) {
+		return OUTBOX_RECORD_CORRUPT;
+	}
+	return OUTBOX_RECORD_VALID;
+}
+
+static bool MqttOutbox_sectorIsEmpty(uint32_t sector)
+{
+	uint16_t magic = 0;
+	esp_partition_read(s_partition, MqttOutbox_address(sector, 0), &magic, sizeof(magic));
+	return magic == 0xFFFF;
+}
+
+static uint32_t MqttOutbox_countPending(uint32_t sector, uint32_t offset, uint32_t endOffset)
+{
+	mqtt_outbox_header_t header;
+	uint32_t count = 0;
+	while ((offset < endOffset) && MqttOutbox_readHeader(sector, offset, &header)) {
+		if (header.state == OUTBOX_STATE_PENDING) {
+			count++;
+		}
+		offset += OUTBOX_RECORD_SIZE(header.len);
+	}
+	return count;
+}
+
+// sector kế tiếp để ghi: xoá trước, nếu đang chứa bản tin chưa gửi thì bỏ bản tin cũ nhất
+static void MqttOutbox_nextWriteSector()
+{
+	s_writeSector = (s_writeSector + 1) % s_sectorCount;
+	s_writeOffset = 0;
+	if (MqttOutbox_sectorIsEmpty(s_writeSector)) {
+		return;
+	}
+	if (s_readSector == s_writeSector) {
+		uint32_t dropped = MqttOutbox_countPending(s_readSector, s_readOffset, MQTT_OUTBOX_SECTOR_SIZE);
+		if (dropped > 0) {
+			log_error("Outbox full, drop %lu oldest records", dropped);
+		}
+		s_stats.dropped += dropped;
+		s_stats.pending -= dropped;
+		s_readSector = (s_readSector + 1) % s_sectorCount;
+		s_readOffset = 0;
+	}
+	esp_partition_erase_range(s_partition, MqttOutbox_address(s_writeSector, 0), MQTT_OUTBOX_SECTOR_SIZE);
+	s_stats.erases++;
+}
+
+static void MqttOutbox_mount()
+{
+	mqtt_outbox_header_t header;
+	int32_t newest = -1;
+
+	// sector ghi sau cùng là sector có seq bản ghi đầu tiên lớn nhất
+	for (uint32_t i = 0; i < s_sectorCount; i++) {
+		if (MqttOutbox_readHeader(i, 0, &header)) {
+			if (newest < 0 || (int32_t)(header.seq - s_seq) > 0) {
+				newest = i;
+				s_seq = header.seq;
+			}
+		}
+	}
+	if (newest < 0) {
+		s_writeSector = 0;
+		s_writeOffset = 0;
+		s_readSector = 0;
+		s_readOffset = 0;
+		if (!MqttOutbox_sectorIsEmpty(0)) {
+			esp_partition_erase_range(s_partition, 0, MQTT_OUTBOX_SECTOR_SIZE);
+			s_stats.erases++;
+		}
+		return;
+	}
+
+	s_writeSector = newest;
+	s_writeOffset = 0;
+	while (MqttOutbox_readHeader(s_writeSector, s_writeOffset, &header)) {
+		s_seq = header.seq + 1;
+		s_writeOffset += OUTBOX_RECORD_SIZE(header.len);
+	}
+	if (s_writeOffset < MQTT_OUTBOX_SECTOR_SIZE) {
+		uint16_t magic = 0;
+		esp_partition_read(s_partition, MqttOutbox_address(s_writeSector, s_writeOffset), &magic, sizeof(magic));
+		if (magic != 0xFFFF) {
+			// bản ghi bị ngắt giữa chừng (mất nguồn), ghi tiếp từ sector sau
+			s_writeOffset = MQTT_OUTBOX_SECTOR_SIZE;
+		}
+	}
+
+	// đi từ sector cũ nhất, vị trí đọc là bản ghi chưa gửi đầu tiên
+	bool found = false;
+	for (uint32_t i = 1; i <= s_sectorCount; i++) {
+		uint32_t sector = (s_writeSector + i) % s_sectorCount;
+		uint32_t offset = 0;
+		uint32_t endOffset = (sector == s_writeSector) ? s_writeOffset : MQTT_OUTBOX_SECTOR_SIZE;
+		while ((offset < endOffset) && MqttOutbox_readHeader(sector, offset, &header)) {
+			if (header.state == OUTBOX_STATE_PENDING) {
+				if (!found) {
+					s_readSector = sector;
+					s_readOffset = offset;
+					found = true;
+				}
+				s_stats.pending++;
+			}
+			offset += OUTBOX_RECORD_SIZE(header.len);
+		}
+	}
+	if (!found) {
+		s_readSector = s_writeSector;
+		s_readOffset = s_writeOffset;
+	}
+}
+
+/*******************************************************************************
+ * Replay Task
+ ******************************************************************************/
+static bool MqttOutbox_readIsEnd()
+{
+	return (s_readSector == s_writeSector) && (s_readOffset >= s_writeOffset);
+}
+
+static void MqttOutbox_advanceRead(uint32_t size)
+{
+	s_readOffset += size;
+	if ((s_readSector != s_writeSector) && (s_readOffset >= MQTT_OUTBOX_SECTOR_SIZE)) {
+		s_readSector = (s_readSector + 1) % s_sectorCount;
+		s_readOffset = 0;
+	}
+}
+
+// gọi khi giữ s_outboxLock
+static void MqttOutbox_markDelivered()
+{
+	// sector có thể đã bị xoá khi outbox đầy trong lúc chờ PUBACK
+	if ((s_readSector == s_inflightSector) && (s_readOffset == s_inflightOffset)) {
+		uint8_t state = OUTBOX_STATE_DELIVERED;
+		esp_partition_write(s_partition, MqttOutbox_address(s_inflightSector, s_inflightOffset) + offsetof(mqtt_outbox_header_t, state), &state, sizeof(state));
+		MqttOutbox_advanceRead(s_inflightSize);
+		s_stats.pending--;
+	}
+	s_stats.replayed++;
+	s_inflightMsgId = 0;
+}
+
+static void task_replayOutbox(void *arg)
+{
+	mqtt_outbox_header_t header;
+	char topic[MQTT_OUTBOX_MAX_PAYLOAD + 1];
+	char *data = NULL;
+
+	while (1)
+	{
+		if (!g_isMqttConnected || s_stats.pending == 0) {
+			ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+			continue;
+		}
+
+		// tìm bản tin chưa gửi cũ nhất
+		bool found = false;
+		uint32_t sector = 0, offset = 0, size = 0;
+		xSemaphoreTake(s_outboxLock, portMAX_DELAY);
+		while (!MqttOutbox_readIsEnd()) {
+			mqtt_outbox_record_t ret = MqttOutbox_readRecord(s_readSector, s_readOffset, &header);
+			if (ret == OUTBOX_RECORD_END) {
+				// hết bản ghi trong sector này
+				s_readOffset = MQTT_OUTBOX_SECTOR_SIZE;
+				MqttOutbox_advanceRead(0);
+				continue;
+			}
+			if (ret == OUTBOX_RECORD_CORRUPT) {
+				s_stats.corrupt++;
+				if (header.state == OUTBOX_STATE_PENDING) {
+					s_stats.pending--;
+				}
+				MqttOutbox_advanceRead(OUTBOX_RECORD_SIZE(header.len));
+				continue;
+			}
+			if (header.state != OUTBOX_STATE_PENDING) {
+				MqttOutbox_advanceRead(OUTBOX_RECORD_SIZE(header.len));
+				continue;
+			}
+			sector = s_readSector;
+			offset = s_readOffset;
+			size = OUTBOX_RECORD_SIZE(header.len);
+			memcpy(topic, s_record + sizeof(mqtt_outbox_header_t), header.topicLen);
+			topic[header.topicLen] = '\0';
+			data = topic + header.topicLen + 1;
+			memcpy(data, s_record + sizeof(mqtt_outbox_header_t) + header.topicLen, header.len - header.topicLen);
+			found = true;
+			break;
+		}
+		if (!found) {
+			s_stats.pending = 0;
+		}
+		xSemaphoreGive(s_outboxLock);
+		if (!found) {
+			continue;
+		}
+
+		int msgId = MQTT_clientPublishPriority(topic, data, header.len - header.topicLen, MQTT_OUTBOX_QOS, MQTT_PRIORITY_LOW);
+		if (msgId <= 0) {
+			vTaskDelay(1000/portTICK_PERIOD_MS);
+			continue;
+		}
+
+		// msg_id chỉ là esp-mqtt đã nhận vào RAM: giữ bản ghi pending tới khi có PUBACK
+		xSemaphoreTake(s_outboxLock, portMAX_DELAY);
+		s_inflightMsgId = msgId;
+		s_inflightSector = sector;
+		s_inflightOffset = offset;
+		s_inflightSize = size;
+		if (s_earlyAckMsgId == msgId) {
+			// PUBACK tới trước khi kịp ghi nhận msg_id
+			MqttOutbox_markDelivered();
+		}
+		s_earlyAckMsgId = 0;
+		xSemaphoreGive(s_outboxLock);
+
+		TickType_t start = xTaskGetTickCount();
+		while ((s_inflightMsgId != 0) && g_isMqttConnected && ((xTaskGetTickCount() - start) < MQTT_OUTBOX_ACK_TIMEOUT/portTICK_PERIOD_MS)) {
+			ulTaskNotifyTake(pdTRUE, MQTT_OUTBOX_REPLAY_INTERVAL/portTICK_PERIOD_MS);
+		}
+		xSemaphoreTake(s_outboxLock, portMAX_DELAY);
+		if (s_inflightMsgId != 0) {
+			// mất kết nối hoặc quá thời gian: bản ghi vẫn pending, gửi lại lần sau
+			log_warning("No PUBACK for msg_id %d, retry", s_inflightMsgId);
+			s_inflightMsgId = 0;
+		}
+		xSemaphoreGive(s_outboxLock);
+
+		vTaskDelay(MQTT_OUTBOX_REPLAY_INTERVAL/portTICK_PERIOD_MS);
+	}
+}
+
+/*******************************************************************************
+ * Application Funtions
+ ******************************************************************************/
+void MqttOutbox_Initialize()
+{
+	if (s_outboxLock != NULL) {
+		return;
+	}
+	s_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, MQTT_OUTBOX_PARTITION_LABEL);
+	if (s_partition == NULL) {
+		log_error("Partition \"%s\" not found", MQTT_OUTBOX_PARTITION_LABEL);
+		return;
+	}
+	s_sectorCount = s_partition->size/MQTT_OUTBOX_SECTOR_SIZE;
+	s_outboxLock = xSemaphoreCreateMutex();
+
+	int64_t timeStart = esp_timer_get_time();
+	MqttOutbox_mount();
+	log_warning("Outbox mount %lld ms: %lu sectors, write %lu:%lu, pending %lu", (esp_timer_get_time() - timeStart)/1000,
+																				s_sectorCount,
+																				s_writeSector,
+																				s_writeOffset,
+																				s_stats.pending);
+
+	xTaskCreate(task_replayOutbox, "task_mqttOutbox", MQTT_OUTBOX_TASK_STACK, NULL, MQTT_OUTBOX_TASK_PRIORITY, &s_outboxTask);
+}
+
+bool MqttOutbox_append(const char *topic, const char *data, size_t len)
+{
+	if (s_outboxLock == NULL) {
+		return false;
+	}
+	size_t topicLen = strlen(topic);
+	if ((topicLen > 0xFF) || (topicLen + len > MQTT_OUTBOX_MAX_PAYLOAD)) {
+		log_error("Record too long: %s", topic);
+		return false;
+	}
+	uint32_t size = OUTBOX_RECORD_SIZE(topicLen + len);
+
+	xSemaphoreTake(s_outboxLock, portMAX_DELAY);
+	if (s_writeOffset + size > MQTT_OUTBOX_SECTOR_SIZE) {
+		MqttOutbox_nextWriteSector();
+	}
+
+	memset(s_record, 0xFF, size);
+	mqtt_outbox_header_t *header = (mqtt_outbox_header_t *)s_record;
+	header->magic = MQTT_OUTBOX_RECORD_MAGIC;
+	header->len = topicLen + len;
+	header->seq = s_seq;
+	header->crc = 0;
+	header->topicLen = topicLen;
+	header->state = OUTBOX_STATE_PENDING;
+	header->reserved = 0;
+	memcpy(s_record + sizeof(mqtt_outbox_header_t), topic, topicLen);
+	memcpy(s_record + sizeof(mqtt_outbox_header_t) + topicLen, data, len);
+	header->crc = ht_check_crc32(s_record, size);
+
+	esp_err_t err = esp_partition_write(s_partition, MqttOutbox_address(s_writeSector, s_writeOffset), s_record, size);
+	if (err != ESP_OK) {
+		// bỏ phần còn lại của sector, lần sau ghi sang sector mới
+		s_writeOffset = MQTT_OUTBOX_SECTOR_SIZE;
+		xSemaphoreGive(s_outboxLock);
+		log_error("Write record fail: %s", esp_err_to_name(err));
+		return false;
+	}
+	s_writeOffset += size;
+	s_seq++;
+	s_stats.pending++;
+	s_stats.appended++;
+	xSemaphoreGive(s_outboxLock);
+
+	MqttOutbox_notify();
+	return true;
+}
+
+// gọi từ MQTT_EVENT_PUBLISHED
+void MqttOutbox_onPublished(int msg_id)
+{
+	if ((s_outboxLock == NULL) || (msg_id <= 0)) {
+		return;
+	}
+	xSemaphoreTake(s_outboxLock, portMAX_DELAY);
+	bool matched = (msg_id == s_inflightMsgId);
+	if (matched) {
+		MqttOutbox_markDelivered();
+	} else {
+		s_earlyAckMsgId = msg_id;
+	}
+	xSemaphoreGive(s_outboxLock);
+	if (matched) {
+		MqttOutbox_notify();
+	}
+}
+
+bool MqttOutbox_hasPending()
+{
+	return s_stats.pending > 0;
+}
+
+void MqttOutbox_notify()
+{
+	if (s_outboxTask != NULL) {
+		xTaskNotifyGive(s_outboxTask);
+	}
+}
+
+void MqttOutbox_getStats(mqtt_outbox_stats_t *stats)
+{
+	if (s_outboxLock == NULL) {
+		memset(stats, 0, sizeof(mqtt_outbox_stats_t));
+		return;
+	}
+	xSemaphoreTake(s_outboxLock, portMAX_DELAY);
+	memcpy(stats, &s_stats, sizeof(mqtt_outbox_stats_t));
+	xSemaphoreGive(s_outboxLock);
+}
+
+void MqttOutbox_printStats()
+{
+	mqtt_outbox_stats_t stats;
+	MqttOutbox_getStats(&stats);
+	printf("Mqtt outbox: [pending - %lu] [appended - %lu] [replayed - %lu] [dropped - %lu] [corrupt - %lu] [erases - %lu]\n", stats.pending,
+																															stats.appended,
+																															stats.replayed,
+																															stats.dropped,
+																															stats.corrupt,
+																															stats.erases);
+}
+
+/***********************************************/
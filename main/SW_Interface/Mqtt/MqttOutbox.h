@@ -0,0 +1,47 @@
+/**
+ ******************************************************************************
+ * @file    MqttOutbox.h
+ * @author  HT EZLife Co.,LTD.
+ * @date    January 1, 2025
+ ******************************************************************************/
+
+#ifndef __MQTT_OUTBOX_H
+#define __MQTT_OUTBOX_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "Global.h"
+
+/* Exported types ------------------------------------------------------------*/
+typedef struct
+{
+	uint32_t pending;
+	uint32_t appended;
+	uint32_t replayed;
+	uint32_t dropped;
+	uint32_t corrupt;
+	uint32_t erases;
+} mqtt_outbox_stats_t;
+
+/* Exported macro ------------------------------------------------------------*/
+// Lưu bản tin khi mất kết nối MQTT vào partition "storage" (không mount FAT)
+#define MQTT_OUTBOX_ENABLE
+#define MQTT_OUTBOX_PARTITION_LABEL     "storage"
+#define MQTT_OUTBOX_SECTOR_SIZE         4096
+#define MQTT_OUTBOX_RECORD_MAGIC        0x4F42
+#define MQTT_OUTBOX_MAX_PAYLOAD         512     // topic + data của 1 bản tin
+#define MQTT_OUTBOX_QOS                 1
+#define MQTT_OUTBOX_REPLAY_INTERVAL     200     // ms giữa 2 bản tin gửi lại
+#define MQTT_OUTBOX_ACK_TIMEOUT         10000   // ms chờ PUBACK trước khi gửi lại
+#define MQTT_OUTBOX_TASK_STACK          (3*1024)
+#define MQTT_OUTBOX_TASK_PRIORITY       3
+
+/* Exported functions ------------------------------------------------------- */
+void MqttOutbox_Initialize();
+bool MqttOutbox_append(const char *topic, const char *data, size_t len);
+void MqttOutbox_onPublished(int msg_id);
+bool MqttOutbox_hasPending();
+void MqttOutbox_notify();
+void MqttOutbox_getStats(mqtt_outbox_stats_t *stats);
+void MqttOutbox_printStats();
+
+#endif /* __MQTT_OUTBOX_H */
@@ -0,0 +1,421 @@
+/**
+ ******************************************************************************
+ * @file    MqttQueue.c
+ * @author  HT EZLife Co.,LTD.
+ * @date    January 1, 2025
+ ******************************************************************************/
+/*******************************************************************************
+ * Include
+ ******************************************************************************/
+#include "MqttQueue.h"
+#include "MqttHandler.h"
+#include "HTG_Utility.h"
+#include "esp_attr.h"
+#include <stddef.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define TAG "MQTT_Queue"
+
+#ifndef DISABLE_LOG_ALL
+#define MQTT_QUEUE_LOG_INFO_ON
+#endif
+
+#ifdef MQTT_QUEUE_LOG_INFO_ON
+#define log_info(format, ...) ESP_LOGI(TAG, format, ##__VA_ARGS__)
+#define log_error(format, ...) ESP_LOGE(TAG, format, ##__VA_ARGS__)
+#define log_warning(format, ...) ESP_LOGW(TAG, format, ##__VA_ARGS__)
+#else
+#define log_info(format, ...)
+#define log_error(format, ...)
+#define log_warning(format, ...)
+#endif
+
+#define MQTT_QUEUE_MSG_ID_SENDING	(-1)
+
+/*******************************************************************************
+ * Extern Variables
+ ******************************************************************************/
+extern bool g_isMqttConnected;
+
+/*******************************************************************************
+ * Typedef Variables
+ ******************************************************************************/
+typedef struct
+{
+	bool pending;
+	uint32_t seq;
+	char key[MQTT_QUEUE_KEY_LEN];
+	char topic[MQTT_QUEUE_TOPIC_LEN];
+	char *data;
+	size_t len;
+} mqtt_queue_slot_t;
+
+typedef struct
+{
+	char key[MQTT_QUEUE_KEY_LEN];
+	uint32_t hash;
+} mqtt_queue_hash_t;
+
+// msgId: 0 ô trống, MQTT_QUEUE_MSG_ID_SENDING đã lấy khỏi hàng đợi nhưng chưa publish xong
+typedef struct
+{
+	int msgId;
+	mqtt_queue_hash_t state;
+} mqtt_queue_inflight_t;
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t count;
+	mqtt_queue_hash_t entries[MQTT_QUEUE_MAX_SLOTS];
+	uint32_t crc;
+} mqtt_queue_acked_t;
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+static mqtt_queue_slot_t s_slots[MQTT_QUEUE_MAX_SLOTS];
+static mqtt_queue_stats_t s_stats;
+static uint32_t s_seq = 0;
+static SemaphoreHandle_t s_queueLock = NULL;
+static TaskHandle_t s_drainTask = NULL;
+
+#ifdef MQTT_QUEUE_DELTA_ENABLE
+// giữ qua soft reset (ESP_resetChip), mất khi mất nguồn
+static RTC_NOINIT_ATTR mqtt_queue_acked_t s_ackedState;
+static mqtt_queue_inflight_t s_inflight[MQTT_QUEUE_INFLIGHT_MAX];
+static uint8_t s_inflightIdx = 0;
+#endif
+
+/*******************************************************************************
+ * Private Functions
+ ******************************************************************************/
+static mqtt_queue_slot_t *MqttQueue_findSlot(const char *key)
+{
+	for (uint8_t i = 0; i < MQTT_QUEUE_MAX_SLOTS; i++) {
+		if (s_slots[i].pending && strcmp(s_slots[i].key, key) == 0) {
+			return &s_slots[i];
+		}
+	}
+	return NULL;
+}
+
+static mqtt_queue_slot_t *MqttQueue_findFreeSlot()
+{
+	for (uint8_t i = 0; i < MQTT_QUEUE_MAX_SLOTS; i++) {
+		if (!s_slots[i].pending) {
+			return &s_slots[i];
+		}
+	}
+	return NULL;
+}
+
+static mqtt_queue_slot_t *MqttQueue_findOldest()
+{
+	mqtt_queue_slot_t *oldest = NULL;
+	for (uint8_t i = 0; i < MQTT_QUEUE_MAX_SLOTS; i++) {
+		if (s_slots[i].pending && (oldest == NULL || (int32_t)(s_slots[i].seq - oldest->seq) < 0)) {
+			oldest = &s_slots[i];
+		}
+	}
+	return oldest;
+}
+
+#ifdef MQTT_QUEUE_DELTA_ENABLE
+static uint32_t MqttQueue_ackedCrc()
+{
+	return ht_check_crc32((uint8_t *)&s_ackedState, offsetof(mqtt_queue_acked_t, crc));
+}
+
+static void MqttQueue_resetAcked()
+{
+	memset(&s_ackedState, 0, sizeof(s_ackedState));
+	s_ackedState.magic = MQTT_QUEUE_STATE_MAGIC;
+	s_ackedState.crc = MqttQueue_ackedCrc();
+}
+
+static mqtt_queue_hash_t *MqttQueue_findAcked(const char *key)
+{
+	for (uint32_t i = 0; i < s_ackedState.count; i++) {
+		if (strcmp(s_ackedState.entries[i].key, key) == 0) {
+			return &s_ackedState.entries[i];
+		}
+	}
+	return NULL;
+}
+
+// key còn bản tin đang gửi/chờ PUBACK khác giá trị mới: giá trị đã ACK sắp bị thay,
+// không được coi giá trị mới là trùng (ACK -> gửi OFF -> push ON)
+static bool MqttQueue_inflightDiffers(const char *key, uint32_t hash)
+{
+	for (uint8_t i = 0; i < MQTT_QUEUE_INFLIGHT_MAX; i++) {
+		if ((s_inflight[i].msgId != 0) && (strcmp(s_inflight[i].state.key, key) == 0) && (s_inflight[i].state.hash != hash)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void MqttQueue_saveAcked(const mqtt_queue_hash_t *state)
+{
+	mqtt_queue_hash_t *acked = MqttQueue_findAcked(state->key);
+	if (acked == NULL) {
+		if (s_ackedState.count >= MQTT_QUEUE_MAX_SLOTS) {
+			return;
+		}
+		acked = &s_ackedState.entries[s_ackedState.count++];
+	}
+	memcpy(acked, state, sizeof(mqtt_queue_hash_t));
+	s_ackedState.crc = MqttQueue_ackedCrc();
+}
+#endif
+
+static void MqttQueue_freeSlot(mqtt_queue_slot_t *slot)
+{
+	free(slot->data);
+	slot->data = NULL;
+	slot->len = 0;
+	slot->pending = false;
+	s_stats.depth--;
+}
+
+/*******************************************************************************
+ * Drain Task
+ ******************************************************************************/
+static void task_drainQueue(void *arg)
+{
+	char topic[MQTT_QUEUE_TOPIC_LEN];
+	char key[MQTT_QUEUE_KEY_LEN];
+
+	while (1)
+	{
+		if (!g_isMqttConnected || s_stats.depth == 0) {
+			// chờ có bản tin mới hoặc kết nối lại server
+			ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+			continue;
+		}
+
+		// lấy bản tin cũ nhất ra khỏi hàng đợi, publish ngoài lock
+		xSemaphoreTake(s_queueLock, portMAX_DELAY);
+		mqtt_queue_slot_t *slot = MqttQueue_findOldest();
+		if (slot == NULL) {
+			xSemaphoreGive(s_queueLock);
+			continue;
+		}
+		char *data = slot->data;
+		size_t len = slot->len;
+		uint32_t seq = slot->seq;
+		strcpy(topic, slot->topic);
+		strcpy(key, slot->key);
+		slot->data = NULL;
+		MqttQueue_freeSlot(slot);
+#ifdef MQTT_QUEUE_DELTA_ENABLE
+		// ghi nhận đang gửi ngay lúc lấy ra, trước khi có PUBACK (xem MqttQueue_inflightDiffers)
+		mqtt_queue_inflight_t *inflight = &s_inflight[s_inflightIdx];
+		s_inflightIdx = (s_inflightIdx + 1) % MQTT_QUEUE_INFLIGHT_MAX;
+		inflight->msgId = MQTT_QUEUE_MSG_ID_SENDING;
+		strcpy(inflight->state.key, key);
+		inflight->state.hash = ht_check_crc32((uint8_t *)data, len);
+#endif
+		xSemaphoreGive(s_queueLock);
+
+#ifdef MQTT_QUEUE_DELTA_ENABLE
+		int msg_id = MQTT_clientPublish(topic, data, len, MQTT_QUEUE_DELTA_QOS);
+#else
+		int msg_id = MQTT_clientPublish(topic, data, len, 0);
+#endif
+		if (msg_id < 0) {
+			// publish lỗi: trả lại hàng đợi nếu chưa có giá trị mới hơn cho cùng key
+			xSemaphoreTake(s_queueLock, portMAX_DELAY);
+#ifdef MQTT_QUEUE_DELTA_ENABLE
+			if (inflight->msgId == MQTT_QUEUE_MSG_ID_SENDING) {
+				inflight->msgId = 0;
+			}
+#endif
+			if (MqttQueue_findSlot(key) == NULL && (slot = MqttQueue_findFreeSlot()) != NULL) {
+				slot->pending = true;
+				slot->seq = seq;
+				strcpy(slot->key, key);
+				strcpy(slot->topic, topic);
+				slot->data = data;
+				slot->len = len;
+				s_stats.depth++;
+				data = NULL;
+			} else {
+				s_stats.dropped++;
+			}
+			xSemaphoreGive(s_queueLock);
+			free(data);
+			vTaskDelay(1000/portTICK_PERIOD_MS);
+			continue;
+		}
+
+		s_stats.sent++;
+#ifdef MQTT_QUEUE_DELTA_ENABLE
+		// chờ PUBACK (MQTT_EVENT_PUBLISHED) mới ghi nhận hash đã gửi
+		xSemaphoreTake(s_queueLock, portMAX_DELAY);
+		if (inflight->msgId == MQTT_QUEUE_MSG_ID_SENDING) {
+			inflight->msgId = msg_id;
+		}
+		xSemaphoreGive(s_queueLock);
+#endif
+		free(data);
+		vTaskDelay(MQTT_QUEUE_DRAIN_INTERVAL/portTICK_PERIOD_MS);
+	}
+}
+
+/*******************************************************************************
+ * Application Funtions
+ ******************************************************************************/
+void MqttQueue_Initialize()
+{
+	if (s_queueLock != NULL) {
+		return;
+	}
+	s_queueLock = xSemaphoreCreateMutex();
+#ifdef MQTT_QUEUE_DELTA_ENABLE
+	if ((s_ackedState.magic != MQTT_QUEUE_STATE_MAGIC) || (s_ackedState.count > MQTT_QUEUE_MAX_SLOTS) || (s_ackedState.crc != MqttQueue_ackedCrc())) {
+		log_warning("No acked state in RTC memory, full publish");
+		MqttQueue_resetAcked();
+	} else {
+		log_warning("Acked state in RTC memory: %lu properties", s_ackedState.count);
+	}
+#endif
+	xTaskCreate(task_drainQueue, "task_mqttQueue", MQTT_QUEUE_TASK_STACK, NULL, MQTT_QUEUE_TASK_PRIORITY, &s_drainTask);
+}
+
+bool MqttQueue_push(const char *key, const char *topic, const char *data, size_t len)
+{
+	if (s_queueLock == NULL) {
+		log_error("Queue not initialized");
+		return false;
+	}
+	if ((strlen(key) >= MQTT_QUEUE_KEY_LEN) || (strlen(topic) >= MQTT_QUEUE_TOPIC_LEN)) {
+		log_error("Key or topic too long: %s", key);
+		return false;
+	}
+
+	char *copy = (char *)malloc(len + 1);
+	if (copy == NULL) {
+		log_error("Malloc data fail: %s", key);
+		s_stats.dropped++;
+		return false;
+	}
+	memcpy(copy, data, len);
+	copy[len] = '\0';
+
+	xSemaphoreTake(s_queueLock, portMAX_DELAY);
+	s_stats.enqueued++;
+	mqtt_queue_slot_t *slot = MqttQueue_findSlot(key);
+#ifdef MQTT_QUEUE_DELTA_ENABLE
+	mqtt_queue_hash_t *acked = MqttQueue_findAcked(key);
+	uint32_t hash = ht_check_crc32((uint8_t *)data, len);
+	if ((acked != NULL) && (acked->hash == hash) && !MqttQueue_inflightDiffers(key, hash)) {
+		// giá trị trùng lần publish đã xác nhận: bỏ qua, huỷ cả giá trị đang chờ nếu có
+		if (slot != NULL) {
+			MqttQueue_freeSlot(slot);
+		}
+		s_stats.suppressed++;
+		xSemaphoreGive(s_queueLock);
+		free(copy);
+		return true;
+	}
+#endif
+	if (slot != NULL) {
+		// last-value-wins: thay giá trị đang chờ, giữ nguyên thứ tự gửi
+		free(slot->data);
+		s_stats.coalesced++;
+	} else {
+		slot = MqttQueue_findFreeSlot();
+		if (slot == NULL) {
+			xSemaphoreGive(s_queueLock);
+			log_error("Queue full, drop: %s", key);
+			s_stats.dropped++;
+			free(copy);
+			return false;
+		}
+		slot->pending = true;
+		slot->seq = s_seq++;
+		strcpy(slot->key, key);
+		strcpy(slot->topic, topic);
+		s_stats.depth++;
+		if (s_stats.depth > s_stats.maxDepth) {
+			s_stats.maxDepth = s_stats.depth;
+		}
+	}
+	slot->data = copy;
+	slot->len = len;
+	xSemaphoreGive(s_queueLock);
+
+	MqttQueue_notify();
+	return true;
+}
+
+void MqttQueue_notify()
+{
+	if (s_drainTask != NULL) {
+		xTaskNotifyGive(s_drainTask);
+	}
+}
+
+void MqttQueue_onPublished(int msg_id)
+{
+#ifdef MQTT_QUEUE_DELTA_ENABLE
+	if (s_queueLock == NULL || msg_id <= 0) {
+		return;
+	}
+	xSemaphoreTake(s_queueLock, portMAX_DELAY);
+	for (uint8_t i = 0; i < MQTT_QUEUE_INFLIGHT_MAX; i++) {
+		if (s_inflight[i].msgId == msg_id) {
+			MqttQueue_saveAcked(&s_inflight[i].state);
+			s_inflight[i].msgId = 0;
+			s_stats.acked++;
+			break;
+		}
+	}
+	xSemaphoreGive(s_queueLock);
+#endif
+}
+
+void MqttQueue_requestFullSync()
+{
+#ifdef MQTT_QUEUE_DELTA_ENABLE
+	if (s_queueLock == NULL) {
+		return;
+	}
+	xSemaphoreTake(s_queueLock, portMAX_DELAY);
+	MqttQueue_resetAcked();
+	memset(s_inflight, 0, sizeof(s_inflight));
+	xSemaphoreGive(s_queueLock);
+	log_warning("Full sync requested, clear acked state");
+#endif
+}
+
+void MqttQueue_getStats(mqtt_queue_stats_t *stats)
+{
+	if (s_queueLock == NULL) {
+		memset(stats, 0, sizeof(mqtt_queue_stats_t));
+		return;
+	}
+	xSemaphoreTake(s_queueLock, portMAX_DELAY);
+	memcpy(stats, &s_stats, sizeof(mqtt_queue_stats_t));
+	xSemaphoreGive(s_queueLock);
+}
+
+void MqttQueue_printStats()
+{
+	mqtt_queue_stats_t stats;
+	MqttQueue_getStats(&stats);
+	printf("Mqtt queue: [depth - %lu] [max depth - %lu] [enqueued - %lu] [coalesced - %lu] [sent - %lu] [dropped - %lu] [suppressed - %lu] [acked - %lu]\n", stats.depth,
+																																						stats.maxDepth,
+																																						stats.enqueued,
+																																						stats.coalesced,
+																																						stats.sent,
+																																						stats.dropped,
+																																						stats.suppressed,
+																																						stats.acked);
+}
+
+/***********************************************/
@@ -0,0 +1,53 @@
+/**
+ ******************************************************************************
+ * @file    MqttQueue.h
+ * @author  HT EZLife Co.,LTD.
+ * @date    January 1, 2025
+ ******************************************************************************/
+
+#ifndef __MQTT_QUEUE_H
+#define __MQTT_QUEUE_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "Global.h"
+
+/* Exported types ------------------------------------------------------------*/
+typedef struct
+{
+	uint32_t depth;
+	uint32_t maxDepth;
+	uint32_t enqueued;
+	uint32_t coalesced;
+	uint32_t sent;
+	uint32_t dropped;
+	uint32_t suppressed;
+	uint32_t acked;
+} mqtt_queue_stats_t;
+
+/* Exported macro ------------------------------------------------------------*/
+#define MQTT_QUEUE_MAX_SLOTS            12
+#define MQTT_QUEUE_KEY_LEN              24
+#define MQTT_QUEUE_TOPIC_LEN            100
+#define MQTT_QUEUE_DRAIN_INTERVAL       100     // ms giữa 2 lần publish liên tiếp
+#define MQTT_QUEUE_TASK_STACK           (4*1024)
+#define MQTT_QUEUE_TASK_PRIORITY        4
+
+// Chỉ publish property có giá trị khác lần publish cuối đã được server xác nhận (PUBACK)
+#define MQTT_QUEUE_DELTA_ENABLE
+#define MQTT_QUEUE_DELTA_QOS            1
+#define MQTT_QUEUE_INFLIGHT_MAX         8
+#define MQTT_QUEUE_STATE_MAGIC          0x48544451
+
+// key riêng cho tiến độ OTA (khác MQTT_RELIABLE_KEY_OTA), chỉ giữ bản mới nhất
+#define MQTT_QUEUE_KEY_OTA_PROGRESS     "PROCESS_OTA/P"
+
+/* Exported functions ------------------------------------------------------- */
+void MqttQueue_Initialize();
+bool MqttQueue_push(const char *key, const char *topic, const char *data, size_t len);
+void MqttQueue_notify();
+void MqttQueue_onPublished(int msg_id);
+void MqttQueue_requestFullSync();
+void MqttQueue_getStats(mqtt_queue_stats_t *stats);
+void MqttQueue_printStats();
+
+#endif /* __MQTT_QUEUE_H */
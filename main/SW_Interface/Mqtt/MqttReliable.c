@@ -0,0 +1,449 @@
+/**
+ ******************************************************************************
+ * @file    MqttReliable.c
+ * @author  HT EZLife Co.,LTD.
+ * @date    January 1, 2025
+ ******************************************************************************/
+/*******************************************************************************
+ * Include
+ ******************************************************************************/
+#include "MqttReliable.h"
+#include "MqttHandler.h"
+#include "FlashHandler.h"
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define TAG "MQTT_Reliable"
+
+#ifndef DISABLE_LOG_ALL
+#define MQTT_RELIABLE_LOG_INFO_ON
+#endif
+
+#ifdef MQTT_RELIABLE_LOG_INFO_ON
+#define log_info(format, ...) ESP_LOGI(TAG, format, ##__VA_ARGS__)
+#define log_error(format, ...) ESP_LOGE(TAG, format, ##__VA_ARGS__)
+#define log_warning(format, ...) ESP_LOGW(TAG, format, ##__VA_ARGS__)
+#else
+#define log_info(format, ...)
+#define log_error(format, ...)
+#define log_warning(format, ...)
+#endif
+
+/*******************************************************************************
+ * Extern Variables
+ ******************************************************************************/
+extern bool g_isMqttConnected;
+
+/*******************************************************************************
+ * Typedef Variables
+ ******************************************************************************/
+typedef enum
+{
+	RELIABLE_STATE_IDLE,
+	RELIABLE_STATE_INFLIGHT,
+	RELIABLE_STATE_WAIT_APP,
+} mqtt_reliable_state_t;
+
+typedef struct
+{
+	uint8_t used;
+	uint8_t flags;
+	uint16_t len;
+	uint32_t seq;
+	char key[MQTT_RELIABLE_KEY_LEN];
+	char topic[MQTT_RELIABLE_TOPIC_LEN];
+	char data[MQTT_RELIABLE_DATA_LEN];
+} mqtt_reliable_record_t;
+
+typedef struct
+{
+	uint32_t magic;
+	mqtt_reliable_record_t records[MQTT_RELIABLE_MAX_RECORDS];
+} mqtt_reliable_store_t;
+
+typedef struct
+{
+	mqtt_reliable_state_t state;
+	int msgId;
+	uint8_t attempts;
+	TickType_t nextTick;
+} mqtt_reliable_runtime_t;
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+static mqtt_reliable_store_t s_store;
+static mqtt_reliable_store_t s_storeCopy;
+static mqtt_reliable_runtime_t s_runtime[MQTT_RELIABLE_MAX_RECORDS];
+static mqtt_reliable_stats_t s_stats;
+static uint32_t s_seq = 0;
+static bool s_storeDirty = false;
+static SemaphoreHandle_t s_reliableLock = NULL;
+static TaskHandle_t s_reliableTask = NULL;
+
+/*******************************************************************************
+ * Private Functions
+ ******************************************************************************/
+static int MqttReliable_find(const char *key)
+{
+	for (uint8_t i = 0; i < MQTT_RELIABLE_MAX_RECORDS; i++) {
+		if (s_store.records[i].used && strcmp(s_store.records[i].key, key) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int MqttReliable_findOldest(bool freeOnly)
+{
+	int oldest = -1;
+	for (uint8_t i = 0; i < MQTT_RELIABLE_MAX_RECORDS; i++) {
+		if (!s_store.records[i].used) {
+			if (freeOnly) {
+				return i;
+			}
+			continue;
+		}
+		if (!freeOnly && (oldest < 0 || (int32_t)(s_store.records[i].seq - s_store.records[oldest].seq) < 0)) {
+			oldest = i;
+		}
+	}
+	return oldest;
+}
+
+static TickType_t MqttReliable_backoff(uint8_t attempts)
+{
+	uint32_t backoff_ms = MQTT_RELIABLE_BACKOFF_MIN;
+	while (attempts-- > 1 && backoff_ms < MQTT_RELIABLE_BACKOFF_MAX) {
+		backoff_ms *= 2;
+	}
+	if (backoff_ms > MQTT_RELIABLE_BACKOFF_MAX) {
+		backoff_ms = MQTT_RELIABLE_BACKOFF_MAX;
+	}
+	return pdMS_TO_TICKS(backoff_ms);
+}
+
+static void MqttReliable_remove(int idx)
+{
+	if (s_store.records[idx].flags & MQTT_RELIABLE_FLAG_PERSIST) {
+		s_storeDirty = true;
+	}
+	memset(&s_store.records[idx], 0, sizeof(mqtt_reliable_record_t));
+	memset(&s_runtime[idx], 0, sizeof(mqtt_reliable_runtime_t));
+	s_stats.pending--;
+}
+
+// chỉ lưu các bản tin có cờ PERSIST, gọi khi đang giữ lock
+static void MqttReliable_copyStore()
+{
+	memset(&s_storeCopy, 0, sizeof(s_storeCopy));
+	s_storeCopy.magic = MQTT_RELIABLE_MAGIC;
+	for (uint8_t i = 0; i < MQTT_RELIABLE_MAX_RECORDS; i++) {
+		if (s_store.records[i].used && (s_store.records[i].flags & MQTT_RELIABLE_FLAG_PERSIST)) {
+			memcpy(&s_storeCopy.records[i], &s_store.records[i], sizeof(mqtt_reliable_record_t));
+		}
+	}
+	s_storeDirty = false;
+}
+
+static void MqttReliable_saveStore()
+{
+	if (!FlashHandler_setDataSync(MQTT_RELIABLE_NAMESPACE, MQTT_RELIABLE_NVS_KEY, &s_storeCopy, sizeof(s_storeCopy))) {
+		log_error("Save pending records fail");
+	}
+}
+
+/*******************************************************************************
+ * Reliable Task
+ ******************************************************************************/
+static void task_reliable(void *arg)
+{
+	char topic[MQTT_RELIABLE_TOPIC_LEN];
+	char data[MQTT_RELIABLE_DATA_LEN];
+
+	while (1)
+	{
+		TickType_t wait = pdMS_TO_TICKS(1000);
+		int idx = -1;
+		uint16_t len = 0;
+
+		xSemaphoreTake(s_reliableLock, portMAX_DELAY);
+		if (s_storeDirty) {
+			MqttReliable_copyStore();
+			xSemaphoreGive(s_reliableLock);
+			MqttReliable_saveStore();
+			xSemaphoreTake(s_reliableLock, portMAX_DELAY);
+		}
+
+		if (!g_isMqttConnected || s_stats.pending == 0) {
+			xSemaphoreGive(s_reliableLock);
+			// chờ có bản tin mới hoặc kết nối lại server
+			ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+			continue;
+		}
+
+		TickType_t now = xTaskGetTickCount();
+		for (uint8_t i = 0; i < MQTT_RELIABLE_MAX_RECORDS; i++) {
+			if (!s_store.records[i].used) {
+				continue;
+			}
+			mqtt_reliable_runtime_t *rt = &s_runtime[i];
+			if ((rt->state != RELIABLE_STATE_IDLE) && (int32_t)(now - rt->nextTick) >= 0) {
+				// hết thời gian chờ PUBACK hoặc chờ server xác nhận: gửi lại sau backoff,
+				// không dồn thêm vào lượt gửi lại QoS1 của esp-mqtt
+				if (rt->state == RELIABLE_STATE_INFLIGHT) {
+					s_stats.inflight--;
+				}
+				TickType_t backoff = MqttReliable_backoff(rt->attempts);
+				log_warning("No ack for %s, retry %d in %lu ms", s_store.records[i].key, rt->attempts, (uint32_t)pdTICKS_TO_MS(backoff));
+				rt->state = RELIABLE_STATE_IDLE;
+				rt->msgId = 0;
+				rt->nextTick = now + backoff;
+				s_stats.retries++;
+			}
+			if ((rt->state == RELIABLE_STATE_IDLE) && (int32_t)(now - rt->nextTick) >= 0) {
+				if (idx < 0 || (int32_t)(s_store.records[i].seq - s_store.records[idx].seq) < 0) {
+					idx = i;
+				}
+			}
+		}
+
+		if ((idx >= 0) && (s_stats.inflight < MQTT_RELIABLE_WINDOW)) {
+			strcpy(topic, s_store.records[idx].topic);
+			len = s_store.records[idx].len;
+			memcpy(data, s_store.records[idx].data, len);
+			s_runtime[idx].state = RELIABLE_STATE_INFLIGHT;
+			if (s_runtime[idx].attempts < UINT8_MAX) {
+				s_runtime[idx].attempts++;
+			}
+			s_runtime[idx].nextTick = now + pdMS_TO_TICKS(MQTT_RELIABLE_ACK_TIMEOUT);
+			s_stats.inflight++;
+		} else {
+			idx = -1;
+		}
+		xSemaphoreGive(s_reliableLock);
+
+		if (idx >= 0) {
+			int msg_id = MQTT_clientPublishPriority(topic, data, len, MQTT_RELIABLE_QOS, MQTT_PRIORITY_HIGH);
+
+			xSemaphoreTake(s_reliableLock, portMAX_DELAY);
+			if (s_runtime[idx].state == RELIABLE_STATE_INFLIGHT) {
+				if (msg_id < 0) {
+					s_runtime[idx].state = RELIABLE_STATE_IDLE;
+					s_runtime[idx].nextTick = xTaskGetTickCount() + MqttReliable_backoff(s_runtime[idx].attempts);
+					s_stats.inflight--;
+				} else {
+					s_runtime[idx].msgId = msg_id;
+					s_stats.sent++;
+				}
+			}
+			xSemaphoreGive(s_reliableLock);
+			wait = 0;
+		}
+
+		ulTaskNotifyTake(pdTRUE, wait);
+	}
+}
+
+/*******************************************************************************
+ * Application Funtions
+ ******************************************************************************/
+void MqttReliable_Initialize()
+{
+	if (s_reliableLock != NULL) {
+		return;
+	}
+	s_reliableLock = xSemaphoreCreateMutex();
+
+	if (FlashHandler_getData(MQTT_RELIABLE_NAMESPACE, MQTT_RELIABLE_NVS_KEY, &s_store) && (s_store.magic == MQTT_RELIABLE_MAGIC)) {
+		for (uint8_t i = 0; i < MQTT_RELIABLE_MAX_RECORDS; i++) {
+			if (s_store.records[i].used) {
+				s_stats.pending++;
+				if ((int32_t)(s_store.records[i].seq - s_seq) >= 0) {
+					s_seq = s_store.records[i].seq + 1;
+				}
+			}
+		}
+		log_warning("Pending records in flash: %lu", s_stats.pending);
+	} else {
+		memset(&s_store, 0, sizeof(s_store));
+	}
+	s_store.magic = MQTT_RELIABLE_MAGIC;
+
+	xTaskCreate(task_reliable, "task_mqttReliable", MQTT_RELIABLE_TASK_STACK, NULL, MQTT_RELIABLE_TASK_PRIORITY, &s_reliableTask);
+}
+
+bool MqttReliable_push(const char *key, const char *topic, const char *data, size_t len, uint8_t flags)
+{
+	if (s_reliableLock == NULL) {
+		log_error("Reliable not initialized");
+		return false;
+	}
+	if ((strlen(key) >= MQTT_RELIABLE_KEY_LEN) || (strlen(topic) >= MQTT_RELIABLE_TOPIC_LEN) || (len > MQTT_RELIABLE_DATA_LEN)) {
+		log_error("Key, topic or data too long: %s", key);
+		return false;
+	}
+
+	xSemaphoreTake(s_reliableLock, portMAX_DELAY);
+	s_stats.pushed++;
+	// cùng key: bản tin mới thay bản tin cũ đang chờ
+	int idx = MqttReliable_find(key);
+	if (idx >= 0) {
+		if (s_runtime[idx].state == RELIABLE_STATE_INFLIGHT) {
+			s_stats.inflight--;
+		}
+		if (s_store.records[idx].flags & MQTT_RELIABLE_FLAG_PERSIST) {
+			s_storeDirty = true;
+		}
+	} else {
+		idx = MqttReliable_findOldest(true);
+		if (idx < 0) {
+			idx = MqttReliable_findOldest(false);
+			log_error("Reliable full, drop: %s", s_store.records[idx].key);
+			if (s_runtime[idx].state == RELIABLE_STATE_INFLIGHT) {
+				s_stats.inflight--;
+			}
+			MqttReliable_remove(idx);
+			s_stats.dropped++;
+		}
+		s_stats.pending++;
+	}
+
+	mqtt_reliable_record_t *record = &s_store.records[idx];
+	record->used = 1;
+	record->flags = flags;
+	record->len = len;
+	record->seq = s_seq++;
+	strcpy(record->key, key);
+	strcpy(record->topic, topic);
+	memcpy(record->data, data, len);
+	memset(&s_runtime[idx], 0, sizeof(mqtt_reliable_runtime_t));
+	s_runtime[idx].nextTick = xTaskGetTickCount();
+
+	bool needSave = (flags & MQTT_RELIABLE_FLAG_PERSIST) || s_storeDirty;
+	if (needSave) {
+		MqttReliable_copyStore();
+	}
+	xSemaphoreGive(s_reliableLock);
+
+	// lưu ngay trước khi trả về, người gọi có thể reset chip ngay sau đó
+	if (needSave) {
+		MqttReliable_saveStore();
+	}
+	MqttReliable_notify();
+	return true;
+}
+
+void MqttReliable_confirm(const char *key)
+{
+	if (s_reliableLock == NULL) {
+		return;
+	}
+	xSemaphoreTake(s_reliableLock, portMAX_DELAY);
+	int idx = MqttReliable_find(key);
+	if (idx >= 0) {
+		if (s_runtime[idx].state == RELIABLE_STATE_INFLIGHT) {
+			s_stats.inflight--;
+		}
+		MqttReliable_remove(idx);
+		s_stats.confirmed++;
+		log_info("Server confirm: %s", key);
+	}
+	xSemaphoreGive(s_reliableLock);
+	MqttReliable_notify();
+}
+
+bool MqttReliable_isPending(const char *key)
+{
+	if (s_reliableLock == NULL) {
+		return false;
+	}
+	xSemaphoreTake(s_reliableLock, portMAX_DELAY);
+	bool pending = (MqttReliable_find(key) >= 0);
+	xSemaphoreGive(s_reliableLock);
+	return pending;
+}
+
+void MqttReliable_notify()
+{
+	if (s_reliableTask != NULL) {
+		xTaskNotifyGive(s_reliableTask);
+	}
+}
+
+void MqttReliable_onConnected()
+{
+	if (s_reliableLock == NULL) {
+		return;
+	}
+	// msg_id của phiên trước không còn giá trị, gửi lại ngay các bản tin chưa xong
+	xSemaphoreTake(s_reliableLock, portMAX_DELAY);
+	TickType_t now = xTaskGetTickCount();
+	for (uint8_t i = 0; i < MQTT_RELIABLE_MAX_RECORDS; i++) {
+		if (s_store.records[i].used) {
+			s_runtime[i].state = RELIABLE_STATE_IDLE;
+			s_runtime[i].msgId = 0;
+			s_runtime[i].nextTick = now;
+		}
+	}
+	s_stats.inflight = 0;
+	xSemaphoreGive(s_reliableLock);
+	MqttReliable_notify();
+}
+
+void MqttReliable_onPublished(int msg_id)
+{
+	if (s_reliableLock == NULL || msg_id <= 0) {
+		return;
+	}
+	xSemaphoreTake(s_reliableLock, portMAX_DELAY);
+	for (uint8_t i = 0; i < MQTT_RELIABLE_MAX_RECORDS; i++) {
+		if (s_store.records[i].used && (s_runtime[i].state == RELIABLE_STATE_INFLIGHT) && (s_runtime[i].msgId == msg_id)) {
+			s_stats.inflight--;
+			s_stats.acked++;
+			if (s_store.records[i].flags & MQTT_RELIABLE_FLAG_APP_ACK) {
+				// broker đã nhận, chờ server phản hồi, quá hạn thì gửi lại với backoff
+				TickType_t timeout = MqttReliable_backoff(s_runtime[i].attempts);
+				if (timeout < pdMS_TO_TICKS(MQTT_RELIABLE_APP_ACK_TIMEOUT)) {
+					timeout = pdMS_TO_TICKS(MQTT_RELIABLE_APP_ACK_TIMEOUT);
+				}
+				s_runtime[i].state = RELIABLE_STATE_WAIT_APP;
+				s_runtime[i].msgId = 0;
+				s_runtime[i].nextTick = xTaskGetTickCount() + timeout;
+			} else {
+				MqttReliable_remove(i);
+			}
+			break;
+		}
+	}
+	xSemaphoreGive(s_reliableLock);
+	MqttReliable_notify();
+}
+
+void MqttReliable_getStats(mqtt_reliable_stats_t *stats)
+{
+	if (s_reliableLock == NULL) {
+		memset(stats, 0, sizeof(mqtt_reliable_stats_t));
+		return;
+	}
+	xSemaphoreTake(s_reliableLock, portMAX_DELAY);
+	memcpy(stats, &s_stats, sizeof(mqtt_reliable_stats_t));
+	xSemaphoreGive(s_reliableLock);
+}
+
+void MqttReliable_printStats()
+{
+	mqtt_reliable_stats_t stats;
+	MqttReliable_getStats(&stats);
+	printf("Mqtt reliable: [pending - %lu] [inflight - %lu] [pushed - %lu] [sent - %lu] [retries - %lu] [acked - %lu] [confirmed - %lu] [dropped - %lu]\n", stats.pending,
+																																						stats.inflight,
+																																						stats.pushed,
+																																						stats.sent,
+																																						stats.retries,
+																																						stats.acked,
+																																						stats.confirmed,
+																																						stats.dropped);
+}
+
+/***********************************************/
@@ -0,0 +1,65 @@
+/**
+ ******************************************************************************
+ * @file    MqttReliable.h
+ * @author  HT EZLife Co.,LTD.
+ * @date    January 1, 2025
+ ******************************************************************************/
+
+#ifndef __MQTT_RELIABLE_H
+#define __MQTT_RELIABLE_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "Global.h"
+
+/* Exported types ------------------------------------------------------------*/
+typedef struct
+{
+	uint32_t pending;
+	uint32_t inflight;
+	uint32_t pushed;
+	uint32_t sent;
+	uint32_t retries;
+	uint32_t acked;
+	uint32_t confirmed;
+	uint32_t dropped;
+} mqtt_reliable_stats_t;
+
+/* Exported macro ------------------------------------------------------------*/
+#define MQTT_RELIABLE_MAX_RECORDS       4
+#define MQTT_RELIABLE_WINDOW            2       // số bản tin QoS1 chờ PUBACK cùng lúc
+#define MQTT_RELIABLE_KEY_LEN           24
+#define MQTT_RELIABLE_TOPIC_LEN         100
+#define MQTT_RELIABLE_DATA_LEN          160
+#define MQTT_RELIABLE_QOS               1
+
+#define MQTT_RELIABLE_ACK_TIMEOUT       10000   // ms chờ PUBACK trước khi gửi lại
+#define MQTT_RELIABLE_BACKOFF_MIN       2000    // ms, nhân đôi sau mỗi lần gửi lại
+#define MQTT_RELIABLE_BACKOFF_MAX       300000
+#define MQTT_RELIABLE_APP_ACK_TIMEOUT   60000   // ms chờ server phản hồi bản tin cần xác nhận
+#define MQTT_RELIABLE_TASK_STACK        (3*1024)
+#define MQTT_RELIABLE_TASK_PRIORITY     4
+
+#define MQTT_RELIABLE_NAMESPACE         "mqtt_reliable"
+#define MQTT_RELIABLE_NVS_KEY           "pending"
+#define MQTT_RELIABLE_MAGIC             0x48545252
+
+// Cờ cho từng bản tin
+#define MQTT_RELIABLE_FLAG_PERSIST      0x01    // lưu NVS, gửi lại sau khi khởi động lại
+#define MQTT_RELIABLE_FLAG_APP_ACK      0x02    // PUBACK chưa đủ, chờ MqttReliable_confirm() từ server
+
+#define MQTT_RELIABLE_KEY_OTA           "PROCESS_OTA"
+#define MQTT_RELIABLE_KEY_ACTIVE        "ACTIVE_DEVICE"
+#define MQTT_RELIABLE_KEY_CERT_CONFIRM  "CERT_CONFIRM"
+
+/* Exported functions ------------------------------------------------------- */
+void MqttReliable_Initialize();
+bool MqttReliable_push(const char *key, const char *topic, const char *data, size_t len, uint8_t flags);
+void MqttReliable_confirm(const char *key);
+bool MqttReliable_isPending(const char *key);
+void MqttReliable_notify();
+void MqttReliable_onConnected();
+void MqttReliable_onPublished(int msg_id);
+void MqttReliable_getStats(mqtt_reliable_stats_t *stats);
+void MqttReliable_printStats();
+
+#endif /* __MQTT_RELIABLE_H */
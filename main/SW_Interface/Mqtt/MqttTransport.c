@@ -0,0 +1,384 @@
+/**
+ ******************************************************************************
+ * @file    MqttTransport.c
+ * @author  HT EZLife Co.,LTD.
+ * @date    January 1, 2025
+ ******************************************************************************/
+/*******************************************************************************
+ * Include
+ ******************************************************************************/
+#include "MqttTransport.h"
+#include "HTG_Utility.h"
+#include "esp_attr.h"
+#include "esp_idf_version.h"
+#include "mbedtls/ssl.h"
+#include <sys/select.h>
+#include <stddef.h>
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define TAG "MQTT_Transport"
+
+#ifndef DISABLE_LOG_ALL
+#define MQTT_TRANSPORT_LOG_INFO_ON
+#endif
+
+#ifdef MQTT_TRANSPORT_LOG_INFO_ON
+#define log_info(format, ...) ESP_LOGI(TAG, format, ##__VA_ARGS__)
+#define log_error(format, ...) ESP_LOGE(TAG, format, ##__VA_ARGS__)
+#define log_warning(format, ...) ESP_LOGW(TAG, format, ##__VA_ARGS__)
+#else
+#define log_info(format, ...)
+#define log_error(format, ...)
+#define log_warning(format, ...)
+#endif
+
+/*******************************************************************************
+ * Typedef Variables
+ ******************************************************************************/
+typedef struct
+{
+	esp_tls_t *tls;
+	int sockfd;
+	const char *cacert;
+	const mqtt_cert_creds_t *creds;     // đọc lúc connect, đổi cert chỉ cần kết nối lại
+} mqtt_transport_ctx_t;
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t len;
+	uint32_t crc;
+	uint8_t data[MQTT_TLS_SESSION_CACHE_LEN];
+} mqtt_tls_session_cache_t;
+
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+// esp_tls_client_session_t là kiểu ẩn của esp-tls (esp_tls_private.h), bên trong chỉ bọc 1 mbedtls_ssl_session.
+// Layout đã kiểm tra với IDF 5.0 - 5.2, đổi IDF phải đối chiếu lại struct esp_tls_client_session
+#if (ESP_IDF_VERSION < ESP_IDF_VERSION_VAL(5, 0, 0)) || (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 3, 0))
+#error "Check esp_tls_client_session layout in esp_tls_private.h before using MqttTransport session cache"
+#endif
+#ifndef CONFIG_ESP_TLS_USING_MBEDTLS
+#error "MqttTransport session cache needs esp-tls on mbedtls"
+#endif
+typedef struct
+{
+	mbedtls_ssl_session saved_session;
+} mqtt_tls_client_session_t;
+_Static_assert(offsetof(mqtt_tls_client_session_t, saved_session) == 0, "saved_session must be the first member");
+#endif
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+// giữ qua soft reset (ESP_resetChip), mất khi mất nguồn
+static RTC_NOINIT_ATTR mqtt_tls_session_cache_t s_sessionCache;
+static mqtt_tls_stats_t s_tlsStats;
+static const uint32_t s_histogramBounds[] = MQTT_TLS_HISTOGRAM_BOUNDS;
+
+/*******************************************************************************
+ * Session Cache
+ ******************************************************************************/
+static bool MqttTransport_sessionCacheValid()
+{
+	if ((s_sessionCache.magic != MQTT_TLS_SESSION_MAGIC) || (s_sessionCache.len == 0) || (s_sessionCache.len > MQTT_TLS_SESSION_CACHE_LEN)) {
+		return false;
+	}
+	return s_sessionCache.crc == ht_check_crc32(s_sessionCache.data, s_sessionCache.len);
+}
+
+void MqttTransport_clearSession()
+{
+	s_sessionCache.magic = 0;
+	s_sessionCache.len = 0;
+}
+
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+static esp_tls_client_session_t *MqttTransport_loadSession()
+{
+	if (!MqttTransport_sessionCacheValid()) {
+		return NULL;
+	}
+	mqtt_tls_client_session_t *session = (mqtt_tls_client_session_t *)calloc(1, sizeof(mqtt_tls_client_session_t));
+	if (session == NULL) {
+		return NULL;
+	}
+	mbedtls_ssl_session_init(&session->saved_session);
+	int ret = mbedtls_ssl_session_load(&session->saved_session, s_sessionCache.data, s_sessionCache.len);
+	if (ret != 0) {
+		log_error("Load tls session failed: -0x%04X", -ret);
+		MqttTransport_clearSession();
+		esp_tls_free_client_session((esp_tls_client_session_t *)session);
+		return NULL;
+	}
+	return (esp_tls_client_session_t *)session;
+}
+
+static void MqttTransport_saveSession(esp_tls_t *tls)
+{
+	mbedtls_ssl_context *ssl = (mbedtls_ssl_context *)esp_tls_get_ssl_context(tls);
+	mbedtls_ssl_session session;
+	size_t olen = 0;
+
+	mbedtls_ssl_session_init(&session);
+	int ret = mbedtls_ssl_get_session(ssl, &session);
+	if (ret == 0) {
+		ret = mbedtls_ssl_session_save(&session, s_sessionCache.data, MQTT_TLS_SESSION_CACHE_LEN, &olen);
+	}
+	// olen = số byte session cần, kể cả khi lỗi MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL
+	s_tlsStats.sessionLen = olen;
+	if (ret == 0) {
+		log_info("Tls session saved %u/%u bytes", (unsigned)olen, MQTT_TLS_SESSION_CACHE_LEN);
+		s_sessionCache.len = olen;
+		s_sessionCache.crc = ht_check_crc32(s_sessionCache.data, olen);
+		s_sessionCache.magic = MQTT_TLS_SESSION_MAGIC;
+	} else {
+		log_error("Save tls session failed: -0x%04X, need %u/%u bytes", -ret, (unsigned)olen, MQTT_TLS_SESSION_CACHE_LEN);
+		MqttTransport_clearSession();
+	}
+	mbedtls_ssl_session_free(&session);
+}
+
+// Session resume giữ nguyên thời điểm bắt đầu của session cũ, handshake đầy đủ tạo session mới
+static bool MqttTransport_isSessionResumed(esp_tls_client_session_t *offered, esp_tls_t *tls)
+{
+	if (offered == NULL) {
+		return false;
+	}
+	mbedtls_ssl_context *ssl = (mbedtls_ssl_context *)esp_tls_get_ssl_context(tls);
+	mbedtls_ssl_session session;
+	bool resumed = false;
+
+	mbedtls_ssl_session_init(&session);
+	if (mbedtls_ssl_get_session(ssl, &session) == 0) {
+		mbedtls_ssl_session *saved = &((mqtt_tls_client_session_t *)offered)->saved_session;
+		resumed = (session.MBEDTLS_PRIVATE(start) == saved->MBEDTLS_PRIVATE(start));
+	}
+	mbedtls_ssl_session_free(&session);
+	return resumed;
+}
+#endif
+
+static void MqttTransport_recordHandshake(uint32_t duration_ms)
+{
+	uint8_t idx = 0;
+	while ((idx < (sizeof(s_histogramBounds)/sizeof(s_histogramBounds[0]))) && (duration_ms > s_histogramBounds[idx])) {
+		idx++;
+	}
+	s_tlsStats.histogram[idx]++;
+	s_tlsStats.handshakes++;
+	s_tlsStats.lastHandshakeMs = duration_ms;
+}
+
+/*******************************************************************************
+ * Transport Functions
+ ******************************************************************************/
+static int MqttTransport_poll(mqtt_transport_ctx_t *ctx, int timeout_ms, bool isRead)
+{
+	fd_set fdset, errset;
+	struct timeval timeout = {
+		.tv_sec = timeout_ms/1000,
+		.tv_usec = (timeout_ms%1000)*1000,
+	};
+
+	FD_ZERO(&fdset);
+	FD_ZERO(&errset);
+	FD_SET(ctx->sockfd, &fdset);
+	FD_SET(ctx->sockfd, &errset);
+	int ret = select(ctx->sockfd + 1, isRead ? &fdset : NULL, isRead ? NULL : &fdset, &errset, (timeout_ms >= 0) ? &timeout : NULL);
+	if ((ret > 0) && FD_ISSET(ctx->sockfd, &errset)) {
+		log_error("Poll socket error");
+		return -1;
+	}
+	return ret;
+}
+
+static int MqttTransport_pollRead(esp_transport_handle_t t, int timeout_ms)
+{
+	mqtt_transport_ctx_t *ctx = esp_transport_get_context_data(t);
+	if (ctx->tls == NULL) {
+		return -1;
+	}
+	if (esp_tls_get_bytes_avail(ctx->tls) > 0) {
+		return 1;
+	}
+	return MqttTransport_poll(ctx, timeout_ms, true);
+}
+
+static int MqttTransport_pollWrite(esp_transport_handle_t t, int timeout_ms)
+{
+	mqtt_transport_ctx_t *ctx = esp_transport_get_context_data(t);
+	if (ctx->tls == NULL) {
+		return -1;
+	}
+	return MqttTransport_poll(ctx, timeout_ms, false);
+}
+
+static int MqttTransport_close(esp_transport_handle_t t)
+{
+	mqtt_transport_ctx_t *ctx = esp_transport_get_context_data(t);
+	if (ctx->tls != NULL) {
+		esp_tls_conn_destroy(ctx->tls);
+		ctx->tls = NULL;
+	}
+	ctx->sockfd = -1;
+	return 0;
+}
+
+static int MqttTransport_connect(esp_transport_handle_t t, const char *host, int port, int timeout_ms)
+{
+	mqtt_transport_ctx_t *ctx = esp_transport_get_context_data(t);
+	esp_tls_client_session_t *session = NULL;
+	bool resumed = false;
+
+	MqttTransport_close(t);
+	ctx->tls = esp_tls_init();
+	if (ctx->tls == NULL) {
+		log_error("Init esp tls failed");
+		return -1;
+	}
+
+	esp_tls_cfg_t cfg = {
+		.cacert_buf = (const unsigned char *)ctx->cacert,
+		.cacert_bytes = strlen(ctx->cacert) + 1,
+		.clientcert_buf = ctx->creds->cert,
+		.clientcert_bytes = ctx->creds->certLen,
+		.clientkey_buf = ctx->creds->key,
+		.clientkey_bytes = ctx->creds->keyLen,
+		.timeout_ms = timeout_ms,
+	};
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+	session = MqttTransport_loadSession();
+	cfg.client_session = session;
+#endif
+
+	int64_t timeStart = esp_timer_get_time();
+	if (esp_tls_conn_new_sync(host, strlen(host), port, &cfg, ctx->tls) <= 0) {
+		log_error("TLS connect to %s:%d failed", host, port);
+		s_tlsStats.handshakeFail++;
+		// session cũ có thể đã bị server huỷ, lần sau handshake đầy đủ
+		MqttTransport_clearSession();
+		if (session != NULL) {
+			esp_tls_free_client_session(session);
+		}
+		MqttTransport_close(t);
+		return -1;
+	}
+	uint32_t duration_ms = (uint32_t)((esp_timer_get_time() - timeStart)/1000);
+	MqttTransport_recordHandshake(duration_ms);
+
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+	resumed = MqttTransport_isSessionResumed(session, ctx->tls);
+	if (resumed) {
+		s_tlsStats.sessionHit++;
+	} else {
+		s_tlsStats.sessionMiss++;
+	}
+	MqttTransport_saveSession(ctx->tls);
+	if (session != NULL) {
+		esp_tls_free_client_session(session);
+	}
+#else
+	s_tlsStats.sessionMiss++;
+#endif
+	log_warning("TLS handshake %lu ms, session %s", duration_ms, resumed ? "resumed" : "full");
+
+	esp_tls_get_conn_sockfd(ctx->tls, &ctx->sockfd);
+	return 0;
+}
+
+static int MqttTransport_read(esp_transport_handle_t t, char *buffer, int len, int timeout_ms)
+{
+	mqtt_transport_ctx_t *ctx = esp_transport_get_context_data(t);
+	if (ctx->tls == NULL) {
+		return -1;
+	}
+	if (esp_tls_get_bytes_avail(ctx->tls) <= 0) {
+		int poll = MqttTransport_pollRead(t, timeout_ms);
+		if (poll <= 0) {
+			return poll;
+		}
+	}
+	int ret = esp_tls_conn_read(ctx->tls, (unsigned char *)buffer, len);
+	if (ret == ESP_TLS_ERR_SSL_WANT_READ || ret == ESP_TLS_ERR_SSL_TIMEOUT) {
+		return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+	}
+	if (ret == 0) {
+		return ERR_TCP_TRANSPORT_CONNECTION_CLOSED_BY_FIN;
+	}
+	if (ret < 0) {
+		log_error("TLS read error: -0x%04X", -ret);
+	}
+	return ret;
+}
+
+static int MqttTransport_write(esp_transport_handle_t t, const char *buffer, int len, int timeout_ms)
+{
+	mqtt_transport_ctx_t *ctx = esp_transport_get_context_data(t);
+	int poll = MqttTransport_pollWrite(t, timeout_ms);
+	if (poll <= 0) {
+		return poll;
+	}
+	int ret = esp_tls_conn_write(ctx->tls, (const unsigned char *)buffer, len);
+	if (ret < 0) {
+		log_error("TLS write error: -0x%04X", -ret);
+	}
+	return ret;
+}
+
+static int MqttTransport_destroy(esp_transport_handle_t t)
+{
+	MqttTransport_close(t);
+	free(esp_transport_get_context_data(t));
+	return 0;
+}
+
+/*******************************************************************************
+ * Application Funtions
+ ******************************************************************************/
+esp_transport_handle_t MqttTransport_create(const char *cacert, const mqtt_cert_creds_t *creds)
+{
+	mqtt_transport_ctx_t *ctx = (mqtt_transport_ctx_t *)calloc(1, sizeof(mqtt_transport_ctx_t));
+	if (ctx == NULL) {
+		return NULL;
+	}
+	esp_transport_handle_t t = esp_transport_init();
+	if (t == NULL) {
+		free(ctx);
+		return NULL;
+	}
+	ctx->sockfd = -1;
+	ctx->cacert = cacert;
+	ctx->creds = creds;
+
+	esp_transport_set_context_data(t, ctx);
+	esp_transport_set_default_port(t, MQTT_TLS_DEFAULT_PORT);
+	esp_transport_set_func(t, MqttTransport_connect, MqttTransport_read, MqttTransport_write, MqttTransport_close, MqttTransport_pollRead, MqttTransport_pollWrite, MqttTransport_destroy);
+
+	log_warning("TLS session in RTC memory: %s", MqttTransport_sessionCacheValid() ? "yes" : "no");
+	return t;
+}
+
+void MqttTransport_getStats(mqtt_tls_stats_t *stats)
+{
+	memcpy(stats, &s_tlsStats, sizeof(mqtt_tls_stats_t));
+}
+
+void MqttTransport_printStats()
+{
+	printf("Mqtt tls: [handshake - %lu] [hit - %lu] [miss - %lu] [fail - %lu] [last - %lu ms] [session - %lu B] [<=250 - %lu] [<=500 - %lu] [<=1000 - %lu] [<=2000 - %lu] [<=4000 - %lu] [>4000 - %lu]\n", s_tlsStats.handshakes,
+																																								s_tlsStats.sessionHit,
+																																								s_tlsStats.sessionMiss,
+																																								s_tlsStats.handshakeFail,
+																																								s_tlsStats.lastHandshakeMs,
+																																								s_tlsStats.sessionLen,
+																																								s_tlsStats.histogram[0],
+																																								s_tlsStats.histogram[1],
+																																								s_tlsStats.histogram[2],
+																																								s_tlsStats.histogram[3],
+																																								s_tlsStats.histogram[4],
+																																								s_tlsStats.histogram[5]);
+}
+
+/***********************************************/
@@ -0,0 +1,50 @@
+/**
+ ******************************************************************************
+ * @file    MqttTransport.h
+ * @author  HT EZLife Co.,LTD.
+ * @date    January 1, 2025
+ ******************************************************************************/
+
+#ifndef __MQTT_TRANSPORT_H
+#define __MQTT_TRANSPORT_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "Global.h"
+#include "esp_transport.h"
+#include "MqttCert.h"
+
+/* Exported types ------------------------------------------------------------*/
+typedef struct
+{
+	uint32_t handshakes;
+	uint32_t sessionHit;
+	uint32_t sessionMiss;
+	uint32_t handshakeFail;
+	uint32_t lastHandshakeMs;
+	uint32_t sessionLen;            // số byte mbedtls_ssl_session_save cần ở lần lưu gần nhất
+	uint32_t histogram[6];
+} mqtt_tls_stats_t;
+
+/* Exported macro ------------------------------------------------------------*/
+// Tái sử dụng TLS session (session ticket / session id) khi kết nối lại AWS IoT
+#define MQTT_TLS_SESSION_RESUME_ENABLE
+#ifdef CONFIG_MBEDTLS_SSL_KEEP_PEER_CERTIFICATE
+// session lưu nguyên cert DER của broker (cert ATS của AWS IoT ~1.5-2 KB), dễ vượt cache
+#define MQTT_TLS_SESSION_CACHE_LEN          2048
+#else
+// header 8 + start 8 + suite 2 + id 33 + master 48 + digest cert 34 + ticket (3 + ticket + 4) + cờ 2
+#define MQTT_TLS_SESSION_CACHE_LEN          512
+#endif
+#define MQTT_TLS_SESSION_MAGIC              0x48545453
+#define MQTT_TLS_DEFAULT_PORT               8883
+
+// Giới hạn trên (ms) các khoảng histogram thời gian handshake, khoảng cuối là lớn hơn
+#define MQTT_TLS_HISTOGRAM_BOUNDS           {250, 500, 1000, 2000, 4000}
+
+/* Exported functions ------------------------------------------------------- */
+esp_transport_handle_t MqttTransport_create(const char *cacert, const mqtt_cert_creds_t *creds);
+void MqttTransport_clearSession();
+void MqttTransport_getStats(mqtt_tls_stats_t *stats);
+void MqttTransport_printStats();
+
+#endif /* __MQTT_TRANSPORT_H */
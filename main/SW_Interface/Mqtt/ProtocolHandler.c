@@ -9,6 +9,7 @@
  ******************************************************************************/
 #include "ProtocolHandler.h"
 #include "MqttHandler.h"
+#include "MqttCert.h"
 #include "BLE_handler.h"
 #include "HttpHandler.h"
 #include "FlashHandler.h"
@@ -16,9 +17,16 @@
 #include "timeCheck.h"
 #include "gateway_config.h"
 #include "OTA_http.h"
+#include "OTA_decode.h"
+#include "OTA_health.h"
+#include "OTA_ble.h"
 #include "myCronJob.h"
 #include "OutputControl.h"
 #include "HTG_Utility.h"
+#include "MqttQueue.h"
+#include "MqttReliable.h"
+#include "esp_attr.h"
+#include <stddef.h>
 
 /*******************************************************************************
  * Definitions
@@ -44,7 +52,10 @@
  ******************************************************************************/
 extern bool begin_active_device, end_active_device;
 extern bool needCheckVersionEspOTA;
+extern bool needSendInfoMqtt;
+extern bool needUpdateDataActived;
 extern bool g_mqttHaveNewCertificate;
+extern bool g_isMqttConnected;
 extern char topic_filter[2][30];
 extern char g_product_Id[PRODUCT_ID_LEN];
 
@@ -56,9 +67,6 @@ bool checkStateOtaEsp = false;
 char *s_linkDownload = NULL;
 char *s_signature = NULL;
 
-uint16_t lenCert = 0;
-uint16_t lenKey = 0;
-
 versionFwOld versionFwOld_t = {
 	.versionEspOld = 0,
 };
@@ -68,6 +76,16 @@ confirmEndOta confirmEndOta_t = {
 };
 mqtt_certKey_t *pMqttCertKey = NULL;
 
+// giữ qua soft reset: lệnh LINK_UPDATE gửi lại sau khi OTA xong reset chip không chạy lại
+static RTC_NOINIT_ATTR cmd_dedup_cache_t s_dedupCache;
+static cmd_latency_stats_t s_latencyStats;
+static int64_t s_latencyLastReportUs = 0;
+static int64_t s_flashLastReportUs = 0;
+static uint32_t s_flashLastNvsWrites = 0;
+static uint32_t s_flashLastCommits = 0;
+static uint32_t s_bleHeapReportedSeq = 0;
+static const uint32_t s_latencyBounds[] = CMD_LATENCY_HISTOGRAM_BOUNDS;
+
 /*******************************************************************************
  * Prototypes
  ******************************************************************************/
@@ -81,19 +99,36 @@ void sendStatusCronjob(uint8_t valueSend)
 /*******************************************************************************
  * Task Process Update Firmware
  ******************************************************************************/
+// callback từ task tải OTA, đã throttle theo thời gian và % trong OTA_http
+static void reportOtaProgress(const ota_progress_t *progress)
+{
+	char data_send[sizeof(confirmEndOta_t.dataSend)];
+	snprintf(data_send, sizeof(data_send), "{\"Begin\":1,\"End\":0,\"Status\":\"Ota_Progress\",\"Pct\":%d,\"Off\":%lu,\"Total\":%lu,\"Bps\":%lu,\"Retry\":%d,\"Resume\":%d}",
+																											(progress->percent == OTA_PROGRESS_PERCENT_UNKNOWN) ? -1 : progress->percent,
+																											progress->offset,
+																											progress->total,
+																											progress->bytesPerSec,
+																											progress->retries,
+																											progress->resumes);
+	MQTT_PublishProgressFirmware(data_send);
+}
+
 static void task_processUF(void *arg)
 {
 	s_taskUpdateFirmware = true;
 	log_warning("Begin task process update firmware");
 
 	log_warning(" --> OTA For ESP");
-	char data_send[100] = "{\"Begin\":1,\"End\":0,\"Status\":\"Check_Data_Valid\"}";
+	// "Manifest": theo dõi LINK_UPDATE còn thiếu sha256/imageSig trước khi bật OTA_IMAGE_SIGN_REQUIRED
+	char data_send[100];
+	snprintf(data_send, sizeof(data_send), "{\"Begin\":1,\"End\":0,\"Status\":\"Check_Data_Valid\",\"Manifest\":\"%s\"}", OTA_http_hasManifest() ? "signed" : "missing");
 	MQTT_PublishStateUpdateFirmware(data_send);
 
 	needCheckVersionEspOTA = false;
 	checkStateOtaEsp = true;
 	Flash_saveStateOtaEsp();
 
+	OTA_http_setProgressCallback(reportOtaProgress);
 	OTA_http_DoOTA(s_linkDownload, PHASE_OTA_ESP);
 
 	vTaskDelay(2000/portTICK_PERIOD_MS);
@@ -116,44 +151,40 @@ void progressUpdateFirmware()
 	versionFwOld_t.versionEspOld = FIRM_VER;
 	Flash_saveOldVersionFirmware();
 
-	BLE_releaseBle();
+	BLE_releaseForDownload();
+	// gói delta nhỏ có thể xong và reset trước chu kỳ báo cáo kế tiếp
+	ht_reportBleHeap();
 	vTaskDelay(1000/portTICK_PERIOD_MS);
 
 	xTaskCreate(task_processUF, "task_processUF", 4*1024, NULL, 5, NULL);
 }
 
-static void task_checkStateServer(void *arg) 
-{
-	uint8_t delayTimeSendStateOta = 0;
-
-	log_warning("Begin task check state server");
-	while (confirmEndOta_t.state)
-	{
-		if (delayTimeSendStateOta == 0) {
-			MQTT_PublishStateUpdateFirmware(confirmEndOta_t.dataSend);
-		}
-		if (delayTimeSendStateOta >= 60) {
-			delayTimeSendStateOta = 0;
-		}
-		delayTimeSendStateOta++;
-		vTaskDelay(1000/portTICK_PERIOD_MS);
-	}
-
-	log_warning("Delete task check state server");
-	vTaskDelay(100/portTICK_PERIOD_MS);
-	vTaskDelete(NULL);
-}
-
 void checkEndOtaFromServer()
 {
-	xTaskCreate(task_checkStateServer, "task_checkStateServer", 2048, NULL, 5, NULL);
+	// bản tin kết thúc OTA đã nằm trong MqttReliable (NVS) thì không đẩy lại
+	if (!MqttReliable_isPending(MQTT_RELIABLE_KEY_OTA)) {
+		MQTT_PublishStateEndFirmware(confirmEndOta_t.dataSend);
+	}
 }
 
 void checkUpdateVerFwEsp()
 {
+	ota_health_record_t healthRecord;
+
     if (versionFwOld_t.versionEspOld != FIRM_VER) {
-		char data_send[100] = "{\"Begin\":0,\"End\":1,\"Status\":\"Ota_Success\"}";
-	    MQTT_PublishStateUpdateFirmware(data_send);
+		char data_send[sizeof(confirmEndOta_t.dataSend)] = "{\"Begin\":0,\"End\":1,\"Status\":\"Ota_Success\"}";
+		ota_result_t otaResult;
+		if (OTA_http_getLastResult(&otaResult)) {
+			// kèm kiểu gói, số byte đã tải (kể cả tải lại do mất kết nối/reset), thời gian tải và thời gian từ boot tới valid
+			snprintf(data_send, sizeof(data_send), "{\"Begin\":0,\"End\":1,\"Status\":\"Ota_Success\",\"Fmt\":\"%s\",\"Download\":%lu,\"Redownload\":%lu,\"Resume\":%d,\"Ms\":%lu,\"Valid\":%lu}",
+																											OtaDecode_formatName(otaResult.format),
+																											otaResult.downloaded,
+																											(otaResult.downloaded > otaResult.transferSize) ? otaResult.downloaded - otaResult.transferSize : 0,
+																											otaResult.resumes,
+																											otaResult.elapsedMs,
+																											OtaHealth_getTimeToValid());
+		}
+	    MQTT_PublishStateEndFirmware(data_send);
 
 		confirmEndOta_t.state = true;
 		strcpy(confirmEndOta_t.dataSend, data_send);
@@ -164,8 +195,13 @@ void checkUpdateVerFwEsp()
 
 		checkStateOtaEsp = false;
     	Flash_saveStateOtaEsp();
-    } else {
-		reportOtaFailure();
+    } else if (OtaHealth_getRollback(&healthRecord)) {
+		reportOtaRollback(&healthRecord);
+	} else {
+		OTA_http_setProgressCallback(reportOtaProgress);
+		if (!OTA_http_resume()) {
+			reportOtaFailure();
+		}
 	}
 }
 
@@ -184,10 +220,30 @@ void reportOtaCheckDataInvalid()
 	}
 }
 
+// image mới không đạt các mốc health trong deadline, bootloader đã quay lại image này
+void reportOtaRollback(const ota_health_record_t *record)
+{
+	char data_send[sizeof(confirmEndOta_t.dataSend)];
+	snprintf(data_send, sizeof(data_send), "{\"Begin\":0,\"End\":1,\"Status\":\"Ota_Rollback\",\"Ver\":%d,\"Missing\":%d,\"Ms\":%lu}",
+																											record->firmVer,
+																											OTA_HEALTH_MILESTONE_ALL & ~record->milestones,
+																											record->elapsedMs);
+	MQTT_PublishStateEndFirmware(data_send);
+
+	confirmEndOta_t.state = true;
+	strcpy(confirmEndOta_t.dataSend, data_send);
+	Flash_saveStateEndOta();
+
+	checkStateOtaEsp = false;
+	Flash_saveStateOtaEsp();
+	OTA_http_clearResume();
+	OtaHealth_clearRecord();
+}
+
 void reportOtaFailure()
 {
 	char data_send[100] = "{\"Begin\":0,\"End\":1,\"Status\":\"Ota_Fail\"}";
-	MQTT_PublishStateUpdateFirmware(data_send);
+	MQTT_PublishStateEndFirmware(data_send);
 
 	confirmEndOta_t.state = true;
 	strcpy(confirmEndOta_t.dataSend, data_send);
@@ -195,20 +251,199 @@ void reportOtaFailure()
 
 	checkStateOtaEsp = false;
 	Flash_saveStateOtaEsp();
+	OTA_http_clearResume();
 	ESP_resetChip();
 }
 
 /*******************************************************************************
  * Process Data Receive From Server
  ******************************************************************************/
-void ht_processCmd(char *data)
+void ht_processFullSync()
 {
+	// bỏ trạng thái đã xác nhận, publish lại toàn bộ thông tin thiết bị
+	MqttQueue_requestFullSync();
+	needSendInfoMqtt = true;
+	needUpdateDataActived = true;
+#ifndef MQTT_HELLO_DOCUMENT_ENABLE
+	Out_publishStateRelayDefault();
+#endif
+}
+
+static void ht_checkDedupCache()
+{
+	if ((s_dedupCache.magic != CMD_DEDUP_MAGIC) || (s_dedupCache.next >= CMD_DEDUP_MAX) || (s_dedupCache.crc != ht_check_crc32((uint8_t *)&s_dedupCache, offsetof(cmd_dedup_cache_t, crc)))) {
+		memset(&s_dedupCache, 0, sizeof(s_dedupCache));
+		s_dedupCache.magic = CMD_DEDUP_MAGIC;
+		s_dedupCache.crc = ht_check_crc32((uint8_t *)&s_dedupCache, offsetof(cmd_dedup_cache_t, crc));
+	}
+}
+
+static cmd_dedup_entry_t *ht_findRequest(const char *rid, const char *property)
+{
+	for (uint8_t i = 0; i < CMD_DEDUP_MAX; i++) {
+		if ((strcmp(s_dedupCache.entries[i].rid, rid) == 0) && (strcmp(s_dedupCache.entries[i].property, property) == 0)) {
+			return &s_dedupCache.entries[i];
+		}
+	}
+	return NULL;
+}
+
+static int64_t ht_epochMs(int64_t timerUs)
+{
+	if (!checkRealTimeLocal()) {
+		return 0;
+	}
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (int64_t)tv.tv_sec*1000 + tv.tv_usec/1000 - (esp_timer_get_time() - timerUs)/1000;
+}
+
+static void ht_recordLatency(uint32_t latencyUs)
+{
+	uint8_t idx = 0;
+	while ((idx < (sizeof(s_latencyBounds)/sizeof(s_latencyBounds[0]))) && (latencyUs > s_latencyBounds[idx])) {
+		idx++;
+	}
+	s_latencyStats.histogram[idx]++;
+	s_latencyStats.count++;
+	s_latencyStats.sumUs += latencyUs;
+	if (latencyUs > s_latencyStats.maxUs) {
+		s_latencyStats.maxUs = latencyUs;
+	}
+}
+
+static cmd_dedup_entry_t *ht_saveRequest(const char *rid, const char *property, cmd_result_t result, int64_t recvUs, int64_t actUs)
+{
+	cmd_dedup_entry_t *entry = &s_dedupCache.entries[s_dedupCache.next];
+	s_dedupCache.next = (s_dedupCache.next + 1) % CMD_DEDUP_MAX;
+	strcpy(entry->rid, rid);
+	strcpy(entry->property, property);
+	entry->result = result;
+	entry->latencyUs = (uint32_t)(actUs - recvUs);
+	entry->recvMs = ht_epochMs(recvUs);
+	entry->actMs = ht_epochMs(actUs);
+	s_dedupCache.crc = ht_check_crc32((uint8_t *)&s_dedupCache, offsetof(cmd_dedup_cache_t, crc));
+	return entry;
+}
+
+static void ht_publishAck(cmd_dedup_entry_t *entry)
+{
+	char pData[160] = "";
+	sprintf(pData, "{\"%s\":\"%s\",\"r\":%d,\"rt\":%lld,\"at\":%lld,\"lat\":%lu}", CMD_REQUEST_ID_KEY, entry->rid, entry->result, entry->recvMs, entry->actMs, entry->latencyUs);
+	MQTT_PublishAck(entry->property, pData, entry->rid);
+}
+
+// lấy "rid" của lệnh, không có hoặc quá dài thì xử lý như lệnh cũ (không dedup, không ack)
+static bool ht_getRequestId(cJSON *msgObject, char *rid)
+{
+	cJSON *ridItem = cJSON_GetObjectItem(msgObject, CMD_REQUEST_ID_KEY);
+	if (cJSON_IsString(ridItem) && (ridItem->valuestring != NULL) && (strlen(ridItem->valuestring) > 0) && (strlen(ridItem->valuestring) < CMD_REQUEST_ID_LEN)) {
+		strcpy(rid, ridItem->valuestring);
+		return true;
+	}
+	if (cJSON_IsNumber(ridItem)) {
+		// chỉ nhận số nguyên biểu diễn chính xác bằng double (|rid| <= 2^53)
+		double value = ridItem->valuedouble;
+		if ((value > CMD_REQUEST_ID_NUM_MAX) || (value < -CMD_REQUEST_ID_NUM_MAX) || (value != (double)(int64_t)value)) {
+			log_error("Invalid numeric rid");
+			return false;
+		}
+		int len = snprintf(rid, CMD_REQUEST_ID_LEN, "%lld", (long long)value);
+		return (len > 0) && (len < CMD_REQUEST_ID_LEN);
+	}
+	return false;
+}
+
+static cmd_result_t ht_processLinkFirmware(cJSON *msgObject)
+{
+	if (OtaBle_isActive()) {
+		// không đổi manifest đang dùng cho BLE OTA, không tắt Bluedroid giữa lúc truyền
+		log_error("BLE OTA is running");
+		return CMD_RESULT_BUSY;
+	}
+	if (s_taskUpdateFirmware || (s_linkDownload != NULL)) {
+		// đang OTA: không tải lại, không ghi đè link đang dùng
+		log_error("Task process update firmware is running");
+		return CMD_RESULT_BUSY;
+	}
+	if (OtaHealth_isPending()) {
+		// image mới chưa valid: partition còn lại là image cũ để rollback, không được ghi đè
+		log_error("Firmware pending verify, reject OTA");
+		return CMD_RESULT_BUSY;
+	}
+	if (!cJSON_HasObjectItem(msgObject, "d")) {
+		return CMD_RESULT_INVALID;
+	}
+	cJSON *dataItem = cJSON_GetObjectItem(msgObject, "d");
+	if (cJSON_HasObjectItem(dataItem, "url") && cJSON_HasObjectItem(dataItem, "signature")) {
+		char *url = cJSON_GetObjectItem(dataItem, "url")->valuestring;
+		char *sig = cJSON_GetObjectItem(dataItem, "signature")->valuestring;
+		
+		if (url != NULL && sig != NULL) {
+			char key_ota[20] = "";
+			uint32_t crc32_sn = ht_check_crc32_sn_device();
+			sprintf(key_ota, "HT-%08lx", crc32_sn);
+			// log_warning("Key OTA: \"%s\"", key_ota);
+
+			s_linkDownload = (char*)calloc(strlen(url) + 1, 1);
+			strcpy(s_linkDownload, url);
+			s_signature = (char*)calloc(strlen(sig) + 1, 1);
+			strcpy(s_signature, sig);
+
+			log_warning("URL: ");
+			printf(" \"%s\"\n", s_linkDownload);
+			log_warning("Signature: ");
+			printf(" \"%s\"\n", s_signature);
+
+			// HMAC chỉ xác thực URL, nội dung image xác thực bằng SHA-256 + chữ ký trong manifest
+			cJSON *shaItem = cJSON_GetObjectItem(dataItem, "sha256");
+			cJSON *imageSigItem = cJSON_GetObjectItem(dataItem, "imageSig");
+			char *imageSha = cJSON_IsString(shaItem) ? shaItem->valuestring : NULL;
+			char *imageSig = cJSON_IsString(imageSigItem) ? imageSigItem->valuestring : NULL;
+
+			if (verify_ota_signature(MODEL_NAME, s_linkDownload, s_signature, key_ota) && OTA_http_setManifest(imageSha, imageSig)) {
+				log_warning("Signature verification successful");
+				progressUpdateFirmware();
+				return CMD_RESULT_OK;
+			} else {
+				log_error("OTA signature verification failed");
+				reportOtaCheckDataInvalid();
+			}
+		} else {
+			log_error("URL or Signature is NULL");
+			reportOtaCheckDataInvalid();
+		}
+	} else {
+		log_error("URL or Signature not found in message");
+		reportOtaCheckDataInvalid();
+	}
+	return CMD_RESULT_INVALID;
+}
+
+void ht_processCmd(char *data, int64_t recvUs)
+{
+	cmd_result_t result = CMD_RESULT_OK;
+	int64_t actUs = 0;
+	char rid[CMD_REQUEST_ID_LEN] = "";
+
 	cJSON *msgObject = cJSON_Parse(data);
 	if (msgObject == NULL) {
 		log_error("CJSON_Parse unsuccess!");
 		return;
 	}
 
+	bool hasRequestId = ht_getRequestId(msgObject, rid);
+	if (hasRequestId) {
+		ht_checkDedupCache();
+		cmd_dedup_entry_t *entry = ht_findRequest(rid, topic_filter[PROPERTY_CODE]);
+		if (entry != NULL) {
+			log_warning("Duplicate request %s/%s, resend ack", entry->property, rid);
+			ht_publishAck(entry);
+			cJSON_Delete(msgObject);
+			return;
+		}
+	}
+
 	if (strcmp(topic_filter[EVENT_TYPE], EVT_CONTROL_PROPERTY) == 0) {
 		// event type: control property (CP)
 		if (strcmp(topic_filter[PROPERTY_CODE], PROPERTY_CODE_ACTIVE_DEVICE) == 0) {
@@ -218,12 +453,17 @@ void ht_processCmd(char *data)
 				}
 			}
 		} else if (strcmp(topic_filter[PROPERTY_CODE], PROPERTY_CODE_S_SWITCH) == 0) {
+			result = CMD_RESULT_INVALID;
 			if (cJSON_HasObjectItem(msgObject, "d")) {
 				cJSON *dataItem = cJSON_GetObjectItem(msgObject, "d");
 				if (cJSON_HasObjectItem(dataItem, "id") && cJSON_HasObjectItem(dataItem, "state")) {
 					uint8_t id = atoi(cJSON_GetObjectItem(dataItem, "id")->valuestring);
 					uint8_t state = atoi(cJSON_GetObjectItem(dataItem, "state")->valuestring);
-					Out_setRelay(id - 1, state);
+					if ((id >= 1) && (id <= BUTTON_MAX)) {
+						Out_setRelay(id - 1, state);
+						actUs = esp_timer_get_time();
+						result = CMD_RESULT_OK;
+					}
 				}
 			}
 		}
@@ -239,62 +479,137 @@ void ht_processCmd(char *data)
 					// chưa xử lý
 				}
 			}
+		} else if (strcmp(topic_filter[PROPERTY_CODE], PROPERTY_CODE_FULL_SYNC) == 0) {
+			log_warning("Server request full sync");
+			ht_processFullSync();
+		} else if (strcmp(topic_filter[PROPERTY_CODE], PROPERTY_CODE_ENCODING) == 0) {
+			result = CMD_RESULT_INVALID;
+			cJSON *dataItem = cJSON_GetObjectItem(msgObject, "d");
+			if (cJSON_IsString(dataItem)) {
+				if (strcmp(dataItem->valuestring, MQTT_PAYLOAD_ENCODING_CBOR_STR) == 0) {
+					result = MQTT_setPayloadEncoding(MQTT_PAYLOAD_CBOR) ? CMD_RESULT_OK : CMD_RESULT_UNSUPPORTED;
+				} else if (strcmp(dataItem->valuestring, MQTT_PAYLOAD_ENCODING_JSON_STR) == 0) {
+					result = MQTT_setPayloadEncoding(MQTT_PAYLOAD_JSON) ? CMD_RESULT_OK : CMD_RESULT_UNSUPPORTED;
+				}
+			}
+			if (result == CMD_RESULT_OK) {
+				// gửi lại trạng thái theo định dạng mới
+				ht_processFullSync();
+			}
+		} else {
+			result = CMD_RESULT_UNSUPPORTED;
 		}
 	} else if (strcmp(topic_filter[EVENT_TYPE], EVT_UPDATE_FIRMWARE) == 0) {
 		// event type: update firmware (UF)
 		if (strcmp(topic_filter[PROPERTY_CODE], PROPERTY_CODE_LINK_FIRMWARE) == 0) {
-			if (cJSON_HasObjectItem(msgObject, "d")) {
-				cJSON *dataItem = cJSON_GetObjectItem(msgObject, "d");
-				if (cJSON_HasObjectItem(dataItem, "url") && cJSON_HasObjectItem(dataItem, "signature")) {
-					char *url = cJSON_GetObjectItem(dataItem, "url")->valuestring;
-					char *sig = cJSON_GetObjectItem(dataItem, "signature")->valuestring;
-					
-					if (url != NULL && sig != NULL) {
-						char key_ota[20] = "";
-						uint32_t crc32_sn = ht_check_crc32_sn_device();
-						sprintf(key_ota, "HT-%08lx", crc32_sn);
-						// log_warning("Key OTA: \"%s\"", key_ota);
-
-						s_linkDownload = (char*)calloc(strlen(url) + 1, 1);
-						strcpy(s_linkDownload, url);
-						s_signature = (char*)calloc(strlen(sig) + 1, 1);
-						strcpy(s_signature, sig);
-
-						log_warning("URL: ");
-						printf(" \"%s\"\n", s_linkDownload);
-						log_warning("Signature: ");
-						printf(" \"%s\"\n", s_signature);
-
-						if (verify_ota_signature(MODEL_NAME, s_linkDownload, s_signature, key_ota)) {
-							log_warning("Signature verification successful");
-							progressUpdateFirmware();
-						} else {
-							log_error("OTA signature verification failed");
-							reportOtaCheckDataInvalid();
-						}
-					} else {
-						log_error("URL or Signature is NULL");
-						reportOtaCheckDataInvalid();
-					}
-				} else {
-					log_error("URL or Signature not found in message");
-					reportOtaCheckDataInvalid();
-				}
-			}
+			result = ht_processLinkFirmware(msgObject);
 		} else if (strcmp(topic_filter[PROPERTY_CODE], PROPERTY_CODE_PROCESS_OTA) == 0) {
 			if (cJSON_HasObjectItem(msgObject, "d")) {
 				if (atoi(cJSON_GetObjectItem(msgObject, "d")->valuestring)) {
 					confirmEndOta_t.state = false;
 					strcpy(confirmEndOta_t.dataSend, "");
 					Flash_saveStateEndOta();
+					MqttReliable_confirm(MQTT_RELIABLE_KEY_OTA);
 				}
 			}
+		} else {
+			result = CMD_RESULT_UNSUPPORTED;
 		}
+	} else {
+		result = CMD_RESULT_UNSUPPORTED;
+	}
+
+	// lệnh không điều khiển relay: thời điểm thực thi là lúc xử lý xong
+	if (actUs == 0) {
+		actUs = esp_timer_get_time();
+	}
+	if (result == CMD_RESULT_OK) {
+		ht_recordLatency((uint32_t)(actUs - recvUs));
+	}
+	if (hasRequestId) {
+		ht_publishAck(ht_saveRequest(rid, topic_filter[PROPERTY_CODE], result, recvUs, actUs));
 	}
 
 	cJSON_Delete(msgObject);
 }
 
+void ht_reportCmdLatency()
+{
+	int64_t now = esp_timer_get_time();
+	if ((now - s_latencyLastReportUs) < (int64_t)CMD_LATENCY_REPORT_INTERVAL*1000000 || s_latencyStats.count == 0 || !g_isMqttConnected) {
+		return;
+	}
+	char data[200] = "";
+	int len = sprintf(data, "{\"n\":%lu,\"avg\":%llu,\"max\":%lu,\"h\":[", s_latencyStats.count, s_latencyStats.sumUs/s_latencyStats.count, s_latencyStats.maxUs);
+	for (uint8_t i = 0; i < CMD_LATENCY_BUCKETS; i++) {
+		len += sprintf(data + len, "%s%lu", (i == 0) ? "" : ",", s_latencyStats.histogram[i]);
+	}
+	sprintf(data + len, "]}");
+	MQTT_PublishData(data, PROPERTY_CODE_CMD_LATENCY);
+
+	memset(&s_latencyStats, 0, sizeof(s_latencyStats));
+	s_latencyLastReportUs = now;
+}
+
+// số lần ghi NVS thật trong 1 ngày, kèm thời gian đọc flash lúc boot
+void ht_reportFlashStats()
+{
+	int64_t now = esp_timer_get_time();
+	if ((now - s_flashLastReportUs) < (int64_t)FLASH_STATS_REPORT_INTERVAL*1000000 || !g_isMqttConnected) {
+		return;
+	}
+	flash_stats_t stats;
+	FlashHandler_getStats(&stats);
+	char data[200] = "";
+	sprintf(data, "{\"bootMs\":%lu,\"bootOps\":%lu,\"set\":%lu,\"skip\":%lu,\"coal\":%lu,\"nvsW\":%lu,\"commit\":%lu,\"err\":%lu}", stats.bootMs,
+																															stats.bootNvsOps,
+																															stats.writes,
+																															stats.skipped,
+																															stats.coalesced,
+																															stats.nvsWrites - s_flashLastNvsWrites,
+																															stats.commits - s_flashLastCommits,
+																															stats.errors);
+	MQTT_PublishData(data, PROPERTY_CODE_FLASH_STATS);
+
+	s_flashLastNvsWrites = stats.nvsWrites;
+	s_flashLastCommits = stats.commits;
+	s_flashLastReportUs = now;
+}
+
+// heap đo lúc bỏ Bluedroid trước khi tải OTA/cert, gửi 1 lần cho mỗi lần đo (thiết bị reset sau OTA)
+void ht_reportBleHeap()
+{
+	ble_heap_report_t report;
+	BLE_getHeapReport(&report);
+	if ((report.seq == s_bleHeapReportedSeq) || !g_isMqttConnected) {
+		return;
+	}
+	char data[200] = "";
+	sprintf(data, "{\"before\":%lu,\"hostOff\":%lu,\"beaconOnly\":%lu,\"largest\":%lu,\"budget\":%lu,\"fits\":%d}", report.freeBefore,
+																															report.freeHostOff,
+																															report.freeBeaconOnly,
+																															report.largestBlock,
+																															report.budget,
+																															report.beaconOnly);
+	MQTT_PublishData(data, PROPERTY_CODE_BLE_HEAP);
+
+	s_bleHeapReportedSeq = report.seq;
+}
+
+void ht_printCmdLatency()
+{
+	printf("Cmd latency: [count - %lu] [avg - %llu us] [max - %lu us] [<=1ms - %lu] [<=5ms - %lu] [<=10ms - %lu] [<=50ms - %lu] [<=100ms - %lu] [<=500ms - %lu] [>500ms - %lu]\n", s_latencyStats.count,
+																																							(s_latencyStats.count > 0) ? s_latencyStats.sumUs/s_latencyStats.count : 0,
+																																							s_latencyStats.maxUs,
+																																							s_latencyStats.histogram[0],
+																																							s_latencyStats.histogram[1],
+																																							s_latencyStats.histogram[2],
+																																							s_latencyStats.histogram[3],
+																																							s_latencyStats.histogram[4],
+																																							s_latencyStats.histogram[5],
+																																							s_latencyStats.histogram[6]);
+}
+
 /*******************************************************************************
  * Process Certificate
  ******************************************************************************/
@@ -350,7 +665,8 @@ void ht_processCertificate(char* topic, char* data)
 
 	if (strcmp(part3, "privateKey") == 0) {
 		if (cJSON_HasObjectItem(msgObject, "privateKey")) {
-			ht_gen_signature(cJSON_GetObjectItem(msgObject, "privateKey")->valuestring);
+			// ký trong task riêng, không chặn task MQTT
+			MqttCert_requestSignature(cJSON_GetObjectItem(msgObject, "privateKey")->valuestring);
 		}
 	} else if (strcmp(part3, "getcert") == 0) {
 		if (cJSON_HasObjectItem(msgObject, "keyLink") && cJSON_HasObjectItem(msgObject, "certLink")) {
@@ -360,20 +676,16 @@ void ht_processCertificate(char* topic, char* data)
 			if (linkCert != NULL && linkKey != NULL && pMqttCertKey == NULL) {
 				pMqttCertKey = (mqtt_certKey_t*)calloc(1, sizeof(mqtt_certKey_t));
 				if (pMqttCertKey != NULL) {
-					BLE_releaseBle();
+					BLE_releaseForDownload();
 					vTaskDelay(1000/portTICK_PERIOD_MS);
-					lenCert = 0;
-					lenKey = 0;
 					printf("link cert: %s\n", linkCert);
-					if (Http_downloadFileCert(linkCert) == true) {
-						// printf("%s", pMqttCertKey->cert);
-						printf("link key: %s\n", linkKey);
-
-						if (Http_downloadFileKey(linkKey) == true) {
-							// printf("%s", pMqttCertKey->key);
-							printf("%d %d\n", lenCert, lenKey);
-							MqttHandle_startCheckNewCertificate();
-						}
+					printf("link key: %s\n", linkKey);
+					if (Http_downloadCertKey(linkCert, linkKey, pMqttCertKey) == true) {
+						MqttHandle_startCheckNewCertificate();
+					} else {
+						// cho phép server gửi lại link
+						free(pMqttCertKey);
+						pMqttCertKey = NULL;
 					}
 				}
 			}
@@ -382,7 +694,7 @@ void ht_processCertificate(char* topic, char* data)
 		if (cJSON_HasObjectItem(msgObject, "status")) {
 			if (strcmp(cJSON_GetObjectItem(msgObject, "status")->valuestring, "completed") == 0) {
 				printf("confirm ok\n");
-				if (FlashHandler_saveCertKeyMqttInStore() == true) {
+				if (MqttCert_commit() == true) {
 					FlashHandler_saveEnvironmentMqttInStore();
 					g_mqttHaveNewCertificate = true;
 					printf("restart esp after 1s\n");
@@ -401,7 +713,7 @@ void ht_processCertificate(char* topic, char* data)
  ******************************************************************************/
 bool Flash_saveOldVersionFirmware()
 {
-    if (FlashHandler_setData(NAME_VERSION_FW_OLD, KEY_VERSION_FW_OLD, &versionFwOld_t, sizeof(versionFwOld_t))) {
+    if (FlashHandler_setDataSync(NAME_VERSION_FW_OLD, KEY_VERSION_FW_OLD, &versionFwOld_t, sizeof(versionFwOld_t))) {
         log_info("Set old version firmware success");
 		return true;
     } else {
@@ -412,7 +724,7 @@ bool Flash_saveOldVersionFirmware()
 
 bool Flash_saveStateOtaEsp()
 {
-    if (FlashHandler_setData(NAME_VERSION_FW_ESP, KEY_VERSION_FW_OLD, &checkStateOtaEsp, sizeof(checkStateOtaEsp))) {
+    if (FlashHandler_setDataSync(NAME_VERSION_FW_ESP, KEY_VERSION_FW_OLD, &checkStateOtaEsp, sizeof(checkStateOtaEsp))) {
         log_info("Set state ota esp success");
 		return true;
     } else {
@@ -423,7 +735,7 @@ bool Flash_saveStateOtaEsp()
 
 bool Flash_saveStateEndOta()
 {
-    if (FlashHandler_setData(NAME_CONFIRM_END_OTA, KEY_VERSION_FW_OLD, &confirmEndOta_t, sizeof(confirmEndOta_t))) {
+    if (FlashHandler_setDataSync(NAME_CONFIRM_END_OTA, KEY_VERSION_FW_OLD, &confirmEndOta_t, sizeof(confirmEndOta_t))) {
         log_info("Set state end ota success");
 		return true;
     } else {
@@ -10,8 +10,15 @@
 
 /* Includes ------------------------------------------------------------------*/
 #include "Global.h"
+#include "OTA_health.h"
 
 /* Exported types ------------------------------------------------------------*/
+#define CMD_REQUEST_ID_LEN 				40
+#define CMD_REQUEST_ID_NUM_MAX 			9007199254740992.0	// 2^53
+#define CMD_PROPERTY_LEN 				30
+#define CMD_DEDUP_MAX 					8
+#define CMD_LATENCY_BUCKETS 			7
+
 typedef struct
 {
 	uint16_t versionEspOld;
@@ -20,13 +27,48 @@ typedef struct
 typedef struct 
 {
 	bool state;
-	char dataSend[100];
+	char dataSend[140];		// gửi qua MqttReliable: "{\"d\":" + dataSend + "}" <= MQTT_RELIABLE_DATA_LEN
 } confirmEndOta;
 
+typedef enum
+{
+	CMD_RESULT_OK = 0,
+	CMD_RESULT_INVALID,
+	CMD_RESULT_BUSY,
+	CMD_RESULT_UNSUPPORTED,
+} cmd_result_t;
+
+typedef struct
+{
+	char rid[CMD_REQUEST_ID_LEN];
+	char property[CMD_PROPERTY_LEN];
+	int8_t result;
+	uint32_t latencyUs;         // nhận -> thực thi
+	int64_t recvMs;             // epoch ms, 0 khi chưa đồng bộ thời gian
+	int64_t actMs;
+} cmd_dedup_entry_t;
+
+typedef struct
+{
+	uint32_t count;
+	uint32_t maxUs;
+	uint64_t sumUs;
+	uint32_t histogram[CMD_LATENCY_BUCKETS];
+} cmd_latency_stats_t;
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t next;
+	cmd_dedup_entry_t entries[CMD_DEDUP_MAX];
+	uint32_t crc;
+} cmd_dedup_cache_t;
+
 /* Exported macro ------------------------------------------------------------*/
 #define EVT_UPDATE_PROPERTY 	"UP"
 #define EVT_CONTROL_PROPERTY 	"CP"
 #define EVT_UPDATE_FIRMWARE 	"UF"
+#define EVT_ACK 				"ACK"
 
 #define PROPERTY_CODE_S_SWITCH   			"S_SWITCH"
 #define PROPERTY_CODE_S_LOCKTOUCH   		"S_LOCKTOUCH"
@@ -39,12 +81,27 @@ typedef struct
 #define PROPERTY_CODE_PROCESS_OTA  			"PROCESS_OTA"
 #define PROPERTY_CODE_SCHEDULE  			"SCHEDULE"
 #define PROPERTY_CODE_SCHEDULE_CURRENT  	"SCHEDULE_CURRENT"
+#define PROPERTY_CODE_HELLO  				"HELLO"
+#define PROPERTY_CODE_FULL_SYNC  			"FULL_SYNC"
+#define PROPERTY_CODE_CMD_LATENCY  			"CMD_LATENCY"
+#define PROPERTY_CODE_FLASH_STATS  			"FLASH_STATS"
+#define PROPERTY_CODE_BLE_HEAP  			"BLE_HEAP"
+#define PROPERTY_CODE_ENCODING  			"ENCODING"
 
 #define NAME_VERSION_FW_OLD 			"ver_fw_old"
 #define NAME_VERSION_FW_ESP 			"ver_fw_esp"
 #define NAME_CONFIRM_END_OTA 			"cf_end_ota"
 #define KEY_VERSION_FW_OLD 				"update_fw"
 
+// Lệnh có "rid": lệnh trùng (server gửi lại, QoS1 redelivery) chỉ trả lại ack đã lưu, không thực thi
+#define CMD_REQUEST_ID_KEY 				"rid"
+#define CMD_DEDUP_MAGIC 				0x48544444
+
+// Histogram độ trễ nhận lệnh -> thực thi (us), khoảng cuối là lớn hơn, gửi lên server định kỳ
+#define CMD_LATENCY_HISTOGRAM_BOUNDS 	{1000, 5000, 10000, 50000, 100000, 500000}
+#define CMD_LATENCY_REPORT_INTERVAL 	3600	// s
+#define FLASH_STATS_REPORT_INTERVAL 	86400	// s, số lần ghi flash mỗi ngày
+
 #define MAX_LEN_COMMON 					12
 #define MIN_LEN_COMMON 					9
 #define MAX_LEN_ESP 					10
@@ -56,8 +113,14 @@ void checkEndOtaFromServer();
 void checkUpdateVerFwEsp();
 void reportOtaCheckDataInvalid();
 void reportOtaFailure();
+void reportOtaRollback(const ota_health_record_t *record);
 
-void ht_processCmd(char *data);
+void ht_processFullSync();
+void ht_processCmd(char *data, int64_t recvUs);
+void ht_reportCmdLatency();
+void ht_reportFlashStats();
+void ht_reportBleHeap();
+void ht_printCmdLatency();
 void ht_processCertificate(char* topic, char* data);
 
 bool Flash_saveOldVersionFirmware();
@@ -31,42 +31,37 @@
 #endif
 
 /*******************************************************************************
- * Extern Variables
+ * Typedef Variables
  ******************************************************************************/
-extern uint16_t lenCert;
-extern uint16_t lenKey;
-extern mqtt_certKey_t *pMqttCertKey;
+typedef struct
+{
+    char *buf;
+    size_t cap;
+    size_t len;
+    bool overflow;
+} http_sink_t;
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+static http_cert_stats_t s_certStats;
 
 /*******************************************************************************
  * Application Funtions
  ******************************************************************************/
-static esp_err_t downloadCert_callback(esp_http_client_event_t *evt)
+static esp_err_t downloadCertKey_callback(esp_http_client_event_t *evt)
 {
     switch (evt->event_id) {
     case HTTP_EVENT_ERROR:
         log_error("HTTP_EVENT_ERROR");
         break;
     case HTTP_EVENT_ON_CONNECTED:
+        // mỗi lần ON_CONNECTED là 1 lần bắt tay TLS
         log_warning("HTTP_EVENT_ON_CONNECTED");
-        break;
-    case HTTP_EVENT_HEADER_SENT:
-        log_info("HTTP_EVENT_HEADER_SENT");
-        break;
-    case HTTP_EVENT_ON_HEADER:
-        log_info("HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value);
-        break;
-    case HTTP_EVENT_ON_DATA:
-        log_info("HTTP_EVENT_ON_DATA, len=%d", evt->data_len);
-        if (!esp_http_client_is_chunked_response(evt->client)) {
-            memcpy(pMqttCertKey->cert + lenCert, evt->data,evt->data_len);
-            lenCert += evt->data_len;
-        }
-        break;
-    case HTTP_EVENT_ON_FINISH:
-        log_warning("HTTP_EVENT_ON_FINISH");
+        s_certStats.handshakes++;
         break;
     case HTTP_EVENT_DISCONNECTED:
-        log_error("HTTP_EVENT_DISCONNECTED");
+        log_warning("HTTP_EVENT_DISCONNECTED");
         int mbedtls_err = 0;
         esp_err_t err = esp_tls_get_and_clear_last_error(evt->data, &mbedtls_err, NULL);
         if (err != 0) {
@@ -80,100 +75,105 @@ static esp_err_t downloadCert_callback(esp_http_client_event_t *evt)
     return ESP_OK;
 }
 
-bool Http_downloadFileCert(char *linkFile)
+// đọc body vào sink (esp_http_client_read đã giải mã chunked), dư 1 byte cho '\0'
+static bool Http_readToSink(esp_http_client_handle_t client, const char *url, http_sink_t *sink)
 {
-    bool result = false;
-    esp_http_client_config_t config = {
-        .url = linkFile,
-        .event_handler = downloadCert_callback,
-        .transport_type = HTTP_TRANSPORT_OVER_SSL,
-        .buffer_size_tx = 1024,
-    };
-    esp_http_client_handle_t client = esp_http_client_init(&config);
+    char extra;
+    int len;
 
-    esp_err_t err = esp_http_client_perform(client);
-    if (err == ESP_OK) {
-        log_info("download ceritficate file Status = %d, content_length = %lld", esp_http_client_get_status_code(client), esp_http_client_get_content_length(client));
-        if (esp_http_client_get_status_code(client) == 200 || esp_http_client_get_status_code(client) == 201) {
-            result = true;
-            pMqttCertKey->cert[lenCert] = '\0';
-            log_info("download ceritficate file OK");
-        }
-    } else {
-        log_error("download ceritficate file failed: %s", esp_err_to_name(err));
+    sink->len = 0;
+    sink->overflow = false;
+    esp_http_client_set_url(client, url);
+    esp_err_t err = esp_http_client_open(client, 0);
+    if (err != ESP_OK) {
+        log_error("Open %s failed: %s", url, esp_err_to_name(err));
+        return false;
+    }
+    int64_t contentLength = esp_http_client_fetch_headers(client);
+    int status = esp_http_client_get_status_code(client);
+    log_info("Status = %d, content_length = %lld, chunked = %d", status, contentLength, esp_http_client_is_chunked_response(client));
+    if ((status != 200) && (status != 201)) {
+        esp_http_client_close(client);
+        return false;
+    }
+    if (contentLength >= (int64_t)sink->cap) {
+        log_error("Content length %lld > %d", contentLength, sink->cap - 1);
+        esp_http_client_close(client);
+        return false;
     }
-    esp_http_client_cleanup(client);
-
-    return result;
-}
 
-static esp_err_t downloadKey_callback(esp_http_client_event_t *evt)
-{
-    switch (evt->event_id) {
-    case HTTP_EVENT_ERROR:
-        log_error("HTTP_EVENT_ERROR");
-        break;
-    case HTTP_EVENT_ON_CONNECTED:
-        log_warning("HTTP_EVENT_ON_CONNECTED");
-        break;
-    case HTTP_EVENT_HEADER_SENT:
-        log_info("HTTP_EVENT_HEADER_SENT");
-        break;
-    case HTTP_EVENT_ON_HEADER:
-        log_info("HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value);
-        break;
-    case HTTP_EVENT_ON_DATA:
-        log_info("HTTP_EVENT_ON_DATA, len=%d", evt->data_len);
-        if (!esp_http_client_is_chunked_response(evt->client)) {
-            memcpy(pMqttCertKey->key + lenKey, evt->data,evt->data_len);
-            lenKey += evt->data_len;
+    while (sink->len < sink->cap - 1) {
+        len = esp_http_client_read(client, sink->buf + sink->len, sink->cap - 1 - sink->len);
+        if (len < 0) {
+            esp_http_client_close(client);
+            return false;
         }
-
-        break;
-    case HTTP_EVENT_ON_FINISH:
-        log_warning("HTTP_EVENT_ON_FINISH");
-        break;
-    case HTTP_EVENT_DISCONNECTED:
-        log_error("HTTP_EVENT_DISCONNECTED");
-        int mbedtls_err = 0;
-        esp_err_t err = esp_tls_get_and_clear_last_error(evt->data, &mbedtls_err, NULL);
-        if (err != 0) {
-            log_info( "Last esp error code: 0x%x", err);
-            log_info( "Last mbedtls failure: 0x%x", mbedtls_err);
+        if (len == 0) {
+            break;
         }
-        break;
-    default:
-        break;
+        sink->len += len;
     }
-    return ESP_OK;
+    // đầy buffer mà server vẫn còn dữ liệu
+    if ((sink->len == sink->cap - 1) && (esp_http_client_read(client, &extra, 1) > 0)) {
+        sink->overflow = true;
+    }
+    sink->buf[sink->len] = '\0';
+    if (sink->overflow || !esp_http_client_is_complete_data_received(client)) {
+        log_error("Download %s incomplete, overflow: %d", url, sink->overflow);
+        esp_http_client_close(client);
+        return false;
+    }
+    // đọc hết response để giữ kết nối cho request sau
+    esp_http_client_flush_response(client, NULL);
+    return true;
 }
 
-bool Http_downloadFileKey(char *linkFile)
+bool Http_downloadCertKey(char *linkCert, char *linkKey, mqtt_certKey_t *certKey)
 {
     bool result = false;
+    http_sink_t certSink = {certKey->cert, sizeof(certKey->cert), 0, false};
+    http_sink_t keySink = {certKey->key, sizeof(certKey->key), 0, false};
     esp_http_client_config_t config = {
-        .url = linkFile,
-        .event_handler = downloadKey_callback,
+        .url = linkCert,
+        .event_handler = downloadCertKey_callback,
         .transport_type = HTTP_TRANSPORT_OVER_SSL,
         .buffer_size_tx = 1024,
+        .keep_alive_enable = true,
     };
+    uint32_t handshakes = s_certStats.handshakes;
+    int64_t beginUs = esp_timer_get_time();
+
     esp_http_client_handle_t client = esp_http_client_init(&config);
+    if (client == NULL) {
+        return false;
+    }
 
-    esp_err_t err = esp_http_client_perform(client);
-    if (err == ESP_OK) {
-        log_info( "download key file Status = %d, content_length = %lld", esp_http_client_get_status_code(client), esp_http_client_get_content_length(client));
-        if (esp_http_client_get_status_code(client) == 200 || esp_http_client_get_status_code(client) == 201)
-        {
+    if (Http_readToSink(client, linkCert, &certSink)) {
+#ifndef HTTP_CERT_KEEP_ALIVE_ENABLE
+        // so sánh: mở kết nối TLS mới cho file key như bản cũ
+        esp_http_client_close(client);
+#endif
+        // cùng host: esp_http_client giữ kết nối TLS, khác host thì tự đóng và kết nối lại
+        if (Http_readToSink(client, linkKey, &keySink)) {
             result = true;
-            pMqttCertKey->key[lenKey] = '\0';
-            log_info( "download key file OK");
         }
-    } else {
-        log_error( "download key file failed: %s", esp_err_to_name(err));
     }
+    esp_http_client_close(client);
     esp_http_client_cleanup(client);
-    
+
+    s_certStats.downloads++;
+    s_certStats.lastMs = (esp_timer_get_time() - beginUs)/1000;
+    s_certStats.lastHandshakes = s_certStats.handshakes - handshakes;
+    if (result) {
+        s_certStats.success++;
+    }
+    log_warning("Download cert %d + key %d bytes: %s, %lu ms, %lu handshake", certSink.len, keySink.len, result ? "ok" : "fail", s_certStats.lastMs, s_certStats.lastHandshakes);
     return result;
 }
 
+void Http_getCertStats(http_cert_stats_t *stats)
+{
+    memcpy(stats, &s_certStats, sizeof(http_cert_stats_t));
+}
+
 /***********************************************/
\ No newline at end of file
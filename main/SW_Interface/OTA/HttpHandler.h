@@ -10,11 +10,24 @@
 
 /* Includes ------------------------------------------------------------------*/
 #include "Global.h"
+#include "MqttHandler.h"
 
 /* Exported types ------------------------------------------------------------*/
+typedef struct
+{
+    uint32_t downloads;
+    uint32_t success;
+    uint32_t handshakes;
+    uint32_t lastHandshakes;
+    uint32_t lastMs;
+} http_cert_stats_t;
+
 /* Exported macro ------------------------------------------------------------*/
+// Tải cert và key trên cùng 1 kết nối TLS (keep-alive), bỏ define để đo lại cách 2 lần bắt tay
+#define HTTP_CERT_KEEP_ALIVE_ENABLE
+
 /* Exported functions ------------------------------------------------------- */
-bool Http_downloadFileCert(char *linkFile);
-bool Http_downloadFileKey(char *linkFile);
+bool Http_downloadCertKey(char *linkCert, char *linkKey, mqtt_certKey_t *certKey);
+void Http_getCertStats(http_cert_stats_t *stats);
 
 #endif /* __HTTP_HANDLER_H */
\ No newline at end of file
@@ -0,0 +1,406 @@
+/**
+ ******************************************************************************
+ * @file    OTA_ble.c
+ * @author  HT EZLife Co.,LTD.
+ * @date    January 1, 2025
+ ******************************************************************************/
+/*******************************************************************************
+ * Include
+ ******************************************************************************/
+#include "OTA_ble.h"
+#include "OTA_http.h"
+#include "WatchDog.h"
+#include "freertos/stream_buffer.h"
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define TAG "Ota_Ble"
+
+#ifndef DISABLE_LOG_ALL
+#define OTA_BLE_LOG_INFO_ON
+#endif
+
+#ifdef OTA_BLE_LOG_INFO_ON
+#define log_info(format, ...) ESP_LOGI(TAG, format, ##__VA_ARGS__)
+#define log_error(format, ...) ESP_LOGE(TAG, format, ##__VA_ARGS__)
+#define log_warning(format, ...) ESP_LOGW(TAG, format, ##__VA_ARGS__)
+#else
+#define log_info(format, ...)
+#define log_error(format, ...)
+#define log_warning(format, ...)
+#endif
+
+#define OTA_BLE_BEGIN_MIN_LEN       (1 + 4 + 32)
+#define OTA_BLE_ATT_OVERHEAD        3
+#define OTA_BLE_TASK_END            0x01
+#define OTA_BLE_TASK_ABORT          0x02
+#define OTA_BLE_RECEIVE_WAIT_MS     200
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+static ota_ble_notify_t s_notify = NULL;
+static uint16_t s_mtu = 23;
+
+// phiên hiện tại, giữ qua các lần kết nối BLE
+static volatile bool s_active = false;
+static ota_ble_stats_t s_stats;
+static uint8_t s_imageSha[32];
+static uint32_t s_nakOffset = UINT32_MAX;
+static uint8_t s_sinceAck = 0;
+static int64_t s_startUs = 0;
+
+// task ghi flash
+static StreamBufferHandle_t s_stream = NULL;
+static TaskHandle_t s_task = NULL;
+static const esp_partition_t *s_partition = NULL;
+static esp_ota_handle_t s_otaHandle = 0;
+static mbedtls_sha256_context s_sha;
+static uint8_t *s_writeBuf = NULL;
+static uint32_t s_writeLen = 0;
+static uint32_t s_written = 0;
+
+/*******************************************************************************
+ * Notify
+ ******************************************************************************/
+static void OtaBle_put32(uint8_t *data, uint32_t value)
+{
+    data[0] = value & 0xff;
+    data[1] = (value >> 8) & 0xff;
+    data[2] = (value >> 16) & 0xff;
+    data[3] = (value >> 24) & 0xff;
+}
+
+static uint32_t OtaBle_get32(const uint8_t *data)
+{
+    return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static void OtaBle_respond(uint8_t op, uint8_t status)
+{
+    uint8_t rsp[2] = {op | OTA_BLE_RSP_FLAG, status};
+    if (s_notify != NULL) {
+        s_notify(rsp, sizeof(rsp));
+    }
+}
+
+static void OtaBle_sendOffset(uint8_t evt, uint32_t offset)
+{
+    uint8_t rsp[5] = {evt};
+    OtaBle_put32(&rsp[1], offset);
+    if (s_notify != NULL) {
+        s_notify(rsp, sizeof(rsp));
+    }
+}
+
+/*******************************************************************************
+ * Flash Writer
+ ******************************************************************************/
+static bool OtaBle_flush()
+{
+    if (s_writeLen == 0) {
+        return true;
+    }
+    // buffer đầu tiên đủ chứa header image + app desc
+    if ((s_written == 0) && !OTA_http_validateImageHeader(s_writeBuf, s_writeLen)) {
+        return false;
+    }
+    mbedtls_sha256_update(&s_sha, s_writeBuf, s_writeLen);
+    esp_err_t err = esp_ota_write(s_otaHandle, s_writeBuf, s_writeLen);
+    if (err != ESP_OK) {
+        log_error("esp_ota_write failed: %s", esp_err_to_name(err));
+        return false;
+    }
+    s_written += s_writeLen;
+    s_writeLen = 0;
+    return true;
+}
+
+static uint8_t OtaBle_finish()
+{
+    uint8_t digest[32];
+
+    // lấy hết dữ liệu còn trong stream buffer
+    while ((s_written + s_writeLen) < s_stats.imageSize) {
+        size_t n = xStreamBufferReceive(s_stream, s_writeBuf + s_writeLen, OTA_BLE_WRITE_BUF_SIZE - s_writeLen, OTA_BLE_RECEIVE_WAIT_MS/portTICK_PERIOD_MS);
+        if (n == 0) {
+            log_error("Stream ended at %lu/%lu", s_written + s_writeLen, s_stats.imageSize);
+            return OTA_BLE_ERR_INVALID;
+        }
+        s_writeLen += n;
+        if ((s_writeLen == OTA_BLE_WRITE_BUF_SIZE) && !OtaBle_flush()) {
+            return OTA_BLE_ERR_FLASH;
+        }
+    }
+    if (!OtaBle_flush()) {
+        return OTA_BLE_ERR_FLASH;
+    }
+
+    mbedtls_sha256_finish(&s_sha, digest);
+    if (memcmp(digest, s_imageSha, sizeof(digest)) != 0) {
+        log_error("Image SHA-256 does not match BEGIN");
+        return OTA_BLE_ERR_HASH;
+    }
+    // cùng kiểm tra manifest đã ký như OTA HTTP
+    if (!OTA_http_checkImage(digest)) {
+        return OTA_BLE_ERR_HASH;
+    }
+    // esp_ota_end kiểm tra lại toàn bộ image trước khi cho đổi boot
+    esp_err_t err = esp_ota_end(s_otaHandle);
+    s_otaHandle = 0;
+    if ((err != ESP_OK) || (esp_ota_set_boot_partition(s_partition) != ESP_OK)) {
+        log_error("Image invalid: %s", esp_err_to_name(err));
+        return OTA_BLE_ERR_INVALID;
+    }
+    return OTA_BLE_OK;
+}
+
+static void OtaBle_cleanup()
+{
+    // callback BLE kiểm tra s_active trước khi dùng stream buffer
+    s_active = false;
+    vTaskDelay(50/portTICK_PERIOD_MS);
+    if (s_otaHandle != 0) {
+        esp_ota_abort(s_otaHandle);
+        s_otaHandle = 0;
+    }
+    mbedtls_sha256_free(&s_sha);
+    free(s_writeBuf);
+    s_writeBuf = NULL;
+    if (s_stream != NULL) {
+        vStreamBufferDelete(s_stream);
+        s_stream = NULL;
+    }
+    OTA_http_setManifestRaw(NULL, NULL, 0);
+    s_task = NULL;
+}
+
+static void otaBleWriterTask(void *arg)
+{
+    uint32_t bits = 0;
+    TickType_t lastData = xTaskGetTickCount();
+
+    while (true)
+    {
+        size_t n = xStreamBufferReceive(s_stream, s_writeBuf + s_writeLen, OTA_BLE_WRITE_BUF_SIZE - s_writeLen, OTA_BLE_RECEIVE_WAIT_MS/portTICK_PERIOD_MS);
+        if (n > 0) {
+            lastData = xTaskGetTickCount();
+            s_writeLen += n;
+            if ((s_writeLen == OTA_BLE_WRITE_BUF_SIZE) && !OtaBle_flush()) {
+                OtaBle_respond(OTA_BLE_OP_END, OTA_BLE_ERR_FLASH);
+                log_error("Write fail at %lu, abort", s_written);
+                break;
+            }
+        }
+
+        xTaskNotifyWait(0, UINT32_MAX, &bits, 0);
+        if (bits & OTA_BLE_TASK_ABORT) {
+            log_warning("Abort at %lu/%lu", s_stats.offset, s_stats.imageSize);
+            break;
+        }
+        if (bits & OTA_BLE_TASK_END) {
+            uint8_t status = OtaBle_finish();
+            s_stats.elapsedMs = (esp_timer_get_time() - s_startUs)/1000;
+            log_warning("BLE OTA %lu bytes in %lu ms (%lu B/s), chunk %d, window %d, packets %lu, nak %lu, dropped %lu, resumes %d, status %d", s_stats.imageSize,
+                                                                                                            s_stats.elapsedMs,
+                                                                                                            (s_stats.elapsedMs > 0) ? (uint32_t)((uint64_t)s_stats.imageSize * 1000 / s_stats.elapsedMs) : 0,
+                                                                                                            s_stats.chunk,
+                                                                                                            s_stats.window,
+                                                                                                            s_stats.packets,
+                                                                                                            s_stats.naks,
+                                                                                                            s_stats.dropped,
+                                                                                                            s_stats.resumes,
+                                                                                                            status);
+            OtaBle_respond(OTA_BLE_OP_END, status);
+            if (status == OTA_BLE_OK) {
+                log_warning(" --->>>> Prepare to restart system..........");
+                vTaskDelay(1000/portTICK_PERIOD_MS);
+                ESP_resetChip();
+            }
+            break;
+        }
+        if ((xTaskGetTickCount() - lastData) > (OTA_BLE_IDLE_TIMEOUT_MS/portTICK_PERIOD_MS)) {
+            log_error("Session idle, abort at %lu/%lu", s_stats.offset, s_stats.imageSize);
+            break;
+        }
+    }
+    OtaBle_cleanup();
+    vTaskDelete(NULL);
+}
+
+/*******************************************************************************
+ * Control
+ ******************************************************************************/
+// chunk theo MTU hiện tại, cửa sổ sao cho phần gửi chưa ACK chiếm tối đa nửa stream buffer
+static void OtaBle_updateWindow()
+{
+    s_stats.chunk = MIN(s_mtu - OTA_BLE_ATT_OVERHEAD - OTA_BLE_DATA_HEADER_LEN, OTA_BLE_CHUNK_MAX);
+    s_stats.window = MAX(2, MIN(OTA_BLE_WINDOW_MAX, (OTA_BLE_STREAM_BUF_SIZE / 2) / s_stats.chunk));
+    s_sinceAck = 0;
+    s_nakOffset = UINT32_MAX;
+}
+
+static uint8_t OtaBle_begin(const uint8_t *data, uint16_t len)
+{
+    if (len < OTA_BLE_BEGIN_MIN_LEN) {
+        return OTA_BLE_ERR_INVALID;
+    }
+    uint32_t imageSize = OtaBle_get32(&data[1]);
+    const uint8_t *sha = &data[5];
+
+    if (s_active) {
+        // cùng image: tải tiếp từ byte đã nhận
+        if ((imageSize == s_stats.imageSize) && (memcmp(sha, s_imageSha, sizeof(s_imageSha)) == 0)) {
+            s_stats.resumes++;
+            OtaBle_updateWindow();
+            log_warning("Resume at %lu/%lu, chunk %d, window %d", s_stats.offset, imageSize, s_stats.chunk, s_stats.window);
+            return OTA_BLE_OK;
+        }
+        return OTA_BLE_ERR_BUSY;
+    }
+    if (OTA_http_isRunning()) {
+        return OTA_BLE_ERR_BUSY;
+    }
+
+    s_partition = esp_ota_get_next_update_partition(NULL);
+    if ((s_partition == NULL) || (imageSize == 0) || (imageSize > s_partition->size)) {
+        log_error("Invalid image size %lu", imageSize);
+        return OTA_BLE_ERR_INVALID;
+    }
+    // BLE không có URL đã xác thực từ server như OTA HTTP: luôn bắt buộc chữ ký,
+    // không phụ thuộc OTA_IMAGE_SIGN_REQUIRED
+    if (len == OTA_BLE_BEGIN_MIN_LEN) {
+        log_error("BEGIN without image signature");
+        return OTA_BLE_ERR_SIGNATURE;
+    }
+    if (!OTA_http_setManifestRaw(sha, &data[OTA_BLE_BEGIN_MIN_LEN], len - OTA_BLE_BEGIN_MIN_LEN)) {
+        return OTA_BLE_ERR_SIGNATURE;
+    }
+
+    // xoá flash dần theo sector khi ghi, không chặn callback BLE lúc bắt đầu
+    esp_err_t err = esp_ota_begin(s_partition, OTA_WITH_SEQUENTIAL_WRITES, &s_otaHandle);
+    if (err != ESP_OK) {
+        log_error("esp_ota_begin failed: %s", esp_err_to_name(err));
+        s_otaHandle = 0;
+        return OTA_BLE_ERR_FLASH;
+    }
+    s_writeBuf = (uint8_t *)malloc(OTA_BLE_WRITE_BUF_SIZE);
+    s_stream = xStreamBufferCreate(OTA_BLE_STREAM_BUF_SIZE, 1);
+    mbedtls_sha256_init(&s_sha);
+    mbedtls_sha256_starts(&s_sha, 0);
+    if ((s_writeBuf == NULL) || (s_stream == NULL)) {
+        OtaBle_cleanup();
+        return OTA_BLE_ERR_NO_MEM;
+    }
+
+    memset(&s_stats, 0, sizeof(s_stats));
+    s_stats.imageSize = imageSize;
+    memcpy(s_imageSha, sha, sizeof(s_imageSha));
+    s_writeLen = 0;
+    s_written = 0;
+    s_startUs = esp_timer_get_time();
+    OtaBle_updateWindow();
+    s_active = true;
+    if (xTaskCreate(otaBleWriterTask, "otaBleWriter", OTA_BLE_TASK_STACK, NULL, OTA_BLE_TASK_PRIORITY, &s_task) != pdPASS) {
+        OtaBle_cleanup();
+        return OTA_BLE_ERR_NO_MEM;
+    }
+    log_warning("BLE OTA begin: %lu bytes to 0x%lx, chunk %d, window %d", imageSize, s_partition->address, s_stats.chunk, s_stats.window);
+    return OTA_BLE_OK;
+}
+
+/*******************************************************************************
+ * Application Funtions
+ ******************************************************************************/
+void OtaBle_setNotify(ota_ble_notify_t notify)
+{
+    s_notify = notify;
+}
+
+void OtaBle_setMtu(uint16_t mtu)
+{
+    s_mtu = mtu;
+}
+
+// gọi trong callback GATTS (task BTC)
+void OtaBle_onControl(const uint8_t *data, uint16_t len)
+{
+    if (len == 0) {
+        return;
+    }
+    switch (data[0]) {
+    case OTA_BLE_OP_BEGIN: {
+        uint8_t status = OtaBle_begin(data, len);
+        uint8_t rsp[9] = {OTA_BLE_OP_BEGIN | OTA_BLE_RSP_FLAG, status};
+        OtaBle_put32(&rsp[2], s_active ? s_stats.offset : 0);
+        rsp[6] = s_stats.chunk & 0xff;
+        rsp[7] = (s_stats.chunk >> 8) & 0xff;
+        rsp[8] = s_stats.window;
+        if (s_notify != NULL) {
+            s_notify(rsp, sizeof(rsp));
+        }
+        break;
+    }
+    case OTA_BLE_OP_END:
+        if (!s_active || (s_stats.offset != s_stats.imageSize)) {
+            OtaBle_respond(OTA_BLE_OP_END, OTA_BLE_ERR_INVALID);
+            break;
+        }
+        // task ghi trả lời sau khi kiểm tra hash
+        xTaskNotify(s_task, OTA_BLE_TASK_END, eSetBits);
+        break;
+    case OTA_BLE_OP_ABORT:
+        if (s_active) {
+            xTaskNotify(s_task, OTA_BLE_TASK_ABORT, eSetBits);
+        }
+        OtaBle_respond(OTA_BLE_OP_ABORT, OTA_BLE_OK);
+        break;
+    default:
+        log_error("Unknown op 0x%02x", data[0]);
+        break;
+    }
+}
+
+// gọi trong callback GATTS (task BTC), không chờ: gói sai thứ tự hoặc buffer đầy thì bỏ và báo NAK
+void OtaBle_onData(const uint8_t *data, uint16_t len)
+{
+    if (!s_active || (len <= OTA_BLE_DATA_HEADER_LEN)) {
+        return;
+    }
+    uint32_t offset = OtaBle_get32(data);
+    uint16_t n = len - OTA_BLE_DATA_HEADER_LEN;
+
+    if ((offset != s_stats.offset) || (n > s_stats.imageSize - offset) ||
+        (xStreamBufferSpacesAvailable(s_stream) < n)) {
+        s_stats.dropped++;
+        // gói cũ (client đang gửi lại) thì bỏ qua, mất gói hoặc đầy thì NAK 1 lần cho mỗi vị trí
+        if ((offset >= s_stats.offset) && (s_nakOffset != s_stats.offset)) {
+            s_nakOffset = s_stats.offset;
+            s_stats.naks++;
+            OtaBle_sendOffset(OTA_BLE_EVT_NAK, s_stats.offset);
+        }
+        return;
+    }
+
+    xStreamBufferSend(s_stream, data + OTA_BLE_DATA_HEADER_LEN, n, 0);
+    s_stats.offset += n;
+    s_stats.packets++;
+    s_nakOffset = UINT32_MAX;
+    if ((++s_sinceAck >= s_stats.window / 2) || (s_stats.offset == s_stats.imageSize)) {
+        s_sinceAck = 0;
+        OtaBle_sendOffset(OTA_BLE_EVT_ACK, s_stats.offset);
+    }
+}
+
+bool OtaBle_isActive()
+{
+    return s_active;
+}
+
+void OtaBle_getStats(ota_ble_stats_t *stats)
+{
+    memcpy(stats, &s_stats, sizeof(ota_ble_stats_t));
+}
+
+/***********************************************/
@@ -0,0 +1,79 @@
+/**
+ ******************************************************************************
+ * @file    OTA_ble.h
+ * @author  HT EZLife Co.,LTD.
+ * @date    January 1, 2025
+ ******************************************************************************/
+
+#ifndef __OTA_BLE_H
+#define __OTA_BLE_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "Global.h"
+
+/* Exported types ------------------------------------------------------------*/
+// gửi notify trên characteristic điều khiển (BLE_handler cung cấp)
+typedef void (*ota_ble_notify_t)(const uint8_t *data, uint16_t len);
+
+typedef enum
+{
+    OTA_BLE_OK = 0,
+    OTA_BLE_ERR_BUSY,           // đang OTA qua HTTP hoặc phiên khác
+    OTA_BLE_ERR_INVALID,        // lệnh/kích thước/header image sai
+    OTA_BLE_ERR_SIGNATURE,      // thiếu hoặc sai chữ ký manifest
+    OTA_BLE_ERR_FLASH,
+    OTA_BLE_ERR_HASH,           // SHA-256 image khác manifest
+    OTA_BLE_ERR_NO_MEM,
+} ota_ble_status_t;
+
+typedef struct
+{
+    uint32_t imageSize;
+    uint32_t offset;            // byte đã nhận liên tục
+    uint32_t packets;
+    uint32_t naks;              // số lần báo mất gói
+    uint32_t dropped;           // gói sai offset hoặc buffer đầy
+    uint32_t elapsedMs;
+    uint16_t chunk;
+    uint8_t window;
+    uint8_t resumes;
+} ota_ble_stats_t;
+
+/* Exported macro ------------------------------------------------------------*/
+// Giao thức (little-endian), tools/ble_ota_client.py là client mẫu:
+// điều khiển (write, notify):
+//  BEGIN 0x01 <u32 imageSize> <sha256[32]> <chữ ký DER (bắt buộc)>
+//        -> 0x81 <status> <u32 offset> <u16 chunk> <u8 window>   offset > 0: tải tiếp phiên cũ
+//  END   0x02 -> 0x82 <status>                                    OK thì đổi boot partition và reset
+//                                                                 (cũng gửi khi ghi flash lỗi giữa chừng)
+//  ABORT 0x03 -> 0x83 <status>
+//        <- 0x84 <u32 offset>  ACK: đã nhận liên tục đến offset
+//        <- 0x85 <u32 offset>  NAK: mất gói, gửi lại từ offset
+// dữ liệu (write without response): <u32 offset> <tối đa chunk byte>
+#define OTA_BLE_OP_BEGIN            0x01
+#define OTA_BLE_OP_END              0x02
+#define OTA_BLE_OP_ABORT            0x03
+#define OTA_BLE_RSP_FLAG            0x80
+#define OTA_BLE_EVT_ACK             0x84
+#define OTA_BLE_EVT_NAK             0x85
+#define OTA_BLE_DATA_HEADER_LEN     4
+
+#define OTA_BLE_CHUNK_MAX           (512 - OTA_BLE_DATA_HEADER_LEN)
+// buffer giữa callback BLE và task ghi flash, quyết định cửa sổ gửi không chờ ACK
+#define OTA_BLE_STREAM_BUF_SIZE     (8*1024)
+#define OTA_BLE_WINDOW_MAX          32
+#define OTA_BLE_WRITE_BUF_SIZE      4096
+#define OTA_BLE_TASK_STACK          (4*1024)
+#define OTA_BLE_TASK_PRIORITY       5
+// phiên giữ trong RAM để tải tiếp khi mất kết nối BLE, không có dữ liệu quá lâu thì huỷ
+#define OTA_BLE_IDLE_TIMEOUT_MS     (5*60000)
+
+/* Exported functions ------------------------------------------------------- */
+void OtaBle_setNotify(ota_ble_notify_t notify);
+void OtaBle_setMtu(uint16_t mtu);
+void OtaBle_onControl(const uint8_t *data, uint16_t len);
+void OtaBle_onData(const uint8_t *data, uint16_t len);
+bool OtaBle_isActive();
+void OtaBle_getStats(ota_ble_stats_t *stats);
+
+#endif /* __OTA_BLE_H */
@@ -0,0 +1,243 @@
+/**
+ ******************************************************************************
+ * @file    OTA_decode.c
+ * @author  HT EZLife Co.,LTD.
+ * @date    January 1, 2025
+ ******************************************************************************/
+/*******************************************************************************
+ * Include
+ ******************************************************************************/
+#include "OTA_decode.h"
+#include "esp32/rom/miniz.h"
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define TAG "Ota_Decode"
+
+#ifndef DISABLE_LOG_ALL
+#define OTA_DECODE_LOG_INFO_ON
+#endif
+
+#ifdef OTA_DECODE_LOG_INFO_ON
+#define log_info(format, ...) ESP_LOGI(TAG, format, ##__VA_ARGS__)
+#define log_error(format, ...) ESP_LOGE(TAG, format, ##__VA_ARGS__)
+#define log_warning(format, ...) ESP_LOGW(TAG, format, ##__VA_ARGS__)
+#else
+#define log_info(format, ...)
+#define log_error(format, ...)
+#define log_warning(format, ...)
+#endif
+
+/*******************************************************************************
+ * Typedef Variables
+ ******************************************************************************/
+typedef struct
+{
+    uint8_t hdr[9];             // opcode + tham số, có thể nằm vắt qua 2 lần feed
+    uint8_t hdrLen;
+    uint32_t literal;           // số byte 'I' còn lại
+    uint8_t *copyBuf;
+} ota_delta_state_t;
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+static uint8_t s_format = OTA_FORMAT_RAW;
+static uint32_t s_baseSize = 0;
+static ota_decode_output_t s_output = NULL;
+static ota_decode_base_t s_base = NULL;
+
+// inflate bằng miniz trong ROM: 11 KB trạng thái + 32 KB cửa sổ
+static tinfl_decompressor *s_inflator = NULL;
+static uint8_t *s_dict = NULL;
+static uint32_t s_dictOfs = 0;
+static bool s_inflateDone = false;
+static ota_delta_state_t s_delta;
+
+/*******************************************************************************
+ * Delta
+ ******************************************************************************/
+static uint32_t OtaDecode_le32(const uint8_t *data)
+{
+    return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static bool OtaDecode_copyBase(uint32_t offset, uint32_t len)
+{
+    if ((offset > s_baseSize) || (len > s_baseSize - offset)) {
+        log_error("Copy out of base: %lu + %lu > %lu", offset, len, s_baseSize);
+        return false;
+    }
+    while (len > 0) {
+        uint32_t n = MIN(len, OTA_DELTA_COPY_BUF_SIZE);
+        if (!s_base(offset, s_delta.copyBuf, n) || !s_output(s_delta.copyBuf, n)) {
+            return false;
+        }
+        offset += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool OtaDecode_deltaFeed(const uint8_t *data, uint32_t len)
+{
+    while (len > 0)
+    {
+        if (s_delta.literal > 0) {
+            uint32_t n = MIN(len, s_delta.literal);
+            if (!s_output(data, n)) {
+                return false;
+            }
+            data += n;
+            len -= n;
+            s_delta.literal -= n;
+            continue;
+        }
+
+        s_delta.hdr[s_delta.hdrLen++] = *data++;
+        len--;
+        uint8_t need = (s_delta.hdr[0] == OTA_DELTA_OP_COPY) ? 9 : (s_delta.hdr[0] == OTA_DELTA_OP_INSERT) ? 5 : 0;
+        if (need == 0) {
+            log_error("Invalid delta op: 0x%02x", s_delta.hdr[0]);
+            return false;
+        }
+        if (s_delta.hdrLen < need) {
+            continue;
+        }
+        s_delta.hdrLen = 0;
+        if (s_delta.hdr[0] == OTA_DELTA_OP_COPY) {
+            if (!OtaDecode_copyBase(OtaDecode_le32(&s_delta.hdr[1]), OtaDecode_le32(&s_delta.hdr[5]))) {
+                return false;
+            }
+        } else {
+            s_delta.literal = OtaDecode_le32(&s_delta.hdr[1]);
+        }
+    }
+    return true;
+}
+
+/*******************************************************************************
+ * Inflate
+ ******************************************************************************/
+static bool OtaDecode_consume(const uint8_t *data, uint32_t len)
+{
+    if (s_format == OTA_FORMAT_DELTA) {
+        return OtaDecode_deltaFeed(data, len);
+    }
+    return s_output(data, len);
+}
+
+static bool OtaDecode_inflate(const uint8_t *data, uint32_t len)
+{
+    while (!s_inflateDone)
+    {
+        size_t inBytes = len;
+        size_t outBytes = TINFL_LZ_DICT_SIZE - s_dictOfs;
+        tinfl_status status = tinfl_decompress(s_inflator, data, &inBytes, s_dict, s_dict + s_dictOfs, &outBytes,
+                                               TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+        data += inBytes;
+        len -= inBytes;
+        if (outBytes > 0) {
+            if (!OtaDecode_consume(s_dict + s_dictOfs, outBytes)) {
+                return false;
+            }
+            s_dictOfs = (s_dictOfs + outBytes) & (TINFL_LZ_DICT_SIZE - 1);
+        }
+        if (status < TINFL_STATUS_DONE) {
+            log_error("Inflate failed: %d", status);
+            return false;
+        }
+        if (status == TINFL_STATUS_DONE) {
+            s_inflateDone = true;
+        } else if ((status == TINFL_STATUS_NEEDS_MORE_INPUT) && (len == 0)) {
+            break;
+        }
+    }
+    // dữ liệu thừa sau luồng zlib: gói lỗi
+    return (len == 0);
+}
+
+/*******************************************************************************
+ * Application Funtions
+ ******************************************************************************/
+bool OtaDecode_begin(const ota_package_header_t *header, ota_decode_output_t output, ota_decode_base_t base)
+{
+    OtaDecode_end();
+
+    if ((header->magic != OTA_PACKAGE_MAGIC) || (header->version != OTA_PACKAGE_VERSION) || (header->headerLen < sizeof(ota_package_header_t))) {
+        log_error("Invalid package header");
+        return false;
+    }
+    if ((header->type != OTA_FORMAT_ZLIB) && (header->type != OTA_FORMAT_DELTA)) {
+        log_error("Unsupported package type: %d", header->type);
+        return false;
+    }
+
+    s_format = header->type;
+    s_baseSize = header->baseSize;
+    s_output = output;
+    s_base = base;
+    s_inflator = (tinfl_decompressor *)malloc(sizeof(tinfl_decompressor));
+    s_dict = (uint8_t *)malloc(TINFL_LZ_DICT_SIZE);
+    if (s_format == OTA_FORMAT_DELTA) {
+        s_delta.copyBuf = (uint8_t *)malloc(OTA_DELTA_COPY_BUF_SIZE);
+    }
+    if ((s_inflator == NULL) || (s_dict == NULL) || ((s_format == OTA_FORMAT_DELTA) && (s_delta.copyBuf == NULL))) {
+        log_error("Malloc decoder fail, free heap %lu", esp_get_free_heap_size());
+        OtaDecode_end();
+        return false;
+    }
+    tinfl_init(s_inflator);
+    log_warning("Package %s: target %lu bytes, base %lu bytes", OtaDecode_formatName(s_format), header->targetSize, header->baseSize);
+    return true;
+}
+
+bool OtaDecode_feed(const uint8_t *data, uint32_t len)
+{
+    if (s_inflator == NULL) {
+        return false;
+    }
+    return OtaDecode_inflate(data, len);
+}
+
+// luồng zlib đã kết thúc và không còn lệnh delta dở dang
+bool OtaDecode_finish()
+{
+    if (!s_inflateDone) {
+        log_error("Inflate not finished");
+        return false;
+    }
+    if ((s_delta.hdrLen > 0) || (s_delta.literal > 0)) {
+        log_error("Delta stream truncated");
+        return false;
+    }
+    return true;
+}
+
+void OtaDecode_end()
+{
+    free(s_inflator);
+    s_inflator = NULL;
+    free(s_dict);
+    s_dict = NULL;
+    free(s_delta.copyBuf);
+    memset(&s_delta, 0, sizeof(s_delta));
+    s_dictOfs = 0;
+    s_inflateDone = false;
+    s_format = OTA_FORMAT_RAW;
+}
+
+const char *OtaDecode_formatName(uint8_t format)
+{
+    switch (format) {
+    case OTA_FORMAT_ZLIB:
+        return "zlib";
+    case OTA_FORMAT_DELTA:
+        return "delta";
+    default:
+        return "raw";
+    }
+}
+
+/***********************************************/
@@ -0,0 +1,58 @@
+/**
+ ******************************************************************************
+ * @file    OTA_decode.h
+ * @author  HT EZLife Co.,LTD.
+ * @date    January 1, 2025
+ ******************************************************************************/
+
+#ifndef __OTA_DECODE_H
+#define __OTA_DECODE_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "Global.h"
+
+/* Exported types ------------------------------------------------------------*/
+typedef enum
+{
+    OTA_FORMAT_RAW = 0,         // file .bin của app, ghi thẳng
+    OTA_FORMAT_ZLIB,            // header + zlib(image)
+    OTA_FORMAT_DELTA,           // header + zlib(lệnh patch trên partition đang chạy)
+} ota_format_t;
+
+// header gói nén/delta, little-endian, tạo bằng tools/ota_patch.py
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;
+    uint8_t version;
+    uint8_t type;               // ota_format_t
+    uint16_t headerLen;
+    uint32_t targetSize;        // kích thước image sau giải nén/patch
+    uint32_t baseSize;          // delta: kích thước image gốc
+    uint8_t targetSha[32];      // SHA-256 của image sau giải nén/patch
+    uint8_t baseSha[32];        // delta: SHA-256 image gốc (esp_partition_get_sha256)
+} ota_package_header_t;
+
+// nhận dữ liệu image đã giải nén/patch
+typedef bool (*ota_decode_output_t)(const uint8_t *data, uint32_t len);
+// delta: đọc dữ liệu image gốc (partition đang chạy)
+typedef bool (*ota_decode_base_t)(uint32_t offset, uint8_t *data, uint32_t len);
+
+/* Exported macro ------------------------------------------------------------*/
+#define OTA_PACKAGE_MAGIC           0x414F5448      // "HTOA"
+#define OTA_PACKAGE_VERSION         1
+
+// lệnh trong luồng delta (sau giải nén):
+//  'C' <u32 srcOffset> <u32 len>   copy từ image gốc
+//  'I' <u32 len> <len byte>        chèn dữ liệu mới
+#define OTA_DELTA_OP_COPY           'C'
+#define OTA_DELTA_OP_INSERT         'I'
+#define OTA_DELTA_COPY_BUF_SIZE     1024
+
+/* Exported functions ------------------------------------------------------- */
+bool OtaDecode_begin(const ota_package_header_t *header, ota_decode_output_t output, ota_decode_base_t base);
+bool OtaDecode_feed(const uint8_t *data, uint32_t len);
+bool OtaDecode_finish();
+void OtaDecode_end();
+const char *OtaDecode_formatName(uint8_t format);
+
+#endif /* __OTA_DECODE_H */
@@ -0,0 +1,169 @@
+/**
+ ******************************************************************************
+ * @file    OTA_health.c
+ * @author  HT EZLife Co.,LTD.
+ * @date    January 1, 2025
+ ******************************************************************************/
+/*******************************************************************************
+ * Include
+ ******************************************************************************/
+#include "OTA_health.h"
+#include "FlashHandler.h"
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+#define TAG "Ota_Health"
+
+#ifndef DISABLE_LOG_ALL
+#define OTA_HEALTH_LOG_INFO_ON
+#endif
+
+#ifdef OTA_HEALTH_LOG_INFO_ON
+#define log_info(format, ...) ESP_LOGI(TAG, format, ##__VA_ARGS__)
+#define log_error(format, ...) ESP_LOGE(TAG, format, ##__VA_ARGS__)
+#define log_warning(format, ...) ESP_LOGW(TAG, format, ##__VA_ARGS__)
+#else
+#define log_info(format, ...)
+#define log_error(format, ...)
+#define log_warning(format, ...)
+#endif
+
+#define OTA_HEALTH_CHECK_PERIOD_US  (1000*1000)
+
+/*******************************************************************************
+ * Variables
+ ******************************************************************************/
+static bool s_pending = false;
+static uint8_t s_milestones = 0;
+static uint32_t s_timeToValidMs = 0;
+static esp_timer_handle_t s_healthTimer = NULL;
+static portMUX_TYPE s_healthLock = portMUX_INITIALIZER_UNLOCKED;
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+static void OtaHealth_check(void *arg);
+
+static const esp_timer_create_args_t s_healthTimerArgs = {
+    .callback = &OtaHealth_check,
+    .name = "otaHealth"
+};
+
+/*******************************************************************************
+ * Health Gate
+ ******************************************************************************/
+static void OtaHealth_saveRecord(uint8_t result, uint32_t elapsedMs)
+{
+    ota_health_record_t record = {
+        .magic = OTA_HEALTH_MAGIC,
+        .firmVer = FIRM_VER,
+        .result = result,
+        .milestones = s_milestones,
+        .elapsedMs = elapsedMs,
+    };
+    if (!FlashHandler_setDataSync(OTA_HEALTH_NAMESPACE, OTA_HEALTH_KEY_RECORD, &record, sizeof(record))) {
+        log_error("Save health record fail");
+    }
+}
+
+static void OtaHealth_stop()
+{
+    esp_timer_stop(s_healthTimer);
+    esp_timer_delete(s_healthTimer);
+    s_healthTimer = NULL;
+    s_pending = false;
+}
+
+// chạy trong task esp_timer mỗi giây, tới khi valid hoặc rollback
+static void OtaHealth_check(void *arg)
+{
+    uint32_t nowMs = (uint32_t)(esp_timer_get_time() / 1000);
+
+    if ((s_milestones & OTA_HEALTH_MILESTONE_ALL) == OTA_HEALTH_MILESTONE_ALL) {
+        esp_err_t err = esp_ota_mark_app_valid_cancel_rollback();
+        if (err != ESP_OK) {
+            log_error("Mark app valid fail: %s", esp_err_to_name(err));
+            return;
+        }
+        s_timeToValidMs = nowMs;
+        OtaHealth_saveRecord(OTA_HEALTH_RESULT_VALID, nowMs);
+        log_warning("Firmware %d valid after %lu ms", FIRM_VER, nowMs);
+        OtaHealth_stop();
+        return;
+    }
+
+    if (nowMs < OTA_HEALTH_DEADLINE_MS) {
+        return;
+    }
+
+    log_error("Health deadline: milestones 0x%02x/0x%02x, rollback", s_milestones, OTA_HEALTH_MILESTONE_ALL);
+    OtaHealth_saveRecord(OTA_HEALTH_RESULT_ROLLBACK, nowMs);
+    // reboot ngay, không qua ESP_resetChip
+    FlashHandler_flush();
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+    // chỉ tới đây khi không còn image cũ hợp lệ để quay lại
+    log_error("No app to rollback, keep running");
+    OtaHealth_stop();
+}
+
+/*******************************************************************************
+ * Application Funtions
+ ******************************************************************************/
+// gọi sớm trong app_main, sau Flash_Initialize
+void OtaHealth_begin()
+{
+    esp_ota_img_states_t state;
+    const esp_partition_t *running = esp_ota_get_running_partition();
+
+    if ((esp_ota_get_state_partition(running, &state) != ESP_OK) || (state != ESP_OTA_IMG_PENDING_VERIFY)) {
+        return;
+    }
+
+    log_warning("New firmware %d pending verify, deadline %d ms", FIRM_VER, OTA_HEALTH_DEADLINE_MS);
+    FlashHandler_eraseData(OTA_HEALTH_NAMESPACE, OTA_HEALTH_KEY_RECORD);
+    s_pending = true;
+    if ((esp_timer_create(&s_healthTimerArgs, &s_healthTimer) != ESP_OK) ||
+        (esp_timer_start_periodic(s_healthTimer, OTA_HEALTH_CHECK_PERIOD_US) != ESP_OK)) {
+        // không có timer: reset trước khi valid sẽ bị bootloader rollback
+        log_error("Start health timer fail");
+    }
+}
+
+void OtaHealth_setMilestone(uint8_t milestone)
+{
+    if (!s_pending || ((s_milestones & milestone) == milestone)) {
+        return;
+    }
+    portENTER_CRITICAL(&s_healthLock);
+    s_milestones |= milestone;
+    portEXIT_CRITICAL(&s_healthLock);
+    log_info("Milestone 0x%02x at %lu ms", milestone, (uint32_t)(esp_timer_get_time() / 1000));
+}
+
+bool OtaHealth_isPending()
+{
+    return s_pending;
+}
+
+// 0: boot này không phải lần đầu của image mới
+uint32_t OtaHealth_getTimeToValid()
+{
+    return s_timeToValidMs;
+}
+
+// image cũ chạy lại sau khi image mới bị rollback
+bool OtaHealth_getRollback(ota_health_record_t *record)
+{
+    if (!FlashHandler_getData(OTA_HEALTH_NAMESPACE, OTA_HEALTH_KEY_RECORD, record)) {
+        return false;
+    }
+    return (record->magic == OTA_HEALTH_MAGIC) && (record->result == OTA_HEALTH_RESULT_ROLLBACK) && (record->firmVer != FIRM_VER);
+}
+
+void OtaHealth_clearRecord()
+{
+    FlashHandler_eraseData(OTA_HEALTH_NAMESPACE, OTA_HEALTH_KEY_RECORD);
+}
+
+/***********************************************/
@@ -0,0 +1,56 @@
+/**
+ ******************************************************************************
+ * @file    OTA_health.h
+ * @author  HT EZLife Co.,LTD.
+ * @date    January 1, 2025
+ ******************************************************************************/
+
+#ifndef __OTA_HEALTH_H
+#define __OTA_HEALTH_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "Global.h"
+
+/* Exported types ------------------------------------------------------------*/
+// các mốc image mới phải đạt trước khi được đánh dấu valid
+typedef enum
+{
+    OTA_HEALTH_WIFI = 0x01,     // có IP
+    OTA_HEALTH_MQTT = 0x02,     // kết nối broker
+    OTA_HEALTH_BEACON = 0x04,   // phát iBeacon chấm công
+} ota_health_milestone_t;
+
+typedef enum
+{
+    OTA_HEALTH_RESULT_NONE = 0,
+    OTA_HEALTH_RESULT_VALID,
+    OTA_HEALTH_RESULT_ROLLBACK,
+} ota_health_result_t;
+
+// lưu NVS: image cũ đọc lại sau rollback để báo lên server
+typedef struct
+{
+    uint32_t magic;
+    uint16_t firmVer;           // FIRM_VER của image mới
+    uint8_t result;             // ota_health_result_t
+    uint8_t milestones;         // các mốc đã đạt
+    uint32_t elapsedMs;         // valid: thời gian từ lúc boot tới valid; rollback: deadline
+} ota_health_record_t;
+
+/* Exported macro ------------------------------------------------------------*/
+#define OTA_HEALTH_MILESTONE_ALL    (OTA_HEALTH_WIFI | OTA_HEALTH_MQTT | OTA_HEALTH_BEACON)
+// quá thời gian chưa đủ mốc thì quay lại image cũ (cần CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE)
+#define OTA_HEALTH_DEADLINE_MS      (5*60*1000)
+#define OTA_HEALTH_NAMESPACE        "ota_health"
+#define OTA_HEALTH_KEY_RECORD       "record"
+#define OTA_HEALTH_MAGIC            0x4F544856
+
+/* Exported functions ------------------------------------------------------- */
+void OtaHealth_begin();
+void OtaHealth_setMilestone(uint8_t milestone);
+bool OtaHealth_isPending();
+uint32_t OtaHealth_getTimeToValid();
+bool OtaHealth_getRollback(ota_health_record_t *record);
+void OtaHealth_clearRecord();
+
+#endif /* __OTA_HEALTH_H */
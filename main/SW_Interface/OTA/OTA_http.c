@@ -11,6 +11,14 @@
 #include "Wifi_Handler.h"
 #include "BLE_handler.h"
 #include "WatchDog.h"
+#include "FlashHandler.h"
+#include "HTG_Utility.h"
+#include "OTA_decode.h"
+#include "OTA_ble.h"
+#include "esp_crt_bundle.h"
+#include "esp_app_desc.h"
+#include "esp_app_format.h"
+#include "spi_flash_mmap.h"
 
 /*******************************************************************************
  * Definitions
@@ -35,20 +43,457 @@
  * Extern Variables
  ******************************************************************************/
 extern char *s_linkDownload;
+extern const uint8_t ota_sign_pub_pem_start[]      asm("_binary_ota_sign_pub_pem_start");
+extern const uint8_t ota_sign_pub_pem_end[]        asm("_binary_ota_sign_pub_pem_end");
+
+/*******************************************************************************
+ * Typedef Variables
+ ******************************************************************************/
+typedef struct
+{
+    uint8_t idx;
+    uint32_t len;               // 0: kết thúc
+} ota_ring_item_t;
+
+// checkpoint trong NVS: flash đã ghi và SHA-256 đã băm đến đúng offset (bội của OTA_RESUME_CHECKPOINT_STEP)
+typedef struct
+{
+    uint32_t magic;
+    uint32_t urlCrc;
+    uint32_t partAddr;
+    uint32_t offset;
+    uint32_t totalLen;          // 0: chưa biết (chunked)
+    uint32_t received;          // tổng byte đã tải, kể cả phần tải lại
+    uint8_t resumes;
+    uint8_t bootResumes;
+    char etag[OTA_RESUME_ETAG_MAX_LEN];
+    mbedtls_sha256_context sha; // bản clone dạng software, lưu/khôi phục bằng memcpy
+} ota_resume_ckpt_t;
 
 /*******************************************************************************
  * Variables
  ******************************************************************************/
 bool hasOtaTask = false;
-esp_ota_handle_t update_handle = 0;
 const esp_partition_t *update_partition = NULL;
 
+static uint8_t *s_ringBuf[OTA_RING_BUF_COUNT];
+static QueueHandle_t s_freeQueue = NULL;
+static QueueHandle_t s_fullQueue = NULL;
+static SemaphoreHandle_t s_writerDone = NULL;
+static volatile bool s_writeError = false;
+static ota_stats_t s_otaStats;
+static uint32_t s_writeOffset = 0;
+static uint32_t s_erasedEnd = 0;
+static uint32_t s_nextCheckpoint = 0;
+static uint32_t s_receivedBase = 0;
+static mbedtls_sha256_context s_sha;
+static ota_resume_ckpt_t s_ckpt;
+// lấy từ header response hiện tại
+static char s_etag[OTA_RESUME_ETAG_MAX_LEN];
+static uint32_t s_rangeStart = 0;
+static uint32_t s_rangeTotal = 0;
+// gói nén/delta: s_inOffset là byte của file tải, s_writeOffset là byte image đã ghi (raw: bằng nhau)
+static uint32_t s_inOffset = 0;
+static uint8_t s_format = OTA_FORMAT_RAW;
+static ota_package_header_t s_package;
+static uint8_t *s_outBuf = NULL;
+static uint32_t s_outLen = 0;
+static uint8_t s_runningSha[32];
+static ota_manifest_t s_manifest;
+// báo tiến độ
+static ota_progress_cb_t s_progressCb = NULL;
+static ota_progress_t s_progressLast;
+static int64_t s_progressLastUs = 0;
+static uint32_t s_progressLastBytes = 0;
+
 /*******************************************************************************
  * Prototypes
  ******************************************************************************/
 bool Init_Ota();
 void End_Ota();
 
+/*******************************************************************************
+ * Ring Buffer
+ ******************************************************************************/
+static void OtaHttp_ringDelete()
+{
+    for (uint8_t i = 0; i < OTA_RING_BUF_COUNT; i++) {
+        free(s_ringBuf[i]);
+        s_ringBuf[i] = NULL;
+    }
+    if (s_freeQueue != NULL) {
+        vQueueDelete(s_freeQueue);
+        s_freeQueue = NULL;
+    }
+    if (s_fullQueue != NULL) {
+        vQueueDelete(s_fullQueue);
+        s_fullQueue = NULL;
+    }
+    if (s_writerDone != NULL) {
+        vSemaphoreDelete(s_writerDone);
+        s_writerDone = NULL;
+    }
+}
+
+static bool OtaHttp_ringCreate()
+{
+    s_freeQueue = xQueueCreate(OTA_RING_BUF_COUNT, sizeof(uint8_t));
+    s_fullQueue = xQueueCreate(OTA_RING_BUF_COUNT + 1, sizeof(ota_ring_item_t));
+    s_writerDone = xSemaphoreCreateBinary();
+    if ((s_freeQueue == NULL) || (s_fullQueue == NULL) || (s_writerDone == NULL)) {
+        OtaHttp_ringDelete();
+        return false;
+    }
+    for (uint8_t i = 0; i < OTA_RING_BUF_COUNT; i++) {
+        s_ringBuf[i] = (uint8_t *)malloc(OTA_RING_BUF_SIZE);
+        if (s_ringBuf[i] == NULL) {
+            log_error("Malloc ring buffer %d fail", i);
+            OtaHttp_ringDelete();
+            return false;
+        }
+        xQueueSend(s_freeQueue, &i, 0);
+    }
+    return true;
+}
+
+// kiểm tra header ảnh ngay ở buffer đầu tiên, không đợi tải hết 1.7 MB mới biết sai file
+static bool OtaHttp_validateHeader(const uint8_t *data, uint32_t len)
+{
+    const esp_image_header_t *header = (const esp_image_header_t *)data;
+    const esp_app_desc_t *newDesc = (const esp_app_desc_t *)(data + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t));
+    const esp_app_desc_t *runDesc = esp_app_get_description();
+
+    if (len < OTA_IMAGE_HEADER_LEN) {
+        log_error("Image too short: %lu", len);
+        return false;
+    }
+    if (header->magic != ESP_IMAGE_HEADER_MAGIC) {
+        log_error("Invalid image magic: 0x%02x", header->magic);
+        return false;
+    }
+    if (header->chip_id != CONFIG_IDF_FIRMWARE_CHIP_ID) {
+        log_error("Invalid chip id: %d", header->chip_id);
+        return false;
+    }
+    if (newDesc->magic_word != ESP_APP_DESC_MAGIC_WORD) {
+        log_error("Invalid app desc magic: 0x%08lx", newDesc->magic_word);
+        return false;
+    }
+    if (strncmp(newDesc->project_name, runDesc->project_name, sizeof(newDesc->project_name)) != 0) {
+        log_error("Project mismatch: %s != %s", newDesc->project_name, runDesc->project_name);
+        return false;
+    }
+    log_warning("New image: %s %s (running %s)", newDesc->project_name, newDesc->version, runDesc->version);
+    return true;
+}
+
+/*******************************************************************************
+ * Resume Checkpoint
+ ******************************************************************************/
+// bắt đầu lại từ byte 0: checkpoint cũ không còn đúng với dữ liệu sẽ ghi
+static void OtaHttp_packageEnd()
+{
+    OtaDecode_end();
+    free(s_outBuf);
+    s_outBuf = NULL;
+    s_outLen = 0;
+    s_format = OTA_FORMAT_RAW;
+}
+
+static void OtaHttp_resetProgress()
+{
+    OtaHttp_packageEnd();
+    s_inOffset = 0;
+    s_writeOffset = 0;
+    s_erasedEnd = 0;
+    s_nextCheckpoint = OTA_RESUME_CHECKPOINT_STEP;
+    mbedtls_sha256_free(&s_sha);
+    mbedtls_sha256_init(&s_sha);
+    mbedtls_sha256_starts(&s_sha, 0);
+    s_ckpt.magic = 0;
+    s_ckpt.offset = 0;
+    s_ckpt.totalLen = 0;
+    s_ckpt.etag[0] = '\0';
+    FlashHandler_eraseData(OTA_RESUME_NAMESPACE, OTA_RESUME_KEY_CKPT);
+}
+
+static bool OtaHttp_loadCheckpoint(const char *url)
+{
+    bool result = false;
+    char *storedUrl = (char *)calloc(OTA_RESUME_URL_MAX_LEN, 1);
+    if (storedUrl == NULL) {
+        return false;
+    }
+    ota_manifest_t storedManifest = {0};
+    FlashHandler_getData(OTA_RESUME_NAMESPACE, OTA_RESUME_KEY_MANIFEST, &storedManifest);
+    if (FlashHandler_getData(OTA_RESUME_NAMESPACE, OTA_RESUME_KEY_CKPT, &s_ckpt) &&
+        FlashHandler_getData(OTA_RESUME_NAMESPACE, OTA_RESUME_KEY_URL, storedUrl)) {
+        result = (s_ckpt.magic == OTA_RESUME_MAGIC) &&
+                 (memcmp(&storedManifest, &s_manifest, sizeof(ota_manifest_t)) == 0) &&
+                 (s_ckpt.partAddr == update_partition->address) &&
+                 (s_ckpt.urlCrc == ht_check_crc32((uint8_t *)url, strlen(url))) &&
+                 (strncmp(storedUrl, url, OTA_RESUME_URL_MAX_LEN) == 0) &&
+                 (s_ckpt.offset > 0) && (s_ckpt.offset % OTA_RESUME_CHECKPOINT_STEP == 0) &&
+                 (s_ckpt.offset <= update_partition->size);
+    }
+    free(storedUrl);
+    return result;
+}
+
+static void OtaHttp_newCheckpoint(const char *url)
+{
+    memset(&s_ckpt, 0, sizeof(s_ckpt));
+    s_ckpt.urlCrc = ht_check_crc32((uint8_t *)url, strlen(url));
+    s_ckpt.partAddr = update_partition->address;
+    s_receivedBase = 0;
+    mbedtls_sha256_init(&s_sha);
+    OtaHttp_resetProgress();
+    FlashHandler_eraseData(OTA_RESUME_NAMESPACE, OTA_RESUME_KEY_RESULT);
+    FlashHandler_setDataSync(OTA_RESUME_NAMESPACE, OTA_RESUME_KEY_MANIFEST, &s_manifest, sizeof(ota_manifest_t));
+
+    // URL chỉ lưu 1 lần, checkpoint không phải ghi lại chuỗi dài
+    if (strlen(url) < OTA_RESUME_URL_MAX_LEN) {
+        char *storedUrl = (char *)calloc(OTA_RESUME_URL_MAX_LEN, 1);
+        if (storedUrl != NULL) {
+            strcpy(storedUrl, url);
+            FlashHandler_setDataSync(OTA_RESUME_NAMESPACE, OTA_RESUME_KEY_URL, storedUrl, OTA_RESUME_URL_MAX_LEN);
+            free(storedUrl);
+        }
+    } else {
+        log_warning("URL too long, resume after reset disabled");
+    }
+}
+
+static void OtaHttp_saveCheckpoint(uint32_t offset)
+{
+    s_ckpt.magic = OTA_RESUME_MAGIC;
+    s_ckpt.offset = offset;
+    s_ckpt.received = s_receivedBase + s_otaStats.bytes;
+    // clone đọc trạng thái SHA phần cứng ra ngữ cảnh software, s_sha vẫn băm tiếp bình thường
+    mbedtls_sha256_clone(&s_ckpt.sha, &s_sha);
+    if (!FlashHandler_setDataSync(OTA_RESUME_NAMESPACE, OTA_RESUME_KEY_CKPT, &s_ckpt, sizeof(s_ckpt))) {
+        log_error("Save checkpoint %lu fail", offset);
+    }
+}
+
+/*******************************************************************************
+ * Flash Writer
+ ******************************************************************************/
+// ghi thẳng vào partition, xoá từng block ngay trước vị trí ghi
+// (esp_ota_begin với OTA_SIZE_UNKNOWN xoá cả partition, không tải tiếp được)
+static bool OtaHttp_flashWrite(const uint8_t *data, uint32_t len)
+{
+    esp_err_t err;
+    uint32_t end = s_writeOffset + len;
+
+    if (end > update_partition->size) {
+        log_error("Image exceeds partition: %lu > %lu", end, update_partition->size);
+        return false;
+    }
+    if (end > s_erasedEnd) {
+        uint32_t eraseEnd = (end + OTA_FLASH_ERASE_STEP - 1) / OTA_FLASH_ERASE_STEP * OTA_FLASH_ERASE_STEP;
+        if (eraseEnd > update_partition->size) {
+            eraseEnd = update_partition->size;
+        }
+        err = esp_partition_erase_range(update_partition, s_erasedEnd, eraseEnd - s_erasedEnd);
+        if (err != ESP_OK) {
+            log_error("Erase 0x%lx failed: %s", s_erasedEnd, esp_err_to_name(err));
+            return false;
+        }
+        s_erasedEnd = eraseEnd;
+    }
+    err = esp_partition_write(update_partition, s_writeOffset, data, len);
+    if (err != ESP_OK) {
+        log_error("Write 0x%lx failed: %s", s_writeOffset, esp_err_to_name(err));
+        return false;
+    }
+    return true;
+}
+
+// băm dữ liệu đã ghi, tách đúng tại mốc checkpoint để SHA lưu khớp với offset
+static void OtaHttp_hashAndCheckpoint(const uint8_t *data, uint32_t len)
+{
+    uint32_t split = 0;
+
+    if (s_writeOffset + len >= s_nextCheckpoint) {
+        split = s_nextCheckpoint - s_writeOffset;
+        mbedtls_sha256_update(&s_sha, data, split);
+        OtaHttp_saveCheckpoint(s_nextCheckpoint);
+        s_nextCheckpoint += OTA_RESUME_CHECKPOINT_STEP;
+    }
+    mbedtls_sha256_update(&s_sha, data + split, len - split);
+}
+
+// kiểm tra header ở byte đầu tiên, ghi flash, băm
+static bool OtaHttp_commitImage(const uint8_t *data, uint32_t len)
+{
+    if ((s_writeOffset == 0) && !OtaHttp_validateHeader(data, len)) {
+        return false;
+    }
+    if (!OtaHttp_flashWrite(data, len)) {
+        return false;
+    }
+    OtaHttp_hashAndCheckpoint(data, len);
+    s_writeOffset += len;
+    return true;
+}
+
+static bool OtaHttp_outputFlush()
+{
+    bool result = (s_outLen == 0) || OtaHttp_commitImage(s_outBuf, s_outLen);
+    s_outLen = 0;
+    return result;
+}
+
+// dữ liệu giải nén/patch ra từng đoạn nhỏ, gom đủ OTA_DECODE_OUT_BUF_SIZE mới ghi flash
+static bool OtaHttp_output(const uint8_t *data, uint32_t len)
+{
+    while (len > 0) {
+        uint32_t n = MIN(len, OTA_DECODE_OUT_BUF_SIZE - s_outLen);
+        memcpy(s_outBuf + s_outLen, data, n);
+        s_outLen += n;
+        data += n;
+        len -= n;
+        if ((s_outLen == OTA_DECODE_OUT_BUF_SIZE) && !OtaHttp_outputFlush()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool OtaHttp_readBase(uint32_t offset, uint8_t *data, uint32_t len)
+{
+    esp_err_t err = esp_partition_read(esp_ota_get_running_partition(), offset, data, len);
+    if (err != ESP_OK) {
+        log_error("Read base 0x%lx failed: %s", offset, esp_err_to_name(err));
+        return false;
+    }
+    return true;
+}
+
+// nhận dạng file tải theo byte đầu: 0xE9 là image thường, "HTOA" là gói nén/delta
+static bool OtaHttp_beginPackage(const uint8_t *data, uint32_t len, uint32_t *headerLen)
+{
+    *headerLen = 0;
+    if (data[0] == ESP_IMAGE_HEADER_MAGIC) {
+        s_format = OTA_FORMAT_RAW;
+        return true;
+    }
+    if (len < sizeof(ota_package_header_t)) {
+        log_error("Unknown image format");
+        return false;
+    }
+    memcpy(&s_package, data, sizeof(ota_package_header_t));
+    if ((s_package.magic != OTA_PACKAGE_MAGIC) || (s_package.headerLen > len)) {
+        log_error("Unknown image format: 0x%08lx", s_package.magic);
+        return false;
+    }
+    if (s_package.targetSize > update_partition->size) {
+        log_error("Image %lu > partition %lu", s_package.targetSize, update_partition->size);
+        return false;
+    }
+    if ((s_package.type == OTA_FORMAT_DELTA) &&
+        ((s_package.baseSize > esp_ota_get_running_partition()->size) || (memcmp(s_package.baseSha, s_runningSha, sizeof(s_runningSha)) != 0))) {
+        log_error("Delta base is not the running image");
+        return false;
+    }
+    s_outBuf = (uint8_t *)malloc(OTA_DECODE_OUT_BUF_SIZE);
+    if ((s_outBuf == NULL) || !OtaDecode_begin(&s_package, OtaHttp_output, OtaHttp_readBase)) {
+        return false;
+    }
+    s_format = s_package.type;
+    // trạng thái inflate không lưu được: gói nén không có checkpoint, lỗi thì tải lại từ đầu
+    s_nextCheckpoint = UINT32_MAX;
+    *headerLen = s_package.headerLen;
+    return true;
+}
+
+static bool OtaHttp_finishPackage()
+{
+    if (!OtaDecode_finish() || !OtaHttp_outputFlush()) {
+        return false;
+    }
+    if (s_writeOffset != s_package.targetSize) {
+        log_error("Image size %lu != %lu", s_writeOffset, s_package.targetSize);
+        return false;
+    }
+    return true;
+}
+
+static void otaWriterTask(void *arg)
+{
+    ota_ring_item_t item;
+    int64_t beginUs;
+
+    while (1)
+    {
+        beginUs = esp_timer_get_time();
+        xQueueReceive(s_fullQueue, &item, portMAX_DELAY);
+        s_otaStats.writeStallMs += (esp_timer_get_time() - beginUs)/1000;
+        if (item.len == 0) {
+            break;
+        }
+        // lỗi ghi: vẫn trả buffer để task tải không bị treo
+        if (!s_writeError) {
+            uint32_t headerLen = 0;
+            uint8_t *data = s_ringBuf[item.idx];
+            beginUs = esp_timer_get_time();
+            if ((s_inOffset == 0) && !OtaHttp_beginPackage(data, item.len, &headerLen)) {
+                s_writeError = true;
+            } else if (s_format == OTA_FORMAT_RAW) {
+                s_writeError = !OtaHttp_commitImage(data, item.len);
+            } else {
+                s_writeError = !OtaDecode_feed(data + headerLen, item.len - headerLen);
+            }
+            s_inOffset += item.len;
+            s_otaStats.writeMs += (esp_timer_get_time() - beginUs)/1000;
+        }
+        xQueueSend(s_freeQueue, &item.idx, portMAX_DELAY);
+    }
+    xSemaphoreGive(s_writerDone);
+    vTaskDelete(NULL);
+}
+
+/*******************************************************************************
+ * Image Manifest
+ ******************************************************************************/
+static bool OtaHttp_verifySignature(const uint8_t *hash, const uint8_t *sig, size_t sigLen)
+{
+    mbedtls_pk_context pk;
+    mbedtls_pk_init(&pk);
+    // PEM nhúng dạng TEXT đã có '\0' cuối, độ dài tính cả '\0' theo yêu cầu mbedtls
+    int ret = mbedtls_pk_parse_public_key(&pk, ota_sign_pub_pem_start, ota_sign_pub_pem_end - ota_sign_pub_pem_start);
+    if (ret == 0) {
+        ret = mbedtls_pk_verify(&pk, MBEDTLS_MD_SHA256, hash, sizeof(s_manifest.sha), sig, sigLen);
+    }
+    mbedtls_pk_free(&pk);
+    if (ret != 0) {
+        log_error("Image signature invalid: -0x%04x", -ret);
+        return false;
+    }
+    return true;
+}
+
+// hash khớp manifest mới được đổi boot partition
+static bool OtaHttp_checkManifest(const uint8_t *digest)
+{
+    if (!s_manifest.valid) {
+#ifdef OTA_IMAGE_SIGN_REQUIRED
+        log_error("No signed image hash");
+        return false;
+#else
+        log_warning("No signed image hash, skip image check");
+        return true;
+#endif
+    }
+    if (memcmp(digest, s_manifest.sha, sizeof(s_manifest.sha)) != 0) {
+        log_error("Image SHA-256 does not match manifest");
+        return false;
+    }
+    log_warning("Image SHA-256 matches signed manifest");
+    return true;
+}
+
 /*******************************************************************************
  * Application Funtions
  ******************************************************************************/
@@ -61,23 +506,15 @@ esp_err_t downloadUpdateFile_callback(esp_http_client_event_t *evt)
     case HTTP_EVENT_ON_CONNECTED:
         log_warning("HTTP_EVENT_ON_CONNECTED");
         break;
-    case HTTP_EVENT_HEADER_SENT:
-        log_info("HTTP_EVENT_HEADER_SENT");
-        break;
     case HTTP_EVENT_ON_HEADER:
-        log_info("HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value);
-        break;
-    case HTTP_EVENT_ON_DATA:
-        log_info("HTTP_EVENT_ON_DATA, len=%d", evt->data_len);
-        if (!esp_http_client_is_chunked_response(evt->client)) {
-            printf(" -> esp_ota_write.%d\n", evt->data_len);
-            esp_ota_write(update_handle, (const void *)evt->data, (size_t)evt->data_len);
-            vTaskDelay(2/portTICK_PERIOD_MS);
+        if (strcasecmp(evt->header_key, "ETag") == 0) {
+            strncpy(s_etag, evt->header_value, OTA_RESUME_ETAG_MAX_LEN - 1);
+            s_etag[OTA_RESUME_ETAG_MAX_LEN - 1] = '\0';
+        } else if (strcasecmp(evt->header_key, "Content-Range") == 0) {
+            // "bytes <start>-<end>/<total>", total có thể là "*"
+            sscanf(evt->header_value, "bytes %lu-%*u/%lu", &s_rangeStart, &s_rangeTotal);
         }
         break;
-    case HTTP_EVENT_ON_FINISH:
-        log_warning("HTTP_EVENT_ON_FINISH");
-        break;
     case HTTP_EVENT_DISCONNECTED:
         log_error("HTTP_EVENT_DISCONNECTED");
         int mbedtls_err = 0;
@@ -93,44 +530,320 @@ esp_err_t downloadUpdateFile_callback(esp_http_client_event_t *evt)
     return ESP_OK;
 }
 
+/*******************************************************************************
+ * Progress
+ ******************************************************************************/
+static void OtaHttp_progressBegin()
+{
+    memset(&s_progressLast, 0, sizeof(s_progressLast));
+    s_progressLast.percent = OTA_PROGRESS_PERCENT_UNKNOWN;
+    s_progressLastUs = esp_timer_get_time();
+    s_progressLastBytes = 0;
+}
+
+// gọi trong task tải, chỉ báo khi đủ điều kiện throttle để không tranh băng thông với file OTA
+static void OtaHttp_reportProgress()
+{
+    if (s_progressCb == NULL) {
+        return;
+    }
+    int64_t nowUs = esp_timer_get_time();
+    uint32_t sinceMs = (nowUs - s_progressLastUs)/1000;
+    if (sinceMs < OTA_PROGRESS_REPORT_MIN_MS) {
+        return;
+    }
+
+    ota_progress_t progress = {
+        .percent = OTA_PROGRESS_PERCENT_UNKNOWN,
+        .retries = s_otaStats.retries,
+        .resumes = s_ckpt.resumes,
+        .offset = s_inOffset,
+        .total = s_ckpt.totalLen,
+        .bytesPerSec = (uint32_t)((uint64_t)(s_otaStats.bytes - s_progressLastBytes) * 1000 / sinceMs),
+    };
+    if (progress.total > 0) {
+        progress.percent = (uint8_t)MIN(100, (uint64_t)progress.offset * 100 / progress.total);
+    }
+    bool stepReached = (progress.percent != OTA_PROGRESS_PERCENT_UNKNOWN) &&
+                       ((s_progressLast.percent == OTA_PROGRESS_PERCENT_UNKNOWN) || (progress.percent >= s_progressLast.percent + OTA_PROGRESS_REPORT_STEP));
+    if (!stepReached && (progress.retries == s_progressLast.retries) && (sinceMs < OTA_PROGRESS_REPORT_MAX_MS)) {
+        return;
+    }
+
+    s_progressCb(&progress);
+    memcpy(&s_progressLast, &progress, sizeof(progress));
+    s_progressLastUs = nowUs;
+    s_progressLastBytes = s_otaStats.bytes;
+}
+
+static bool OtaHttp_readStream(esp_http_client_handle_t client)
+{
+    uint8_t idx;
+    int len = 0;
+    uint32_t fill;
+    uint32_t nextLog = OTA_PROGRESS_LOG_STEP;
+    int64_t beginUs;
+    int64_t startUs = esp_timer_get_time();
+
+    while (!s_writeError)
+    {
+        beginUs = esp_timer_get_time();
+        xQueueReceive(s_freeQueue, &idx, portMAX_DELAY);
+        s_otaStats.readStallMs += (esp_timer_get_time() - beginUs)/1000;
+
+        // đọc đầy 1 buffer lớn rồi mới chuyển cho task ghi
+        fill = 0;
+        while (fill < OTA_RING_BUF_SIZE) {
+            len = esp_http_client_read(client, (char *)s_ringBuf[idx] + fill, OTA_RING_BUF_SIZE - fill);
+            if (len <= 0) {
+                break;
+            }
+            fill += len;
+        }
+        if (fill > 0) {
+            ota_ring_item_t item = {idx, fill};
+            xQueueSend(s_fullQueue, &item, portMAX_DELAY);
+            s_otaStats.bytes += fill;
+        } else {
+            xQueueSend(s_freeQueue, &idx, 0);
+        }
+
+        if (s_otaStats.bytes >= nextLog) {
+            uint32_t ms = (esp_timer_get_time() - startUs)/1000;
+            log_warning("Downloaded %lu KB, %lu KB/s", s_otaStats.bytes/1024, (ms > 0) ? s_otaStats.bytes/ms : 0);
+            nextLog += OTA_PROGRESS_LOG_STEP;
+        }
+        OtaHttp_reportProgress();
+        if (len < 0) {
+            log_error("esp_http_client_read failed");
+            return false;
+        }
+        if (len == 0) {
+            return esp_http_client_is_complete_data_received(client);
+        }
+    }
+    return false;
+}
+
+// kiểm tra response: 206 tải tiếp từ s_writeOffset, 200 server gửi cả file (không hỗ trợ Range/ETag đổi) thì ghi lại từ 0
+static bool OtaHttp_acceptResponse(int status, int64_t contentLength)
+{
+    uint32_t total = 0;
+
+    if ((status == 206) && (s_inOffset > 0)) {
+        if (s_rangeStart != s_inOffset) {
+            log_error("Content-Range start %lu != offset %lu", s_rangeStart, s_inOffset);
+            OtaHttp_resetProgress();
+            return false;
+        }
+        if (s_rangeTotal > 0) {
+            total = s_rangeTotal;
+        } else if (contentLength > 0) {
+            total = (uint32_t)(s_inOffset + contentLength);
+        } else {
+            // chunked và "bytes x-y/*": chưa biết tổng, giữ theo checkpoint
+            total = s_ckpt.totalLen;
+        }
+        if ((s_ckpt.totalLen > 0) && (total != s_ckpt.totalLen)) {
+            log_error("Image size changed: %lu != %lu", total, s_ckpt.totalLen);
+            OtaHttp_resetProgress();
+            return false;
+        }
+    } else if (status == 200 || status == 201) {
+        if (s_inOffset > 0) {
+            log_warning("Server sent full image, restart from 0 (drop %lu bytes)", s_inOffset);
+            OtaHttp_resetProgress();
+        }
+        total = (contentLength > 0) ? contentLength : 0;
+    } else {
+        // 416: offset không còn hợp lệ với file trên server
+        if (status == 416) {
+            OtaHttp_resetProgress();
+        }
+        return false;
+    }
+
+    if (total > update_partition->size) {
+        log_error("Image %lu > partition %lu", total, update_partition->size);
+        s_writeError = true;
+        return false;
+    }
+    s_ckpt.totalLen = total;
+    if (strlen(s_etag) > 0) {
+        strcpy(s_ckpt.etag, s_etag);
+    }
+    return true;
+}
+
+static bool OtaHttp_downloadOnce(esp_http_client_config_t *config)
+{
+    bool result = false;
+    char range[32];
+
+    esp_http_client_handle_t client = esp_http_client_init(config);
+    if (client == NULL) {
+        return false;
+    }
+    if (s_inOffset > 0) {
+        sprintf(range, "bytes=%lu-", s_inOffset);
+        esp_http_client_set_header(client, "Range", range);
+        // file trên server đã đổi thì server trả 200 cả file thay vì 206
+        if (strlen(s_ckpt.etag) > 0) {
+            esp_http_client_set_header(client, "If-Range", s_ckpt.etag);
+        }
+    }
+    s_etag[0] = '\0';
+    s_rangeStart = 0;
+    s_rangeTotal = 0;
+
+    esp_err_t err = esp_http_client_open(client, 0);
+    if (err == ESP_OK) {
+        int64_t contentLength = esp_http_client_fetch_headers(client);
+        int status = esp_http_client_get_status_code(client);
+        log_warning("downloadUpdateFile status = %d, content_length = %lld, offset = %lu", status, contentLength, s_inOffset);
+        // chunked: content_length = -1, đọc đến hết, esp_http_client_read đã bỏ header chunk
+        if (OtaHttp_acceptResponse(status, contentLength)) {
+            if (xTaskCreate(otaWriterTask, "otaWriterTask", OTA_WRITER_TASK_STACK, NULL, OTA_WRITER_TASK_PRIORITY, NULL) == pdPASS) {
+                result = OtaHttp_readStream(client);
+                // báo kết thúc, chờ task ghi xả hết buffer
+                ota_ring_item_t endItem = {0, 0};
+                xQueueSend(s_fullQueue, &endItem, portMAX_DELAY);
+                xSemaphoreTake(s_writerDone, portMAX_DELAY);
+            }
+        }
+    } else {
+        log_error("downloadUpdateFile request failed: %s", esp_err_to_name(err));
+    }
+    esp_http_client_close(client);
+    esp_http_client_cleanup(client);
+    return result && !s_writeError;
+}
+
 bool downloadUpdateFile(char *linkFile)
 {
     if (Init_Ota() == false) {
         return false;
     }
+    if (OtaHttp_ringCreate() == false) {
+        return false;
+    }
 
     log_warning("start download file: %s", linkFile);
     bool result = false;
+    int64_t startUs = esp_timer_get_time();
+    memset(&s_otaStats, 0, sizeof(s_otaStats));
+    s_writeError = false;
+
+    if (OtaHttp_loadCheckpoint(linkFile)) {
+        s_writeOffset = s_ckpt.offset;
+        s_inOffset = s_ckpt.offset;
+        s_erasedEnd = s_ckpt.offset;
+        s_nextCheckpoint = s_ckpt.offset + OTA_RESUME_CHECKPOINT_STEP;
+        s_receivedBase = s_ckpt.received;
+        memcpy(&s_sha, &s_ckpt.sha, sizeof(s_sha));
+        s_ckpt.resumes++;
+        log_warning("Resume OTA at %lu/%lu, etag %s", s_writeOffset, s_ckpt.totalLen, s_ckpt.etag);
+    } else {
+        OtaHttp_newCheckpoint(linkFile);
+    }
+    s_otaStats.startOffset = s_inOffset;
+    OtaHttp_progressBegin();
+    // delta chỉ áp dụng được khi image gốc đúng là image đang chạy
+    if (esp_partition_get_sha256(esp_ota_get_running_partition(), s_runningSha) != ESP_OK) {
+        memset(s_runningSha, 0, sizeof(s_runningSha));
+    }
 
     esp_http_client_config_t config = {
         .url = linkFile,
         .event_handler = downloadUpdateFile_callback,
-        .transport_type = HTTP_TRANSPORT_OVER_TCP,
+        // http:// hoặc https:// theo link, HTTPS xác thực server bằng certificate bundle
+        .crt_bundle_attach = esp_crt_bundle_attach,
+        .buffer_size = OTA_HTTP_RX_BUFFER_SIZE,
         .buffer_size_tx = 1024,
+        .timeout_ms = OTA_HTTP_TIMEOUT_MS,
     };
-    esp_http_client_handle_t client = esp_http_client_init(&config);
 
-    esp_err_t err = esp_http_client_perform(client);
-    if (err == ESP_OK) {
-        log_warning("downloadUpdateFile status = %d, content_length = %lld", esp_http_client_get_status_code(client), esp_http_client_get_content_length(client));
-        if (esp_http_client_get_status_code(client) == 200 || esp_http_client_get_status_code(client) == 201) {
-            End_Ota();
-            result = true;
+    // mất kết nối: chờ wifi rồi tải tiếp từ byte đã ghi, không reset chip
+    for (uint8_t attempt = 0; (attempt <= OTA_RESUME_MAX_RETRY) && !result && !s_writeError; attempt++) {
+        if (attempt > 0) {
+            s_otaStats.retries++;
+            s_ckpt.resumes++;
+            vTaskDelay(OTA_RESUME_RETRY_DELAY_MS/portTICK_PERIOD_MS);
+            WIFI_HANDLER_WAIT_CONECTED_NOMAL_FOREVER;
+            if (s_format != OTA_FORMAT_RAW) {
+                OtaHttp_resetProgress();
+            }
+            log_warning("Retry %d/%d from offset %lu", attempt, OTA_RESUME_MAX_RETRY, s_inOffset);
+            OtaHttp_reportProgress();
         }
-    } else {
-        log_error("downloadUpdateFile request failed: %s", esp_err_to_name(err));
+        result = OtaHttp_downloadOnce(&config);
+    }
+    OtaHttp_ringDelete();
+    if (result && (s_format != OTA_FORMAT_RAW) && !OtaHttp_finishPackage()) {
+        result = false;
+        s_writeError = true;
     }
-    esp_http_client_cleanup(client);
 
-    return result;
+    s_otaStats.elapsedMs = (esp_timer_get_time() - startUs)/1000;
+    s_otaStats.format = s_format;
+    log_warning("OTA %lu bytes in %lu ms (%lu KB/s), read stall %lu ms, write stall %lu ms, flash write %lu ms", s_otaStats.bytes,
+                                                                                                            s_otaStats.elapsedMs,
+                                                                                                            (s_otaStats.elapsedMs > 0) ? s_otaStats.bytes/s_otaStats.elapsedMs : 0,
+                                                                                                            s_otaStats.readStallMs,
+                                                                                                            s_otaStats.writeStallMs,
+                                                                                                            s_otaStats.writeMs);
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&s_sha, digest);
+    // gói nén/delta: so SHA-256 image sau giải nén với header gói
+    if (result && (s_format != OTA_FORMAT_RAW) && (memcmp(digest, s_package.targetSha, sizeof(digest)) != 0)) {
+        log_error("Image SHA-256 mismatch");
+        result = false;
+        s_writeError = true;
+    }
+    if (result && !OtaHttp_checkManifest(digest)) {
+        result = false;
+        s_writeError = true;
+    }
+    if (result) {
+        mbedtls_sha256_free(&s_sha);
+
+        ota_result_t otaResult = {
+            .imageSize = s_writeOffset,
+            .transferSize = s_inOffset,
+            .downloaded = s_receivedBase + s_otaStats.bytes,
+            .elapsedMs = s_otaStats.elapsedMs,
+            .resumes = s_ckpt.resumes,
+            .format = s_format,
+        };
+        log_warning("Image %lu bytes (%s, file %lu bytes), downloaded %lu (re-downloaded %lu), resumes %d, sha256 %02x%02x%02x%02x...", otaResult.imageSize,
+                                                                                                            OtaDecode_formatName(otaResult.format),
+                                                                                                            otaResult.transferSize,
+                                                                                                            otaResult.downloaded,
+                                                                                                            otaResult.downloaded - otaResult.transferSize,
+                                                                                                            otaResult.resumes,
+                                                                                                            digest[0], digest[1], digest[2], digest[3]);
+        OtaHttp_packageEnd();
+        FlashHandler_eraseData(OTA_RESUME_NAMESPACE, OTA_RESUME_KEY_CKPT);
+        FlashHandler_setDataSync(OTA_RESUME_NAMESPACE, OTA_RESUME_KEY_RESULT, &otaResult, sizeof(otaResult));
+        End_Ota();
+        return true;
+    }
+
+    OtaHttp_packageEnd();
+    mbedtls_sha256_free(&s_sha);
+    if (s_writeError) {
+        // file sai hoặc lỗi flash: tải tiếp cũng vô ích
+        OTA_http_clearResume();
+    } else if (s_ckpt.magic == OTA_RESUME_MAGIC) {
+        // giữ checkpoint cuối, cập nhật số byte đã tải để báo phần tải lại
+        s_ckpt.received = s_receivedBase + s_otaStats.bytes;
+        FlashHandler_setDataSync(OTA_RESUME_NAMESPACE, OTA_RESUME_KEY_CKPT, &s_ckpt, sizeof(s_ckpt));
+    }
+    return false;
 }
 
 bool Init_Ota()
 {
-    esp_err_t err;
-    bool result = false;
-    /* update handle : set by esp_ota_begin(), must be freed via esp_ota_end() */
-
     log_warning(" --> Starting OTA ESP...");
 
     const esp_partition_t *configured = esp_ota_get_boot_partition();
@@ -142,29 +855,26 @@ bool Init_Ota()
     }
     printf(" ->> Running partition type %d subtype %d (offset 0x%08lx)\n", running->type, running->subtype, running->address);
 
-    update_partition = esp_ota_get_next_update_partition(NULL);
-    printf(" -->> Writing to partition subtype %d at offset 0x%lx\n", update_partition->subtype, update_partition->address);
-    assert(update_partition != NULL);
+    // thay cho kiểm tra ESP_ERR_OTA_ROLLBACK_INVALID_STATE của esp_ota_begin: image đang chạy chưa valid
+    // thì partition update là image cũ để rollback
+    esp_ota_img_states_t state;
+    if ((esp_ota_get_state_partition(running, &state) == ESP_OK) && (state == ESP_OTA_IMG_PENDING_VERIFY)) {
+        log_error("Running image pending verify, OTA not allowed");
+        return false;
+    }
 
-    err = esp_ota_begin(update_partition, OTA_SIZE_UNKNOWN, &update_handle);
-    if (err != ESP_OK) {
-        log_error("esp_ota_begin failed, error=%d", err);
-        result = false;
-        ESP_resetChip();
-    } else {
-        result = true;
-        log_warning(" ->> esp_ota_begin success");
+    update_partition = esp_ota_get_next_update_partition(NULL);
+    if ((update_partition == NULL) || (update_partition == running)) {
+        log_error("No OTA partition to write");
+        return false;
     }
-    return result;
+    printf(" -->> Writing to partition subtype %d at offset 0x%lx\n", update_partition->subtype, update_partition->address);
+    return true;
 }
 
 void End_Ota()
 {
-    if (esp_ota_end(update_handle) != ESP_OK) {
-        log_error("esp_ota_end failed!");
-        ESP_resetChip();
-    }
-
+    // esp_ota_set_boot_partition kiểm tra lại toàn bộ image (header, checksum, SHA-256 gắn cuối) trước khi đổi boot
     esp_err_t err = esp_ota_set_boot_partition(update_partition);
     if (err != ESP_OK) {
         log_error("esp_ota_set_boot_partition failed! err=0x%x", err);
@@ -181,7 +891,7 @@ static void otaTask(void *arg)
     uint32_t maxTimeOtaForEsp = 0;
 
     WIFI_HANDLER_WAIT_CONECTED_NOMAL_FOREVER;
-    BLE_releaseBle();
+    BLE_releaseForDownload();
     vTaskDelay(100/portTICK_PERIOD_MS);
 
     if (downloadUpdateFile(s_linkDownload)) {
@@ -220,6 +930,10 @@ void OTA_http_DoOTA(char *linkFile, uint8_t phase)
         log_error("Task OTA is running");
         return;
     }
+    if (OtaBle_isActive()) {
+        log_error("BLE OTA is running");
+        return;
+    }
 
     log_info("Do OTA link: %s", linkFile);
     if (phase == PHASE_OTA_ESP) {
@@ -232,4 +946,139 @@ void OTA_http_DoOTA(char *linkFile, uint8_t phase)
     OtaHttp_createDoOtaTask();
 }
 
+void OTA_http_getStats(ota_stats_t *stats)
+{
+    memcpy(stats, &s_otaStats, sizeof(ota_stats_t));
+}
+
+// gọi khi nhận LINK_UPDATE: xác thực chữ ký trên SHA-256 image trước khi tải
+bool OTA_http_setManifest(const char *shaHex, const char *sigHex)
+{
+    memset(&s_manifest, 0, sizeof(s_manifest));
+    if ((shaHex == NULL) && (sigHex == NULL)) {
+#ifdef OTA_IMAGE_SIGN_REQUIRED
+        log_error("Manifest without image hash");
+        return false;
+#else
+        log_warning("LINK_UPDATE without manifest, image not authenticated");
+        return true;
+#endif
+    }
+    if ((shaHex == NULL) || (sigHex == NULL) || (ht_hex_to_bytes(shaHex, s_manifest.sha, sizeof(s_manifest.sha)) != sizeof(s_manifest.sha))) {
+        log_error("Invalid image hash");
+        return false;
+    }
+
+    uint8_t *sig = (uint8_t *)malloc(OTA_IMAGE_SIG_MAX_LEN);
+    if (sig == NULL) {
+        return false;
+    }
+    int sigLen = ht_hex_to_bytes(sigHex, sig, OTA_IMAGE_SIG_MAX_LEN);
+    s_manifest.valid = (sigLen > 0) && OtaHttp_verifySignature(s_manifest.sha, sig, sigLen);
+    free(sig);
+    return s_manifest.valid;
+}
+
+// false: LINK_UPDATE không kèm manifest, image sẽ không được xác thực
+bool OTA_http_hasManifest()
+{
+    return s_manifest.valid;
+}
+
+// như OTA_http_setManifest, hash/chữ ký dạng nhị phân (OTA qua BLE), sigLen = 0: không có chữ ký
+bool OTA_http_setManifestRaw(const uint8_t *sha, const uint8_t *sig, size_t sigLen)
+{
+    memset(&s_manifest, 0, sizeof(s_manifest));
+    if (sigLen == 0) {
+#ifdef OTA_IMAGE_SIGN_REQUIRED
+        log_error("Manifest without image signature");
+        return false;
+#else
+        return true;
+#endif
+    }
+    memcpy(s_manifest.sha, sha, sizeof(s_manifest.sha));
+    s_manifest.valid = OtaHttp_verifySignature(s_manifest.sha, sig, sigLen);
+    return s_manifest.valid;
+}
+
+// luôn cần manifest đã ký hợp lệ (OTA qua BLE)
+bool OTA_http_checkImage(const uint8_t *digest)
+{
+    if (!s_manifest.valid) {
+        log_error("No signed image hash");
+        return false;
+    }
+    return OtaHttp_checkManifest(digest);
+}
+
+bool OTA_http_validateImageHeader(const uint8_t *data, uint32_t len)
+{
+    return OtaHttp_validateHeader(data, len);
+}
+
+bool OTA_http_isRunning()
+{
+    return hasOtaTask;
+}
+
+// sau reset khi OTA chưa xong: còn checkpoint hợp lệ thì tải tiếp thay vì báo Ota_Fail
+bool OTA_http_resume()
+{
+    if (hasOtaTask || (s_linkDownload != NULL)) {
+        return false;
+    }
+    char *url = (char *)calloc(OTA_RESUME_URL_MAX_LEN, 1);
+    if (url == NULL) {
+        return false;
+    }
+    if (!FlashHandler_getData(OTA_RESUME_NAMESPACE, OTA_RESUME_KEY_URL, url) ||
+        !FlashHandler_getData(OTA_RESUME_NAMESPACE, OTA_RESUME_KEY_CKPT, &s_ckpt) ||
+        (s_ckpt.magic != OTA_RESUME_MAGIC)) {
+        free(url);
+        return false;
+    }
+    // manifest đã xác thực lúc nhận LINK_UPDATE, tải tiếp vẫn so hash như lần đầu
+    memset(&s_manifest, 0, sizeof(s_manifest));
+    if (!FlashHandler_getData(OTA_RESUME_NAMESPACE, OTA_RESUME_KEY_MANIFEST, &s_manifest)) {
+        free(url);
+        return false;
+    }
+    if (s_ckpt.bootResumes >= OTA_RESUME_MAX_BOOT) {
+        log_error("Resume OTA after reset: limit %d reached", OTA_RESUME_MAX_BOOT);
+        free(url);
+        OTA_http_clearResume();
+        return false;
+    }
+    s_ckpt.bootResumes++;
+    FlashHandler_setDataSync(OTA_RESUME_NAMESPACE, OTA_RESUME_KEY_CKPT, &s_ckpt, sizeof(s_ckpt));
+
+    log_warning("Resume OTA after reset (%d/%d) at %lu/%lu", s_ckpt.bootResumes, OTA_RESUME_MAX_BOOT, s_ckpt.offset, s_ckpt.totalLen);
+    s_linkDownload = url;
+    OTA_http_DoOTA(s_linkDownload, PHASE_OTA_ESP);
+    return true;
+}
+
+void OTA_http_clearResume()
+{
+    FlashHandler_eraseData(OTA_RESUME_NAMESPACE, OTA_RESUME_KEY_CKPT);
+    FlashHandler_eraseData(OTA_RESUME_NAMESPACE, OTA_RESUME_KEY_URL);
+    FlashHandler_eraseData(OTA_RESUME_NAMESPACE, OTA_RESUME_KEY_RESULT);
+    FlashHandler_eraseData(OTA_RESUME_NAMESPACE, OTA_RESUME_KEY_MANIFEST);
+}
+
+// đọc 1 lần sau khi boot vào image mới, xoá luôn để không báo lặp
+bool OTA_http_getLastResult(ota_result_t *result)
+{
+    memset(result, 0, sizeof(ota_result_t));
+    bool found = FlashHandler_getData(OTA_RESUME_NAMESPACE, OTA_RESUME_KEY_RESULT, result);
+    OTA_http_clearResume();
+    return found;
+}
+
+void OTA_http_setProgressCallback(ota_progress_cb_t callback)
+{
+    s_progressCb = callback;
+}
+
 /***********************************************/
\ No newline at end of file
@@ -18,10 +18,112 @@ typedef enum
     PHASE_OTA_ESP,
 } phase_ota_mcu;
 
+typedef struct
+{
+    uint32_t bytes;
+    uint32_t elapsedMs;
+    uint32_t readStallMs;       // reader chờ buffer trống (flash chậm hơn mạng)
+    uint32_t writeStallMs;      // writer chờ dữ liệu (mạng chậm hơn flash)
+    uint32_t writeMs;
+    uint32_t startOffset;       // byte bắt đầu của lần tải này (>0: tải tiếp từ checkpoint)
+    uint8_t retries;            // số lần mở lại kết nối trong phiên
+    uint8_t format;             // ota_format_t
+} ota_stats_t;
+
+// kết quả lần cập nhật gần nhất, giữ qua reset để báo cùng Ota_Success
+typedef struct
+{
+    uint32_t imageSize;
+    uint32_t transferSize;      // kích thước file tải (raw: bằng imageSize)
+    uint32_t downloaded;        // tổng byte đã tải, kể cả phần tải lại
+    uint32_t elapsedMs;         // thời gian phiên tải cuối
+    uint8_t resumes;            // số lần tải tiếp (mất kết nối hoặc reset)
+    uint8_t format;             // ota_format_t
+} ota_result_t;
+
+// tiến độ tải gửi lên server qua callback (ProtocolHandler publish Ota_Progress)
+typedef struct
+{
+    uint8_t percent;            // OTA_PROGRESS_PERCENT_UNKNOWN: chunked, chưa biết kích thước
+    uint8_t retries;            // số lần mở lại kết nối trong phiên
+    uint8_t resumes;            // tổng số lần tải tiếp, kể cả sau reset
+    uint32_t offset;            // byte của file đã nhận
+    uint32_t total;             // 0: chưa biết
+    uint32_t bytesPerSec;       // tốc độ từ lần báo trước
+} ota_progress_t;
+
+typedef void (*ota_progress_cb_t)(const ota_progress_t *progress);
+
+// SHA-256 image lấy từ manifest đã xác thực chữ ký, so với SHA-256 tính khi ghi
+typedef struct
+{
+    bool valid;
+    uint8_t sha[32];
+} ota_manifest_t;
+
 /* Exported macro ------------------------------------------------------------*/
 #define MAX_TIME_OTA_FOR_ESP    (5*60000)
 
+// Task tải (otaTask) đọc HTTP vào ring buffer, task ghi (otaWriterTask) ghi flash song song
+#define OTA_RING_BUF_COUNT          4
+#define OTA_RING_BUF_SIZE           (8*1024)
+#define OTA_HTTP_RX_BUFFER_SIZE     4096
+#define OTA_HTTP_TIMEOUT_MS         10000
+#define OTA_WRITER_TASK_STACK       (4*1024)
+#define OTA_WRITER_TASK_PRIORITY    6
+#define OTA_PROGRESS_LOG_STEP       (128*1024)
+// báo tiến độ: cách nhau ít nhất MIN_MS và tăng ít nhất STEP %, hoặc quá MAX_MS / có retry mới
+#define OTA_PROGRESS_REPORT_MIN_MS  10000
+#define OTA_PROGRESS_REPORT_MAX_MS  60000
+#define OTA_PROGRESS_REPORT_STEP    10
+#define OTA_PROGRESS_PERCENT_UNKNOWN 0xFF
+// image header + segment header + esp_app_desc_t, cần có trong buffer đầu tiên để kiểm tra
+#define OTA_IMAGE_HEADER_LEN        (sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t))
+// gói nén/delta (tools/ota_patch.py): gom dữ liệu giải nén trước khi ghi flash
+// thêm ~48 KB heap khi OTA (inflate 11 KB + cửa sổ 32 KB + buffer này + buffer copy delta)
+#define OTA_DECODE_OUT_BUF_SIZE     4096
+// xoá flash theo block 64 KB trước vị trí ghi, không xoá cả partition lúc bắt đầu
+#define OTA_FLASH_ERASE_STEP        (64*1024)
+
+// Tải tiếp: lưu checkpoint (offset, SHA-256 đến offset, URL, ETag) vào NVS mỗi OTA_RESUME_CHECKPOINT_STEP
+// mất kết nối thì mở lại với Range: bytes=<offset>-, reset chip thì tải tiếp sau khi boot
+#define OTA_RESUME_NAMESPACE        "ota_resume"
+#define OTA_RESUME_KEY_CKPT         "ckpt"
+#define OTA_RESUME_KEY_URL          "url"
+#define OTA_RESUME_KEY_RESULT       "result"
+#define OTA_RESUME_KEY_MANIFEST     "manifest"
+#define OTA_RESUME_MAGIC            0x4F544152
+#define OTA_RESUME_CHECKPOINT_STEP  (64*1024)      // bội của OTA_FLASH_ERASE_STEP
+#define OTA_RESUME_URL_MAX_LEN      512
+#define OTA_RESUME_ETAG_MAX_LEN     64
+#define OTA_RESUME_MAX_RETRY        5              // số lần mở lại kết nối trong 1 phiên
+#define OTA_RESUME_RETRY_DELAY_MS   3000
+#define OTA_RESUME_MAX_BOOT         3              // số lần tải tiếp sau reset trước khi báo Ota_Fail
+
+// LINK_UPDATE: "sha256" (hex) và "imageSig" (hex, chữ ký DER ECDSA P-256/RSA trên SHA-256 image sau giải nén)
+// ký bằng tools/ota_patch.py sign, khoá công khai nhúng từ main/ota_sign_pub.pem
+// chỉ đổi boot partition khi SHA-256 tính lúc ghi khớp manifest
+#define OTA_IMAGE_SIG_MAX_LEN       512
+// bật khi server đã gửi sha256/imageSig cho mọi bản tin LINK_UPDATE, không có thì từ chối OTA
+// Lộ trình (Check_Data_Valid báo "Manifest":"signed"/"missing" để theo dõi):
+//  - 2026-10-19: thay khoá tạm trong main/ota_sign_pub.pem bằng khoá release (ota_patch.py keygen)
+//  - 2026-11-16: server gửi manifest ký cho mọi LINK_UPDATE, bản tin "missing" coi là lỗi server
+//  - 2027-01-04: bản firmware đầu tiên bật OTA_IMAGE_SIGN_REQUIRED, nếu 30 ngày không còn "missing"
+// #define OTA_IMAGE_SIGN_REQUIRED
+
 /* Exported functions ------------------------------------------------------- */
 void OTA_http_DoOTA(char *linkFile, uint8_t phase);
+void OTA_http_getStats(ota_stats_t *stats);
+bool OTA_http_setManifest(const char *shaHex, const char *sigHex);
+bool OTA_http_hasManifest();
+bool OTA_http_resume();
+void OTA_http_clearResume();
+bool OTA_http_getLastResult(ota_result_t *result);
+void OTA_http_setProgressCallback(ota_progress_cb_t callback);
+// dùng chung cho OTA qua BLE (OTA_ble.c)
+bool OTA_http_setManifestRaw(const uint8_t *sha, const uint8_t *sig, size_t sigLen);
+bool OTA_http_checkImage(const uint8_t *digest);
+bool OTA_http_validateImageHeader(const uint8_t *data, uint32_t len);
+bool OTA_http_isRunning();
 
 #endif /* __OTA_HTTP_H */
@@ -19,6 +19,7 @@
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include <inttypes.h>
 #include <time.h>
 #include <sys/time.h>
@@ -0,0 +1,106 @@
+/**
+ ******************************************************************************
+ * @file    HTG_Cbor.c
+ * @author  HT EZLife Co.,LTD.
+ * @date    January 1, 2025
+ ******************************************************************************/
+/*******************************************************************************
+ * Include
+ ******************************************************************************/
+#include "HTG_Cbor.h"
+
+/*******************************************************************************
+ * Private Functions
+ ******************************************************************************/
+static void ht_cbor_put(ht_cbor_t *cbor, const uint8_t *data, size_t len)
+{
+	if (cbor->overflow || (cbor->len + len > cbor->cap)) {
+		cbor->overflow = true;
+		return;
+	}
+	memcpy(cbor->buf + cbor->len, data, len);
+	cbor->len += len;
+}
+
+// header: 3 bit major type + giá trị/độ dài dạng ngắn nhất
+static void ht_cbor_head(ht_cbor_t *cbor, uint8_t major, uint64_t value)
+{
+	uint8_t head[9];
+	size_t len = 0;
+
+	if (value < 24) {
+		head[len++] = (major << 5) | (uint8_t)value;
+	} else if (value <= 0xFF) {
+		head[len++] = (major << 5) | 24;
+		head[len++] = (uint8_t)value;
+	} else if (value <= 0xFFFF) {
+		head[len++] = (major << 5) | 25;
+		head[len++] = (uint8_t)(value >> 8);
+		head[len++] = (uint8_t)value;
+	} else if (value <= 0xFFFFFFFF) {
+		head[len++] = (major << 5) | 26;
+		for (int i = 3; i >= 0; i--) {
+			head[len++] = (uint8_t)(value >> (i*8));
+		}
+	} else {
+		head[len++] = (major << 5) | 27;
+		for (int i = 7; i >= 0; i--) {
+			head[len++] = (uint8_t)(value >> (i*8));
+		}
+	}
+	ht_cbor_put(cbor, head, len);
+}
+
+/*******************************************************************************
+ * Application Funtions
+ ******************************************************************************/
+void ht_cbor_init(ht_cbor_t *cbor, uint8_t *buf, size_t cap)
+{
+	cbor->buf = buf;
+	cbor->cap = cap;
+	cbor->len = 0;
+	cbor->overflow = false;
+}
+
+void ht_cbor_uint(ht_cbor_t *cbor, uint64_t value)
+{
+	ht_cbor_head(cbor, HT_CBOR_UINT, value);
+}
+
+void ht_cbor_int(ht_cbor_t *cbor, int64_t value)
+{
+	if (value >= 0) {
+		ht_cbor_head(cbor, HT_CBOR_UINT, (uint64_t)value);
+	} else {
+		ht_cbor_head(cbor, HT_CBOR_NEGINT, (uint64_t)(-1 - value));
+	}
+}
+
+void ht_cbor_bool(ht_cbor_t *cbor, bool value)
+{
+	ht_cbor_head(cbor, HT_CBOR_SIMPLE, value ? 21 : 20);
+}
+
+void ht_cbor_text(ht_cbor_t *cbor, const char *text, size_t len)
+{
+	ht_cbor_head(cbor, HT_CBOR_TEXT, len);
+	ht_cbor_put(cbor, (const uint8_t *)text, len);
+}
+
+void ht_cbor_bytes(ht_cbor_t *cbor, const uint8_t *data, size_t len)
+{
+	ht_cbor_head(cbor, HT_CBOR_BYTES, len);
+	ht_cbor_put(cbor, data, len);
+}
+
+void ht_cbor_array(ht_cbor_t *cbor, size_t count)
+{
+	ht_cbor_head(cbor, HT_CBOR_ARRAY, count);
+}
+
+void ht_cbor_map(ht_cbor_t *cbor, size_t count)
+{
+	ht_cbor_head(cbor, HT_CBOR_MAP, count);
+}
+
+/***********************************************/
@@ -0,0 +1,43 @@
+/**
+ ******************************************************************************
+ * @file    HTG_Cbor.h
+ * @author  HT EZLife Co.,LTD.
+ * @date    January 1, 2025
+ ******************************************************************************/
+
+#ifndef __HTG_CBOR_H
+#define __HTG_CBOR_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "Global.h"
+
+/* Exported types ------------------------------------------------------------*/
+typedef struct
+{
+	uint8_t *buf;
+	size_t cap;
+	size_t len;
+	bool overflow;
+} ht_cbor_t;
+
+/* Exported macro ------------------------------------------------------------*/
+// Major type CBOR (RFC 8949)
+#define HT_CBOR_UINT        0
+#define HT_CBOR_NEGINT      1
+#define HT_CBOR_BYTES       2
+#define HT_CBOR_TEXT        3
+#define HT_CBOR_ARRAY       4
+#define HT_CBOR_MAP         5
+#define HT_CBOR_SIMPLE      7
+
+/* Exported functions ------------------------------------------------------- */
+void ht_cbor_init(ht_cbor_t *cbor, uint8_t *buf, size_t cap);
+void ht_cbor_uint(ht_cbor_t *cbor, uint64_t value);
+void ht_cbor_int(ht_cbor_t *cbor, int64_t value);
+void ht_cbor_bool(ht_cbor_t *cbor, bool value);
+void ht_cbor_text(ht_cbor_t *cbor, const char *text, size_t len);
+void ht_cbor_bytes(ht_cbor_t *cbor, const uint8_t *data, size_t len);
+void ht_cbor_array(ht_cbor_t *cbor, size_t count);
+void ht_cbor_map(ht_cbor_t *cbor, size_t count);
+
+#endif /* __HTG_CBOR_H */
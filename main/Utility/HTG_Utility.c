@@ -80,6 +80,38 @@ uint32_t ht_check_crc32(uint8_t *data, size_t length)
     return crc ^ 0xFFFFFFFF;
 }
 
+static int ht_hex_nibble(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// chuỗi hex -> byte, trả về số byte, -1 nếu sai định dạng hoặc quá maxLen
+int ht_hex_to_bytes(const char *hex, uint8_t *out, size_t maxLen)
+{
+    size_t len = strlen(hex);
+    if ((len % 2 != 0) || (len/2 > maxLen)) {
+        return -1;
+    }
+    for (size_t i = 0; i < len/2; i++) {
+        int hi = ht_hex_nibble(hex[2*i]);
+        int lo = ht_hex_nibble(hex[2*i + 1]);
+        if ((hi < 0) || (lo < 0)) {
+            return -1;
+        }
+        out[i] = (uint8_t)((hi << 4) | lo);
+    }
+    return len/2;
+}
+
 void ht_hmac_sha1(uint8_t *key, size_t key_len, uint8_t *message, size_t message_len, uint8_t *output) 
 {
     mbedtls_md_context_t ctx;
@@ -204,112 +236,8 @@ uint32_t ht_gen_topt()
 }
 
 /*******************************************************************************
- * Generate Signature Functions
+ * Verify Signature Functions
  ******************************************************************************/
-char *ht_convert_escaped_newlines(const char *input, char *output)
-{
-    size_t len = strlen(input);
-    if (!output) {
-        return NULL;
-    }
-
-    size_t j = 0;
-    for (size_t i = 0; i < len; i++) {
-        if (input[i] == '\\' && input[i + 1] == 'n') {
-            output[j++] = '\n';
-            i++; // skip 'n'
-        } else {
-            output[j++] = input[i];
-        }
-    }
-    output[j] = '\0';
-    return output;
-}
-
-void ht_gen_signature(const char *rsa_private_key_pem)
-{
-    int ret;
-    const char *pers = (const char*)DEVICE_PWD;
-    char *output_pem = (char *)malloc(strlen(rsa_private_key_pem) + 1);
-    char signature_string[1025] = "";
-    char message_temp[100] = "";
-
-    mbedtls_pk_context pk;
-    mbedtls_entropy_context entropy;
-    mbedtls_ctr_drbg_context ctr_drbg;
-
-    uint8_t hash[32];
-    uint8_t signature[512];
-    size_t sig_len = 0;
-
-    sprintf(message_temp, "%s:%s", g_product_Id, DEVICE_KEY_SIGN);
-    const uint8_t *message = (const uint8_t *)message_temp;
-
-    // Init
-    mbedtls_pk_init(&pk);
-    mbedtls_entropy_init(&entropy);
-    mbedtls_ctr_drbg_init(&ctr_drbg);
-
-    ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, (const uint8_t *)pers, strlen(pers));
-    if (ret != 0) {
-        printf("Seed failed: -0x%04X\n", -ret);
-        goto cleanup;
-    }
-
-    // Convert PEM Key
-    char *pem_clean = ht_convert_escaped_newlines(rsa_private_key_pem, output_pem);
-    if (!pem_clean) {
-        printf("Memory allocation failed for PEM key conversion.\n");
-        goto cleanup;
-    }
-    printf(">>PEM Key:\n%s\n", pem_clean);
-
-    ret = mbedtls_pk_parse_key(&pk, (const uint8_t *)pem_clean, strlen(pem_clean) + 1, NULL, 0, mbedtls_ctr_drbg_random, &ctr_drbg);
-    if (ret != 0) {
-        printf("Key parse failed: -0x%04X\n", -ret);
-        goto cleanup;
-    }
-
-    if (!mbedtls_pk_can_do(&pk, MBEDTLS_PK_RSA)) {
-        printf("Key is not an RSA private key!\n");
-        goto cleanup;
-    }
-
-    // SHA-256 Hash
-    ret = mbedtls_sha256(message, strlen((const char *)message), hash, 0);
-    if (ret != 0) {
-        printf("mbedtls_sha256 failed: -0x%04X\n", -ret);
-        goto cleanup;
-    }
-
-    printf(">>SHA256 hash of message:\n");
-    for (int i = 0; i < 32; i++) {
-        printf("%02x", hash[i]);
-    }
-    printf("\n");
-
-    // Sign
-    ret = mbedtls_pk_sign(&pk, MBEDTLS_MD_SHA256, hash, sizeof(hash), signature, sizeof(signature), &sig_len, mbedtls_ctr_drbg_random, &ctr_drbg);
-    if (ret != 0) {
-        printf("RSA-SHA256 sign failed: -0x%04X\n", -ret);
-        goto cleanup;
-    }
-
-    printf(">>Signature (%d bytes):\n", (int)sig_len);
-    MQTT_SubscribeTopicGetCert();
-    vTaskDelay(100/portTICK_PERIOD_MS);
-    for (size_t i = 0; i < sig_len; i++) {
-        sprintf(signature_string + (i*2), "%02x", signature[i]);
-    }
-    MQTT_PublishRequestGetCert(signature_string);
-
-cleanup:
-    free(output_pem);
-    mbedtls_pk_free(&pk);
-    mbedtls_ctr_drbg_free(&ctr_drbg);
-    mbedtls_entropy_free(&entropy);
-}
-
 void build_payload_json(char* dest, char* model, char* url)
 {
     sprintf(dest, "{\"model\":\"%s\",\"url\":\"%s\"}", model, url);
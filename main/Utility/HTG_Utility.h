@@ -23,6 +23,7 @@ void ht_print_data(uint8_t *data, uint32_t len);
 void ht_print_binary(uint8_t data);
 uint16_t ht_check_crc16(uint8_t *data, size_t length);
 uint32_t ht_check_crc32(uint8_t *data, size_t length);
+int ht_hex_to_bytes(const char *hex, uint8_t *out, size_t maxLen);
 void ht_hmac_sha1(uint8_t *key, size_t key_len, uint8_t *message, size_t message_len, uint8_t *output);
 uint32_t ht_generate_totp(uint8_t *key, size_t key_len, uint64_t timestamp);
 
@@ -40,7 +41,6 @@ void md5_checksum_serial_number();
 uint32_t ht_check_crc32_sn_device();
 uint32_t ht_gen_topt();
 
-void ht_gen_signature(const char *rsa_private_key_pem);
 bool verify_ota_signature(char* model, char* url, char* received_sig_hex, char* ota_secret_key);
 
 #endif /* __HTG_UTILITY_H */
\ No newline at end of file
@@ -110,7 +110,7 @@ void activeDevice(void* arg)
         	wait_time_active.hour++;
     	}
 		if (wait_time_active.hour == 48) {
-			updateInfoActiveDevice();
+			confirmInfoActiveDevice();
 			begin_active_device = true;
 			Flash_saveBeginActive();
 			Flash_saveWaitTimeActive();
@@ -128,7 +128,7 @@ void activeDevice(void* arg)
     	}
 		
 		if (end_active_device) {
-			updateInfoActiveDevice();
+			confirmInfoActiveDevice();
 			Flash_saveEndActived();
 			Flash_saveTimeActived();
 			log_info("Device SN: %s actived success", g_product_Id);
@@ -223,7 +223,7 @@ void Flash_loadDataActiveDevice()
 
 bool Flash_saveBeginActive()
 {
-    if (FlashHandler_setData(NAME_SPACE_ACTIVE_DEVICE, KEY_BEGIN_ACTIVE_DEVICE, &begin_active_device, sizeof(begin_active_device))) {
+    if (FlashHandler_setDataSync(NAME_SPACE_ACTIVE_DEVICE, KEY_BEGIN_ACTIVE_DEVICE, &begin_active_device, sizeof(begin_active_device))) {
         // log_info("Set begin active success");
 		return true;
     } else {
@@ -234,7 +234,7 @@ bool Flash_saveBeginActive()
 
 bool Flash_saveEndActived()
 {
-    if (FlashHandler_setData(NAME_SPACE_ACTIVE_DEVICE, KEY_END_ACTIVE_DEVICE, &end_active_device, sizeof(end_active_device))) {
+    if (FlashHandler_setDataSync(NAME_SPACE_ACTIVE_DEVICE, KEY_END_ACTIVE_DEVICE, &end_active_device, sizeof(end_active_device))) {
         // log_info("Set end actived success");
 		return true;
     } else {
@@ -277,11 +277,23 @@ bool checkRealTimeLocal()
 	}
 }
 
+void getInfoActiveDevice(char* data)
+{
+	sprintf(data,"{\"time\":\"%lu:%02d:00\",\"confirm\":\"%d\"}", time_actived.hour, time_actived.minute, end_active_device);
+}
+
 void updateInfoActiveDevice()
 {
 	char data[50];			
-	sprintf(data,"{\"time\":\"%lu:%02d:00\",\"confirm\":\"%d\"}", time_actived.hour, time_actived.minute, end_active_device);
+	getInfoActiveDevice(data);
 	MQTT_PublishTimeActiveDevice(data);
 }
 
+void confirmInfoActiveDevice()
+{
+	char data[50];
+	getInfoActiveDevice(data);
+	MQTT_PublishConfirmActiveDevice(data);
+}
+
 /***********************************************/
\ No newline at end of file
@@ -72,6 +72,8 @@ bool Flash_saveTimeActived();
 
 /* Functions callback-------------------------------------------------------- */
 bool checkRealTimeLocal();
+void getInfoActiveDevice(char* data);
 void updateInfoActiveDevice();
+void confirmInfoActiveDevice();
 
 #endif /* __TIME_CHECK_H */
@@ -0,0 +1,494 @@
+#!/usr/bin/env python3
+"""
+Client OTA qua BLE cho fw-beacon (service 0x12ED, thiết bị: main/SW_Interface/OTA/OTA_ble.c).
+
+  ble_ota_client.py send <address> <new.bin> --sig sig.der     cần thư viện bleak, ghép đôi BLE
+  ble_ota_client.py simulate <new.bin|--size N> [--mtu 500] [--interval 15] [--loss 0.01] ...
+  ble_ota_client.py selftest
+
+Giao thức (little-endian), characteristic điều khiển 0xED01 (write, notify):
+  BEGIN 0x01 <u32 size> <sha256[32]> <chữ ký DER>  -> 0x81 <status> <u32 offset> <u16 chunk> <u8 window>
+  END   0x02                                       -> 0x82 <status>
+  ABORT 0x03                                       -> 0x83 <status>
+                                                   <- 0x84 <u32 offset> ACK, 0x85 <u32 offset> NAK
+characteristic dữ liệu 0xED02 (write without response): <u32 offset> <tối đa chunk byte>
+
+Client gửi kiểu go-back-N: tối đa window gói chưa ACK, NAK hoặc quá thời gian chờ thì
+gửi lại từ offset thiết bị báo. Mất kết nối thì kết nối lại và gửi lại BEGIN cùng image,
+thiết bị trả offset đã nhận để tải tiếp (chỉ trong cùng 1 lần boot).
+
+simulate chạy client với mô hình thiết bị + đường truyền (MTU, DLE, connection interval,
+số gói mỗi connection event, mất gói, mất kết nối, tốc độ ghi flash) để so sánh cấu hình.
+Chữ ký bắt buộc, lấy từ "ota_patch.py sign" (in hex) rồi đổi sang file DER. ED01/ED02 chỉ
+ghi được khi link đã mã hoá: hệ điều hành sẽ hỏi ghép đôi ở lần ghi đầu tiên.
+"""
+
+import argparse
+import asyncio
+import hashlib
+import random
+import struct
+import sys
+
+OP_BEGIN = 0x01
+OP_END = 0x02
+OP_ABORT = 0x03
+RSP_FLAG = 0x80
+EVT_ACK = 0x84
+EVT_NAK = 0x85
+
+STATUS = ["OK", "BUSY", "INVALID", "SIGNATURE", "FLASH", "HASH", "NO_MEM"]
+ST_OK, ST_BUSY, ST_INVALID, ST_SIGNATURE, ST_FLASH, ST_HASH, ST_NO_MEM = range(7)
+
+# khớp OTA_ble.h
+DATA_HEADER_LEN = 4
+ATT_OVERHEAD = 3
+CHUNK_MAX = 512 - DATA_HEADER_LEN
+STREAM_BUF_SIZE = 8 * 1024
+WINDOW_MAX = 32
+WRITE_BUF_SIZE = 4096
+ESP_IMAGE_MAGIC = 0xE9
+
+SERVICE_UUID = "000012ed-0000-1000-8000-00805f9b34fb"
+CONTROL_UUID = "0000ed01-0000-1000-8000-00805f9b34fb"
+DATA_UUID = "0000ed02-0000-1000-8000-00805f9b34fb"
+
+# mô phỏng không kiểm chữ ký thật, chỉ cần có (thiết bị thật kiểm bằng main/ota_sign_pub.pem)
+SIM_SIGNATURE = b"\x30" * 70
+
+# thời gian chờ ACK trước khi gửi lại từ offset đã xác nhận
+ACK_TIMEOUT_S = 1.0
+
+
+def begin_packet(image, sig=b""):
+    return struct.pack("<BI", OP_BEGIN, len(image)) + hashlib.sha256(image).digest() + sig
+
+
+def data_packet(image, offset, chunk):
+    return struct.pack("<I", offset) + image[offset:offset + chunk]
+
+
+def parse_notify(data):
+    """Trả về (loại, giá trị): ("begin", (status, offset, chunk, window)), ("ack", offset)..."""
+    op = data[0]
+    if op == OP_BEGIN | RSP_FLAG:
+        status, offset, chunk, window = struct.unpack_from("<BIHB", data, 1)
+        return "begin", (status, offset, chunk, window)
+    if op == OP_END | RSP_FLAG:
+        return "end", data[1]
+    if op == OP_ABORT | RSP_FLAG:
+        return "abort", data[1]
+    if op == EVT_ACK:
+        return "ack", struct.unpack_from("<I", data, 1)[0]
+    if op == EVT_NAK:
+        return "nak", struct.unpack_from("<I", data, 1)[0]
+    raise ValueError("unknown notify 0x%02x" % op)
+
+
+class Sender:
+    """Trạng thái go-back-N phía client, dùng chung cho BLE thật và mô phỏng."""
+
+    def __init__(self, image):
+        self.image = image
+        self.chunk = 20
+        self.window = 2
+        self.acked = 0
+        self.next = 0
+        self.sent = 0
+        self.retransmits = 0
+        self.resumes = 0
+
+    def on_begin(self, offset, chunk, window):
+        if offset > 0:
+            self.resumes += 1
+        self.acked = offset
+        self.next = offset
+        self.chunk = chunk
+        self.window = window
+
+    def can_send(self):
+        return self.next < len(self.image) and (self.next - self.acked) < self.window * self.chunk
+
+    def next_packet(self):
+        pkt = data_packet(self.image, self.next, self.chunk)
+        self.next += len(pkt) - DATA_HEADER_LEN
+        self.sent += 1
+        return pkt
+
+    def on_ack(self, offset):
+        if offset > self.acked:
+            self.acked = offset
+        if self.next < self.acked:
+            self.next = self.acked
+
+    def rewind(self, offset):
+        """NAK hoặc hết thời gian chờ: gửi lại từ offset thiết bị đã nhận."""
+        self.on_ack(offset)
+        self.retransmits += (self.next - self.acked + self.chunk - 1) // self.chunk
+        self.next = self.acked
+
+    def done(self):
+        return self.acked == len(self.image)
+
+
+# ------------------------------------------------------------------ mô phỏng
+class SimDevice:
+    """Bản tham chiếu của OTA_ble.c: stream buffer 8 KB, task ghi flash theo buffer 4 KB."""
+
+    def __init__(self, mtu, flash_bps, notify):
+        self.mtu = mtu
+        self.flash_bps = flash_bps
+        self.notify = notify
+        self.active = False
+        self.image_size = 0
+        self.sha = b""
+        self.offset = 0
+        self.stream = bytearray()
+        self.written = bytearray()
+        self.write_credit = 0.0
+        self.since_ack = 0
+        self.nak_offset = None
+        self.chunk = 0
+        self.window = 0
+        self.naks = 0
+        self.dropped = 0
+        self.resumes = 0
+        self.rebooted = False
+
+    def update_window(self):
+        self.chunk = min(self.mtu - ATT_OVERHEAD - DATA_HEADER_LEN, CHUNK_MAX)
+        self.window = max(2, min(WINDOW_MAX, (STREAM_BUF_SIZE // 2) // self.chunk))
+        self.since_ack = 0
+        self.nak_offset = None
+
+    def on_control(self, data):
+        op = data[0]
+        if op == OP_BEGIN:
+            status = self.begin(data)
+            self.notify(struct.pack("<BBIHB", OP_BEGIN | RSP_FLAG, status,
+                                    self.offset if self.active else 0, self.chunk, self.window))
+        elif op == OP_END:
+            if not self.active or self.offset != self.image_size:
+                self.notify(bytes([OP_END | RSP_FLAG, ST_INVALID]))
+                return
+            self.flush_all()
+            image = bytes(self.written)
+            status = ST_OK
+            if image[:1] != bytes([ESP_IMAGE_MAGIC]):
+                status = ST_INVALID
+            elif hashlib.sha256(image).digest() != self.sha:
+                status = ST_HASH
+            self.notify(bytes([OP_END | RSP_FLAG, status]))
+            self.active = False
+            self.rebooted = status == ST_OK
+        elif op == OP_ABORT:
+            self.active = False
+            self.notify(bytes([OP_ABORT | RSP_FLAG, ST_OK]))
+
+    def begin(self, data):
+        size, sha = struct.unpack_from("<I32s", data, 1)
+        if self.active:
+            if size == self.image_size and sha == self.sha:
+                self.resumes += 1
+                self.update_window()
+                return ST_OK
+            return ST_BUSY
+        if len(data) <= 1 + 4 + 32:
+            return ST_SIGNATURE
+        if size == 0:
+            return ST_INVALID
+        self.active = True
+        self.image_size = size
+        self.sha = sha
+        self.offset = 0
+        self.stream = bytearray()
+        self.written = bytearray()
+        self.update_window()
+        return ST_OK
+
+    def on_data(self, data):
+        if not self.active or len(data) <= DATA_HEADER_LEN:
+            return
+        (offset,) = struct.unpack_from("<I", data)
+        payload = data[DATA_HEADER_LEN:]
+        if (offset != self.offset or len(payload) > self.image_size - offset
+                or STREAM_BUF_SIZE - len(self.stream) < len(payload)):
+            self.dropped += 1
+            if offset >= self.offset and self.nak_offset != self.offset:
+                self.nak_offset = self.offset
+                self.naks += 1
+                self.notify(struct.pack("<BI", EVT_NAK, self.offset))
+            return
+        self.stream.extend(payload)
+        self.offset += len(payload)
+        self.nak_offset = None
+        self.since_ack += 1
+        if self.since_ack >= self.window // 2 or self.offset == self.image_size:
+            self.since_ack = 0
+            self.notify(struct.pack("<BI", EVT_ACK, self.offset))
+
+    def run_writer(self, dt):
+        """Task ghi lấy từ stream buffer theo tốc độ erase + write của flash."""
+        self.write_credit += self.flash_bps * dt
+        n = min(len(self.stream), int(self.write_credit))
+        self.written.extend(self.stream[:n])
+        del self.stream[:n]
+        self.write_credit = min(self.write_credit - n, WRITE_BUF_SIZE)
+
+    def flush_all(self):
+        self.written.extend(self.stream)
+        self.stream = bytearray()
+
+
+class SimLink:
+    """Đường truyền theo connection event: mỗi event gửi tối đa pkts_per_event gói LL."""
+
+    def __init__(self, args, rng):
+        self.interval = args.interval / 1000.0
+        self.pkts_per_event = args.pkts_per_event
+        self.ll_payload = 251 if args.dle else 27
+        self.loss = args.loss
+        self.rng = rng
+
+    def ll_packets(self, att_len):
+        # L2CAP header 4 byte
+        return -(-(att_len + 4) // self.ll_payload)
+
+    def lost(self):
+        return self.rng.random() < self.loss
+
+
+def simulate(image, args, sig=SIM_SIGNATURE, corrupt=False, quiet=False):
+    """Chạy 1 lần OTA mô phỏng, trả về dict kết quả."""
+    rng = random.Random(args.seed)
+    link = SimLink(args, rng)
+    to_client = []
+    device = SimDevice(args.mtu, args.flash_kbps * 1024, to_client.append)
+    sender = Sender(image)
+    payload = bytearray(image)
+    if corrupt:
+        payload[len(payload) // 2] ^= 0xFF
+    sender.image = bytes(payload)
+
+    t = 0.0
+    last_progress = 0.0
+    disconnect_at = int(len(image) * args.disconnect) if args.disconnect else None
+    begin_sent = False
+    connected = True
+    reconnect_at = 0.0
+    end_status = None
+
+    while t < args.max_time:
+        if not connected:
+            if t >= reconnect_at:
+                connected = True
+                begin_sent = False
+            else:
+                t += link.interval
+                continue
+
+        if not begin_sent:
+            device.on_control(begin_packet(image, sig))
+            begin_sent = True
+            last_progress = t
+
+        budget = link.pkts_per_event
+        # notify của thiết bị đi trong cùng connection event, trước dữ liệu kế tiếp
+        while to_client and budget > 0:
+            kind, value = parse_notify(to_client.pop(0))
+            budget -= 1
+            if kind == "begin":
+                status, offset, chunk, window = value
+                if status != ST_OK:
+                    return {"status": STATUS[status], "time": t}
+                sender.on_begin(offset, chunk, window)
+            elif kind == "ack":
+                if value > sender.acked:
+                    last_progress = t
+                sender.on_ack(value)
+            elif kind == "nak":
+                sender.rewind(value)
+            elif kind == "end":
+                end_status = value
+        if end_status is not None:
+            break
+
+        if sender.done():
+            if device.active:
+                device.on_control(bytes([OP_END]))
+        elif t - last_progress > ACK_TIMEOUT_S:
+            sender.rewind(sender.acked)
+            last_progress = t
+
+        while budget > 0 and sender.can_send():
+            pkt = sender.next_packet()
+            need = link.ll_packets(len(pkt) + ATT_OVERHEAD)
+            if need > budget:
+                # gói không vừa event này: gửi ở event sau
+                sender.next -= len(pkt) - DATA_HEADER_LEN
+                sender.sent -= 1
+                break
+            budget -= need
+            if not link.lost():
+                device.on_data(pkt)
+            if disconnect_at is not None and device.offset >= disconnect_at:
+                disconnect_at = None
+                connected = False
+                reconnect_at = t + args.reconnect
+                to_client.clear()
+                break
+
+        device.run_writer(link.interval)
+        t += link.interval
+
+    result = {
+        "status": STATUS[end_status] if end_status is not None else "TIMEOUT",
+        "time": t,
+        "bps": len(image) / t if t > 0 else 0,
+        "chunk": sender.chunk,
+        "window": sender.window,
+        "sent": sender.sent,
+        "retransmits": sender.retransmits,
+        "naks": device.naks,
+        "dropped": device.dropped,
+        "resumes": device.resumes,
+        "image_ok": bytes(device.written) == image,
+    }
+    if not quiet:
+        print("%-8s %7.1f s %7.1f KB/s  chunk %3d window %2d  sent %5d retx %4d nak %3d drop %4d resume %d"
+              % (result["status"], result["time"], result["bps"] / 1024, result["chunk"], result["window"],
+                 result["sent"], result["retransmits"], result["naks"], result["dropped"], result["resumes"]))
+    return result
+
+
+def sim_args(**kw):
+    args = argparse.Namespace(mtu=500, interval=15.0, pkts_per_event=6, dle=True, loss=0.0, disconnect=0.0,
+                              reconnect=3.0, flash_kbps=80, seed=1, max_time=3600.0)
+    for key, value in kw.items():
+        setattr(args, key, value)
+    return args
+
+
+def fake_image(size, seed=1):
+    rng = random.Random(seed)
+    image = bytearray(rng.getrandbits(8) for _ in range(size))
+    image[0] = ESP_IMAGE_MAGIC
+    return bytes(image)
+
+
+def selftest():
+    image = fake_image(256 * 1024)
+    cases = [
+        ("clean", sim_args(), "OK", 0),
+        ("loss 2%", sim_args(loss=0.02), "OK", 0),
+        ("disconnect 40%", sim_args(disconnect=0.4), "OK", 1),
+        ("mtu 23 no dle", sim_args(mtu=23, dle=False), "OK", 0),
+    ]
+    for name, args, status, resumes in cases:
+        print("%-16s" % name, end="")
+        r = simulate(image, args)
+        if r["status"] != status or not r["image_ok"] or r["resumes"] != resumes:
+            raise AssertionError("%s: %r" % (name, r))
+    # dữ liệu khác SHA-256 trong BEGIN phải bị từ chối
+    print("%-16s" % "bad hash", end="")
+    r = simulate(image, sim_args(), corrupt=True)
+    if r["status"] != "HASH":
+        raise AssertionError("bad hash accepted: %r" % r)
+    # BEGIN không có chữ ký phải bị từ chối
+    r = simulate(image, sim_args(), sig=b"", quiet=True)
+    print("%-16s%s" % ("no signature", r["status"]))
+    if r["status"] != "SIGNATURE":
+        raise AssertionError("unsigned image accepted: %r" % r)
+    print("selftest ok")
+
+
+def run_simulate(image, args):
+    print("image %d bytes, mtu %d, interval %.1f ms, %d pkt/event, dle %s, loss %.1f%%, flash %d KB/s"
+          % (len(image), args.mtu, args.interval, args.pkts_per_event, "on" if args.dle else "off",
+             args.loss * 100, args.flash_kbps))
+    simulate(image, args)
+
+
+# ------------------------------------------------------------------ BLE thật
+async def send(address, image, sig):
+    from bleak import BleakClient  # chỉ cần khi gửi tới thiết bị thật
+
+    sender = Sender(image)
+    queue = asyncio.Queue()
+
+    async with BleakClient(address) as client:
+        await client.start_notify(CONTROL_UUID, lambda _, data: queue.put_nowait(parse_notify(bytes(data))))
+        await client.write_gatt_char(CONTROL_UUID, begin_packet(image, sig), response=True)
+        kind, (status, offset, chunk, window) = await asyncio.wait_for(queue.get(), 10)
+        if status != ST_OK:
+            raise RuntimeError("BEGIN: %s" % STATUS[status])
+        sender.on_begin(offset, chunk, window)
+        print("begin offset %d chunk %d window %d" % (offset, chunk, window))
+
+        while not sender.done():
+            while sender.can_send():
+                await client.write_gatt_char(DATA_UUID, sender.next_packet(), response=False)
+            try:
+                kind, value = await asyncio.wait_for(queue.get(), ACK_TIMEOUT_S)
+            except asyncio.TimeoutError:
+                sender.rewind(sender.acked)
+                continue
+            if kind == "ack":
+                sender.on_ack(value)
+                print("\r%d/%d" % (sender.acked, len(image)), end="", flush=True)
+            elif kind == "nak":
+                sender.rewind(value)
+            elif kind == "end":
+                raise RuntimeError("device stopped: %s" % STATUS[value])
+        print()
+
+        await client.write_gatt_char(CONTROL_UUID, bytes([OP_END]), response=True)
+        while True:
+            kind, value = await asyncio.wait_for(queue.get(), 60)
+            if kind == "end":
+                break
+        print("end: %s, retransmits %d" % (STATUS[value], sender.retransmits))
+        return value == ST_OK
+
+
+def read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("send")
+    p.add_argument("address")
+    p.add_argument("new")
+    p.add_argument("--sig", required=True, help="chữ ký DER của SHA-256 image")
+    p = sub.add_parser("simulate")
+    p.add_argument("new", nargs="?")
+    p.add_argument("--size", type=int, default=1024 * 1024)
+    p.add_argument("--mtu", type=int, default=500)
+    p.add_argument("--interval", type=float, default=15.0, help="connection interval (ms)")
+    p.add_argument("--pkts-per-event", type=int, default=6, help="số gói LL mỗi connection event")
+    p.add_argument("--no-dle", dest="dle", action="store_false")
+    p.add_argument("--loss", type=float, default=0.0, help="tỉ lệ mất gói dữ liệu")
+    p.add_argument("--disconnect", type=float, default=0.0, help="mất kết nối tại tỉ lệ image (0-1)")
+    p.add_argument("--reconnect", type=float, default=3.0, help="thời gian kết nối lại (s)")
+    p.add_argument("--flash-kbps", type=int, default=80, help="tốc độ erase + write flash")
+    p.add_argument("--seed", type=int, default=1)
+    p.add_argument("--max-time", type=float, default=3600.0)
+    sub.add_parser("selftest")
+    args = parser.parse_args()
+
+    if args.cmd == "send":
+        sig = read(args.sig)
+        return 0 if asyncio.run(send(args.address, read(args.new), sig)) else 1
+    if args.cmd == "simulate":
+        image = read(args.new) if args.new else fake_image(args.size)
+        run_simulate(image, args)
+        return 0
+    selftest()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
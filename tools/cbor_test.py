@@ -0,0 +1,305 @@
+#!/usr/bin/env python3
+"""
+Kiểm tra main/Utility/HTG_Cbor.c trên máy host (gcc, không cần ESP-IDF).
+
+  cbor_test.py selftest [--cc gcc]
+  cbor_test.py encode <payload.json> [--schema a,b,c] [--cc gcc]
+
+HTG_Cbor.c chỉ dùng C chuẩn: copy sang thư mục tạm cùng Global.h rút gọn, build kèm harness
+đọc lệnh từ stdin (u/i/b/t/y/a/m + tham số, text/bytes dạng hex), in ra "len overflow hex".
+
+selftest:
+  - so byte với vector RFC 8949 Appendix A và các biên độ dài header (23/24, 0xFF/0x100, ...)
+  - encode payload JSON như MQTT_cborValue (key trong schema thành số thứ tự), giải mã lại
+    bằng cbor2 (nếu có, không thì decoder tối giản bên dưới) và so với json.loads
+  - buffer thiếu chỗ: overflow = true, không ghi quá cap
+"""
+
+import argparse
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+CBOR_DIR = os.path.join(ROOT, "main", "Utility")
+
+# Global.h thật kéo theo ESP-IDF, HTG_Cbor.c chỉ cần các header chuẩn
+GLOBAL_H = """#ifndef __GLOBAL_H
+#define __GLOBAL_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#endif
+"""
+
+HARNESS_C = r"""#include <stdio.h>
+#include <stdlib.h>
+#include "HTG_Cbor.h"
+
+static size_t unhex(const char *s, uint8_t *out)
+{
+	size_t n = 0;
+	unsigned int v;
+	while ((s[0] != '\0') && (s[0] != '\n') && (sscanf(s, "%2x", &v) == 1)) {
+		out[n++] = (uint8_t)v;
+		s += 2;
+	}
+	return n;
+}
+
+int main(void)
+{
+	static char line[65536];
+	static uint8_t data[32768];
+	size_t cap = 0;
+	if ((fgets(line, sizeof(line), stdin) == NULL) || (sscanf(line, "cap %zu", &cap) != 1)) {
+		return 2;
+	}
+	// đệm canary sau cap để bắt ghi tràn
+	uint8_t *buf = malloc(cap + 16);
+	memset(buf, 0xA5, cap + 16);
+	ht_cbor_t cbor;
+	ht_cbor_init(&cbor, buf, cap);
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		char *arg = line + 2;
+		switch (line[0]) {
+		case 'u': ht_cbor_uint(&cbor, strtoull(arg, NULL, 10)); break;
+		case 'i': ht_cbor_int(&cbor, strtoll(arg, NULL, 10)); break;
+		case 'b': ht_cbor_bool(&cbor, arg[0] == '1'); break;
+		case 't': { size_t n = unhex(arg, data); ht_cbor_text(&cbor, (const char *)data, n); } break;
+		case 'y': { size_t n = unhex(arg, data); ht_cbor_bytes(&cbor, data, n); } break;
+		case 'a': ht_cbor_array(&cbor, strtoull(arg, NULL, 10)); break;
+		case 'm': ht_cbor_map(&cbor, strtoull(arg, NULL, 10)); break;
+		default: return 2;
+		}
+	}
+	for (size_t i = cap; i < cap + 16; i++) {
+		if (buf[i] != 0xA5) {
+			printf("canary\n");
+			return 1;
+		}
+	}
+	printf("%zu %d ", cbor.len, cbor.overflow ? 1 : 0);
+	for (size_t i = 0; i < cbor.len; i++) {
+		printf("%02x", buf[i]);
+	}
+	printf("\n");
+	free(buf);
+	return 0;
+}
+"""
+
+# RFC 8949 Appendix A + biên chuyển độ dài header
+RFC_VECTORS = [
+    (["u 0"], "00"), (["u 1"], "01"), (["u 10"], "0a"), (["u 23"], "17"), (["u 24"], "1818"),
+    (["u 25"], "1819"), (["u 100"], "1864"), (["u 255"], "18ff"), (["u 256"], "190100"),
+    (["u 1000"], "1903e8"), (["u 65535"], "19ffff"), (["u 65536"], "1a00010000"),
+    (["u 1000000"], "1a000f4240"), (["u 4294967295"], "1affffffff"),
+    (["u 4294967296"], "1b0000000100000000"), (["u 1000000000000"], "1b000000e8d4a51000"),
+    (["u 18446744073709551615"], "1bffffffffffffffff"),
+    (["i 0"], "00"), (["i -1"], "20"), (["i -10"], "29"), (["i -24"], "37"), (["i -25"], "3818"),
+    (["i -100"], "3863"), (["i -1000"], "3903e7"), (["i 9223372036854775807"], "1b7fffffffffffffff"),
+    (["i -9223372036854775808"], "3b7fffffffffffffff"),
+    (["b 0"], "f4"), (["b 1"], "f5"),
+    (["t "], "60"), (["t 61"], "6161"), (["t 49455446"], "6449455446"), (["t c3bc"], "62c3bc"),
+    (["y "], "40"), (["y 01020304"], "4401020304"),
+    (["a 0"], "80"), (["a 3", "u 1", "u 2", "u 3"], "83010203"), (["m 0"], "a0"),
+    (["m 2", "t 61", "u 1", "t 62", "a 2", "u 2", "u 3"], "a26161016162820203"),
+    (["t " + "78" * 24], "7818" + "78" * 24), (["a 24"], "9818"), (["m 256"], "b90100"),
+]
+
+# payload "d" giống thiết bị gửi lên EVT_UPDATE_PROPERTY, kèm schema của MqttHandler.c
+PAYLOADS = [
+    (["serialNumber", "model", "hardVer", "comVer", "firmVer"],
+     {"serialNumber": "HT0123456789", "model": "HT-SB-3T-WB-01", "hardVer": 1, "comVer": 3003, "firmVer": 2003}),
+    (["SSID", "MAC", "IP", "RSSI"],
+     {"SSID": "HT_EZLife Wi-Fi", "MAC": "24:0a:c4:12:34:56", "IP": "192.168.1.20", "RSSI": -67}),
+    (["id", "state"], {"id": 2, "state": True}),
+    (["time", "confirm"], {"time": "12:30", "confirm": False}),
+    (["total", "sch", "e", "j", "d", "lid"],
+     {"total": 2, "sch": [{"e": 1, "j": "0 30 6 * * 1,2,3", "d": [1, 0, -1], "lid": 70000},
+                          {"e": 0, "j": "", "d": [], "lid": 4294967296}]}),
+    # field ngoài schema giữ key text
+    (["id"], {"id": -2147483648, "newField": "ghi chú", "nested": {"x": [True, False, 24, -25]}}),
+]
+
+
+def build(cc, tmp):
+    for name in ("HTG_Cbor.c", "HTG_Cbor.h"):
+        shutil.copy(os.path.join(CBOR_DIR, name), tmp)
+    with open(os.path.join(tmp, "Global.h"), "w") as f:
+        f.write(GLOBAL_H)
+    with open(os.path.join(tmp, "harness.c"), "w") as f:
+        f.write(HARNESS_C)
+    exe = os.path.join(tmp, "cbor_harness")
+    subprocess.run([cc, "-std=c99", "-Wall", "-Wextra", "-Werror", "-O2", "-I", tmp, "-o", exe,
+                    os.path.join(tmp, "HTG_Cbor.c"), os.path.join(tmp, "harness.c")], check=True)
+    return exe
+
+
+def run(exe, ops, cap=4096):
+    out = subprocess.run([exe], input="cap %d\n%s\n" % (cap, "\n".join(ops)), capture_output=True,
+                         text=True, check=True).stdout.split()
+    return int(out[0]), out[1] == "1", bytes.fromhex(out[2]) if len(out) > 2 else b""
+
+
+def json_ops(value, schema):
+    """Lệnh encode giống MQTT_cborValue: key có trong schema thành số thứ tự."""
+    if isinstance(value, dict):
+        ops = ["m %d" % len(value)]
+        for key, child in value.items():
+            ops.append("u %d" % schema.index(key) if key in schema else "t " + key.encode().hex())
+            ops += json_ops(child, schema)
+        return ops
+    if isinstance(value, list):
+        ops = ["a %d" % len(value)]
+        for child in value:
+            ops += json_ops(child, schema)
+        return ops
+    if isinstance(value, bool):
+        return ["b %d" % value]
+    if isinstance(value, int):
+        return ["i %d" % value]
+    if isinstance(value, str):
+        return ["t " + value.encode().hex()]
+    raise ValueError("unsupported JSON value %r" % (value,))
+
+
+def rename_keys(value, schema):
+    """Key số thứ tự sau giải mã về lại tên field để so với JSON."""
+    if isinstance(value, dict):
+        return {(schema[k] if isinstance(k, int) else k): rename_keys(v, schema) for k, v in value.items()}
+    if isinstance(value, list):
+        return [rename_keys(v, schema) for v in value]
+    return value
+
+
+def decode_minimal(data):
+    """Decoder tối giản cho các kiểu HTG_Cbor sinh ra, yêu cầu header dạng ngắn nhất."""
+    def item(pos):
+        major, info = data[pos] >> 5, data[pos] & 0x1F
+        pos += 1
+        if info < 24:
+            arg = info
+        elif info <= 27:
+            size = 1 << (info - 24)
+            arg = int.from_bytes(data[pos:pos + size], "big")
+            if arg < (24 if size == 1 else 1 << (4 * size)):
+                raise ValueError("non-shortest head at %d" % (pos - 1))
+            pos += size
+        else:
+            raise ValueError("unsupported additional info %d" % info)
+        if major == 0:
+            return arg, pos
+        if major == 1:
+            return -1 - arg, pos
+        if major in (2, 3):
+            raw = data[pos:pos + arg]
+            if len(raw) != arg:
+                raise ValueError("truncated string")
+            return (bytes(raw) if major == 2 else raw.decode()), pos + arg
+        if major == 4:
+            out = []
+            for _ in range(arg):
+                child, pos = item(pos)
+                out.append(child)
+            return out, pos
+        if major == 5:
+            out = {}
+            for _ in range(arg):
+                key, pos = item(pos)
+                out[key], pos = item(pos)
+            return out, pos
+        if major == 7 and arg in (20, 21):
+            return arg == 21, pos
+        raise ValueError("unsupported major type %d" % major)
+
+    value, pos = item(0)
+    if pos != len(data):
+        raise ValueError("trailing bytes")
+    return value
+
+
+def decode(data):
+    try:
+        import cbor2
+    except ImportError:
+        return decode_minimal(data), "minimal"
+    return cbor2.loads(data), "cbor2"
+
+
+def check_payload(exe, schema, payload):
+    data = json.loads(json.dumps(payload))
+    length, overflow, cbor = run(exe, json_ops(data, schema))
+    if overflow or length != len(cbor):
+        raise AssertionError("encode failed: %r" % payload)
+    value, decoder = decode(cbor)
+    if rename_keys(value, schema) != data:
+        raise AssertionError("%s decode differs: %r != %r" % (decoder, value, data))
+    if decoder != "minimal" and rename_keys(decode_minimal(cbor), schema) != data:
+        raise AssertionError("minimal decode differs")
+    return len(json.dumps(data, separators=(",", ":")).encode()), length, decoder
+
+
+def selftest(cc):
+    with tempfile.TemporaryDirectory() as tmp:
+        exe = build(cc, tmp)
+        for ops, expect in RFC_VECTORS:
+            _, overflow, out = run(exe, ops)
+            if overflow or out.hex() != expect:
+                raise AssertionError("%s: %s != %s" % (ops, out.hex(), expect))
+        print("rfc8949 vectors: %d ok" % len(RFC_VECTORS))
+
+        for schema, payload in PAYLOADS:
+            json_len, cbor_len, decoder = check_payload(exe, schema, payload)
+            print("payload %-40.40s json %4d cbor %4d (%s)" % (",".join(schema), json_len, cbor_len, decoder))
+
+        # thiếu chỗ: dừng ghi ở header/chuỗi không vừa, cờ overflow giữ nguyên
+        ops = json_ops(PAYLOADS[1][1], PAYLOADS[1][0])
+        full, _, data = run(exe, ops)
+        for cap in range(full):
+            length, overflow, out = run(exe, ops, cap)
+            if not overflow or length > cap or not data.startswith(out):
+                raise AssertionError("cap %d: len %d overflow %d" % (cap, length, overflow))
+        length, overflow, _ = run(exe, ops, full)
+        if overflow or length != full:
+            raise AssertionError("exact cap rejected")
+        # chuỗi không vừa: chỉ còn header, item sau nhỏ hơn cũng không được ghi
+        length, overflow, out = run(exe, ["t " + "41" * 10, "u 1"], 5)
+        if not overflow or out != b"\x6a":
+            raise AssertionError("overflow not sticky")
+    print("selftest ok")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("selftest")
+    p.add_argument("--cc", default=os.environ.get("CC", "gcc"))
+    p = sub.add_parser("encode")
+    p.add_argument("payload")
+    p.add_argument("--schema", default="")
+    p.add_argument("--cc", default=os.environ.get("CC", "gcc"))
+    args = parser.parse_args()
+
+    if args.cmd == "encode":
+        with open(args.payload) as f:
+            payload = json.load(f)
+        schema = [name for name in args.schema.split(",") if name]
+        with tempfile.TemporaryDirectory() as tmp:
+            exe = build(args.cc, tmp)
+            json_len, cbor_len, decoder = check_payload(exe, schema, payload)
+            _, _, data = run(exe, json_ops(payload, schema))
+        print(data.hex())
+        print("json %d bytes, cbor %d bytes (%.1f%%), decoded by %s" % (json_len, cbor_len, 100.0 * cbor_len / json_len, decoder))
+    else:
+        selftest(args.cc)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
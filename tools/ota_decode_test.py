@@ -0,0 +1,398 @@
+#!/usr/bin/env python3
+"""
+Chạy main/SW_Interface/OTA/OTA_decode.c trên máy host với gói tạo bởi ota_patch.py.
+
+  ota_decode_test.py selftest [--miniz <dir>] [--cc gcc]
+  ota_decode_test.py apply <package.ota> <out.bin> [--base base.bin] [--chunk N] [--seed S] [--miniz <dir>]
+
+OTA_decode.c build bằng gcc cùng Global.h rút gọn. esp32/rom/miniz.h:
+  --miniz <dir>  thư mục chứa miniz.c/miniz.h của miniz (bản amalgamated): dùng đúng tinfl_decompress
+                 như bản trong ROM ESP32
+  mặc định       tinfl_decompress giả lập trên zlib của host, cùng API và status, kiểm tra vùng ra
+                 nằm trong cửa sổ TINFL_LZ_DICT_SIZE
+Gói được feed theo từng đoạn kích thước ngẫu nhiên (1 byte đến cả gói): header lệnh delta bị cắt
+giữa 2 lần feed, cửa sổ 32 KB quay vòng nhiều lần.
+
+selftest: gói zlib/delta phải ra đúng image mới; gói hỏng (cắt cụt, thừa dữ liệu, lật bit, lệnh
+sai, 'C' ngoài image gốc, 'I' dài quá luồng, header sai) phải bị từ chối ở begin/feed/finish và
+không bao giờ đọc ngoài image gốc.
+"""
+
+import argparse
+import json
+import os
+import random
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import zlib
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import ota_patch  # noqa: E402
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+OTA_DIR = os.path.join(ROOT, "main", "SW_Interface", "OTA")
+
+# Global.h thật kéo theo ESP-IDF, OTA_decode.c chỉ cần libc + log
+GLOBAL_H = r"""#ifndef __GLOBAL_H
+#define __GLOBAL_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#define ESP_LOGI(tag, format, ...) fprintf(stderr, "I %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) fprintf(stderr, "W %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGE(tag, format, ...) fprintf(stderr, "E %s: " format "\n", tag, ##__VA_ARGS__)
+#define esp_get_free_heap_size() 0UL
+#endif
+"""
+
+MINIZ_ROM_H = r"""#include "miniz.h"
+"""
+
+# cùng API/status với tinfl của miniz, inflate bằng zlib; kiểm tra tham số vùng ra như tinfl (không có
+# TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF: vùng ra phải nằm trong cửa sổ 2^n bắt đầu tại pOut_buf_start)
+MINIZ_SHIM_H = r"""#ifndef __MINIZ_SHIM_H
+#define __MINIZ_SHIM_H
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#define TINFL_LZ_DICT_SIZE 32768
+enum {
+    TINFL_FLAG_PARSE_ZLIB_HEADER = 1,
+    TINFL_FLAG_HAS_MORE_INPUT = 2,
+    TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF = 4,
+    TINFL_FLAG_COMPUTE_ADLER32 = 8,
+};
+typedef enum {
+    TINFL_STATUS_FAILED_CANNOT_MAKE_PROGRESS = -4,
+    TINFL_STATUS_BAD_PARAM = -3,
+    TINFL_STATUS_ADLER32_MISMATCH = -2,
+    TINFL_STATUS_FAILED = -1,
+    TINFL_STATUS_DONE = 0,
+    TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+    TINFL_STATUS_HAS_MORE_OUTPUT = 2,
+} tinfl_status;
+
+typedef struct {
+    z_stream zs;
+    int started;
+    int done;
+} tinfl_decompressor;
+
+#define tinfl_init(r) do { (r)->started = 0; (r)->done = 0; } while (0)
+
+// tinfl thật không cấp phát; giữ state zlib của stream dở dang để LeakSanitizer chỉ báo leak của OTA_decode.c
+static void *volatile s_shimPending;
+
+static inline tinfl_status tinfl_decompress(tinfl_decompressor *r, const uint8_t *pIn_buf_next, size_t *pIn_buf_size,
+                                            uint8_t *pOut_buf_start, uint8_t *pOut_buf_next, size_t *pOut_buf_size,
+                                            const uint32_t decomp_flags)
+{
+    size_t inSize = *pIn_buf_size;
+    size_t outSize = *pOut_buf_size;
+    *pIn_buf_size = 0;
+    *pOut_buf_size = 0;
+    if (!(decomp_flags & TINFL_FLAG_PARSE_ZLIB_HEADER) || (decomp_flags & TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF) ||
+        (pOut_buf_next < pOut_buf_start) || (outSize == 0) ||
+        ((size_t)(pOut_buf_next - pOut_buf_start) + outSize > TINFL_LZ_DICT_SIZE)) {
+        return TINFL_STATUS_BAD_PARAM;
+    }
+    if (r->done) {
+        return TINFL_STATUS_DONE;
+    }
+    if (!r->started) {
+        memset(&r->zs, 0, sizeof(r->zs));
+        if (inflateInit(&r->zs) != Z_OK) {
+            return TINFL_STATUS_FAILED;
+        }
+        s_shimPending = r->zs.state;
+        r->started = 1;
+    }
+    r->zs.next_in = (Bytef *)pIn_buf_next;
+    r->zs.avail_in = inSize;
+    r->zs.next_out = pOut_buf_next;
+    r->zs.avail_out = outSize;
+    int ret = inflate(&r->zs, Z_NO_FLUSH);
+    *pIn_buf_size = inSize - r->zs.avail_in;
+    *pOut_buf_size = outSize - r->zs.avail_out;
+    if (ret == Z_STREAM_END) {
+        r->done = 1;
+        inflateEnd(&r->zs);
+        return TINFL_STATUS_DONE;
+    }
+    if ((ret != Z_OK) && (ret != Z_BUF_ERROR)) {
+        int adler = (r->zs.msg != NULL) && (strstr(r->zs.msg, "check") != NULL);
+        inflateEnd(&r->zs);
+        r->done = 0;
+        r->started = 0;
+        return adler ? TINFL_STATUS_ADLER32_MISMATCH : TINFL_STATUS_FAILED;
+    }
+    if (r->zs.avail_out == 0) {
+        return TINFL_STATUS_HAS_MORE_OUTPUT;
+    }
+    return (decomp_flags & TINFL_FLAG_HAS_MORE_INPUT) ? TINFL_STATUS_NEEDS_MORE_INPUT : TINFL_STATUS_FAILED_CANNOT_MAKE_PROGRESS;
+}
+#endif
+"""
+
+HARNESS_C = r"""#include "OTA_decode.h"
+
+static uint8_t *s_baseImage;
+static size_t s_baseLen;
+static uint8_t *s_out;
+static size_t s_outLen;
+static size_t s_outCap;
+static bool s_overrun;
+
+static uint8_t *readFile(const char *path, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *buf = malloc(*len + 1);
+    if (fread(buf, 1, *len, f) != *len) {
+        *len = 0;
+    }
+    fclose(f);
+    return buf;
+}
+
+static bool outputCb(const uint8_t *data, uint32_t len)
+{
+    // image ra vượt quá nhiều so với header: dừng như task ghi flash hết partition
+    if (s_outLen + len > s_outCap) {
+        return false;
+    }
+    memcpy(s_out + s_outLen, data, len);
+    s_outLen += len;
+    return true;
+}
+
+static bool baseCb(uint32_t offset, uint8_t *data, uint32_t len)
+{
+    if (((size_t)offset > s_baseLen) || ((size_t)len > s_baseLen - offset)) {
+        s_overrun = true;
+        return false;
+    }
+    memcpy(data, s_baseImage + offset, len);
+    return true;
+}
+
+// argv: package base|- out seed maxChunk
+int main(int argc, char **argv)
+{
+    size_t pkgLen = 0;
+    if (argc != 6) {
+        return 2;
+    }
+    uint8_t *pkg = readFile(argv[1], &pkgLen);
+    if ((pkg == NULL) || (pkgLen < sizeof(ota_package_header_t))) {
+        return 2;
+    }
+    if (strcmp(argv[2], "-") != 0) {
+        s_baseImage = readFile(argv[2], &s_baseLen);
+    }
+    ota_package_header_t header;
+    memcpy(&header, pkg, sizeof(header));
+    s_outCap = (size_t)header.targetSize + 65536;
+    s_out = malloc(s_outCap);
+
+    unsigned long seed = strtoul(argv[4], NULL, 10);
+    unsigned long maxChunk = strtoul(argv[5], NULL, 10);
+    bool begin = OtaDecode_begin(&header, outputCb, baseCb);
+    bool feed = begin;
+    size_t pos = (header.headerLen < pkgLen) ? header.headerLen : pkgLen;
+    unsigned long feeds = 0;
+    while (feed && (pos < pkgLen)) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        size_t n = 1 + (size_t)((seed >> 33) % maxChunk);
+        if (n > pkgLen - pos) {
+            n = pkgLen - pos;
+        }
+        feed = OtaDecode_feed(pkg + pos, n);
+        pos += n;
+        feeds++;
+    }
+    bool finish = feed && OtaDecode_finish();
+    OtaDecode_end();
+
+    FILE *f = fopen(argv[3], "wb");
+    fwrite(s_out, 1, s_outLen, f);
+    fclose(f);
+    printf("{\"begin\": %s, \"feed\": %s, \"finish\": %s, \"out\": %zu, \"feeds\": %lu, \"overrun\": %s}\n",
+           begin ? "true" : "false", feed ? "true" : "false", finish ? "true" : "false", s_outLen, feeds,
+           s_overrun ? "true" : "false");
+    free(pkg);
+    free(s_baseImage);
+    free(s_out);
+    return 0;
+}
+"""
+
+# (seed, chunk tối đa): 1 byte, nhỏ hơn header lệnh delta, vừa, lớn hơn cửa sổ 32 KB, cả gói
+CHUNKS = [(1, 1), (2, 5), (3, 13), (4, 300), (5, 4096), (6, 40000), (7, 1 << 30)]
+
+
+def build(cc, tmp, miniz_dir):
+    stub = os.path.join(tmp, "stub")
+    os.makedirs(os.path.join(stub, "esp32", "rom"))
+    for name in ("OTA_decode.c", "OTA_decode.h"):
+        shutil.copy(os.path.join(OTA_DIR, name), tmp)
+    with open(os.path.join(tmp, "Global.h"), "w") as f:
+        f.write(GLOBAL_H)
+    with open(os.path.join(tmp, "harness.c"), "w") as f:
+        f.write(HARNESS_C)
+    sources = [os.path.join(tmp, "OTA_decode.c"), os.path.join(tmp, "harness.c")]
+    flags = ["-std=gnu11", "-Wall", "-Wno-format", "-O1", "-g", "-fsanitize=address,undefined", "-I", tmp, "-I", stub]
+    if miniz_dir:
+        with open(os.path.join(stub, "esp32", "rom", "miniz.h"), "w") as f:
+            f.write(MINIZ_ROM_H)
+        flags += ["-I", miniz_dir]
+        sources.append(os.path.join(miniz_dir, "miniz.c"))
+    else:
+        with open(os.path.join(stub, "esp32", "rom", "miniz.h"), "w") as f:
+            f.write(MINIZ_SHIM_H)
+    exe = os.path.join(tmp, "ota_decode_harness")
+    subprocess.run([cc] + flags + ["-o", exe] + sources + ["-lz"], check=True)
+    return exe
+
+
+def run(exe, tmp, package, base=None, seed=1, chunk=4096):
+    pkg_path = os.path.join(tmp, "pkg.ota")
+    base_path = os.path.join(tmp, "base.bin")
+    out_path = os.path.join(tmp, "out.bin")
+    ota_patch.write(pkg_path, package)
+    if base is not None:
+        ota_patch.write(base_path, base)
+    proc = subprocess.run([exe, pkg_path, base_path if base is not None else "-", out_path, str(seed), str(chunk)],
+                          capture_output=True, text=True)
+    if proc.returncode != 0:
+        raise AssertionError("harness exit %d\n%s" % (proc.returncode, proc.stderr))
+    state = json.loads(proc.stdout)
+    state["data"] = ota_patch.read(out_path)
+    state["log"] = proc.stderr
+    return state
+
+
+def images():
+    """Image gốc ngẫu nhiên + bản mới sửa vài đoạn, và 1 image rất nén được (tham chiếu xa quay vòng cửa sổ)."""
+    rng = random.Random(7)
+    base = bytearray(rng.getrandbits(8) for _ in range(192 * 1024))
+    base[0] = ota_patch.ESP_IMAGE_MAGIC
+    base[ota_patch.ESP_IMAGE_HASH_APPENDED_OFFSET] = 0
+    target = bytearray(base)
+    for _ in range(16):
+        pos = rng.randrange(len(target) - 512)
+        target[pos:pos + rng.randrange(1, 64)] = bytes(rng.getrandbits(8) for _ in range(rng.randrange(1, 300)))
+    text = b"".join(b"fw-beacon %06d %s\n" % (i, b"x" * (i % 37)) for i in range(6000))
+    return bytes(base), bytes(target), text
+
+
+def delta_package(base, target, ops):
+    return ota_patch.make_header(ota_patch.TYPE_DELTA, target, base) + zlib.compress(ops, 9)
+
+
+def expect_ok(exe, tmp, name, package, target, base=None):
+    for seed, chunk in CHUNKS:
+        state = run(exe, tmp, package, base, seed, chunk)
+        if not (state["begin"] and state["feed"] and state["finish"]) or state["data"] != target:
+            raise AssertionError("%s chunk<=%d: %s, out %d/%d\n%s" % (name, chunk, {k: state[k] for k in ("begin", "feed", "finish")},
+                                                                     state["out"], len(target), state["log"]))
+    print("%-40s ok  (%d bytes -> %d bytes, %d chunk sizes)" % (name, len(package), len(target), len(CHUNKS)))
+
+
+def expect_fail(exe, tmp, name, package, base=None, stage=None):
+    for seed, chunk in CHUNKS:
+        state = run(exe, tmp, package, base, seed, chunk)
+        if state["overrun"]:
+            raise AssertionError("%s: read outside base image" % name)
+        failed = "begin" if not state["begin"] else "feed" if not state["feed"] else "finish" if not state["finish"] else None
+        if failed is None or (stage is not None and failed not in stage):
+            raise AssertionError("%s chunk<=%d: failed at %s, expected %s\n%s" % (name, chunk, failed, stage, state["log"]))
+    print("%-40s rejected at %s" % (name, "/".join(stage) if stage else "begin/feed/finish"))
+
+
+def selftest(cc, miniz_dir):
+    base, target, text = images()
+    with tempfile.TemporaryDirectory() as tmp:
+        exe = build(cc, tmp, miniz_dir)
+        print("tinfl: %s" % (os.path.join(miniz_dir, "miniz.c") if miniz_dir else "zlib shim (no --miniz)"))
+
+        zlib_pkg = ota_patch.compress(target)
+        delta_pkg = ota_patch.delta(base, target)
+        expect_ok(exe, tmp, "zlib", zlib_pkg, target)
+        expect_ok(exe, tmp, "zlib, highly compressible", ota_patch.compress(text), text)
+        expect_ok(exe, tmp, "delta", delta_pkg, target, base)
+        expect_ok(exe, tmp, "delta, empty base copy list", ota_patch.delta(text[:1000], text), text, text[:1000])
+
+        # gói hỏng
+        expect_fail(exe, tmp, "bad magic", b"XXXX" + zlib_pkg[4:], stage=["begin"])
+        expect_fail(exe, tmp, "unsupported type", zlib_pkg[:5] + b"\x09" + zlib_pkg[6:], stage=["begin"])
+        expect_fail(exe, tmp, "truncated zlib stream", zlib_pkg[:-10], stage=["finish"])
+        expect_fail(exe, tmp, "trailing bytes after zlib stream", zlib_pkg + b"\x00\x01\x02", stage=["feed"])
+        expect_fail(exe, tmp, "adler32 mismatch", zlib_pkg[:-1] + bytes([zlib_pkg[-1] ^ 0x01]), stage=["feed"])
+        rng = random.Random(3)
+        body = ota_patch.HEADER_LEN
+        for i in range(6):
+            pos = rng.randrange(body + 2, len(delta_pkg) - 4)
+            bad = bytearray(delta_pkg)
+            bad[pos] ^= 1 << rng.randrange(8)
+            expect_fail(exe, tmp, "bit flip at %d" % pos, bytes(bad), base)
+
+        copy = lambda src, n: struct.pack("<cII", b"C", src, n)
+        insert = lambda data: struct.pack("<cI", b"I", len(data)) + data
+        expect_fail(exe, tmp, "delta invalid op", delta_package(base, target, insert(b"abc") + b"X" + bytes(8)), base, ["feed"])
+        expect_fail(exe, tmp, "delta copy past base end", delta_package(base, target, copy(len(base) - 16, 17)), base, ["feed"])
+        expect_fail(exe, tmp, "delta copy offset wraps u32", delta_package(base, target, copy(0xFFFFFFF0, 0x20)), base, ["feed"])
+        expect_fail(exe, tmp, "delta op header truncated", delta_package(base, target, copy(0, 64) + b"C" + bytes(4)), base, ["finish"])
+        expect_fail(exe, tmp, "delta insert longer than stream", delta_package(base, target, struct.pack("<cI", b"I", 100) + bytes(40)), base, ["finish"])
+        # 'C' đúng biên cuối image gốc vẫn hợp lệ
+        ops = copy(len(base) - 4096, 4096) + insert(b"tail")
+        expect_ok(exe, tmp, "delta copy up to base end", delta_package(base, base[-4096:] + b"tail", ops), base[-4096:] + b"tail", base)
+    print("selftest ok")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("selftest")
+    p.add_argument("--miniz")
+    p.add_argument("--cc", default=os.environ.get("CC", "gcc"))
+    p = sub.add_parser("apply")
+    p.add_argument("package")
+    p.add_argument("out")
+    p.add_argument("--base")
+    p.add_argument("--chunk", type=int, default=4096)
+    p.add_argument("--seed", type=int, default=1)
+    p.add_argument("--miniz")
+    p.add_argument("--cc", default=os.environ.get("CC", "gcc"))
+    args = parser.parse_args()
+
+    if args.cmd == "apply":
+        with tempfile.TemporaryDirectory() as tmp:
+            exe = build(args.cc, tmp, args.miniz)
+            state = run(exe, tmp, ota_patch.read(args.package), ota_patch.read(args.base) if args.base else None,
+                        args.seed, args.chunk)
+        sys.stderr.write(state["log"])
+        if not (state["begin"] and state["feed"] and state["finish"]):
+            print("decode failed")
+            return 1
+        ota_patch.write(args.out, state["data"])
+        print("%s: %d bytes in %d feeds" % (args.out, state["out"], state["feeds"]))
+    else:
+        selftest(args.cc, args.miniz)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
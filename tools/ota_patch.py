@@ -0,0 +1,355 @@
+#!/usr/bin/env python3
+"""
+Tạo gói OTA nén / delta cho fw-beacon (đọc bởi main/SW_Interface/OTA/OTA_decode.c).
+
+  ota_patch.py compress <new.bin> <out.ota>
+  ota_patch.py delta <base.bin> <new.bin> <out.ota>
+  ota_patch.py apply <package.ota> <out.bin> [--base base.bin]
+  ota_patch.py sign <new.bin> <private_key.pem> [--pub main/ota_sign_pub.pem]
+  ota_patch.py keygen <private_key.pem>
+  ota_patch.py test <base.bin> <new.bin>
+  ota_patch.py selftest
+
+Header (little-endian, 80 byte):
+  magic "HTOA" | version u8 | type u8 (1 zlib, 2 delta) | headerLen u16
+  targetSize u32 | baseSize u32 | targetSha[32] | baseSha[32]
+Sau header là luồng zlib. Với delta, dữ liệu giải nén là chuỗi lệnh:
+  'C' <u32 srcOffset> <u32 len>   copy từ image gốc (partition đang chạy)
+  'I' <u32 len> <bytes>           chèn dữ liệu mới
+
+sign in ra "sha256" và "imageSig" cho manifest LINK_UPDATE: chữ ký DER (openssl dgst -sha256 -sign)
+trên SHA-256 của image sau giải nén, thiết bị kiểm bằng main/ota_sign_pub.pem. sign từ chối khi
+khoá riêng không khớp khoá công khai sẽ build vào firmware.
+
+Khoá ký release (ECDSA P-256):
+  - khoá riêng không bao giờ nằm trong repo, do người phụ trách release giữ trên máy ký release
+    (offline); repo chỉ có khoá công khai main/ota_sign_pub.pem
+  - tạo/đổi khoá: keygen <đường dẫn ngoài repo> ghi khoá riêng ra đó, ghi đè main/ota_sign_pub.pem
+    và in fingerprint (SHA-256 của khoá công khai DER) để ghi vào biên bản release
+  - thiết bị chỉ nhận khoá mới sau khi cập nhật firmware build với pem mới: bản firmware đó phải
+    được ký bằng khoá cũ (thiết bị đang chạy kiểm bằng khoá cũ), các bản sau ký bằng khoá mới
+"""
+
+import argparse
+import hashlib
+import os
+import random
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+import zlib
+
+MAGIC = 0x414F5448
+VERSION = 1
+TYPE_ZLIB = 1
+TYPE_DELTA = 2
+HEADER_FMT = "<IBBHII32s32s"
+HEADER_LEN = struct.calcsize(HEADER_FMT)
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+PUB_PEM = os.path.join(ROOT, "main", "ota_sign_pub.pem")
+
+ESP_IMAGE_MAGIC = 0xE9
+ESP_IMAGE_HASH_APPENDED_OFFSET = 23
+
+# khớp tối thiểu để đáng phát lệnh copy (lệnh 'C' tốn 9 byte)
+MATCH_BLOCK = 32
+INDEX_STEP = 4
+
+
+def image_sha256(image):
+    """SHA-256 giống esp_partition_get_sha256() trên partition app."""
+    if len(image) > 32 and image[0] == ESP_IMAGE_MAGIC and image[ESP_IMAGE_HASH_APPENDED_OFFSET] == 1:
+        # image có SHA-256 gắn cuối: ESP-IDF trả lại chính giá trị này
+        return image[-32:]
+    return hashlib.sha256(image).digest()
+
+
+def make_header(ptype, target, base=b""):
+    return struct.pack(HEADER_FMT, MAGIC, VERSION, ptype, HEADER_LEN, len(target), len(base),
+                       hashlib.sha256(target).digest(), image_sha256(base) if base else bytes(32))
+
+
+def parse_header(package):
+    if len(package) < HEADER_LEN:
+        raise ValueError("package too short")
+    magic, version, ptype, header_len, target_size, base_size, target_sha, base_sha = \
+        struct.unpack_from(HEADER_FMT, package)
+    if magic != MAGIC or version != VERSION or header_len < HEADER_LEN:
+        raise ValueError("invalid package header")
+    return ptype, header_len, target_size, base_size, target_sha, base_sha
+
+
+def compress(target):
+    return make_header(TYPE_ZLIB, target) + zlib.compress(target, 9)
+
+
+def diff_ops(base, target):
+    """Sinh lệnh copy/insert bằng bảng băm khối MATCH_BLOCK byte của image gốc."""
+    index = {}
+    for pos in range(0, len(base) - MATCH_BLOCK + 1, INDEX_STEP):
+        index.setdefault(base[pos:pos + MATCH_BLOCK], pos)
+
+    ops = bytearray()
+    literal_start = 0
+
+    def flush_literal(end):
+        if end > literal_start:
+            ops.extend(struct.pack("<cI", b"I", end - literal_start))
+            ops.extend(target[literal_start:end])
+
+    j = 0
+    while j <= len(target) - MATCH_BLOCK:
+        src = index.get(target[j:j + MATCH_BLOCK])
+        if src is None:
+            j += 1
+            continue
+        # mở rộng về sau theo khối rồi từng byte
+        length = MATCH_BLOCK
+        while (src + length + 256 <= len(base) and j + length + 256 <= len(target)
+               and base[src + length:src + length + 256] == target[j + length:j + length + 256]):
+            length += 256
+        while (src + length < len(base) and j + length < len(target)
+               and base[src + length] == target[j + length]):
+            length += 1
+        # mở rộng về trước vào phần literal đang chờ
+        while src > 0 and j > literal_start and base[src - 1] == target[j - 1]:
+            src -= 1
+            j -= 1
+            length += 1
+        flush_literal(j)
+        ops.extend(struct.pack("<cII", b"C", src, length))
+        j += length
+        literal_start = j
+    flush_literal(len(target))
+    return bytes(ops)
+
+
+def delta(base, target):
+    return make_header(TYPE_DELTA, target, base) + zlib.compress(diff_ops(base, target), 9)
+
+
+def apply(package, base=None):
+    """Bản tham chiếu của OTA_decode.c: giải nén theo từng đoạn nhỏ như trên thiết bị."""
+    ptype, header_len, target_size, base_size, target_sha, base_sha = parse_header(package)
+    inflator = zlib.decompressobj()
+    stream = bytearray()
+    body = package[header_len:]
+    for pos in range(0, len(body), 4096):
+        stream.extend(inflator.decompress(body[pos:pos + 4096]))
+    stream.extend(inflator.flush())
+    if not inflator.eof or inflator.unused_data:
+        raise ValueError("zlib stream invalid")
+
+    if ptype == TYPE_ZLIB:
+        out = bytes(stream)
+    elif ptype == TYPE_DELTA:
+        if base is None:
+            raise ValueError("delta package needs --base")
+        if len(base) != base_size or image_sha256(base) != base_sha:
+            raise ValueError("base image does not match package")
+        out = bytearray()
+        pos = 0
+        while pos < len(stream):
+            op = stream[pos:pos + 1]
+            if op == b"C":
+                src, length = struct.unpack_from("<II", stream, pos + 1)
+                if src + length > len(base):
+                    raise ValueError("copy out of base")
+                out.extend(base[src:src + length])
+                pos += 9
+            elif op == b"I":
+                (length,) = struct.unpack_from("<I", stream, pos + 1)
+                out.extend(stream[pos + 5:pos + 5 + length])
+                pos += 5 + length
+            else:
+                raise ValueError("invalid delta op 0x%02x" % stream[pos])
+        out = bytes(out)
+    else:
+        raise ValueError("unsupported package type %d" % ptype)
+
+    if len(out) != target_size or hashlib.sha256(out).digest() != target_sha:
+        raise ValueError("target image hash mismatch")
+    return out
+
+
+def sign(target, key_path):
+    """Ký SHA-256 image bằng openssl, trả về (sha256 hex, chữ ký hex)."""
+    sig = subprocess.run(["openssl", "dgst", "-sha256", "-sign", key_path], input=target,
+                         stdout=subprocess.PIPE, check=True).stdout
+    return hashlib.sha256(target).hexdigest(), sig.hex()
+
+
+def fingerprint(pub_path):
+    """SHA-256 của khoá công khai dạng DER."""
+    der = subprocess.run(["openssl", "pkey", "-pubin", "-in", pub_path, "-outform", "DER"],
+                         stdout=subprocess.PIPE, check=True).stdout
+    return hashlib.sha256(der).hexdigest()
+
+
+def keygen(key_path, pub_path=PUB_PEM):
+    """Tạo khoá ký release mới ngoài repo, ghi khoá công khai vào pem build vào firmware."""
+    key_path = os.path.abspath(key_path)
+    if os.path.commonpath([key_path, ROOT]) == ROOT:
+        raise ValueError("private key must be stored outside the repository")
+    if os.path.exists(key_path):
+        raise ValueError("%s already exists" % key_path)
+    subprocess.run(["openssl", "ecparam", "-name", "prime256v1", "-genkey", "-noout", "-out", key_path], check=True)
+    os.chmod(key_path, 0o600)
+    subprocess.run(["openssl", "ec", "-in", key_path, "-pubout", "-out", pub_path], check=True, stderr=subprocess.DEVNULL)
+    return fingerprint(pub_path)
+
+
+def key_matches(key_path, pub_path):
+    pub = subprocess.run(["openssl", "pkey", "-in", key_path, "-pubout", "-outform", "DER"],
+                         stdout=subprocess.PIPE, check=True).stdout
+    return hashlib.sha256(pub).hexdigest() == fingerprint(pub_path)
+
+
+def verify(target, pub_path, sig_hex):
+    with tempfile.NamedTemporaryFile(delete=False) as f:
+        f.write(bytes.fromhex(sig_hex))
+    try:
+        result = subprocess.run(["openssl", "dgst", "-sha256", "-verify", pub_path, "-signature", f.name],
+                                input=target, stdout=subprocess.DEVNULL)
+    finally:
+        os.unlink(f.name)
+    return result.returncode == 0
+
+
+def run_test(base, target):
+    """Tạo gói zlib và delta, áp dụng lại và so với image mới."""
+    results = []
+    for name, build in (("zlib", lambda: compress(target)), ("delta", lambda: delta(base, target))):
+        start = time.time()
+        package = build()
+        elapsed = time.time() - start
+        if apply(package, base) != target:
+            raise AssertionError("%s: applied image differs" % name)
+        results.append((name, len(package), elapsed))
+    print("raw   %8d bytes" % len(target))
+    for name, size, elapsed in results:
+        print("%-5s %8d bytes (%5.1f%%), build %.1f s" % (name, size, 100.0 * size / len(target), elapsed))
+
+
+def selftest():
+    """Image giả lập: gốc ngẫu nhiên, bản mới sửa/chèn/xoá vài đoạn như 1 bản release nhỏ."""
+    rng = random.Random(1)
+    base = bytearray(rng.getrandbits(8) for _ in range(256 * 1024))
+    base[0] = ESP_IMAGE_MAGIC
+    base[ESP_IMAGE_HASH_APPENDED_OFFSET] = 0
+    target = bytearray(base)
+    for _ in range(20):
+        pos = rng.randrange(len(target) - 512)
+        target[pos:pos + rng.randrange(1, 64)] = bytes(rng.getrandbits(8) for _ in range(rng.randrange(1, 256)))
+    run_test(bytes(base), bytes(target))
+
+    # gói hỏng phải bị từ chối
+    package = bytearray(delta(bytes(base), bytes(target)))
+    package[-10] ^= 0xFF
+    try:
+        apply(bytes(package), bytes(base))
+    except (ValueError, zlib.error):
+        pass
+    else:
+        raise AssertionError("corrupted package accepted")
+    try:
+        apply(delta(bytes(base), bytes(target)), bytes(target))
+    except ValueError:
+        pass
+    else:
+        raise AssertionError("wrong base accepted")
+
+    # chữ ký manifest: khoá tạm, image sửa 1 byte phải bị từ chối
+    with tempfile.TemporaryDirectory() as tmp:
+        key = os.path.join(tmp, "key.pem")
+        pub = os.path.join(tmp, "pub.pem")
+        subprocess.run(["openssl", "ecparam", "-name", "prime256v1", "-genkey", "-noout", "-out", key], check=True)
+        subprocess.run(["openssl", "ec", "-in", key, "-pubout", "-out", pub], check=True, stderr=subprocess.DEVNULL)
+        _, sig_hex = sign(bytes(target), key)
+        if not verify(bytes(target), pub, sig_hex):
+            raise AssertionError("signature rejected")
+        target[100] ^= 0x01
+        if verify(bytes(target), pub, sig_hex):
+            raise AssertionError("modified image accepted")
+        other = os.path.join(tmp, "other.pem")
+        subprocess.run(["openssl", "ecparam", "-name", "prime256v1", "-genkey", "-noout", "-out", other], check=True)
+        if not key_matches(key, pub) or key_matches(other, pub):
+            raise AssertionError("key/pubkey match check wrong")
+        try:
+            keygen(os.path.join(ROOT, "main", "ota_sign_key.pem"), os.path.join(tmp, "new_pub.pem"))
+        except ValueError:
+            pass
+        else:
+            raise AssertionError("private key inside repository accepted")
+    print("selftest ok")
+
+
+def read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def write(path, data):
+    with open(path, "wb") as f:
+        f.write(data)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("compress")
+    p.add_argument("new")
+    p.add_argument("out")
+    p = sub.add_parser("delta")
+    p.add_argument("base")
+    p.add_argument("new")
+    p.add_argument("out")
+    p = sub.add_parser("apply")
+    p.add_argument("package")
+    p.add_argument("out")
+    p.add_argument("--base")
+    p = sub.add_parser("sign")
+    p.add_argument("new")
+    p.add_argument("key")
+    p.add_argument("--pub", default=PUB_PEM)
+    p = sub.add_parser("keygen")
+    p.add_argument("key")
+    p = sub.add_parser("test")
+    p.add_argument("base")
+    p.add_argument("new")
+    sub.add_parser("selftest")
+    args = parser.parse_args()
+
+    if args.cmd == "compress":
+        target = read(args.new)
+        package = compress(target)
+        write(args.out, package)
+        print("%s: %d -> %d bytes" % (args.out, len(target), len(package)))
+    elif args.cmd == "delta":
+        target = read(args.new)
+        package = delta(read(args.base), target)
+        write(args.out, package)
+        print("%s: %d -> %d bytes" % (args.out, len(target), len(package)))
+    elif args.cmd == "apply":
+        base = read(args.base) if args.base else None
+        write(args.out, apply(read(args.package), base))
+    elif args.cmd == "sign":
+        if not key_matches(args.key, args.pub):
+            print("%s does not match %s (fingerprint %s)" % (args.key, args.pub, fingerprint(args.pub)))
+            return 1
+        sha_hex, sig_hex = sign(read(args.new), args.key)
+        print('"sha256": "%s",' % sha_hex)
+        print('"imageSig": "%s"' % sig_hex)
+    elif args.cmd == "keygen":
+        print("%s: fingerprint %s" % (PUB_PEM, keygen(args.key)))
+    elif args.cmd == "test":
+        run_test(read(args.base), read(args.new))
+    else:
+        selftest()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())